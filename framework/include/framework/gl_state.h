@@ -0,0 +1,54 @@
+#pragma once
+#include "opengl_includes.h"
+#include <cstdint>
+
+// Thin cache in front of the GL binding/state calls that are issued many times per frame. Every setter compares
+// against the last value it set and skips the driver call if nothing changes. All code that changes one of the
+// tracked states must go through here (or call invalidate() afterwards), otherwise the cache goes stale.
+//
+// Deleting an object that is currently bound resets its binding to 0 inside GL, so objects must be deleted through
+// the delete* functions below to keep the cache in sync.
+class GLState {
+public:
+    struct Counters {
+        uint32_t issued { 0 }; // Calls that reached the driver.
+        uint32_t elided { 0 }; // Calls skipped because the state was already set.
+    };
+
+    static void useProgram(GLuint program);
+    static void bindVertexArray(GLuint vao);
+    // Note that GL_ELEMENT_ARRAY_BUFFER is part of the VAO state; binding a VAO forgets the cached index buffer.
+    static void bindBuffer(GLenum target, GLuint buffer);
+    static void bindBufferBase(GLenum target, GLuint index, GLuint buffer);
+    static void bindBufferRange(GLenum target, GLuint index, GLuint buffer, GLintptr offset, GLsizeiptr size);
+    // unit is the texture unit index (0, 1, ...), not GL_TEXTURE0 + i.
+    static void bindTexture(GLuint unit, GLenum target, GLuint texture);
+    static void bindFramebuffer(GLenum target, GLuint framebuffer);
+
+    static void setEnabled(GLenum capability, bool enabled);
+    static void blendFunc(GLenum sourceFactor, GLenum destinationFactor);
+    static void depthFunc(GLenum func);
+    static void depthMask(bool enabled);
+    static void viewport(GLint x, GLint y, GLsizei width, GLsizei height);
+
+    static void deleteBuffer(GLuint buffer);
+    static void deleteTexture(GLuint texture);
+    static void deleteVertexArray(GLuint vao);
+    static void deleteProgram(GLuint program);
+    static void deleteFramebuffer(GLuint framebuffer);
+
+    // Forget everything (e.g. after third-party code such as ImGui changed the state behind our back).
+    static void invalidate();
+
+    // Whether objects should be created and edited with direct state access (glCreate*, glNamed*, glTexture*) and
+    // immutable storage instead of bind-to-edit. Window enables it for OpenGLVersion::GL45 contexts; classes that
+    // support both paths keep the bind-based one for 4.1.
+    static void setDirectStateAccess(bool enabled);
+    static bool directStateAccess();
+
+    // Counters of the frame that is being recorded and of the last finished frame; endFrame() is called by
+    // Window::swapBuffers().
+    static Counters currentFrameCounters();
+    static Counters lastFrameCounters();
+    static void endFrame();
+};
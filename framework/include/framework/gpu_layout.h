@@ -0,0 +1,148 @@
+#pragma once
+#include "disable_all_warnings.h"
+#include "shader.h"
+DISABLE_WARNINGS_PUSH()
+#include <fmt/format.h>
+#include <glm/mat3x3.hpp>
+#include <glm/mat4x4.hpp>
+#include <glm/vec2.hpp>
+#include <glm/vec3.hpp>
+#include <glm/vec4.hpp>
+DISABLE_WARNINGS_POP()
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+// Compile-time std140/std430 layout computation (https://www.khronos.org/opengl/wiki/Interface_Block_(GLSL)#Memory_layout).
+// Describe a GLSL block as a type list and compare the offsets against the C++ struct that mirrors it:
+//
+//   using MaterialLayout = gpu_layout::Struct<gpu_layout::Packing::Std140, glm::vec3, glm::vec3, float, float>;
+//   GPU_LAYOUT_CHECK_MEMBER(GPUMaterial, MaterialLayout, 1, ks);
+//
+// If all members check out, the C++ struct can be uploaded with a single memcpy/glBufferSubData. Use
+// validateUniformBlock() after linking to compare the same layout against what the driver reports.
+namespace gpu_layout {
+
+enum class Packing {
+    Std140,
+    Std430
+};
+
+// GLSL array "T name[N]".
+template <typename T, size_t N>
+struct Array { };
+
+// GLSL struct or interface block.
+template <Packing P, typename... Members>
+struct Struct;
+
+constexpr size_t roundUp(size_t value, size_t alignment)
+{
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+template <Packing P, typename T>
+struct TypeLayout;
+
+// Scalars (bool is stored as a 32-bit integer).
+template <Packing P>
+struct TypeLayout<P, float> {
+    static constexpr size_t alignment = 4, size = 4;
+};
+template <Packing P>
+struct TypeLayout<P, int32_t> {
+    static constexpr size_t alignment = 4, size = 4;
+};
+template <Packing P>
+struct TypeLayout<P, uint32_t> {
+    static constexpr size_t alignment = 4, size = 4;
+};
+
+// Vectors: vec2 aligns to 8, vec3 and vec4 align to 16 (vec3 only occupies 12 bytes).
+template <Packing P, glm::length_t L, typename T>
+struct TypeLayout<P, glm::vec<L, T>> {
+    static_assert(sizeof(T) == 4);
+    static constexpr size_t alignment = (L == 2 ? 2 : 4) * 4;
+    static constexpr size_t size = L * 4;
+};
+
+// Arrays: in std140 the element stride (and array alignment) is rounded up to a vec4; std430 does not do that.
+template <Packing P, typename T, size_t N>
+struct TypeLayout<P, Array<T, N>> {
+    static constexpr size_t alignment = P == Packing::Std140 ? roundUp(TypeLayout<P, T>::alignment, 16) : TypeLayout<P, T>::alignment;
+    static constexpr size_t stride = roundUp(TypeLayout<P, T>::size, alignment);
+    static constexpr size_t size = stride * N;
+};
+
+// Column-major matrices are laid out as an array of column vectors.
+template <Packing P, glm::length_t C, glm::length_t R>
+struct TypeLayout<P, glm::mat<C, R, float>> : TypeLayout<P, Array<glm::vec<R, float>, static_cast<size_t>(C)>> { };
+
+// Nested structs: aligned to their largest member (rounded up to a vec4 in std140) and padded to that alignment.
+template <Packing P, Packing Q, typename... Members>
+struct TypeLayout<P, Struct<Q, Members...>> {
+    static_assert(P == Q, "Mixing std140 and std430 inside one block is not supported");
+    static constexpr size_t alignment = Struct<Q, Members...>::alignment;
+    static constexpr size_t size = Struct<Q, Members...>::size;
+};
+
+template <Packing P, typename... Members>
+struct Struct {
+    static constexpr Packing packing = P;
+    static constexpr size_t count = sizeof...(Members);
+
+    static constexpr size_t alignment = []() {
+        const size_t maxAlignment = std::max({ size_t(1), TypeLayout<P, Members>::alignment... });
+        return P == Packing::Std140 ? roundUp(maxAlignment, 16) : maxAlignment;
+    }();
+
+    // Byte offset of every member.
+    static constexpr std::array<size_t, count> offsets = []() {
+        std::array<size_t, count> out {};
+        const std::array<size_t, count> alignments { TypeLayout<P, Members>::alignment... };
+        const std::array<size_t, count> sizes { TypeLayout<P, Members>::size... };
+        size_t offset = 0;
+        for (size_t i = 0; i < count; i++) {
+            offset = roundUp(offset, alignments[i]);
+            out[i] = offset;
+            offset += sizes[i];
+        }
+        return out;
+    }();
+
+    // Size including the trailing padding required when the struct is used as a member or array element.
+    static constexpr size_t size = []() {
+        const std::array<size_t, count> sizes { TypeLayout<P, Members>::size... };
+        return count == 0 ? 0 : roundUp(offsets[count - 1] + sizes[count - 1], alignment);
+    }();
+};
+
+// Compare the layout reported by the driver (see Shader::uniformBlockMemberOffset) with the compile-time layout.
+// memberNames[i] is the GLSL name of the i-th layout member (use e.g. "lights[0].position" for an array of structs).
+// Members that the compiler removed are skipped. Throws ShaderLoadingException on a mismatch.
+template <typename Layout>
+void validateUniformBlock(const Shader& shader, std::string_view blockName, const std::array<std::string_view, Layout::count>& memberNames)
+{
+    const std::optional<GLint> blockSize = shader.uniformBlockSize(ShaderName(blockName));
+    if (!blockSize)
+        return; // Block is not used by this program.
+    if (static_cast<size_t>(*blockSize) > Layout::size)
+        throw ShaderLoadingException(fmt::format("Uniform block {} is {} bytes on the GPU but {} bytes on the CPU", blockName, *blockSize, Layout::size));
+
+    for (size_t i = 0; i < Layout::count; i++) {
+        const std::optional<GLint> offset = shader.uniformBlockMemberOffset(ShaderName(blockName), ShaderName(memberNames[i]));
+        if (offset && static_cast<size_t>(*offset) != Layout::offsets[i])
+            throw ShaderLoadingException(fmt::format("Uniform block {} member {} is at offset {} on the GPU but at {} on the CPU", blockName, memberNames[i], *offset, Layout::offsets[i]));
+    }
+}
+
+}
+
+// static_assert that member `member` of C++ struct `type` sits at the offset of the `index`-th member of `layout`.
+#define GPU_LAYOUT_CHECK_MEMBER(type, layout, index, member) \
+    static_assert(offsetof(type, member) == layout::offsets[index], #type "::" #member " does not match the GLSL layout")
+// static_assert that a C++ struct spans at least the whole GLSL layout, so uploading sizeof(type) bytes is safe.
+#define GPU_LAYOUT_CHECK_SIZE(type, layout) \
+    static_assert(sizeof(type) >= layout::size, #type " is smaller than its GLSL layout")
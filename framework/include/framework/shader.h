@@ -8,14 +8,50 @@ DISABLE_WARNINGS_PUSH()
 #include <glm/vec3.hpp>
 #include <glm/vec4.hpp>
 DISABLE_WARNINGS_POP()
+#include <cstdint>
 #include <exception>
 #include <filesystem>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 struct ShaderLoadingException : public std::runtime_error {
     using std::runtime_error::runtime_error;
 };
 
+// Uniform / uniform block names are looked up by their 32-bit FNV-1a hash. Hashing a string literal
+// happens at compile time (see the _uniform literal below), so hot loops never build an std::string
+// or ask the driver for a location.
+constexpr uint32_t hashShaderName(std::string_view name)
+{
+    uint32_t hash = 2166136261u;
+    for (char c : name) {
+        hash ^= static_cast<uint8_t>(c);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+struct ShaderName {
+    constexpr explicit ShaderName(std::string_view name)
+        : hash(hashShaderName(name))
+    {
+    }
+
+    uint32_t hash;
+};
+
+namespace shader_literals {
+    // Usage: shader.getUniformLocation("mvpMatrix"_uniform)
+    consteval ShaderName operator""_uniform(const char* name, size_t length)
+    {
+        return ShaderName(std::string_view(name, length));
+    }
+}
+
 class Shader {
 public:
     Shader();
@@ -30,19 +66,89 @@ public:
 
     // Bind the uniform define by the given name to the given buffer and location in its assigned block, 
     void bindUniformBlock(const std::string& blockName, GLuint bindingLocation, GLuint uniformBlockBuffer) const;
+    // Same as above but using the table reflected at link time; glUniformBlockBinding is only called when the
+    // block's binding point actually changes. Returns false if the program has no (active) block with that name.
+    bool bindUniformBlock(ShaderName blockName, GLuint bindingLocation, GLuint uniformBlockBuffer) const;
+    // Bind only [offset, offset + size) of the buffer (glBindBufferRange), e.g. a slice of a UniformRingBuffer.
+    bool bindUniformBlock(ShaderName blockName, GLuint bindingLocation, GLuint uniformBlockBuffer, GLintptr offset, GLsizeiptr size) const;
 
     // Query an attribute location by its name in the shader
     GLuint getAttributeLocation(const std::string& name) const;
     
     // Query a uniform location by its name in the shader
     GLint getUniformLocation(const std::string& name) const;
+    // Look up a uniform location in the table reflected at link time. Returns -1 for unknown/inactive
+    // uniforms, which glUniform* silently ignores (same as the driver would do).
+    GLint getUniformLocation(ShaderName name) const;
+
+    // Uniform block layout as reported by the driver at link time (GL_UNIFORM_BLOCK_DATA_SIZE / GL_UNIFORM_OFFSET).
+    // Empty if the block or member is not active. See gpu_layout::validateUniformBlock.
+    std::optional<GLint> uniformBlockSize(ShaderName blockName) const;
+    std::optional<GLint> uniformBlockMemberOffset(ShaderName blockName, ShaderName memberName) const;
 
 private:
     friend class ShaderBuilder;
+    friend class PendingShader;
     Shader(GLuint program);
 
+    // Query all active uniforms and uniform blocks once and store them in flat tables sorted by name hash.
+    void reflect();
+
+    struct UniformEntry {
+        uint32_t hash;
+        GLint location;
+    };
+    struct UniformBlockEntry {
+        uint32_t hash;
+        GLuint index;
+        mutable GLuint binding;
+        GLint dataSize;
+    };
+    struct UniformBlockMemberEntry {
+        uint32_t blockHash;
+        uint32_t hash;
+        GLint offset;
+    };
+
+    const UniformBlockEntry* findUniformBlock(ShaderName blockName) const;
+
 private:
     GLuint m_program;
+    std::vector<UniformEntry> m_uniforms;
+    std::vector<UniformBlockEntry> m_uniformBlocks;
+    std::vector<UniformBlockMemberEntry> m_uniformBlockMembers;
+};
+
+// A program whose compilation and link have been submitted to the driver but not waited on yet. When the driver
+// supports KHR_parallel_shader_compile (or the ARB variant) the driver compiles on its own threads and isReady() can
+// be polled without blocking; otherwise the work happens when finish() queries the results.
+class PendingShader {
+public:
+    PendingShader(const PendingShader&) = delete;
+    PendingShader(PendingShader&&);
+    ~PendingShader();
+
+    PendingShader& operator=(PendingShader&&);
+
+    bool isReady() const;
+    // Wait for the driver, check for compile/link errors (throws ShaderLoadingException) and hand over the program.
+    Shader finish();
+
+private:
+    friend class ShaderBuilder;
+    PendingShader() = default;
+    void free();
+
+    struct StageShader {
+        GLuint shader;
+        std::filesystem::path file;
+    };
+
+private:
+    GLuint m_program { 0 };
+    std::vector<StageShader> m_shaders;
+    std::filesystem::path m_cacheFile;
+    uint64_t m_cacheKey { 0 };
 };
 
 class ShaderBuilder {
@@ -50,14 +156,95 @@ public:
     ShaderBuilder() = default;
     ShaderBuilder(const ShaderBuilder&) = delete;
     ShaderBuilder(ShaderBuilder&&) = default;
-    ~ShaderBuilder();
+    ~ShaderBuilder() = default;
 
+    // #include "file.glsl" directives are resolved relative to the including file (each file is included at most
+    // once per stage). Error messages refer to files by source string number: 0 is the stage file and N > 0 the N-th
+    // entry of dependencies() for that stage.
     ShaderBuilder& addStage(GLuint shaderStage, std::filesystem::path shaderFile);
+    // Inject "#define name value" right after the #version line of every stage.
+    ShaderBuilder& addDefine(std::string name, std::string value = "");
     Shader build();
+    // Submit compilation without blocking (see PendingShader).
+    PendingShader buildAsync();
+
+    // All files (stage files and everything they #include) that the program is built from.
+    std::vector<std::filesystem::path> dependencies() const;
+
+    // Linked programs are stored in this directory (glGetProgramBinary) keyed by a hash of the stage sources and the
+    // driver's vendor/renderer/version strings. Later builds with the same key load the binary instead of compiling,
+    // and silently fall back to compiling if the driver rejects it. An empty path (the default) disables the cache.
+    static void setBinaryCacheDirectory(std::filesystem::path directory);
+
+private:
+    struct Stage {
+        GLuint type;
+        std::filesystem::path file;
+        std::string source;
+        std::vector<std::filesystem::path> dependencies;
+    };
+
+    std::string stageSource(const Stage& stage) const;
+    uint64_t binaryCacheKey() const;
+
+private:
+    std::vector<Stage> m_stages;
+    std::vector<std::pair<std::string, std::string>> m_defines;
+
+    static std::filesystem::path s_binaryCacheDirectory;
+};
+
+// Keyed cache of preprocessor permutations of the same set of shader files. Each feature is a #define that is
+// either present or absent; a bit mask of features selects the variant. Variants are built on first use, so the
+// per-draw selection is a single array lookup. This replaces uniform-driven branching inside the shaders.
+class ShaderVariants {
+public:
+    using Stages = std::vector<std::pair<GLuint, std::filesystem::path>>;
+    using Defines = std::vector<std::pair<std::string, std::string>>;
+
+    ShaderVariants() = default;
+    // Defines are added to every variant (e.g. a fixed MAX_LIGHTS); features are toggled per variant (at most 16).
+    ShaderVariants(Stages stages, std::vector<std::string> features, Defines defines = {});
+
+    // Get (and build if needed) the variant for the given feature mask (bit i corresponds to features[i]). Does not
+    // throw: a variant that fails to compile is logged once and the base variant is returned until the next reload().
+    const Shader& select(uint32_t featureMask = 0);
+    // Build all permutations up front to avoid hitches during the first frames.
+    void buildAll();
+    // Submit all permutations to the driver without waiting; select()/buildAll() pick up the results.
+    void buildAllAsync();
+
+    // Hot reload: recompile all variants that were built so far in the background. The old programs stay in use
+    // until poll() finds that the new ones linked; variants that fail to compile keep their old program.
+    void reload();
+    void poll();
+    // Whether the file is one of the stages or #included by them.
+    bool usesFile(const std::filesystem::path& file) const;
+
+private:
+    PendingShader submit(uint32_t featureMask);
 
 private:
-    void freeShaders();
+    Stages m_stages;
+    std::vector<std::string> m_features;
+    Defines m_defines;
+    // Stage files and their (transitive) includes as of the last build; used to decide what to reload.
+    std::vector<std::filesystem::path> m_dependencies;
+    std::vector<std::optional<Shader>> m_variants;
+    std::vector<std::optional<PendingShader>> m_pending;
+    std::vector<bool> m_failed;
+};
+
+// Polls the modification times of all files with the given extension in a directory (used for shader hot reload).
+class ShaderFileWatcher {
+public:
+    explicit ShaderFileWatcher(std::filesystem::path directory, std::string extension = ".glsl");
+
+    // Files that were modified or added since the previous call.
+    std::vector<std::filesystem::path> poll();
 
 private:
-    std::vector<GLuint> m_shaders;
+    std::filesystem::path m_directory;
+    std::string m_extension;
+    std::unordered_map<std::string, std::filesystem::file_time_type> m_timestamps;
 };
@@ -0,0 +1,58 @@
+#pragma once
+#include "opengl_includes.h"
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Uniform buffer space for data that changes every frame (per-view constants, per-object transforms). The buffer is
+// split into framesInFlight regions; every frame writes into the next region and binds the pieces it wrote with
+// glBindBufferRange. A fence per region guarantees that the CPU never overwrites data the GPU may still read, so
+// there is no need to orphan the buffer (glBufferData) or to let the driver synchronize (glBufferSubData on a buffer
+// that is in use).
+//
+// With persistentMapping (GL 4.4+, so OpenGLVersion::GL45) the buffer is allocated with glBufferStorage and stays
+// mapped: push() writes straight into GPU-visible memory. Otherwise push() stages the data on the CPU and flush()
+// uploads everything since the previous flush with a single glBufferSubData into the (idle) region.
+class UniformRingBuffer {
+public:
+    static constexpr size_t framesInFlight = 3;
+
+    UniformRingBuffer(GLsizeiptr bytesPerFrame, bool persistentMapping);
+    UniformRingBuffer(const UniformRingBuffer&) = delete;
+    ~UniformRingBuffer();
+
+    UniformRingBuffer& operator=(const UniformRingBuffer&) = delete;
+
+    // Moves to the next region, waiting for the GPU if it has not finished the frame that used it last.
+    void beginFrame();
+    // Fences the current region; call after the last draw that reads from it.
+    void endFrame();
+
+    // Copies size bytes into the current region and returns their offset in buffer(). Offsets are aligned to
+    // GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT so they can be passed to glBindBufferRange directly. Throws
+    // std::runtime_error if the frame does not fit in bytesPerFrame.
+    GLintptr push(const void* pData, GLsizeiptr size);
+    template <typename T>
+    GLintptr push(const T& data) { return push(&data, sizeof(T)); }
+    // Makes all data pushed since the previous flush available to the GPU; call before the draws that read it.
+    void flush();
+
+    GLuint buffer() const { return m_buffer; }
+    bool isPersistentlyMapped() const { return m_pMapped != nullptr; }
+    // Number of beginFrame() calls that had to wait for the GPU.
+    uint32_t stallCount() const { return m_stallCount; }
+
+private:
+    GLuint m_buffer { 0 };
+    GLsizeiptr m_regionSize { 0 };
+    GLintptr m_alignment { 256 };
+    std::byte* m_pMapped { nullptr };
+    std::vector<std::byte> m_staging; // Only used without persistent mapping.
+
+    std::array<GLsync, framesInFlight> m_fences {};
+    size_t m_region { framesInFlight - 1 };
+    GLintptr m_offset { 0 }; // Relative to the start of the current region.
+    GLintptr m_flushedOffset { 0 };
+    uint32_t m_stallCount { 0 };
+};
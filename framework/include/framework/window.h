@@ -21,6 +21,7 @@ enum class OpenGLVersion {
 
 class Window {
 public:
+	// A GL45 window falls back to a GL41 context where 4.5 is not available; see getGLVersion().
 	Window(std::string_view title, const glm::ivec2& windowSize, OpenGLVersion glVersion, bool presentable = true);
 	~Window();
 
@@ -62,6 +63,7 @@ public:
 	[[nodiscard]] glm::ivec2 getFrameBufferSize() const;
 	[[nodiscard]] float getAspectRatio() const;
 	[[nodiscard]] float getDpiScalingFactor() const;
+	[[nodiscard]] OpenGLVersion getGLVersion() const; // Version of the context that was created.
 
 private:
 	static void keyCallback(GLFWwindow* window, int key, int scancode, int action, int mods);
@@ -72,10 +74,10 @@ private:
 	static void windowSizeCallback(GLFWwindow* window, int width, int height);
 
 private:
-	GLFWwindow* m_pWindow;
+	GLFWwindow* m_pWindow { nullptr };
 	glm::ivec2 m_windowSize;
 	float m_dpiScalingFactor = 1.0f;
-	const OpenGLVersion m_glVersion;
+	OpenGLVersion m_glVersion;
         bool m_presentable;
 
 	std::vector<KeyCallback> m_keyCallbacks;
@@ -0,0 +1,304 @@
+#include "gl_state.h"
+#include <algorithm>
+#include <array>
+#include <cassert>
+
+// Value that never matches a real GL name/enum, used for "unknown" state.
+static constexpr GLuint unknown = 0xFFFFFFFF;
+
+static constexpr size_t maxTextureUnits = 32;
+static constexpr size_t maxIndexedBindings = 32;
+
+// Targets that are tracked by bindBuffer/bindTexture; anything else is passed straight through.
+static constexpr std::array<GLenum, 9> bufferTargets {
+    GL_ARRAY_BUFFER, GL_ELEMENT_ARRAY_BUFFER, GL_UNIFORM_BUFFER, GL_SHADER_STORAGE_BUFFER, GL_DRAW_INDIRECT_BUFFER,
+    GL_TEXTURE_BUFFER, GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, GL_PIXEL_UNPACK_BUFFER
+};
+static constexpr std::array<GLenum, 4> textureTargets { GL_TEXTURE_2D, GL_TEXTURE_2D_ARRAY, GL_TEXTURE_BUFFER, GL_TEXTURE_CUBE_MAP };
+static constexpr std::array<GLenum, 5> capabilities { GL_BLEND, GL_DEPTH_TEST, GL_CULL_FACE, GL_SCISSOR_TEST, GL_STENCIL_TEST };
+
+struct IndexedBinding {
+    GLuint buffer { unknown };
+    GLintptr offset { -1 };
+    GLsizeiptr size { -1 };
+};
+
+struct CachedState {
+    GLuint program { unknown };
+    GLuint vao { unknown };
+    std::array<GLuint, bufferTargets.size()> buffers;
+    std::array<IndexedBinding, maxIndexedBindings> uniformBuffers;
+    std::array<IndexedBinding, maxIndexedBindings> storageBuffers;
+    GLuint activeTextureUnit { unknown };
+    std::array<std::array<GLuint, textureTargets.size()>, maxTextureUnits> textures;
+    GLuint drawFramebuffer { unknown };
+    GLuint readFramebuffer { unknown };
+    std::array<int, capabilities.size()> enabled; // -1: unknown
+    GLenum blendSource { unknown }, blendDestination { unknown };
+    GLenum depthFunc { unknown };
+    int depthMask { -1 };
+    std::array<GLint, 4> viewport { -1, -1, -1, -1 };
+
+    CachedState()
+    {
+        buffers.fill(unknown);
+        for (auto& unitTextures : textures)
+            unitTextures.fill(unknown);
+        enabled.fill(-1);
+    }
+};
+
+static CachedState state;
+static bool directStateAccessEnabled = false;
+static GLState::Counters currentCounters;
+static GLState::Counters lastCounters;
+
+template <typename Container>
+static int indexOf(const Container& container, GLenum value)
+{
+    const auto iter = std::find(std::begin(container), std::end(container), value);
+    return iter == std::end(container) ? -1 : static_cast<int>(iter - std::begin(container));
+}
+
+// Returns true (and counts an issued call) if cached != value, updating the cache; counts an elided call otherwise.
+template <typename T>
+static bool changeState(T& cached, const T& value)
+{
+    if (cached == value) {
+        currentCounters.elided++;
+        return false;
+    }
+    cached = value;
+    currentCounters.issued++;
+    return true;
+}
+
+static void activeTexture(GLuint unit)
+{
+    if (changeState(state.activeTextureUnit, unit))
+        glActiveTexture(GL_TEXTURE0 + unit);
+}
+
+void GLState::useProgram(GLuint program)
+{
+    if (changeState(state.program, program))
+        glUseProgram(program);
+}
+
+void GLState::bindVertexArray(GLuint vao)
+{
+    if (changeState(state.vao, vao)) {
+        glBindVertexArray(vao);
+        state.buffers[static_cast<size_t>(indexOf(bufferTargets, GL_ELEMENT_ARRAY_BUFFER))] = unknown;
+    }
+}
+
+void GLState::bindBuffer(GLenum target, GLuint buffer)
+{
+    const int index = indexOf(bufferTargets, target);
+    if (index < 0) {
+        currentCounters.issued++;
+        glBindBuffer(target, buffer);
+    } else if (changeState(state.buffers[static_cast<size_t>(index)], buffer)) {
+        glBindBuffer(target, buffer);
+    }
+}
+
+static IndexedBinding* indexedBinding(GLenum target, GLuint index)
+{
+    if (index >= maxIndexedBindings)
+        return nullptr;
+    if (target == GL_UNIFORM_BUFFER)
+        return &state.uniformBuffers[index];
+    if (target == GL_SHADER_STORAGE_BUFFER)
+        return &state.storageBuffers[index];
+    return nullptr;
+}
+
+void GLState::bindBufferBase(GLenum target, GLuint index, GLuint buffer)
+{
+    // Offset/size -1 mark "whole buffer"; a subsequent bindBufferRange with real values always differs.
+    bindBufferRange(target, index, buffer, -1, -1);
+}
+
+void GLState::bindBufferRange(GLenum target, GLuint index, GLuint buffer, GLintptr offset, GLsizeiptr size)
+{
+    IndexedBinding* pBinding = indexedBinding(target, index);
+    const IndexedBinding binding { buffer, offset, size };
+    if (pBinding && pBinding->buffer == buffer && pBinding->offset == offset && pBinding->size == size) {
+        currentCounters.elided++;
+        return;
+    }
+    if (pBinding)
+        *pBinding = binding;
+    currentCounters.issued++;
+    if (offset < 0)
+        glBindBufferBase(target, index, buffer);
+    else
+        glBindBufferRange(target, index, buffer, offset, size);
+
+    // Indexed binds also change the generic binding point.
+    if (const int genericIndex = indexOf(bufferTargets, target); genericIndex >= 0)
+        state.buffers[static_cast<size_t>(genericIndex)] = buffer;
+}
+
+void GLState::bindTexture(GLuint unit, GLenum target, GLuint texture)
+{
+    const int targetIndex = indexOf(textureTargets, target);
+    if (unit >= maxTextureUnits || targetIndex < 0) {
+        activeTexture(unit);
+        currentCounters.issued++;
+        glBindTexture(target, texture);
+        return;
+    }
+
+    GLuint& cached = state.textures[unit][static_cast<size_t>(targetIndex)];
+    if (cached == texture) {
+        currentCounters.elided++;
+        return;
+    }
+    activeTexture(unit);
+    cached = texture;
+    currentCounters.issued++;
+    glBindTexture(target, texture);
+}
+
+void GLState::bindFramebuffer(GLenum target, GLuint framebuffer)
+{
+    const bool draw = target == GL_FRAMEBUFFER || target == GL_DRAW_FRAMEBUFFER;
+    const bool read = target == GL_FRAMEBUFFER || target == GL_READ_FRAMEBUFFER;
+    if ((!draw || state.drawFramebuffer == framebuffer) && (!read || state.readFramebuffer == framebuffer)) {
+        currentCounters.elided++;
+        return;
+    }
+    if (draw)
+        state.drawFramebuffer = framebuffer;
+    if (read)
+        state.readFramebuffer = framebuffer;
+    currentCounters.issued++;
+    glBindFramebuffer(target, framebuffer);
+}
+
+void GLState::setEnabled(GLenum capability, bool enabled)
+{
+    const int index = indexOf(capabilities, capability);
+    if (index >= 0 && !changeState(state.enabled[static_cast<size_t>(index)], int(enabled)))
+        return;
+    if (index < 0)
+        currentCounters.issued++;
+    if (enabled)
+        glEnable(capability);
+    else
+        glDisable(capability);
+}
+
+void GLState::blendFunc(GLenum sourceFactor, GLenum destinationFactor)
+{
+    if (state.blendSource == sourceFactor && state.blendDestination == destinationFactor) {
+        currentCounters.elided++;
+        return;
+    }
+    state.blendSource = sourceFactor;
+    state.blendDestination = destinationFactor;
+    currentCounters.issued++;
+    glBlendFunc(sourceFactor, destinationFactor);
+}
+
+void GLState::depthFunc(GLenum func)
+{
+    if (changeState(state.depthFunc, func))
+        glDepthFunc(func);
+}
+
+void GLState::depthMask(bool enabled)
+{
+    if (changeState(state.depthMask, int(enabled)))
+        glDepthMask(enabled ? GL_TRUE : GL_FALSE);
+}
+
+void GLState::viewport(GLint x, GLint y, GLsizei width, GLsizei height)
+{
+    if (changeState(state.viewport, std::array<GLint, 4> { x, y, width, height }))
+        glViewport(x, y, width, height);
+}
+
+void GLState::deleteBuffer(GLuint buffer)
+{
+    glDeleteBuffers(1, &buffer);
+    for (GLuint& cached : state.buffers) {
+        if (cached == buffer)
+            cached = 0;
+    }
+    for (auto* pBindings : { &state.uniformBuffers, &state.storageBuffers }) {
+        for (IndexedBinding& binding : *pBindings) {
+            if (binding.buffer == buffer)
+                binding = {};
+        }
+    }
+}
+
+void GLState::deleteTexture(GLuint texture)
+{
+    glDeleteTextures(1, &texture);
+    for (auto& unitTextures : state.textures) {
+        for (GLuint& cached : unitTextures) {
+            if (cached == texture)
+                cached = 0;
+        }
+    }
+}
+
+void GLState::deleteVertexArray(GLuint vao)
+{
+    glDeleteVertexArrays(1, &vao);
+    if (state.vao == vao)
+        state.vao = 0;
+}
+
+void GLState::deleteProgram(GLuint program)
+{
+    // A program that is in use is only flagged for deletion; the binding itself stays.
+    glDeleteProgram(program);
+    if (state.program == program)
+        state.program = unknown;
+}
+
+void GLState::deleteFramebuffer(GLuint framebuffer)
+{
+    glDeleteFramebuffers(1, &framebuffer);
+    if (state.drawFramebuffer == framebuffer)
+        state.drawFramebuffer = 0;
+    if (state.readFramebuffer == framebuffer)
+        state.readFramebuffer = 0;
+}
+
+void GLState::invalidate()
+{
+    state = CachedState();
+}
+
+void GLState::setDirectStateAccess(bool enabled)
+{
+    directStateAccessEnabled = enabled;
+}
+
+bool GLState::directStateAccess()
+{
+    return directStateAccessEnabled;
+}
+
+GLState::Counters GLState::currentFrameCounters()
+{
+    return currentCounters;
+}
+
+GLState::Counters GLState::lastFrameCounters()
+{
+    return lastCounters;
+}
+
+void GLState::endFrame()
+{
+    lastCounters = currentCounters;
+    currentCounters = {};
+}
@@ -1,8 +1,11 @@
 #include "shader.h"
+#include "gl_state.h"
 #include <framework/disable_all_warnings.h>
 DISABLE_WARNINGS_PUSH()
+#include <GLFW/glfw3.h>
 #include <fmt/format.h>
 DISABLE_WARNINGS_POP()
+#include <algorithm>
 #include <cassert>
 #include <fstream>
 #include <iostream>
@@ -14,10 +17,14 @@ static constexpr GLuint invalid = 0xFFFFFFFF;
 static bool checkShaderErrors(GLuint shader);
 static bool checkProgramErrors(GLuint program);
 static std::string readFile(std::filesystem::path filePath);
+static std::string resolveIncludes(const std::filesystem::path& file, std::vector<std::filesystem::path>& dependencies);
+static GLuint loadCachedProgram(const std::filesystem::path& cacheFile, uint64_t cacheKey);
+static void storeCachedProgram(GLuint program, const std::filesystem::path& cacheFile, uint64_t cacheKey);
 
 Shader::Shader(GLuint program)
     : m_program(program)
 {
+    reflect();
 }
 
 Shader::Shader()
@@ -28,21 +35,27 @@ Shader::Shader()
 Shader::Shader(Shader&& other)
 {
     m_program = other.m_program;
+    m_uniforms = std::move(other.m_uniforms);
+    m_uniformBlocks = std::move(other.m_uniformBlocks);
+    m_uniformBlockMembers = std::move(other.m_uniformBlockMembers);
     other.m_program = invalid;
 }
 
 Shader::~Shader()
 {
     if (m_program != invalid)
-        glDeleteProgram(m_program);
+        GLState::deleteProgram(m_program);
 }
 
 Shader& Shader::operator=(Shader&& other)
 {
     if (m_program != invalid)
-        glDeleteProgram(m_program);
+        GLState::deleteProgram(m_program);
 
     m_program = other.m_program;
+    m_uniforms = std::move(other.m_uniforms);
+    m_uniformBlocks = std::move(other.m_uniformBlocks);
+    m_uniformBlockMembers = std::move(other.m_uniformBlockMembers);
     other.m_program = invalid;
     return *this;
 }
@@ -50,18 +63,66 @@ Shader& Shader::operator=(Shader&& other)
 void Shader::bind() const
 {
     assert(m_program != invalid);
-    glUseProgram(m_program);
+    GLState::useProgram(m_program);
 }
 
 void Shader::bindUniformBlock(const std::string& blockName, GLuint bindingLocation, GLuint uniformBlockBuffer) const
 {
-    GLuint blockIdx = glGetUniformBlockIndex(m_program, blockName.data());
-    if (blockIdx != GL_INVALID_INDEX) {
-        glUniformBlockBinding(m_program, blockIdx, bindingLocation);
-        glBindBufferBase(GL_UNIFORM_BUFFER, bindingLocation, uniformBlockBuffer);
-    } else {
+    if (!bindUniformBlock(ShaderName(blockName), bindingLocation, uniformBlockBuffer))
         std::cout << "Could not bind uniform block " << blockName << " invalid name" << std::endl;
+}
+
+bool Shader::bindUniformBlock(ShaderName blockName, GLuint bindingLocation, GLuint uniformBlockBuffer) const
+{
+    const UniformBlockEntry* pBlock = findUniformBlock(blockName);
+    if (!pBlock)
+        return false;
+
+    if (pBlock->binding != bindingLocation) {
+        glUniformBlockBinding(m_program, pBlock->index, bindingLocation);
+        pBlock->binding = bindingLocation;
+    }
+    GLState::bindBufferBase(GL_UNIFORM_BUFFER, bindingLocation, uniformBlockBuffer);
+    return true;
+}
+
+bool Shader::bindUniformBlock(ShaderName blockName, GLuint bindingLocation, GLuint uniformBlockBuffer, GLintptr offset, GLsizeiptr size) const
+{
+    const UniformBlockEntry* pBlock = findUniformBlock(blockName);
+    if (!pBlock)
+        return false;
+
+    if (pBlock->binding != bindingLocation) {
+        glUniformBlockBinding(m_program, pBlock->index, bindingLocation);
+        pBlock->binding = bindingLocation;
+    }
+    GLState::bindBufferRange(GL_UNIFORM_BUFFER, bindingLocation, uniformBlockBuffer, offset, size);
+    return true;
+}
+
+const Shader::UniformBlockEntry* Shader::findUniformBlock(ShaderName blockName) const
+{
+    auto iter = std::lower_bound(std::begin(m_uniformBlocks), std::end(m_uniformBlocks), blockName.hash,
+        [](const UniformBlockEntry& entry, uint32_t hash) { return entry.hash < hash; });
+    if (iter == std::end(m_uniformBlocks) || iter->hash != blockName.hash)
+        return nullptr;
+    return &*iter;
+}
+
+std::optional<GLint> Shader::uniformBlockSize(ShaderName blockName) const
+{
+    if (const UniformBlockEntry* pBlock = findUniformBlock(blockName))
+        return pBlock->dataSize;
+    return {};
+}
+
+std::optional<GLint> Shader::uniformBlockMemberOffset(ShaderName blockName, ShaderName memberName) const
+{
+    for (const UniformBlockMemberEntry& member : m_uniformBlockMembers) {
+        if (member.blockHash == blockName.hash && member.hash == memberName.hash)
+            return member.offset;
     }
+    return {};
 }
 
 GLuint Shader::getAttributeLocation(const std::string& name) const
@@ -75,16 +136,155 @@ GLuint Shader::getAttributeLocation(const std::string& name) const
 
 GLint Shader::getUniformLocation(const std::string& name) const
 {
-    GLint loc = glGetUniformLocation(m_program, name.c_str());
-    if (loc == GL_INVALID_INDEX) {
+    GLint loc = getUniformLocation(ShaderName(name));
+    if (loc < 0) {
         std::cerr << "Warning : Could not find uniform " << name << std::endl;
     }
     return loc;
 }
 
-ShaderBuilder::~ShaderBuilder()
+GLint Shader::getUniformLocation(ShaderName name) const
+{
+    auto iter = std::lower_bound(std::begin(m_uniforms), std::end(m_uniforms), name.hash,
+        [](const UniformEntry& entry, uint32_t hash) { return entry.hash < hash; });
+    if (iter == std::end(m_uniforms) || iter->hash != name.hash)
+        return -1;
+    return iter->location;
+}
+
+void Shader::reflect()
+{
+    m_uniforms.clear();
+    m_uniformBlocks.clear();
+    m_uniformBlockMembers.clear();
+
+    GLint maxNameLength = 0;
+    glGetProgramiv(m_program, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxNameLength);
+    GLint maxBlockNameLength = 0;
+    glGetProgramiv(m_program, GL_ACTIVE_UNIFORM_BLOCK_MAX_NAME_LENGTH, &maxBlockNameLength);
+    std::string nameBuffer(static_cast<size_t>(std::max(std::max(maxNameLength, maxBlockNameLength), 1)), '\0');
+
+    GLint numUniforms = 0;
+    glGetProgramiv(m_program, GL_ACTIVE_UNIFORMS, &numUniforms);
+    for (GLuint i = 0; i < static_cast<GLuint>(numUniforms); i++) {
+        GLsizei nameLength = 0;
+        GLint size = 0;
+        GLenum type = 0;
+        glGetActiveUniform(m_program, i, static_cast<GLsizei>(nameBuffer.size()), &nameLength, &size, &type, nameBuffer.data());
+        std::string_view name(nameBuffer.data(), static_cast<size_t>(nameLength));
+
+        // Members of uniform blocks have no location; they are accessed through the block.
+        const GLint location = glGetUniformLocation(m_program, nameBuffer.c_str());
+        if (location < 0)
+            continue;
+
+        // Arrays are reported as "name[0]"; register them under both "name" and "name[0]".
+        m_uniforms.push_back({ hashShaderName(name), location });
+        if (name.ends_with("[0]"))
+            m_uniforms.push_back({ hashShaderName(name.substr(0, name.size() - 3)), location });
+    }
+
+    GLint numBlocks = 0;
+    glGetProgramiv(m_program, GL_ACTIVE_UNIFORM_BLOCKS, &numBlocks);
+    for (GLuint i = 0; i < static_cast<GLuint>(numBlocks); i++) {
+        GLsizei nameLength = 0;
+        glGetActiveUniformBlockName(m_program, i, static_cast<GLsizei>(nameBuffer.size()), &nameLength, nameBuffer.data());
+        const uint32_t blockHash = hashShaderName(std::string_view(nameBuffer.data(), static_cast<size_t>(nameLength)));
+        GLint binding = 0;
+        glGetActiveUniformBlockiv(m_program, i, GL_UNIFORM_BLOCK_BINDING, &binding);
+        GLint dataSize = 0;
+        glGetActiveUniformBlockiv(m_program, i, GL_UNIFORM_BLOCK_DATA_SIZE, &dataSize);
+        m_uniformBlocks.push_back({ blockHash, i, static_cast<GLuint>(binding), dataSize });
+
+        // Member offsets, used to validate the CPU-side mirrors of the blocks (gpu_layout.h).
+        GLint numMembers = 0;
+        glGetActiveUniformBlockiv(m_program, i, GL_UNIFORM_BLOCK_ACTIVE_UNIFORMS, &numMembers);
+        std::vector<GLint> memberIndices(static_cast<size_t>(numMembers));
+        glGetActiveUniformBlockiv(m_program, i, GL_UNIFORM_BLOCK_ACTIVE_UNIFORM_INDICES, memberIndices.data());
+        for (GLint memberIndex : memberIndices) {
+            const GLuint uniformIndex = static_cast<GLuint>(memberIndex);
+            GLsizei memberNameLength = 0;
+            GLint size = 0;
+            GLenum type = 0;
+            glGetActiveUniform(m_program, uniformIndex, static_cast<GLsizei>(nameBuffer.size()), &memberNameLength, &size, &type, nameBuffer.data());
+            GLint offset = 0;
+            glGetActiveUniformsiv(m_program, 1, &uniformIndex, GL_UNIFORM_OFFSET, &offset);
+            m_uniformBlockMembers.push_back({ blockHash, hashShaderName(std::string_view(nameBuffer.data(), static_cast<size_t>(memberNameLength))), offset });
+        }
+    }
+
+    std::sort(std::begin(m_uniforms), std::end(m_uniforms), [](const UniformEntry& lhs, const UniformEntry& rhs) { return lhs.hash < rhs.hash; });
+    std::sort(std::begin(m_uniformBlocks), std::end(m_uniformBlocks), [](const UniformBlockEntry& lhs, const UniformBlockEntry& rhs) { return lhs.hash < rhs.hash; });
+    // Two different names mapping to the same hash would silently alias; make that loud in debug builds.
+    assert(std::adjacent_find(std::begin(m_uniforms), std::end(m_uniforms), [](const UniformEntry& lhs, const UniformEntry& rhs) { return lhs.hash == rhs.hash; }) == std::end(m_uniforms));
+    assert(std::adjacent_find(std::begin(m_uniformBlocks), std::end(m_uniformBlocks), [](const UniformBlockEntry& lhs, const UniformBlockEntry& rhs) { return lhs.hash == rhs.hash; }) == std::end(m_uniformBlocks));
+}
+
+std::filesystem::path ShaderBuilder::s_binaryCacheDirectory {};
+
+// Header written in front of every cached program binary.
+struct ProgramBinaryHeader {
+    uint32_t magic;
+    GLenum format;
+    uint64_t key;
+    uint64_t size;
+};
+static constexpr uint32_t programBinaryMagic = 0x50424743; // "CGBP"
+
+static uint64_t hashBytes(uint64_t hash, const void* pData, size_t numBytes)
+{
+    // 64-bit FNV-1a
+    const auto* pBytes = static_cast<const uint8_t*>(pData);
+    for (size_t i = 0; i < numBytes; i++) {
+        hash ^= pBytes[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+static uint64_t hashString(uint64_t hash, std::string_view str)
+{
+    // Include the length so that ("ab", "c") and ("a", "bc") hash differently.
+    const uint64_t length = str.size();
+    hash = hashBytes(hash, &length, sizeof(length));
+    return hashBytes(hash, str.data(), str.size());
+}
+
+static std::string_view glString(GLenum name)
 {
-    freeShaders();
+    const GLubyte* pString = glGetString(name);
+    return pString ? std::string_view(reinterpret_cast<const char*>(pString)) : std::string_view();
+}
+
+// KHR_parallel_shader_compile / ARB_parallel_shader_compile are not part of the generated GLAD loader, so the
+// entry point is fetched through GLFW. Both extensions share the same enums.
+static constexpr GLenum GL_COMPLETION_STATUS_KHR = 0x91B1;
+static bool parallelShaderCompileSupported = false;
+
+static void initParallelShaderCompile()
+{
+    static bool initialized = false;
+    if (initialized)
+        return;
+    initialized = true;
+
+    using MaxShaderCompilerThreadsFunc = void(APIENTRYP)(GLuint count);
+    MaxShaderCompilerThreadsFunc pMaxShaderCompilerThreads = nullptr;
+    if (glfwExtensionSupported("GL_KHR_parallel_shader_compile"))
+        pMaxShaderCompilerThreads = reinterpret_cast<MaxShaderCompilerThreadsFunc>(glfwGetProcAddress("glMaxShaderCompilerThreadsKHR"));
+    else if (glfwExtensionSupported("GL_ARB_parallel_shader_compile"))
+        pMaxShaderCompilerThreads = reinterpret_cast<MaxShaderCompilerThreadsFunc>(glfwGetProcAddress("glMaxShaderCompilerThreadsARB"));
+
+    if (pMaxShaderCompilerThreads) {
+        // 0xFFFFFFFF: let the implementation pick the number of threads.
+        pMaxShaderCompilerThreads(0xFFFFFFFF);
+        parallelShaderCompileSupported = true;
+    }
+}
+
+void ShaderBuilder::setBinaryCacheDirectory(std::filesystem::path directory)
+{
+    s_binaryCacheDirectory = std::move(directory);
 }
 
 ShaderBuilder& ShaderBuilder::addStage(GLuint shaderStage, std::filesystem::path shaderFile)
@@ -93,40 +293,376 @@ ShaderBuilder& ShaderBuilder::addStage(GLuint shaderStage, std::filesystem::path
         throw ShaderLoadingException(fmt::format("File {} does not exist", shaderFile.string().c_str()));
     }
 
-    const std::string shaderSource = readFile(shaderFile);
-    const GLuint shader = glCreateShader(shaderStage);
-    const char* shaderSourcePtr = shaderSource.c_str();
-    glShaderSource(shader, 1, &shaderSourcePtr, nullptr);
-    glCompileShader(shader);
-    if (!checkShaderErrors(shader)) {
-        glDeleteShader(shader);
-        throw ShaderLoadingException(fmt::format("Failed to compile shader {}", shaderFile.string().c_str()));
+    // Compilation is deferred to build() so that a cached program binary can be used instead.
+    Stage stage { shaderStage, shaderFile, "", {} };
+    stage.source = resolveIncludes(shaderFile, stage.dependencies);
+    m_stages.push_back(std::move(stage));
+    return *this;
+}
+
+std::vector<std::filesystem::path> ShaderBuilder::dependencies() const
+{
+    std::vector<std::filesystem::path> out;
+    for (const Stage& stage : m_stages) {
+        for (const std::filesystem::path& dependency : stage.dependencies) {
+            if (std::find(std::begin(out), std::end(out), dependency) == std::end(out))
+                out.push_back(dependency);
+        }
     }
+    return out;
+}
 
-    m_shaders.push_back(shader);
+ShaderBuilder& ShaderBuilder::addDefine(std::string name, std::string value)
+{
+    m_defines.emplace_back(std::move(name), std::move(value));
     return *this;
 }
 
 Shader ShaderBuilder::build()
 {
+    return buildAsync().finish();
+}
+
+PendingShader ShaderBuilder::buildAsync()
+{
+    initParallelShaderCompile();
+
+    PendingShader pending;
+    GLint numBinaryFormats = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &numBinaryFormats);
+    if (!s_binaryCacheDirectory.empty() && numBinaryFormats > 0) {
+        pending.m_cacheKey = binaryCacheKey();
+        pending.m_cacheFile = s_binaryCacheDirectory / fmt::format("{:016x}.bin", pending.m_cacheKey);
+        if (GLuint program = loadCachedProgram(pending.m_cacheFile, pending.m_cacheKey); program != 0) {
+            pending.m_program = program;
+            pending.m_cacheFile.clear();
+            return pending;
+        }
+    }
+
+    // Only issue the commands here; errors are checked in PendingShader::finish() so the driver can work on this
+    // in the background (KHR_parallel_shader_compile) or at least batch it with other programs.
+    for (const Stage& stage : m_stages) {
+        const std::string source = stageSource(stage);
+        const GLuint shader = glCreateShader(stage.type);
+        const char* shaderSourcePtr = source.c_str();
+        glShaderSource(shader, 1, &shaderSourcePtr, nullptr);
+        glCompileShader(shader);
+        pending.m_shaders.push_back({ shader, stage.file });
+    }
+
     // Combine vertex and fragment shaders into a single shader program.
-    GLuint program = glCreateProgram();
-    for (GLuint shader : m_shaders)
-        glAttachShader(program, shader);
-    glLinkProgram(program);
-    freeShaders();
+    pending.m_program = glCreateProgram();
+    for (const auto& stageShader : pending.m_shaders)
+        glAttachShader(pending.m_program, stageShader.shader);
+    // Tell the driver we intend to call glGetProgramBinary on this program.
+    glProgramParameteri(pending.m_program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    glLinkProgram(pending.m_program);
+    return pending;
+}
+
+std::string ShaderBuilder::stageSource(const Stage& stage) const
+{
+    if (m_defines.empty())
+        return stage.source;
+
+    // GLSL requires #version to be the first statement, so the defines go directly after it. The #line directive
+    // keeps line numbers in compile errors matching the file on disk.
+    std::string source = stage.source;
+    size_t insertPosition = 0;
+    if (const size_t versionPosition = source.find("#version"); versionPosition != std::string::npos) {
+        size_t lineEnd = source.find('\n', versionPosition);
+        if (lineEnd == std::string::npos) {
+            source += '\n';
+            lineEnd = source.size() - 1;
+        }
+        insertPosition = lineEnd + 1;
+    }
+    const auto lineNumber = std::count(source.begin(), source.begin() + static_cast<std::ptrdiff_t>(insertPosition), '\n') + 1;
+
+    std::string defines;
+    for (const auto& [name, value] : m_defines)
+        defines += fmt::format("#define {} {}\n", name, value);
+    defines += fmt::format("#line {}\n", lineNumber);
+
+    source.insert(insertPosition, defines);
+    return source;
+}
+
+uint64_t ShaderBuilder::binaryCacheKey() const
+{
+    // A binary is only valid for the exact same sources on the exact same driver.
+    uint64_t key = 14695981039346656037ull;
+    key = hashString(key, glString(GL_VENDOR));
+    key = hashString(key, glString(GL_RENDERER));
+    key = hashString(key, glString(GL_VERSION));
+    for (const Stage& stage : m_stages) {
+        key = hashBytes(key, &stage.type, sizeof(stage.type));
+        key = hashString(key, stageSource(stage));
+    }
+    return key;
+}
 
-    if (!checkProgramErrors(program)) {
+static GLuint loadCachedProgram(const std::filesystem::path& cacheFile, uint64_t cacheKey)
+{
+    std::ifstream file(cacheFile, std::ios::binary);
+    if (!file)
+        return 0;
+
+    ProgramBinaryHeader header;
+    if (!file.read(reinterpret_cast<char*>(&header), sizeof(header)) || header.magic != programBinaryMagic || header.key != cacheKey)
+        return 0;
+    std::vector<char> binary(header.size);
+    if (!file.read(binary.data(), static_cast<std::streamsize>(binary.size())))
+        return 0;
+
+    const GLuint program = glCreateProgram();
+    glProgramBinary(program, header.format, binary.data(), static_cast<GLsizei>(binary.size()));
+    GLint linkSuccessful = GL_FALSE;
+    glGetProgramiv(program, GL_LINK_STATUS, &linkSuccessful);
+    if (!linkSuccessful) {
+        // Driver update or otherwise incompatible binary; throw it away and compile from source.
+        glDeleteProgram(program);
+        std::error_code ignored;
+        std::filesystem::remove(cacheFile, ignored);
+        return 0;
+    }
+    return program;
+}
+
+static void storeCachedProgram(GLuint program, const std::filesystem::path& cacheFile, uint64_t cacheKey)
+{
+    GLint binaryLength = 0;
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &binaryLength);
+    if (binaryLength <= 0)
+        return;
+
+    ProgramBinaryHeader header { programBinaryMagic, 0, cacheKey, 0 };
+    std::vector<char> binary(static_cast<size_t>(binaryLength));
+    GLsizei writtenLength = 0;
+    glGetProgramBinary(program, binaryLength, &writtenLength, &header.format, binary.data());
+    header.size = static_cast<uint64_t>(writtenLength);
+
+    std::error_code errorCode;
+    std::filesystem::create_directories(cacheFile.parent_path(), errorCode);
+    std::ofstream file(cacheFile, std::ios::binary);
+    if (!file) {
+        std::cerr << "Warning : Could not write program binary cache " << cacheFile << std::endl;
+        return;
+    }
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(binary.data(), static_cast<std::streamsize>(header.size));
+}
+
+PendingShader::PendingShader(PendingShader&& other)
+{
+    *this = std::move(other);
+}
+
+PendingShader::~PendingShader()
+{
+    free();
+}
+
+PendingShader& PendingShader::operator=(PendingShader&& other)
+{
+    free();
+    m_program = std::exchange(other.m_program, 0);
+    m_shaders = std::move(other.m_shaders);
+    other.m_shaders.clear();
+    m_cacheFile = std::move(other.m_cacheFile);
+    m_cacheKey = other.m_cacheKey;
+    return *this;
+}
+
+bool PendingShader::isReady() const
+{
+    if (!parallelShaderCompileSupported || m_program == 0)
+        return true;
+    GLint completed = GL_TRUE;
+    glGetProgramiv(m_program, GL_COMPLETION_STATUS_KHR, &completed);
+    return completed == GL_TRUE;
+}
+
+Shader PendingShader::finish()
+{
+    assert(m_program != 0);
+    for (const auto& stageShader : m_shaders) {
+        if (!checkShaderErrors(stageShader.shader)) {
+            const std::string file = stageShader.file.string();
+            free();
+            throw ShaderLoadingException(fmt::format("Failed to compile shader {}", file.c_str()));
+        }
+    }
+    if (!checkProgramErrors(m_program)) {
+        free();
         throw ShaderLoadingException("Shader program failed to link");
     }
 
-    return Shader(program);
+    if (!m_cacheFile.empty())
+        storeCachedProgram(m_program, m_cacheFile, m_cacheKey);
+
+    for (const auto& stageShader : m_shaders)
+        glDeleteShader(stageShader.shader);
+    m_shaders.clear();
+    return Shader(std::exchange(m_program, 0));
+}
+
+void PendingShader::free()
+{
+    for (const auto& stageShader : m_shaders)
+        glDeleteShader(stageShader.shader);
+    m_shaders.clear();
+    if (m_program != 0)
+        glDeleteProgram(m_program);
+    m_program = 0;
+}
+
+ShaderVariants::ShaderVariants(Stages stages, std::vector<std::string> features, Defines defines)
+    : m_stages(std::move(stages))
+    , m_features(std::move(features))
+    , m_defines(std::move(defines))
+{
+    assert(m_features.size() <= 16);
+    m_variants.resize(size_t(1) << m_features.size());
+    m_pending.resize(m_variants.size());
+    m_failed.resize(m_variants.size(), false);
+}
+
+const Shader& ShaderVariants::select(uint32_t featureMask)
+{
+    assert(featureMask < m_variants.size());
+    std::optional<Shader>& variant = m_variants[featureMask];
+    if (!variant && !m_failed[featureMask]) {
+        std::optional<PendingShader>& pending = m_pending[featureMask];
+        try {
+            if (!pending)
+                pending = submit(featureMask);
+            // Reset before finish() so that a failed compile does not leave a half-finished entry behind.
+            PendingShader pendingShader = std::move(*pending);
+            pending.reset();
+            variant = pendingShader.finish();
+        } catch (const ShaderLoadingException& e) {
+            // Called from the render loop, so do not throw: log once and fall back until the next reload().
+            std::cerr << e.what() << " (falling back to the base variant)" << std::endl;
+            pending.reset();
+            m_failed[featureMask] = true;
+        }
+    }
+    if (variant)
+        return *variant;
+    if (featureMask != 0)
+        return select(0);
+    // Not even the base variant compiled; draw with an empty program rather than crashing.
+    static const Shader emptyShader;
+    return emptyShader;
 }
 
-void ShaderBuilder::freeShaders()
+void ShaderVariants::buildAll()
 {
-    for (GLuint shader : m_shaders)
-        glDeleteShader(shader);
+    buildAllAsync();
+    for (uint32_t featureMask = 0; featureMask < m_variants.size(); featureMask++)
+        select(featureMask);
+}
+
+void ShaderVariants::buildAllAsync()
+{
+    for (uint32_t featureMask = 0; featureMask < m_variants.size(); featureMask++) {
+        if (!m_variants[featureMask] && !m_pending[featureMask])
+            m_pending[featureMask] = submit(featureMask);
+    }
+}
+
+void ShaderVariants::reload()
+{
+    for (uint32_t featureMask = 0; featureMask < m_variants.size(); featureMask++) {
+        // Failed variants are retried by the next select(), which is where they are built for the first time.
+        if (m_failed[featureMask]) {
+            m_failed[featureMask] = false;
+            continue;
+        }
+        if (!m_variants[featureMask])
+            continue;
+        try {
+            m_pending[featureMask] = submit(featureMask);
+        } catch (const ShaderLoadingException& e) {
+            std::cerr << e.what() << std::endl;
+        }
+    }
+}
+
+void ShaderVariants::poll()
+{
+    for (size_t featureMask = 0; featureMask < m_variants.size(); featureMask++) {
+        std::optional<PendingShader>& pending = m_pending[featureMask];
+        // Only swap in reloads; first-time builds are finished by select().
+        if (!pending || !m_variants[featureMask] || !pending->isReady())
+            continue;
+        try {
+            m_variants[featureMask] = pending->finish();
+        } catch (const ShaderLoadingException& e) {
+            std::cerr << e.what() << " (keeping the previous version)" << std::endl;
+        }
+        pending.reset();
+    }
+}
+
+bool ShaderVariants::usesFile(const std::filesystem::path& file) const
+{
+    for (const auto& [stage, stageFile] : m_stages) {
+        std::error_code errorCode;
+        if (std::filesystem::equivalent(stageFile, file, errorCode))
+            return true;
+    }
+    for (const std::filesystem::path& dependency : m_dependencies) {
+        std::error_code errorCode;
+        if (std::filesystem::equivalent(dependency, file, errorCode))
+            return true;
+    }
+    return false;
+}
+
+PendingShader ShaderVariants::submit(uint32_t featureMask)
+{
+    ShaderBuilder builder;
+    for (const auto& [stage, file] : m_stages)
+        builder.addStage(stage, file);
+    for (const auto& [name, value] : m_defines)
+        builder.addDefine(name, value);
+    for (size_t i = 0; i < m_features.size(); i++) {
+        if (featureMask & (1u << i))
+            builder.addDefine(m_features[i]);
+    }
+    // Defines do not affect which files are included (only #include is resolved, not #if), so all variants share
+    // the same dependencies.
+    m_dependencies = builder.dependencies();
+    return builder.buildAsync();
+}
+
+ShaderFileWatcher::ShaderFileWatcher(std::filesystem::path directory, std::string extension)
+    : m_directory(std::move(directory))
+    , m_extension(std::move(extension))
+{
+    poll();
+}
+
+std::vector<std::filesystem::path> ShaderFileWatcher::poll()
+{
+    std::vector<std::filesystem::path> changedFiles;
+    std::error_code errorCode;
+    for (const auto& entry : std::filesystem::directory_iterator(m_directory, errorCode)) {
+        if (!entry.is_regular_file(errorCode) || entry.path().extension() != m_extension)
+            continue;
+        const auto writeTime = entry.last_write_time(errorCode);
+        if (errorCode)
+            continue;
+        auto [iter, inserted] = m_timestamps.try_emplace(entry.path().string(), writeTime);
+        if (!inserted && iter->second != writeTime) {
+            iter->second = writeTime;
+            changedFiles.push_back(entry.path());
+        }
+    }
+    return changedFiles;
 }
 
 static std::string readFile(std::filesystem::path filePath)
@@ -138,6 +674,62 @@ static std::string readFile(std::filesystem::path filePath)
     return buffer.str();
 }
 
+struct IncludeCacheEntry {
+    std::filesystem::file_time_type writeTime;
+    std::string contents;
+};
+// Included files are shared between many programs (and all their variants); only re-read them when they change.
+static std::unordered_map<std::string, IncludeCacheEntry> includeCache;
+
+static const std::string& readIncludeFile(const std::filesystem::path& file)
+{
+    std::error_code errorCode;
+    const auto writeTime = std::filesystem::last_write_time(file, errorCode);
+    auto& entry = includeCache[file.string()];
+    if (entry.contents.empty() || entry.writeTime != writeTime) {
+        entry.writeTime = writeTime;
+        entry.contents = readFile(file);
+    }
+    return entry.contents;
+}
+
+static std::string resolveIncludes(const std::filesystem::path& file, std::vector<std::filesystem::path>& dependencies)
+{
+    const size_t sourceStringNumber = dependencies.size();
+    dependencies.push_back(std::filesystem::weakly_canonical(file));
+
+    std::istringstream input(readIncludeFile(file));
+    std::string output;
+    std::string line;
+    size_t lineNumber = 0;
+    while (std::getline(input, line)) {
+        lineNumber++;
+        const size_t directiveStart = line.find_first_not_of(" \t");
+        if (directiveStart == std::string::npos || line.compare(directiveStart, 8, "#include") != 0) {
+            output += line;
+            output += '\n';
+            continue;
+        }
+
+        const size_t nameStart = line.find('"', directiveStart);
+        const size_t nameEnd = nameStart == std::string::npos ? std::string::npos : line.find('"', nameStart + 1);
+        if (nameEnd == std::string::npos)
+            throw ShaderLoadingException(fmt::format("Malformed #include in {} line {}", file.string().c_str(), lineNumber));
+
+        const std::filesystem::path includeFile = std::filesystem::weakly_canonical(file.parent_path() / line.substr(nameStart + 1, nameEnd - nameStart - 1));
+        if (!std::filesystem::exists(includeFile))
+            throw ShaderLoadingException(fmt::format("File {} included from {} does not exist", includeFile.string().c_str(), file.string().c_str()));
+
+        // Every file is included only once per stage (implicit #pragma once), which also breaks include cycles.
+        if (std::find(std::begin(dependencies), std::end(dependencies), includeFile) == std::end(dependencies)) {
+            output += fmt::format("#line 1 {}\n", dependencies.size());
+            output += resolveIncludes(includeFile, dependencies);
+        }
+        output += fmt::format("#line {} {}\n", lineNumber + 1, sourceStringNumber);
+    }
+    return output;
+}
+
 static bool checkShaderErrors(GLuint shader)
 {
     // Check if the shader compiled successfully.
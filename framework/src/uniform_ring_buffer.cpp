@@ -0,0 +1,119 @@
+#include "uniform_ring_buffer.h"
+#include "disable_all_warnings.h"
+#include "gl_state.h"
+DISABLE_WARNINGS_PUSH()
+#include <fmt/format.h>
+DISABLE_WARNINGS_POP()
+#include <cstring>
+#include <stdexcept>
+
+static GLsizeiptr roundUp(GLsizeiptr value, GLsizeiptr alignment)
+{
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+UniformRingBuffer::UniformRingBuffer(GLsizeiptr bytesPerFrame, bool persistentMapping)
+{
+    GLint alignment = 0;
+    glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+    if (alignment > 0)
+        m_alignment = alignment;
+    m_regionSize = roundUp(bytesPerFrame, m_alignment);
+    const GLsizeiptr totalSize = m_regionSize * static_cast<GLsizeiptr>(framesInFlight);
+
+    if (GLState::directStateAccess()) {
+        glCreateBuffers(1, &m_buffer);
+        if (persistentMapping) {
+            constexpr GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+            glNamedBufferStorage(m_buffer, totalSize, nullptr, flags);
+            m_pMapped = static_cast<std::byte*>(glMapNamedBufferRange(m_buffer, 0, totalSize, flags));
+        } else {
+            glNamedBufferStorage(m_buffer, totalSize, nullptr, GL_DYNAMIC_STORAGE_BIT);
+            m_staging.resize(static_cast<size_t>(m_regionSize));
+        }
+        return;
+    }
+
+    glGenBuffers(1, &m_buffer);
+    GLState::bindBuffer(GL_UNIFORM_BUFFER, m_buffer);
+    // glBufferStorage is only loaded when the context is 4.4 or newer.
+    if (persistentMapping && GLAD_GL_VERSION_4_4) {
+        constexpr GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glBufferStorage(GL_UNIFORM_BUFFER, totalSize, nullptr, flags);
+        m_pMapped = static_cast<std::byte*>(glMapBufferRange(GL_UNIFORM_BUFFER, 0, totalSize, flags));
+    } else {
+        glBufferData(GL_UNIFORM_BUFFER, totalSize, nullptr, GL_STREAM_DRAW);
+        m_staging.resize(static_cast<size_t>(m_regionSize));
+    }
+    GLState::bindBuffer(GL_UNIFORM_BUFFER, 0);
+}
+
+UniformRingBuffer::~UniformRingBuffer()
+{
+    for (GLsync fence : m_fences) {
+        if (fence)
+            glDeleteSync(fence);
+    }
+    if (m_pMapped && GLState::directStateAccess()) {
+        glUnmapNamedBuffer(m_buffer);
+    } else if (m_pMapped) {
+        GLState::bindBuffer(GL_UNIFORM_BUFFER, m_buffer);
+        glUnmapBuffer(GL_UNIFORM_BUFFER);
+    }
+    GLState::deleteBuffer(m_buffer);
+}
+
+void UniformRingBuffer::beginFrame()
+{
+    m_region = (m_region + 1) % framesInFlight;
+    m_offset = m_flushedOffset = 0;
+
+    GLsync& fence = m_fences[m_region];
+    if (!fence)
+        return;
+    // Poll first so that we only count real stalls; normally the GPU is done with a frame from framesInFlight ago.
+    if (glClientWaitSync(fence, 0, 0) == GL_TIMEOUT_EXPIRED) {
+        m_stallCount++;
+        while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1'000'000'000) == GL_TIMEOUT_EXPIRED) { }
+    }
+    glDeleteSync(fence);
+    fence = nullptr;
+}
+
+void UniformRingBuffer::endFrame()
+{
+    flush();
+    m_fences[m_region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+GLintptr UniformRingBuffer::push(const void* pData, GLsizeiptr size)
+{
+    const GLintptr offset = roundUp(m_offset, m_alignment);
+    if (offset + size > m_regionSize)
+        throw std::runtime_error(fmt::format("UniformRingBuffer: frame needs more than {} bytes", m_regionSize));
+
+    const size_t regionStart = m_region * static_cast<size_t>(m_regionSize);
+    std::byte* pDestination = m_pMapped ? m_pMapped + regionStart : m_staging.data();
+    std::memcpy(pDestination + offset, pData, static_cast<size_t>(size));
+    m_offset = offset + size;
+    return static_cast<GLintptr>(regionStart) + offset;
+}
+
+void UniformRingBuffer::flush()
+{
+    // The persistent mapping is coherent, so the writes are already visible to commands issued after them.
+    if (m_pMapped || m_offset == m_flushedOffset)
+        return;
+
+    const GLintptr regionOffset = m_regionSize * static_cast<GLintptr>(m_region);
+    if (GLState::directStateAccess()) {
+        glNamedBufferSubData(m_buffer, regionOffset + m_flushedOffset, m_offset - m_flushedOffset, m_staging.data() + m_flushedOffset);
+        m_flushedOffset = m_offset;
+        return;
+    }
+
+    GLState::bindBuffer(GL_UNIFORM_BUFFER, m_buffer);
+    glBufferSubData(GL_UNIFORM_BUFFER, regionOffset + m_flushedOffset, m_offset - m_flushedOffset, m_staging.data() + m_flushedOffset);
+    GLState::bindBuffer(GL_UNIFORM_BUFFER, 0);
+    m_flushedOffset = m_offset;
+}
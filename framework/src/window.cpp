@@ -1,4 +1,5 @@
 #include "window.h"
+#include "gl_state.h"
 #include <imgui/imgui.h>
 #include <imgui/imgui_impl_glfw.h>
 #include <imgui/imgui_impl_opengl2.h>
@@ -15,6 +16,26 @@ static void glfwErrorCallback(int error, const char* description)
     exit(1);
 }
 
+// Context hints of a (presentable) window for the requested version.
+static void setContextVersionHints(OpenGLVersion glVersion)
+{
+    if (glVersion == OpenGLVersion::GL3) {
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+        glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+    } else if (glVersion == OpenGLVersion::GL41) {
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 1);
+        glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+        glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+    } else if (glVersion == OpenGLVersion::GL45) {
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 5);
+        glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+        glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_FALSE);
+    }
+}
+
 #ifdef GL_DEBUG_SEVERITY_NOTIFICATION
 // OpenGL debug callback
 void APIENTRY glDebugCallback(GLenum source, GLenum type, GLuint id, GLenum severity, GLsizei length, const GLchar* message, const void* userParam)
@@ -26,7 +47,7 @@ void APIENTRY glDebugCallback(GLenum source, GLenum type, GLuint id, GLenum seve
 #endif
 
 Window::Window(std::string_view title, const glm::ivec2& windowSize, OpenGLVersion glVersion, bool presentable)
-    : m_presentable(presentable), m_glVersion(glVersion)
+    : m_glVersion(glVersion), m_presentable(presentable)
 {
     glfwSetErrorCallback(glfwErrorCallback);
     if (!glfwInit()) {
@@ -36,21 +57,7 @@ Window::Window(std::string_view title, const glm::ivec2& windowSize, OpenGLVersi
 
     if (m_presentable) {
         glfwWindowHint(GLFW_VISIBLE, GLFW_TRUE);
-
-        if (glVersion == OpenGLVersion::GL3) {
-            glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
-            glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
-            glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
-        } else if (glVersion == OpenGLVersion::GL41) {
-            glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
-            glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 1);
-            glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
-            glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
-        } else if (glVersion == OpenGLVersion::GL45) {
-            glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
-            glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 5);
-            glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
-        }
+        setContextVersionHints(glVersion);
 #ifndef NDEBUG // Automatically defined by CMake when compiling in Release/MinSizeRel mode.
         glfwWindowHint(GLFW_OPENGL_DEBUG_CONTEXT, GL_TRUE);
 #endif
@@ -76,7 +83,19 @@ Window::Window(std::string_view title, const glm::ivec2& windowSize, OpenGLVersi
 
     // std::string_view does not guarantee that the string contains a terminator character.
     const std::string titleString { title };
-    m_pWindow = glfwCreateWindow(windowSize.x, windowSize.y, titleString.c_str(), nullptr, nullptr);
+    if (m_presentable && glVersion == OpenGLVersion::GL45) {
+        // Not every platform has a 4.5 context (macOS stops at 4.1): fall back to 4.1 instead of exiting.
+        glfwSetErrorCallback(nullptr);
+        m_pWindow = glfwCreateWindow(windowSize.x, windowSize.y, titleString.c_str(), nullptr, nullptr);
+        glfwSetErrorCallback(glfwErrorCallback);
+        if (m_pWindow == nullptr) {
+            std::cerr << "OpenGL 4.5 is not available, falling back to 4.1" << std::endl;
+            m_glVersion = glVersion = OpenGLVersion::GL41;
+            setContextVersionHints(glVersion);
+        }
+    }
+    if (m_pWindow == nullptr)
+        m_pWindow = glfwCreateWindow(windowSize.x, windowSize.y, titleString.c_str(), nullptr, nullptr);
     if (m_pWindow == nullptr) {
         glfwTerminate();
         std::cerr << "Could not create GLFW window" << std::endl;
@@ -101,6 +120,8 @@ Window::Window(std::string_view title, const glm::ivec2& windowSize, OpenGLVersi
         glGetIntegerv(GL_MAJOR_VERSION, &glVersionMajor);
         glGetIntegerv(GL_MINOR_VERSION, &glVersionMinor);
         std::cout << "Initialized OpenGL version " << glVersionMajor << "." << glVersionMinor << std::endl;
+        // Drivers may hand out a newer context than requested; only use DSA when 4.5 was asked for explicitly.
+        GLState::setDirectStateAccess(glVersion == OpenGLVersion::GL45 && GLAD_GL_VERSION_4_5);
 
         // NOTE(Mathijs): this is not supported on macOS since Apple can't be bothered to update
         //  their OpenGL version past 4.1 which released in 2010!
@@ -238,8 +259,11 @@ void Window::swapBuffers()
             ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
         } break;
         };
+        // ImGui changes GL state without going through the state cache.
+        GLState::invalidate();
     }
 
+    GLState::endFrame();
     glfwSwapBuffers(m_pWindow);
 }
 
@@ -445,3 +469,8 @@ float Window::getDpiScalingFactor() const
 {
     return m_dpiScalingFactor;
 }
+
+OpenGLVersion Window::getGLVersion() const
+{
+    return m_glVersion;
+}
@@ -0,0 +1,23 @@
+#version 410
+
+// The box [boundsMin, boundsMax] as 12 triangles, generated from gl_VertexID so no vertex buffer is needed.
+// Corner i has x = bit 0, y = bit 1 and z = bit 2 of i set to the maximum.
+uniform mat4 viewProjectionMatrix;
+uniform vec3 boundsMin;
+uniform vec3 boundsMax;
+
+const int corners[36] = int[36](
+    0, 2, 6, 0, 6, 4, // -x
+    1, 3, 7, 1, 7, 5, // +x
+    0, 1, 5, 0, 5, 4, // -y
+    2, 3, 7, 2, 7, 6, // +y
+    0, 1, 3, 0, 3, 2, // -z
+    4, 5, 7, 4, 7, 6  // +z
+);
+
+void main()
+{
+    int corner = corners[gl_VertexID];
+    vec3 t = vec3(corner & 1, (corner >> 1) & 1, (corner >> 2) & 1);
+    gl_Position = viewProjectionMatrix * vec4(mix(boundsMin, boundsMax, t), 1);
+}
@@ -0,0 +1,36 @@
+#version 410
+
+// Lighting pass of the deferred path: shades every pixel of the G-buffer (see gbuffer.glsl) with the lights of its
+// cluster and the sun, exactly like the forward shader would have, and copies its depth so that forward passes can follow.
+#include "view.glsl"
+#include "lights.glsl"
+#include "shadows.glsl"
+#include "gbuffer.glsl"
+
+uniform sampler2D gbufferAlbedo;
+uniform sampler2D gbufferNormal;
+uniform sampler2D gbufferDepth;
+uniform mat4 inverseViewProjection;
+
+layout(location = 0) out vec4 fragColor;
+
+void main()
+{
+    ivec2 pixel = ivec2(gl_FragCoord.xy);
+    float depth = texelFetch(gbufferDepth, pixel, 0).r;
+    if (depth == 1.0)
+        discard; // Nothing was drawn here
+
+    vec4 albedo = texelFetch(gbufferAlbedo, pixel, 0);
+    gl_FragDepth = depth;
+    if (albedo.a == 0.0) {
+        fragColor = vec4(albedo.rgb, 1.0);
+        return;
+    }
+
+    vec2 ndc = (vec2(pixel) + 0.5) / vec2(textureSize(gbufferDepth, 0)) * 2.0 - 1.0;
+    vec4 position = inverseViewProjection * vec4(ndc, 2.0 * depth - 1.0, 1.0);
+    vec3 normal = decodeGBufferNormal(texelFetch(gbufferNormal, pixel, 0));
+    vec3 worldPosition = position.xyz / position.w;
+    fragColor = vec4(shadeLights(worldPosition, normal, albedo.rgb) + shadeSun(worldPosition, normal, albedo.rgb), 1.0);
+}
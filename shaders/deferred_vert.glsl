@@ -0,0 +1,8 @@
+#version 410
+
+// One triangle covering the screen, made from gl_VertexID; drawn without vertex buffers.
+void main()
+{
+    vec2 position = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);
+    gl_Position = vec4(2.0 * position - 1.0, 0.0, 1.0);
+}
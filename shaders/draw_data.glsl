@@ -0,0 +1,14 @@
+// Per-draw data of a MultiDrawBatch (src/multi_draw.h); #include "draw_data.glsl". Must match GPUDrawData.
+struct DrawData
+{
+    mat4 modelMatrix;
+    mat3 normalModelMatrix;
+    uint materialIndex;
+    uint firstIndex;
+    int baseVertex;
+};
+
+layout(std430, binding = 0) readonly buffer DrawDataBuffer
+{
+    DrawData draws[];
+};
@@ -0,0 +1,35 @@
+// G-buffer of the deferred path; #include "gbuffer.glsl". Two RGBA8 targets plus depth, lit by deferred_frag.glsl:
+//   0: albedo (rgb), lit (a: 1 = shade with the lights, 0 = output the albedo as is)
+//   1: normal, octahedral encoding with 16 bits per component, each split over two channels
+// The position is reconstructed from depth.
+
+// Maps the unit sphere onto the [-1, 1] square: the upper half is the inner diamond, the lower half is folded out.
+vec2 octahedralEncode(vec3 n)
+{
+    n /= abs(n.x) + abs(n.y) + abs(n.z);
+    if (n.z < 0.0)
+        n.xy = (1.0 - abs(n.yx)) * vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+    return n.xy;
+}
+
+vec3 octahedralDecode(vec2 e)
+{
+    vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+    if (n.z < 0.0)
+        n.xy = (1.0 - abs(n.yx)) * vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+    return normalize(n);
+}
+
+vec4 encodeGBufferNormal(vec3 normal)
+{
+    vec2 fixedPoint = round((0.5 * octahedralEncode(normal) + 0.5) * 65535.0);
+    vec2 high = floor(fixedPoint / 256.0);
+    return vec4(high, fixedPoint - 256.0 * high) / 255.0;
+}
+
+vec3 decodeGBufferNormal(vec4 packed)
+{
+    vec4 bytes = round(packed * 255.0);
+    vec2 fixedPoint = 256.0 * bytes.xy + bytes.zw;
+    return octahedralDecode(fixedPoint / 65535.0 * 2.0 - 1.0);
+}
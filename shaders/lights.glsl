@@ -0,0 +1,50 @@
+// Clustered point lights; #include "lights.glsl" after "view.glsl". Filled by LightClusters (src/light_clusters.h).
+uniform samplerBuffer clusterLights; // Two texels per light: position and radius, then color
+uniform usamplerBuffer clusterGrid; // Per cluster: offset into clusterLightIndices and light count
+uniform usamplerBuffer clusterLightIndices;
+uniform ivec3 clusterCount; // Tiles in x and y, depth slices
+uniform vec2 clusterDepth; // Depth of the near plane, depth slices per unit of log(depth)
+
+// Cluster of a world-space position in the current view: its screen tile and the depth slice it falls in.
+int clusterIndex(vec3 worldPosition)
+{
+    vec4 clip = viewProjectionMatrix * vec4(worldPosition, 1.0);
+    float depth = -(viewMatrix * vec4(worldPosition, 1.0)).z;
+    ivec2 tile = clamp(ivec2((0.5 * clip.xy / clip.w + 0.5) * vec2(clusterCount.xy)), ivec2(0), clusterCount.xy - 1);
+    int slice = clamp(int(log(max(depth, 1e-6) / clusterDepth.x) * clusterDepth.y), 0, clusterCount.z - 1);
+    return (slice * clusterCount.y + tile.y) * clusterCount.x + tile.x;
+}
+
+// Range of clusterLightIndices with the lights that reach the cluster.
+uvec2 clusterLightRange(vec3 worldPosition)
+{
+    return texelFetch(clusterGrid, clusterIndex(worldPosition)).xy;
+}
+
+void clusterLight(uint index, out vec3 position, out float radius, out vec3 color)
+{
+    int light = int(texelFetch(clusterLightIndices, int(index)).r);
+    vec4 positionRadius = texelFetch(clusterLights, 2 * light);
+    position = positionRadius.xyz;
+    radius = positionRadius.w;
+    color = texelFetch(clusterLights, 2 * light + 1).rgb;
+}
+
+// Diffuse lighting of a surface point by the lights of its cluster; each fades out smoothly towards the edge of its
+// range. Shared by forward shading (shader_frag.glsl) and the deferred lighting pass (deferred_frag.glsl).
+vec3 shadeLights(vec3 position, vec3 normal, vec3 albedo)
+{
+    vec3 color = vec3(0.0);
+    uvec2 lightRange = clusterLightRange(position);
+    for (uint i = lightRange.x; i < lightRange.x + lightRange.y; i++) {
+        vec3 lightPosition, lightColor;
+        float lightRadius;
+        clusterLight(i, lightPosition, lightRadius, lightColor);
+        vec3 toLight = lightPosition - position;
+        float distance = length(toLight);
+        float window = clamp(1.0 - pow(distance / lightRadius, 4.0), 0.0, 1.0);
+        float diff = max(dot(normal, toLight / max(distance, 1e-4)), 0.0);
+        color += window * window * diff * lightColor * albedo;
+    }
+    return color;
+}
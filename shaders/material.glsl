@@ -0,0 +1,39 @@
+// Shared by all shaders that draw GPUMesh objects; #include "material.glsl" and read the material through materialKd().
+#if defined(INSTANCED) || defined(MATERIAL_TABLE)
+// Instanced draws index a table of materials with the per-instance material index (see InstanceSet in src/instance_set.h).
+// MATERIAL_TABLE only declares the table, for shaders that find the material index some other way.
+#ifndef MAX_MATERIALS
+#define MAX_MATERIALS 64
+#endif
+
+struct MaterialData // Must match the GPUMaterial defined in src/mesh.h
+{
+    vec3 kd;
+    vec3 ks;
+    float shininess;
+    float transparency;
+};
+
+layout(std140) uniform MaterialTable
+{
+    MaterialData materials[MAX_MATERIALS];
+};
+
+vec3 materialKd(uint materialIndex) { return materials[materialIndex].kd; }
+
+#if defined(INSTANCED)
+flat in uint fragMaterialIndex;
+
+vec3 materialKd() { return materialKd(fragMaterialIndex); }
+#endif
+#else
+layout(std140) uniform Material // Must match the GPUMaterial defined in src/mesh.h
+{
+    vec3 kd;
+	vec3 ks;
+	float shininess;
+	float transparency;
+};
+
+vec3 materialKd() { return kd; }
+#endif
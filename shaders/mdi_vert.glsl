@@ -0,0 +1,45 @@
+#version 450
+// Vertex shader of the multi-draw-indirect path (MultiDrawBatch in src/multi_draw.h); pair it with shader_frag.glsl
+// built with INSTANCED so that the fragment shader reads its material from the MaterialTable. With VISIBILITY it only
+// passes the draw index on, for visibility_frag.glsl.
+
+#if defined(HAS_DRAW_PARAMETERS)
+#extension GL_ARB_shader_draw_parameters : require
+#define DRAW_ID gl_DrawIDARB
+#else
+// Every indirect command sets baseInstance to its index, so this per-instance attribute holds the draw index.
+layout(location = 11) in uint drawId;
+#define DRAW_ID drawId
+#endif
+
+#include "view.glsl"
+#include "draw_data.glsl"
+
+layout(location = 0) in vec3 position;
+layout(location = 1) in vec3 normal;
+layout(location = 2) in vec2 texCoord;
+
+out vec3 fragPosition;
+out vec3 fragNormal;
+out vec2 fragTexCoord;
+flat out uint fragMaterialIndex;
+#if defined(VISIBILITY)
+flat out uint fragDrawIndex;
+#endif
+
+// The depth pre-pass draws the batch with this shader too (and shadow_frag.glsl); the main pass tests with GL_EQUAL.
+invariant gl_Position;
+
+void main()
+{
+    DrawData draw = draws[DRAW_ID];
+    gl_Position = viewProjectionMatrix * (draw.modelMatrix * vec4(position, 1));
+
+    fragPosition        = (draw.modelMatrix * vec4(position, 1)).xyz;
+    fragNormal          = draw.normalModelMatrix * normal;
+    fragTexCoord        = texCoord;
+    fragMaterialIndex   = draw.materialIndex;
+#if defined(VISIBILITY)
+    fragDrawIndex       = uint(DRAW_ID);
+#endif
+}
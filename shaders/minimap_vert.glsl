@@ -1,24 +0,0 @@
-#version 410
-
-uniform mat4 mvpMatrix;
-uniform mat4 modelMatrix;
-// Normals should be transformed differently than positions:
-// https://paroj.github.io/gltut/Illumination/Tut09%20Normal%20Transformation.html
-uniform mat3 normalModelMatrix;
-
-layout(location = 0) in vec3 position;
-layout(location = 1) in vec3 normal;
-layout(location = 2) in vec2 texCoord;
-
-out vec3 fragPosition;
-out vec3 fragNormal;
-out vec2 fragTexCoord;
-
-void main()
-{
-    gl_Position = mvpMatrix * vec4(position, 1);
-    
-    fragPosition    = gl_Position.xyz;
-    fragNormal      = normalModelMatrix * normal;
-    fragTexCoord    = texCoord;
-}
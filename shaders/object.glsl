@@ -0,0 +1,9 @@
+// Per-object constants, bound per draw as a range of the uniform ring buffer; #include "object.glsl".
+// Must match GPUObjectConstants in src/application.cpp.
+layout(std140) uniform ObjectConstants
+{
+    mat4 modelMatrix;
+    // Normals should be transformed differently than positions:
+    // https://paroj.github.io/gltut/Illumination/Tut09%20Normal%20Transformation.html
+    mat3 normalModelMatrix;
+};
@@ -1,21 +1,26 @@
 #version 410 core
 
+#define MAX_MINIMAP_ICONS 16
+
 out vec4 fragColor;  // Output color
 
 in vec2 TexCoord;  // Interpolated texture coordinates from the vertex shader
 
-uniform sampler2D texture1;  // The texture sampler
-uniform sampler2D overlay;
+uniform sampler2D texture1;  // The cached top-down map
+uniform mat3 mapTransform;   // From TexCoord to map coordinates; scrolls and rotates the map around the player
+
+// Moving objects are not in the cached map; they are drawn on top as dots (xy = map coordinates, z = radius).
+uniform int iconCount;
+uniform vec3 icons[MAX_MINIMAP_ICONS];
+uniform vec3 iconColors[MAX_MINIMAP_ICONS];
 
 void main()
 {
-    // Sample the color from the texture at the given coordinates
-    
-
-    vec4 overlayColor = texture(overlay, (-1.f) * TexCoord);
-    if(overlayColor.r == 1.f) fragColor = texture(texture1, TexCoord); 
-    else fragColor = overlayColor;
+    vec2 mapCoord = (mapTransform * vec3(TexCoord, 1)).xy;
+    fragColor = texture(texture1, mapCoord);
 
-    if(TexCoord == vec2(0.5f,0.5f)) fragColor = vec4(1.f);
-    else fragColor = texture(texture1, TexCoord); 
+    for (int i = 0; i < iconCount; i++) {
+        if (distance(mapCoord, icons[i].xy) < icons[i].z)
+            fragColor = vec4(iconColors[i], 1);
+    }
 }
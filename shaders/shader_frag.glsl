@@ -1,34 +1,25 @@
 #version 410
 
-layout(std140) uniform Material // Must match the GPUMaterial defined in src/mesh.h
-{
-    vec3 kd;
-	vec3 ks;
-	float shininess;
-	float transparency;
-};
-
-struct Light {
-    vec4 position;
-    vec4 color;
-};
-
-layout(std140) uniform lightBuffer {
-    int light_count;
-    Light lights[32];
-};
+// Variants (see ShaderVariants): HAS_TEXCOORDS, USE_MATERIAL, INSTANCED, GBUFFER and MAX_MATERIALS are injected by
+// the ShaderBuilder. GBUFFER writes the G-buffer of the deferred path (see gbuffer.glsl) instead of shading.
+#include "material.glsl"
+#include "view.glsl"
+#include "lights.glsl"
+#include "shadows.glsl"
 
 uniform sampler2D colorMap;
-uniform bool hasTexCoords;
-uniform bool useMaterial;
-
-uniform vec3 cameraPosition;
 
 in vec3 fragPosition;
 in vec3 fragNormal;
 in vec2 fragTexCoord;
 
+#if defined(GBUFFER)
+#include "gbuffer.glsl"
+layout(location = 0) out vec4 gbufferAlbedo;
+layout(location = 1) out vec4 gbufferNormal;
+#else
 layout(location = 0) out vec4 fragColor;
+#endif
 
 void main()
 {
@@ -36,17 +27,25 @@ void main()
 
     vec3 fullColor;
 
-    if (hasTexCoords)       { fullColor = vec3(texture(colorMap, fragTexCoord).rgb);}
-    else if (useMaterial)   { fullColor = vec3(kd);}
-    else                    { fragColor = vec4(normal, 1); return;} // Output color value, change from (1, 0, 0) to something else
-
-    fragColor = vec4(0.f);
-
-    for(int i = 0; i<light_count; i++){
-        vec3 lightDir = normalize(lights[i].position.rgb - fragPosition);
-        float diff = max(dot(normal, lightDir), 0.0);
-        vec3 diffuse = diff * lights[i].color.rgb * fullColor;
-
-        fragColor += vec4(diffuse, 1.f);
-    }
+#if defined(HAS_TEXCOORDS)
+    fullColor = vec3(texture(colorMap, fragTexCoord).rgb);
+#elif defined(USE_MATERIAL)
+    fullColor = materialKd();
+#else
+#if defined(GBUFFER)
+    // Not lit by the deferred lighting pass.
+    gbufferAlbedo = vec4(normal, 0.0);
+    gbufferNormal = encodeGBufferNormal(normal);
+    return;
+#else
+    fragColor = vec4(normal, 1); return; // Output color value, change from (1, 0, 0) to something else
+#endif
+#endif
+
+#if defined(GBUFFER)
+    gbufferAlbedo = vec4(fullColor, 1.0);
+    gbufferNormal = encodeGBufferNormal(normal);
+#else
+    fragColor = vec4(shadeLights(fragPosition, normal, fullColor) + shadeSun(fragPosition, normal, fullColor), 1.0);
+#endif
 }
@@ -1,24 +1,40 @@
 #version 410
 
-uniform mat4 mvpMatrix;
-uniform mat4 modelMatrix;
-// Normals should be transformed differently than positions:
-// https://paroj.github.io/gltut/Illumination/Tut09%20Normal%20Transformation.html
-uniform mat3 normalModelMatrix;
+#include "view.glsl"
+#include "object.glsl"
 
 layout(location = 0) in vec3 position;
 layout(location = 1) in vec3 normal;
 layout(location = 2) in vec2 texCoord;
+#if defined(INSTANCED)
+// Per-instance attributes, see InstanceAttribute in src/instance_set.h.
+layout(location = 3) in mat4 instanceModelMatrix;
+layout(location = 7) in mat3 instanceNormalModelMatrix;
+layout(location = 10) in uint instanceMaterialIndex;
+
+flat out uint fragMaterialIndex;
+#endif
 
 out vec3 fragPosition;
 out vec3 fragNormal;
 out vec2 fragTexCoord;
 
+// Must match the depth pre-pass (shadow_vert.glsl), which the main pass tests against with GL_EQUAL.
+invariant gl_Position;
+
 void main()
 {
-    gl_Position = mvpMatrix * vec4(position, 1);
+#if defined(INSTANCED)
+    mat4 model          = instanceModelMatrix;
+    mat3 normalModel    = instanceNormalModelMatrix;
+    fragMaterialIndex   = instanceMaterialIndex;
+#else
+    mat4 model          = modelMatrix;
+    mat3 normalModel    = normalModelMatrix;
+#endif
+    gl_Position = viewProjectionMatrix * (model * vec4(position, 1));
     
-    fragPosition    = gl_Position.xyz;
-    fragNormal      = normalModelMatrix * normal;
+    fragPosition    = (model * vec4(position, 1)).xyz; // World space, for the lighting
+    fragNormal      = normalModel * normal;
     fragTexCoord    = texCoord;
 }
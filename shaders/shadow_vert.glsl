@@ -1,10 +1,24 @@
 #version 410
+// Depth-only passes (depth pre-pass, shadow maps), fed by GPUMesh::drawPositions(). The position is transformed with
+// exactly the same expression as in shader_vert.glsl and declared invariant in both, so the depth pre-pass produces
+// bit-identical depths and the main pass can test with GL_EQUAL. INSTANCED reads the model matrix per instance (see
+// InstanceAttribute in src/instance_set.h), for the props in the shadow maps.
 
-uniform mat4 mvpMatrix;
+#include "view.glsl"
+#include "object.glsl"
 
 layout(location = 0) in vec3 position;
+#if defined(INSTANCED)
+layout(location = 3) in mat4 instanceModelMatrix;
+#endif
+
+invariant gl_Position;
 
 void main()
 {
-    gl_Position = mvpMatrix * vec4(position, 1);
+#if defined(INSTANCED)
+    gl_Position = viewProjectionMatrix * (instanceModelMatrix * vec4(position, 1));
+#else
+    gl_Position = viewProjectionMatrix * (modelMatrix * vec4(position, 1));
+#endif
 }
@@ -0,0 +1,42 @@
+// The sun and its cascaded shadow maps; #include "shadows.glsl". Filled by CascadedShadowMaps (src/cascaded_shadows.h)
+// and the sun uniforms in src/application.cpp.
+#define SHADOW_CASCADES 4 // CascadedShadowMaps::cascadeCount
+
+uniform sampler2DArrayShadow shadowMaps; // One layer per cascade
+uniform mat4 shadowMatrices[SHADOW_CASCADES]; // World space to the clip space of each cascade
+uniform vec4 shadowTexelSizes; // World-space size of a texel, per cascade
+uniform int shadowCascades; // 0 when nothing is in shadow
+uniform vec3 sunDirection; // Direction the light travels in
+uniform vec3 sunColor;
+
+// Fraction of the sunlight that reaches a surface point, from the first (finest) cascade that contains it. The point
+// is pushed out along the normal by about a texel against acne, and four hardware-filtered taps soften the edge.
+float sunShadow(vec3 position, vec3 normal)
+{
+    for (int cascade = 0; cascade < shadowCascades; cascade++) {
+        vec3 offsetPosition = position + normal * (1.5 * shadowTexelSizes[cascade]);
+        vec3 coord = (shadowMatrices[cascade] * vec4(offsetPosition, 1.0)).xyz * 0.5 + 0.5;
+        if (any(lessThan(coord.xy, vec2(0.0))) || any(greaterThan(coord.xy, vec2(1.0))))
+            continue;
+        if (coord.z >= 1.0)
+            return 1.0; // Behind every static caster
+
+        vec2 texel = 1.0 / vec2(textureSize(shadowMaps, 0).xy);
+        float lit = 0.0;
+        for (int y = -1; y <= 1; y += 2) {
+            for (int x = -1; x <= 1; x += 2)
+                lit += texture(shadowMaps, vec4(coord.xy + 0.5 * vec2(x, y) * texel, float(cascade), coord.z));
+        }
+        return 0.25 * lit;
+    }
+    return 1.0;
+}
+
+// Diffuse lighting of a surface point by the sun.
+vec3 shadeSun(vec3 position, vec3 normal, vec3 albedo)
+{
+    float diff = max(dot(normal, -sunDirection), 0.0);
+    if (diff == 0.0)
+        return vec3(0.0);
+    return diff * sunShadow(position, normal) * sunColor * albedo;
+}
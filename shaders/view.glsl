@@ -0,0 +1,8 @@
+// Per-view constants, written once per view and frame; #include "view.glsl". Must match GPUViewConstants in src/application.cpp.
+layout(std140) uniform ViewConstants
+{
+    mat4 viewMatrix;
+    mat4 projectionMatrix;
+    mat4 viewProjectionMatrix;
+    vec4 cameraPosition;
+};
@@ -0,0 +1,16 @@
+#version 450
+// Geometry pass of the visibility buffer: stores which triangle of which draw is visible, nothing else. Paired with
+// mdi_vert.glsl built with VISIBILITY; visibility_shade_frag.glsl shades the result.
+
+flat in uint fragDrawIndex;
+
+// The draw index + 1 goes in the bits above the triangle index, so that 0 (the clear value) means nothing was drawn.
+uniform uint triangleBits;
+
+layout(location = 0) out uint visibility;
+
+void main()
+{
+    // gl_PrimitiveID restarts at 0 for every draw of a multi-draw.
+    visibility = ((fragDrawIndex + 1u) << triangleBits) | uint(gl_PrimitiveID);
+}
@@ -0,0 +1,74 @@
+#version 450
+// Material pass of the visibility buffer, drawn as one triangle over the screen (deferred_vert.glsl). Every pixel is
+// shaded exactly once: it looks up the triangle that visibility_frag.glsl stored, fetches its vertices from the
+// geometry arena, interpolates them at the pixel center and lights the result like shader_frag.glsl would have.
+// Variants: USE_MATERIAL (without it the normal is shown, like shader_frag.glsl); MATERIAL_TABLE and MAX_MATERIALS
+// are always injected.
+#include "material.glsl"
+#include "view.glsl"
+#include "lights.glsl"
+#include "shadows.glsl"
+#include "draw_data.glsl"
+
+layout(std430, binding = 1) readonly buffer ArenaVertices
+{
+    float vertexData[]; // Vertex structs (src/mesh.h): position, normal, texture coordinate
+};
+
+layout(std430, binding = 2) readonly buffer ArenaIndices
+{
+    uint indices[];
+};
+
+uniform usampler2D visibilityBuffer;
+uniform sampler2D visibilityDepth;
+uniform uint triangleBits;
+
+layout(location = 0) out vec4 fragColor;
+
+const int vertexStride = 8;
+
+vec3 vertexPosition(int vertex) { return vec3(vertexData[vertexStride * vertex], vertexData[vertexStride * vertex + 1], vertexData[vertexStride * vertex + 2]); }
+vec3 vertexNormal(int vertex) { return vec3(vertexData[vertexStride * vertex + 3], vertexData[vertexStride * vertex + 4], vertexData[vertexStride * vertex + 5]); }
+
+void main()
+{
+    ivec2 pixel = ivec2(gl_FragCoord.xy);
+    uint visibility = texelFetch(visibilityBuffer, pixel, 0).r;
+    if (visibility == 0u)
+        discard; // Nothing was drawn here
+    gl_FragDepth = texelFetch(visibilityDepth, pixel, 0).r;
+
+    DrawData draw = draws[(visibility >> triangleBits) - 1u];
+    uint triangle = visibility & ((1u << triangleBits) - 1u);
+    int vertices[3];
+    vec3 positions[3];
+    vec4 clipPositions[3];
+    for (int i = 0; i < 3; i++) {
+        vertices[i] = draw.baseVertex + int(indices[draw.firstIndex + 3u * triangle + uint(i)]);
+        positions[i] = (draw.modelMatrix * vec4(vertexPosition(vertices[i]), 1.0)).xyz;
+        clipPositions[i] = viewProjectionMatrix * vec4(positions[i], 1.0);
+    }
+
+    // Barycentric coordinates of the pixel center in screen space, then corrected for perspective with 1 / w.
+    vec2 ndc = (vec2(pixel) + 0.5) / vec2(textureSize(visibilityBuffer, 0)) * 2.0 - 1.0;
+    vec2 p0 = clipPositions[0].xy / clipPositions[0].w;
+    vec2 p1 = clipPositions[1].xy / clipPositions[1].w;
+    vec2 p2 = clipPositions[2].xy / clipPositions[2].w;
+    vec2 e1 = p1 - p0, e2 = p2 - p0, toPixel = ndc - p0;
+    float area = e1.x * e2.y - e1.y * e2.x;
+    float b1 = (toPixel.x * e2.y - toPixel.y * e2.x) / area;
+    float b2 = (e1.x * toPixel.y - e1.y * toPixel.x) / area;
+    vec3 weights = vec3(1.0 - b1 - b2, b1, b2) / vec3(clipPositions[0].w, clipPositions[1].w, clipPositions[2].w);
+    weights /= weights.x + weights.y + weights.z;
+
+    vec3 position = weights.x * positions[0] + weights.y * positions[1] + weights.z * positions[2];
+    vec3 normal = normalize(draw.normalModelMatrix * (weights.x * vertexNormal(vertices[0]) + weights.y * vertexNormal(vertices[1]) + weights.z * vertexNormal(vertices[2])));
+
+#if defined(USE_MATERIAL)
+    vec3 albedo = materialKd(draw.materialIndex);
+    fragColor = vec4(shadeLights(position, normal, albedo) + shadeSun(position, normal, albedo), 1.0);
+#else
+    fragColor = vec4(normal, 1.0);
+#endif
+}
@@ -1,5 +1,18 @@
 // #include "Image.h"
+#include "bvh.h"
+#include "cascaded_shadows.h"
+#include "frustum_culling.h"
+#include "instance_set.h"
+#include "light_clusters.h"
+#include "minimap.h"
 #include "mesh.h"
+#include "multi_draw.h"
+#include "offscreen_passes.h"
+#include "occlusion_culling.h"
+#include "occlusion_queries.h"
+#include "potentially_visible_set.h"
+#include "render_graph.h"
+#include "render_queue.h"
 #include "texture.h"
 // Always include window first (because it includes glfw, which includes GL which needs to be included AFTER glew).
 // Can't wait for modules to fix this stuff...
@@ -15,15 +28,28 @@ DISABLE_WARNINGS_PUSH()
 #include <glm/mat4x4.hpp>
 #include <imgui/imgui.h>
 DISABLE_WARNINGS_POP()
+#include <framework/gl_state.h>
+#include <framework/gpu_layout.h>
 #include <framework/shader.h>
+#include <framework/uniform_ring_buffer.h>
 #include <framework/window.h>
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <deque>
 #include <functional>
+#include <optional>
+#include <random>
+#include <string_view>
+#include <thread>
 #include <iostream>
 #include <vector>
 #include <framework/trackball.h>
 #include <camera.h>
 #include <constants.h>
 
+using namespace shader_literals;
+
 
 const float fixedTimeStep = 0.016f; // 60 ticks per sec
 float frameTimeAccumulator = 0.0f; // use this to add up skipped timesteps
@@ -50,6 +76,9 @@ glm::vec3 characterOffset = glm::vec3(0.f,0.f,0.f);
 
 std::vector<GPUMesh> crosshair_mesh;
 
+// Potentially visible sets of the meshes in scene1.obj (see bakeScenePVS()).
+const char *const scenePVSPath = RESOURCE_ROOT "resources/scene1.pvs";
+
 float scaleFactor = 0.5f;
 
 float height = 1.0f * scaleFactor;          // Original height
@@ -67,29 +96,109 @@ glm::vec3 minimap_lowcolor = {0.f, 0.f, 1.f};
 glm::vec3 minimap_highcolor = {1.f, 0.f, 0.f};
 
 float minimap_ortho_height = 25.f;
+constexpr size_t maxMinimapIcons = 16; // MAX_MINIMAP_ICONS in quad_frag.glsl
 
 bool show_map = false;
 
 CameraMode currentCameraMode = CameraMode::FlyCamera;
 
-// UBOs must always use vec4s, vec2s, or scalars, NEVER vec3 
-// https://stackoverflow.com/questions/38172696/should-i-ever-use-a-vec3-inside-of-a-uniform-buffer-or-shader-storage-buffer-o
-// This is very annoying.
-struct Light {
-    glm::vec4 position;
-    glm::vec4 color;
+// Requested context version. GL45 enables direct state access, the persistently mapped uniform ring and the
+// multi-draw-indirect path; where it is not available (macOS stops at 4.1) the window falls back to GL41, and
+// everything below is gated on the version that was actually created (Window::getGLVersion()).
+constexpr OpenGLVersion glVersion = OpenGLVersion::GL45;
+
+// CPU mirror of the ViewConstants block in shaders/view.glsl; pushed to the uniform ring buffer once per view and frame.
+struct GPUViewConstants {
+    glm::mat4 viewMatrix;
+    glm::mat4 projectionMatrix;
+    glm::mat4 viewProjectionMatrix;
+    glm::vec4 cameraPosition;
+};
+using ViewConstantsLayout = gpu_layout::Struct<gpu_layout::Packing::Std140, glm::mat4, glm::mat4, glm::mat4, glm::vec4>;
+GPU_LAYOUT_CHECK_MEMBER(GPUViewConstants, ViewConstantsLayout, 0, viewMatrix);
+GPU_LAYOUT_CHECK_MEMBER(GPUViewConstants, ViewConstantsLayout, 1, projectionMatrix);
+GPU_LAYOUT_CHECK_MEMBER(GPUViewConstants, ViewConstantsLayout, 2, viewProjectionMatrix);
+GPU_LAYOUT_CHECK_MEMBER(GPUViewConstants, ViewConstantsLayout, 3, cameraPosition);
+GPU_LAYOUT_CHECK_SIZE(GPUViewConstants, ViewConstantsLayout);
+constexpr std::array<std::string_view, ViewConstantsLayout::count> ViewConstantsMemberNames { "viewMatrix", "projectionMatrix", "viewProjectionMatrix", "cameraPosition" };
+
+// CPU mirror of the ObjectConstants block in shaders/object.glsl; pushed to the uniform ring buffer once per draw.
+struct GPUObjectConstants {
+    GPUObjectConstants(const glm::mat4& model)
+        : modelMatrix(model)
+        // Normals should be transformed differently than positions (ignoring translations + dealing with scaling):
+        // https://paroj.github.io/gltut/Illumination/Tut09%20Normal%20Transformation.html
+        , normalModelMatrix(glm::inverseTranspose(glm::mat3(model)))
+    {
+    }
+
+    glm::mat4 modelMatrix;
+    glm::mat3x4 normalModelMatrix; // std140 stores each column of a mat3 as a vec4.
+};
+using ObjectConstantsLayout = gpu_layout::Struct<gpu_layout::Packing::Std140, glm::mat4, glm::mat3>;
+GPU_LAYOUT_CHECK_MEMBER(GPUObjectConstants, ObjectConstantsLayout, 0, modelMatrix);
+GPU_LAYOUT_CHECK_MEMBER(GPUObjectConstants, ObjectConstantsLayout, 1, normalModelMatrix);
+GPU_LAYOUT_CHECK_SIZE(GPUObjectConstants, ObjectConstantsLayout);
+constexpr std::array<std::string_view, ObjectConstantsLayout::count> ObjectConstantsMemberNames { "modelMatrix", "normalModelMatrix" };
+
+// Uniform block binding points shared by all shaders that draw GPUMesh objects (GPUMesh::draw binds Material to 0).
+namespace UniformBinding {
+    constexpr GLuint Material        = 0;
+    constexpr GLuint ViewConstants   = 2;
+    constexpr GLuint ObjectConstants = 3;
+    constexpr GLuint MaterialTable   = 4;
+}
+// Upper bound on the draws (over all views) in a frame; sizes the uniform ring buffer.
+constexpr GLsizeiptr maxDrawsPerFrame = 1024;
+// GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT is at most 256 on current hardware, so every ring allocation fits in a slot this big.
+constexpr GLsizeiptr uniformRingSlotSize = 256;
+static_assert(sizeof(GPUViewConstants) <= uniformRingSlotSize && sizeof(GPUObjectConstants) <= uniformRingSlotSize);
+
+// Preprocessor permutations of shader_frag.glsl; bit i enables the i-th define passed to m_defaultShaders.
+namespace DefaultShaderFeature {
+    constexpr uint32_t HasTexCoords = 1u << 0;
+    constexpr uint32_t UseMaterial  = 1u << 1;
+    constexpr uint32_t Instanced    = 1u << 2;
+    constexpr uint32_t GBuffer      = 1u << 3; // Write the G-buffer of the deferred path instead of shading
+}
+
+// How the main view removes the scene meshes that are hidden behind others (after frustum culling).
+enum class OcclusionCullingMode
+{
+    None,
+    Software,
+    HardwareQueries
+};
+const std::array<const char *, 3> occlusionCullingModeNames { "None", "CPU depth rasterizer", "GPU occlusion queries" };
+
+// How the main view shades its opaque geometry; the minimap and all transparent geometry are always shaded forward.
+enum class ShadingPath
+{
+    Forward,
+    Deferred,        // G-buffer, then one lighting pass
+    VisibilityBuffer // Triangle ids of the multi-draw batch, then one material pass (GL 4.5 only)
 };
+const std::array<const char *, 3> shadingPathNames { "Forward", "Deferred", "Visibility buffer" };
 
-std::vector<Light> lights = {{glm::vec4(3.f, 8.f, -10.f, -0.f), glm::vec4(1.f, 1.f, 1.f, 0.f)}};
+// Lights placed in the UI; they are also baked into the minimap. The range of the first one covers the whole scene.
+std::vector<PointLight> lights = {{glm::vec3(3.f, 8.f, -10.f), 50.0f, glm::vec3(1.f)}};
 
 int selectedLightIndex = 0;
 
+// The sun lights the whole scene from one direction; only the main view gets its (cascaded) shadows.
+struct DirectionalLight
+{
+    glm::vec3 direction; // Direction the light travels in
+    glm::vec3 color;
+};
+DirectionalLight sun { glm::normalize(glm::vec3(-0.4f, -1.0f, -0.3f)), glm::vec3(0.4f) };
+
 
 class Application
 {
 public:
     Application()
-        : m_window("Final Project", glm::ivec2(utils::WIDTH, utils::HEIGHT), OpenGLVersion::GL41), m_texture(RESOURCE_ROOT "resources/pattern.png"), characterTexture(RESOURCE_ROOT "resources/doggos.jpg")
+        : m_window("Final Project", glm::ivec2(utils::WIDTH, utils::HEIGHT), glVersion), m_texture(RESOURCE_ROOT "resources/pattern.png"), characterTexture(RESOURCE_ROOT "resources/doggos.jpg")
     {
         pTrackball = std::make_unique<Trackball>(&m_window, glm::radians(50.0f));
         pFlyCamera = std::make_unique<Camera>(&m_window, utils::START_POSITION, utils::START_LOOK_AT);
@@ -110,84 +219,103 @@ public:
             else if (action == GLFW_RELEASE)
                 onMouseReleased(button, mods); });
 
-        m_meshes = GPUMesh::loadMeshGPU(RESOURCE_ROOT "resources/scene1.obj");
-
-        characterMesh = GPUMesh::loadMeshGPU(RESOURCE_ROOT "resources/cylinder.obj");
-
+        // Linked programs are cached on disk so that later launches can skip GLSL compilation.
+        ShaderBuilder::setBinaryCacheDirectory(RESOURCE_ROOT "shader_cache/");
         try
         {
-            ShaderBuilder defaultBuilder;
-            defaultBuilder.addStage(GL_VERTEX_SHADER, RESOURCE_ROOT "shaders/shader_vert.glsl");
-            std::cout << "Linked shader_vert.glsl to defaultBuilder" << std::endl;
-            defaultBuilder.addStage(GL_FRAGMENT_SHADER, RESOURCE_ROOT "shaders/shader_frag.glsl");
-            std::cout << "Linked shader_frag.glsl to defaultBuilder" << std::endl;
-            m_defaultShader = defaultBuilder.build();
-            std::cout << "Built m_defaultShader" << std::endl;
-
-            ShaderBuilder shadowBuilder;
-            shadowBuilder.addStage(GL_VERTEX_SHADER, RESOURCE_ROOT "shaders/shadow_vert.glsl");
-            std::cout << "Linked shadow_vert.glsl to shadowBuilder" << std::endl;
-            shadowBuilder.addStage(GL_FRAGMENT_SHADER, RESOURCE_ROOT "Shaders/shadow_frag.glsl");
-            std::cout << "Linked shadow_frag.glsl to shadowBuilder" << std::endl;
-            m_shadowShader = shadowBuilder.build();
-            std::cout << "Built m_shadowShader" << std::endl;
-
-            ShaderBuilder quadBuilder;
-            quadBuilder.addStage(GL_VERTEX_SHADER, RESOURCE_ROOT "shaders/quad_vert.glsl");
-            std::cout << "Linked quad_vert.glsl to quadBuilder" << std::endl;
-            quadBuilder.addStage(GL_FRAGMENT_SHADER, RESOURCE_ROOT "shaders/quad_frag.glsl");
-            std::cout << "Linked quad_frag.glsl to quadBuilder" << std::endl;
-            m_quadShader = quadBuilder.build();
-            std::cout << "Built m_quadShader" << std::endl;
-
-            ShaderBuilder minimapBuilder;
-            minimapBuilder.addStage(GL_VERTEX_SHADER, RESOURCE_ROOT "shaders/minimap_vert.glsl");
-            std::cout << "Linked minimap_vert.glsl to minimapBuilder" << std::endl;
-            minimapBuilder.addStage(GL_FRAGMENT_SHADER, RESOURCE_ROOT "shaders/minimap_frag.glsl");
-            std::cout << "Linked minimap_frag.glsl to minimapBuilder" << std::endl;
-            m_minimapShader = minimapBuilder.build();
-            std::cout << "Built m_minimapShader" << std::endl;
-
-            // Any new shaders can be added below in similar fashion.
+            // Feature order must match DefaultShaderFeature.
+            m_defaultShaders = ShaderVariants(
+                { { GL_VERTEX_SHADER, RESOURCE_ROOT "shaders/shader_vert.glsl" }, { GL_FRAGMENT_SHADER, RESOURCE_ROOT "shaders/shader_frag.glsl" } },
+                { "HAS_TEXCOORDS", "USE_MATERIAL", "INSTANCED", "GBUFFER" },
+                { { "MAX_MATERIALS", std::to_string(MaterialTable::maxMaterials) } });
+            m_shadowShader = ShaderVariants({ { GL_VERTEX_SHADER, RESOURCE_ROOT "shaders/shadow_vert.glsl" }, { GL_FRAGMENT_SHADER, RESOURCE_ROOT "shaders/shadow_frag.glsl" } }, { "INSTANCED" });
+            m_quadShader = ShaderVariants({ { GL_VERTEX_SHADER, RESOURCE_ROOT "shaders/quad_vert.glsl" }, { GL_FRAGMENT_SHADER, RESOURCE_ROOT "shaders/quad_frag.glsl" } }, {});
+            m_boundingBoxShader = ShaderVariants({ { GL_VERTEX_SHADER, RESOURCE_ROOT "shaders/bounding_box_vert.glsl" }, { GL_FRAGMENT_SHADER, RESOURCE_ROOT "shaders/shadow_frag.glsl" } }, {});
+            m_deferredLightingShader = ShaderVariants({ { GL_VERTEX_SHADER, RESOURCE_ROOT "shaders/deferred_vert.glsl" }, { GL_FRAGMENT_SHADER, RESOURCE_ROOT "shaders/deferred_frag.glsl" } }, {});
+            if (multiDrawSupported())
+            {
+                // shader_frag.glsl with INSTANCED reads the material index that mdi_vert.glsl passes on.
+                ShaderVariants::Defines defines { { "INSTANCED", "" }, { "MAX_MATERIALS", std::to_string(MaterialTable::maxMaterials) } };
+                if (glfwExtensionSupported("GL_ARB_shader_draw_parameters"))
+                    defines.push_back({ "HAS_DRAW_PARAMETERS", "" });
+                m_multiDrawShaders = ShaderVariants(
+                    { { GL_VERTEX_SHADER, RESOURCE_ROOT "shaders/mdi_vert.glsl" }, { GL_FRAGMENT_SHADER, RESOURCE_ROOT "shaders/shader_frag.glsl" } },
+                    { "USE_MATERIAL", "GBUFFER" }, defines);
+                m_multiDrawDepthShader = ShaderVariants(
+                    { { GL_VERTEX_SHADER, RESOURCE_ROOT "shaders/mdi_vert.glsl" }, { GL_FRAGMENT_SHADER, RESOURCE_ROOT "shaders/shadow_frag.glsl" } },
+                    {}, defines);
+                defines.push_back({ "VISIBILITY", "" });
+                m_visibilityShader = ShaderVariants(
+                    { { GL_VERTEX_SHADER, RESOURCE_ROOT "shaders/mdi_vert.glsl" }, { GL_FRAGMENT_SHADER, RESOURCE_ROOT "shaders/visibility_frag.glsl" } },
+                    {}, std::move(defines));
+                m_visibilityShadeShaders = ShaderVariants(
+                    { { GL_VERTEX_SHADER, RESOURCE_ROOT "shaders/deferred_vert.glsl" }, { GL_FRAGMENT_SHADER, RESOURCE_ROOT "shaders/visibility_shade_frag.glsl" } },
+                    { "USE_MATERIAL" }, { { "MATERIAL_TABLE", "" }, { "MAX_MATERIALS", std::to_string(MaterialTable::maxMaterials) } });
+            }
+
+            // Any new shaders can be added below in similar fashion (and to allShaders()).
             // ==> Don't forget to reconfigure CMake when you do!
             //     Visual Studio: PROJECT => Generate Cache for ComputerGraphics
             //     VS Code: ctrl + shift + p => CMake: Configure => enter
             // ....
+
+            // Only submit the work here; the driver compiles while we load the meshes below.
+            for (ShaderVariants* pShaders : allShaders())
+                pShaders->buildAllAsync();
         }
         catch (ShaderLoadingException e)
         {
             std::cerr << e.what() << std::endl;
         }
+
+        m_meshes = GPUMesh::loadMeshGPU(RESOURCE_ROOT "resources/scene1.obj");
+
+        characterMesh = GPUMesh::loadMeshGPU(RESOURCE_ROOT "resources/cylinder.obj");
+
+        try
+        {
+            for (ShaderVariants* pShaders : allShaders())
+                pShaders->buildAll();
+            std::cout << "Built all shaders" << std::endl;
+
+            // Make sure the CPU-side structs match what the GLSL compiler made of the blocks.
+            const Shader& litShader = m_defaultShaders.select(DefaultShaderFeature::UseMaterial);
+            gpu_layout::validateUniformBlock<GPUMaterialLayout>(litShader, "Material", GPUMaterialMemberNames);
+            gpu_layout::validateUniformBlock<ViewConstantsLayout>(litShader, "ViewConstants", ViewConstantsMemberNames);
+            gpu_layout::validateUniformBlock<ObjectConstantsLayout>(litShader, "ObjectConstants", ObjectConstantsMemberNames);
+            const Shader& instancedShader = m_defaultShaders.select(DefaultShaderFeature::UseMaterial | DefaultShaderFeature::Instanced);
+            gpu_layout::validateUniformBlock<GPUMaterialTableLayout>(instancedShader, "MaterialTable", { "materials[0].kd" });
+        }
+        catch (ShaderLoadingException e)
+        {
+            std::cerr << e.what() << std::endl;
+        }
+    }
+
+    // All shader programs, for building and hot reloading.
+    std::vector<ShaderVariants*> allShaders()
+    {
+        std::vector<ShaderVariants*> out { &m_defaultShaders, &m_shadowShader, &m_quadShader, &m_boundingBoxShader, &m_deferredLightingShader };
+        if (multiDrawSupported())
+        {
+            out.push_back(&m_multiDrawShaders);
+            out.push_back(&m_multiDrawDepthShader);
+            out.push_back(&m_visibilityShader);
+            out.push_back(&m_visibilityShadeShaders);
+        }
+        return out;
+    }
+
+    // glMultiDrawElementsIndirect and shader storage buffers need GL 4.3; the arena and batch are filled with DSA (4.5).
+    bool multiDrawSupported() const
+    {
+        return m_window.getGLVersion() == OpenGLVersion::GL45 && GLState::directStateAccess();
     }
 
     void update()
     {
 
         // MINIMAP INITs ***********************************************************************************************
-        unsigned int minimapFBO;
-        glGenFramebuffers(1, &minimapFBO);
-
-        const int minimapWidth = utils::WIDTH, minimapHeight = utils::HEIGHT;
-        unsigned int minimapTex;
-        glGenTextures(1, &minimapTex);
-        glBindTexture(GL_TEXTURE_2D, minimapTex);
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, minimapWidth, minimapHeight, 0, GL_RGB, GL_UNSIGNED_BYTE, nullptr);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);      // Prevents shadow map artifacts.
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);      // Prevents shadow map artifacts.
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER); // Prevents shadow map artifacts.
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER); // Prevents shadow map artifacts.
-        float borderColor[] = {1.0, 1.0, 1.0, 1.0};
-        glTexParameterfv(GL_TEXTURE_2D, GL_TEXTURE_BORDER_COLOR, borderColor); // Prevents shadow map artifacts.
-        glBindTexture(GL_TEXTURE_2D, 0);
-
-        glBindFramebuffer(GL_FRAMEBUFFER, minimapFBO);
-        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, minimapTex, 0);
-        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
-            std::cout << "ERROR::FRAMEBUFFER:: Framebuffer is not complete!" << std::endl;
-        glBindFramebuffer(GL_FRAMEBUFFER, 0);
-
-        Texture minimapOverlay = Texture(RESOURCE_ROOT "resources/map_overlay.png");
-
         GLuint quad_vbo;
         glGenBuffers(1, &quad_vbo);
         GLuint tex_vbo;
@@ -199,97 +327,612 @@ public:
 
         // END MINIMAP INITs ********************************************************************************************
 
-        // LIGHT UBO ****************************************************************************************************
-        int number_of_lights = (int) lights.size();
-
-        GLuint lightUBO;
-        glGenBuffers(1, &lightUBO);
-        glBindBuffer(GL_UNIFORM_BUFFER, lightUBO);
-        //Set buffer size
-        glBufferData(GL_UNIFORM_BUFFER, number_of_lights * sizeof(Light) + 16, NULL, GL_DYNAMIC_DRAW);
-        //Number of lights goes into first 4 bytes
-        glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(int), &number_of_lights);
-        //Now the light data
-        glBufferSubData(GL_UNIFORM_BUFFER, 16, number_of_lights * sizeof(Light), lights.data());
-        //Unbind buffer
-        glBindBuffer(GL_UNIFORM_BUFFER, 0);
-
-        // For updating lights
-        auto refreshLightsUBO = [&] {
-            int number_of_lights = (int) lights.size();
-             glBindBuffer(GL_UNIFORM_BUFFER, lightUBO);
-            //Set buffer size
-            glBufferData(GL_UNIFORM_BUFFER, number_of_lights * sizeof(Light) + 16, NULL, GL_DYNAMIC_DRAW);
-            //Number of lights goes into first 4 bytes
-            glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(int), &number_of_lights);
-            //Now the light data
-            glBufferSubData(GL_UNIFORM_BUFFER, 16, number_of_lights * sizeof(Light), lights.data());
-            //Unbind buffer
-            glBindBuffer(GL_UNIFORM_BUFFER, 0);
+        // LIGHT CLUSTERS ***********************************************************************************************
+        // Lights are binned into a froxel grid per view, so every fragment only shades the lights that reach it. The
+        // main view bins on up to 3 workers plus the render thread; the minimap bakes one small tile at a time.
+        LightClusters sceneLightClusters(std::clamp(std::thread::hardware_concurrency(), 1u, 4u) - 1);
+        LightClusters mapLightClusters(0);
+        std::vector<PointLight> frameLights;
+        // END LIGHT CLUSTERS *******************************************************************************************
+        // DYNAMIC UNIFORMS *********************************************************************************************
+        // View and object constants are written into a triple-buffered ring and bound with glBindBufferRange instead
+        // of being set with glUniform* calls per draw. GL 4.5 contexts write into a persistently mapped buffer.
+        UniformRingBuffer uniformRing((maxDrawsPerFrame + 8) * uniformRingSlotSize, m_window.getGLVersion() == OpenGLVersion::GL45);
+        std::vector<GLintptr> objectConstantOffsets;
+        // END DYNAMIC UNIFORMS *****************************************************************************************
+        // INSTANCED PROPS **********************************************************************************************
+        // Copies of the character geometry drawn with one instanced draw per sub-mesh; the material comes from a table
+        // indexed per instance.
+        MaterialTable propMaterials;
+        auto addPropMaterial = [&](const glm::vec3 &kd)
+        {
+            Material material;
+            material.kd = kd;
+            return propMaterials.add(material);
+        };
+        const std::array<uint32_t, 3> propPalette {
+            addPropMaterial(glm::vec3(0.8f, 0.3f, 0.2f)),
+            addPropMaterial(glm::vec3(0.2f, 0.6f, 0.3f)),
+            addPropMaterial(glm::vec3(0.3f, 0.4f, 0.8f))
+        };
+        std::vector<InstanceSet> propInstances;
+        for (const GPUMesh &mesh : characterMesh)
+            propInstances.emplace_back(mesh);
+        int propCount = 0;
+        // Props are laid out on a square grid around the origin.
+        auto propModelMatrix = [](size_t index)
+        {
+            constexpr size_t gridSize = 64;
+            const glm::vec3 position { 2.0f * float(index % gridSize) - float(gridSize), -1.0f, 2.0f * float(index / gridSize) - float(gridSize) };
+            return glm::scale(glm::translate(glm::mat4(1.0f), position), glm::vec3(0.3f));
+        };
+        auto resizeProps = [&]
+        {
+            for (InstanceSet &instances : propInstances)
+            {
+                const size_t oldCount = instances.size();
+                instances.resize(static_cast<size_t>(propCount));
+                for (size_t i = oldCount; i < instances.size(); i++)
+                    instances.set(i, propModelMatrix(i), propPalette[i % propPalette.size()]);
+                instances.upload();
+            }
+        };
+        // END INSTANCED PROPS ******************************************************************************************
+        // CPU copies of the scene meshes (same file and thus the same sub-mesh order as m_meshes), used for the
+        // multi-draw arena and as occluders.
+        const std::vector<Mesh> sceneCpuMeshes = loadMesh(RESOURCE_ROOT "resources/scene1.obj");
+        // MULTI DRAW INDIRECT ******************************************************************************************
+        // With GL 4.5 the untextured, opaque scene meshes are copied into one geometry arena and drawn with a single
+        // glMultiDrawElementsIndirect per view; everything else still goes through the render queue.
+        std::optional<GeometryArena> sceneArena;
+        std::optional<MaterialTable> sceneMaterials;
+        std::optional<MultiDrawBatch> sceneBatch;
+        std::vector<bool> drawnByMultiDraw(m_meshes.size(), false);
+        std::vector<size_t> multiDrawMeshIndices; // Index into m_meshes of every draw in sceneBatch
+        const std::vector<bool> drawnByQueue; // Nothing skipped
+        if (multiDrawSupported())
+        {
+            const std::vector<Mesh> &cpuMeshes = sceneCpuMeshes;
+            size_t vertexCount = 0, indexCount = 0;
+            for (const Mesh &mesh : cpuMeshes)
+            {
+                vertexCount += mesh.vertices.size();
+                indexCount += 3 * mesh.triangles.size();
+            }
+            sceneArena.emplace(vertexCount, indexCount, cpuMeshes.size());
+            sceneMaterials.emplace();
+            sceneBatch.emplace();
+            for (size_t i = 0; i < cpuMeshes.size() && i < m_meshes.size(); i++)
+            {
+                if (cpuMeshes[i].material.kdTexture || cpuMeshes[i].material.transparency < 1.0f)
+                    continue;
+                sceneBatch->add(sceneArena->add(cpuMeshes[i]), m_meshes[i].modelMatrix, sceneMaterials->add(cpuMeshes[i].material));
+                drawnByMultiDraw[i] = true;
+                multiDrawMeshIndices.push_back(i);
+            }
+        }
+        // The visibility buffer packs the draw index + 1 and the triangle index into 32 bits; the draw index gets as
+        // few bits as the batch needs. Batches that do not fit are shaded forward.
+        uint32_t visibilityTriangleBits = 0;
+        if (sceneBatch)
+        {
+            const uint32_t drawBits = static_cast<uint32_t>(std::bit_width(multiDrawMeshIndices.size()));
+            size_t maxTriangles = 0;
+            for (size_t meshIndex : multiDrawMeshIndices)
+                maxTriangles = std::max(maxTriangles, sceneCpuMeshes[meshIndex].triangles.size());
+            if (drawBits < 32 && static_cast<int>(std::bit_width(maxTriangles)) <= 32 - static_cast<int>(drawBits))
+                visibilityTriangleBits = 32 - drawBits;
+            else
+                std::cerr << "Scene batch does not fit the visibility buffer (" << multiDrawMeshIndices.size() << " draws, up to " << maxTriangles << " triangles)" << std::endl;
+        }
+        // In visibility buffer mode the batch is the geometry of the visibility buffer; the main view does not draw it
+        // forward, but the minimap still does.
+        auto useVisibilityBuffer = [&] { return visibilityTriangleBits > 0 && m_shadingPath == ShadingPath::VisibilityBuffer; };
+        auto useMultiDraw = [&] { return sceneBatch && (m_useMultiDraw || useVisibilityBuffer()); };
+        // END MULTI DRAW INDIRECT **************************************************************************************
+        // FRUSTUM CULLING **********************************************************************************************
+        // The scene meshes never move, so their world-space bounds are computed once. Both the queue and the multi-draw
+        // batch of a view use the same visibility, which is computed once per view and frame. The flat culler tests
+        // every mesh with SIMD; the BVH (object id = index in m_meshes) skips whole subtrees and also answers the
+        // gameplay queries below.
+        FrustumCuller sceneCuller;
+        std::vector<AABB> sceneBounds;
+        for (const GPUMesh &mesh : m_meshes)
+        {
+            sceneCuller.add(mesh.localBoundsMin(), mesh.localBoundsMax(), mesh.modelMatrix);
+            sceneBounds.push_back(AABB::transformed(mesh.localBoundsMin(), mesh.localBoundsMax(), mesh.modelMatrix));
+        }
+        BoundingVolumeHierarchy sceneBVH;
+        sceneBVH.build(sceneBounds);
+        // Baked offline with --bake-pvs; ignored when it is missing or was baked for a different scene.
+        std::optional<PotentiallyVisibleSet> scenePVS;
+        try
+        {
+            scenePVS = PotentiallyVisibleSet::load(scenePVSPath);
+            if (!scenePVS->matches(sceneBounds))
+            {
+                std::cerr << "Ignoring " << scenePVSPath << " because it was baked for a different scene; run with --bake-pvs" << std::endl;
+                scenePVS.reset();
+            }
+        }
+        catch (const PVSLoadingException &e)
+        {
+            std::cerr << e.what() << std::endl;
+        }
+        Visibility pvsVisibility;
+        std::optional<uint32_t> pvsCell;
+        std::deque<std::pair<glm::mat4, Visibility>> bvhVisibilities; // Per view, cleared every frame
+        uint32_t sceneVisibleCount = static_cast<uint32_t>(m_meshes.size());
+        // Returns nullptr when culling is disabled (everything is visible). With usePVS the set of the cell the camera
+        // is in selects the candidates; only those are frustum culled. Not for the minimap, which looks at the scene
+        // from far outside of the cell it is in.
+        auto cullScene = [&](const glm::mat4 &projectionMatrix, const glm::mat4 &viewMatrix, bool usePVS = false) -> const Visibility *
+        {
+            const glm::mat4 viewProjection = projectionMatrix * viewMatrix;
+            pvsCell.reset();
+            if (usePVS && scenePVS && m_usePVS)
+                pvsCell = scenePVS->cellAt(glm::vec3(glm::inverse(viewMatrix)[3]));
+            if (pvsCell)
+            {
+                if (m_useFrustumCulling)
+                    scenePVS->cullFrustum(*pvsCell, viewProjection, m_minScreenSize, sceneBounds, pvsVisibility);
+                else
+                    scenePVS->getVisibility(*pvsCell, pvsVisibility);
+                return &pvsVisibility;
+            }
+            if (!m_useFrustumCulling)
+                return nullptr;
+            if (!m_useSceneBVH)
+                return &sceneCuller.cull(viewProjection, m_minScreenSize);
+            for (const auto &[cachedViewProjection, visibility] : bvhVisibilities)
+            {
+                if (cachedViewProjection == viewProjection)
+                    return &visibility;
+            }
+            auto &[cachedViewProjection, visibility] = bvhVisibilities.emplace_back(viewProjection, Visibility {});
+            sceneBVH.cullFrustum(viewProjection, m_minScreenSize, visibility);
+            return &visibility;
         };
-        // END LIGHT UBO ************************************************************************************************
+        // END FRUSTUM CULLING ******************************************************************************************
+        // OCCLUSION CULLING ********************************************************************************************
+        // The opaque scene meshes double as occluders (they are few and simple); the meshes that survive frustum
+        // culling in the main view are then tested against the software depth buffer.
+        // Up to 3 workers plus the render thread (hardware_concurrency() may return 0 when unknown).
+        OcclusionCuller sceneOcclusion(256, 128, std::clamp(std::thread::hardware_concurrency(), 1u, 4u) - 1);
+        for (size_t i = 0; i < sceneCpuMeshes.size() && i < m_meshes.size(); i++)
+        {
+            if (sceneCpuMeshes[i].material.transparency < 1.0f)
+                continue;
+            std::vector<glm::vec3> positions;
+            for (const Vertex &vertex : sceneCpuMeshes[i].vertices)
+                positions.push_back(glm::vec3(m_meshes[i].modelMatrix * glm::vec4(vertex.position, 1.0f)));
+            sceneOcclusion.addOccluder(positions, sceneCpuMeshes[i].triangles);
+        }
+        Visibility occlusionVisibility;
+        uint32_t sceneOccludedCount = 0;
+        // Returns the visibility after removing the occluded meshes; pVisibility == nullptr means all are visible.
+        auto cullOccluded = [&](const Visibility *pVisibility, const glm::mat4 &projectionMatrix, const glm::mat4 &viewMatrix) -> const Visibility *
+        {
+            sceneOcclusion.render(projectionMatrix * viewMatrix);
+            if (pVisibility)
+                occlusionVisibility = *pVisibility;
+            else
+                occlusionVisibility = Visibility { std::vector<uint8_t>(m_meshes.size(), 1), static_cast<uint32_t>(m_meshes.size()) };
+            sceneOccludedCount = sceneOcclusion.cullOccluded(sceneBounds, occlusionVisibility);
+            return &occlusionVisibility;
+        };
+        // Alternatively the GPU tests the bounding boxes against the depth buffer of the opaque pass; the results are
+        // used a frame or two later.
+        OcclusionQueries sceneQueries(m_meshes.size());
+        auto useOcclusionQueries = [&] { return m_occlusionMode == OcclusionCullingMode::HardwareQueries; };
+        // END OCCLUSION CULLING ****************************************************************************************
+        // SHADOW MAPS **************************************************************************************************
+        // The sun casts shadows through cascaded shadow maps fitted to the main view. The scene meshes and the props
+        // never move, so they are cached per cascade; only the player character (third person) is drawn every frame,
+        // into the cascades it reaches. Casters are drawn from their position streams with shadow_vert.glsl.
+        CascadedShadowMaps shadowMaps(2048);
+        AABB shadowCasterBounds; // Scene meshes and props
+        std::vector<AABB> dynamicShadowCasters;
+        std::vector<const GPUMesh *> shadowCasters;
+        std::vector<GLintptr> shadowCasterOffsets;
+        auto updateShadowCasterBounds = [&]
+        {
+            shadowCasterBounds = AABB {};
+            for (const AABB &bounds : sceneBounds)
+                shadowCasterBounds.extend(bounds);
+            for (size_t i = 0; i < static_cast<size_t>(propCount); i++)
+            {
+                for (const GPUMesh &mesh : characterMesh)
+                    shadowCasterBounds.extend(AABB::transformed(mesh.localBoundsMin(), mesh.localBoundsMax(), propModelMatrix(i)));
+            }
+            shadowMaps.invalidate();
+        };
+        updateShadowCasterBounds();
+        auto renderShadowCasters = [&](const glm::mat4 &lightViewProjection, bool staticCasters)
+        {
+            shadowCasters.clear();
+            if (staticCasters)
+            {
+                const Visibility &visibility = sceneCuller.cull(lightViewProjection);
+                for (size_t i = 0; i < m_meshes.size(); i++)
+                {
+                    if (visibility[i] && !m_meshes[i].isTransparent())
+                        shadowCasters.push_back(&m_meshes[i]);
+                }
+            }
+            else if (currentCameraMode == CameraMode::ThirdPersonCamera)
+            {
+                for (const GPUMesh &mesh : characterMesh)
+                    shadowCasters.push_back(&mesh);
+            }
+            const GPUViewConstants viewConstants { glm::mat4(1.0f), lightViewProjection, lightViewProjection, glm::vec4(0.0f, 0.0f, 0.0f, 1.0f) };
+            const GLintptr viewConstantsOffset = uniformRing.push(viewConstants);
+            shadowCasterOffsets.clear();
+            for (const GPUMesh *pMesh : shadowCasters)
+                shadowCasterOffsets.push_back(uniformRing.push(GPUObjectConstants(pMesh->modelMatrix)));
+            uniformRing.flush();
+
+            const Shader &shader = m_shadowShader.select();
+            shader.bind();
+            shader.bindUniformBlock("ViewConstants"_uniform, UniformBinding::ViewConstants, uniformRing.buffer(), viewConstantsOffset, sizeof(GPUViewConstants));
+            for (size_t i = 0; i < shadowCasters.size(); i++)
+            {
+                shader.bindUniformBlock("ObjectConstants"_uniform, UniformBinding::ObjectConstants, uniformRing.buffer(), shadowCasterOffsets[i], sizeof(GPUObjectConstants));
+                shadowCasters[i]->drawPositions();
+            }
+            if (staticCasters && propCount > 0)
+            {
+                const Shader &instancedShader = m_shadowShader.select(1u);
+                instancedShader.bind();
+                instancedShader.bindUniformBlock("ViewConstants"_uniform, UniformBinding::ViewConstants, uniformRing.buffer(), viewConstantsOffset, sizeof(GPUViewConstants));
+                for (size_t i = 0; i < characterMesh.size(); i++)
+                    characterMesh[i].drawInstanced(instancedShader, propInstances[i]);
+            }
+        };
+        // END SHADOW MAPS **********************************************************************************************
         // RENDER FUNCTIONS *********************************************************************************************
-        auto renderMinimapTexture = [&](Shader &shader)
+        // Pick the permutation of the default shader instead of branching on uniforms inside the fragment shader.
+        auto defaultShaderFeatures = [&](const GPUMesh &mesh) -> uint32_t
+        {
+            if (mesh.hasTextureCoords())
+                return DefaultShaderFeature::HasTexCoords;
+            return m_useMaterial ? DefaultShaderFeature::UseMaterial : 0u;
+        };
+        // Set while the main view draws: only it is shadowed, since the cascades are fitted to it.
+        bool shadowedView = false;
+        // Binds the point lights of the view and the sun.
+        auto bindLighting = [&](const Shader &shader, const LightClusters &lightClusters)
+        {
+            lightClusters.bind(shader);
+            glUniform3fv(shader.getUniformLocation("sunDirection"_uniform), 1, glm::value_ptr(sun.direction));
+            glUniform3fv(shader.getUniformLocation("sunColor"_uniform), 1, glm::value_ptr(sun.color));
+            shadowMaps.bind(shader, shadowedView);
+        };
+        // Set while the main view queues its meshes for the deferred path: opaque ones then fill the G-buffer.
+        bool fillGBuffer = false;
+        // Queue meshes for the default shader; the textured ones use `texture`.
+        // Meshes for which skip[i] is set are drawn elsewhere (the multi-draw batch); culled meshes are left out.
+        // With pQueries, meshes whose occlusion is not known yet are drawn conditionally on their newest query.
+        auto submitMeshes = [&](RenderQueue &queue, std::vector<GPUMesh> &meshes, Texture &texture, const glm::mat4 &viewMatrix, const std::vector<bool> &skip = {}, const Visibility *pVisibility = nullptr, const OcclusionQueries *pQueries = nullptr)
+        {
+            for (size_t i = 0; i < meshes.size(); i++)
+            {
+                if ((i < skip.size() && skip[i]) || (pVisibility && !(*pVisibility)[i]))
+                    continue;
+                GPUMesh &mesh = meshes[i];
+                const RenderPass pass = mesh.isTransparent() ? RenderPass::Transparent : RenderPass::Opaque;
+                const Shader &shader = m_defaultShaders.select(defaultShaderFeatures(mesh) | (fillGBuffer && pass == RenderPass::Opaque ? DefaultShaderFeature::GBuffer : 0u));
+                const glm::vec3 center = 0.5f * (mesh.localBoundsMin() + mesh.localBoundsMax());
+                const float viewDepth = -(viewMatrix * mesh.modelMatrix * glm::vec4(center, 1.0f)).z;
+                queue.submit(pass, shader, mesh, mesh.hasTextureCoords() ? &texture : nullptr, viewDepth, nullptr, pQueries ? pQueries->conditionQuery(i) : 0);
+            }
+        };
+        // Queue one instanced draw per sub-mesh of the props.
+        auto submitProps = [&](RenderQueue &queue, std::vector<GPUMesh> &meshes, Texture &texture)
+        {
+            if (propCount == 0)
+                return;
+            for (size_t i = 0; i < meshes.size(); i++)
+            {
+                const Shader &shader = m_defaultShaders.select(defaultShaderFeatures(meshes[i]) | DefaultShaderFeature::Instanced | (fillGBuffer ? DefaultShaderFeature::GBuffer : 0u));
+                queue.submit(RenderPass::Opaque, shader, meshes[i], meshes[i].hasTextureCoords() ? &texture : nullptr, 0.0f, &propInstances[i]);
+            }
+        };
+        // The deferred lighting and visibility buffer material passes draw one triangle that covers the screen (with
+        // deferred_vert.glsl) into the default framebuffer; core profile still needs a vertex array for that.
+        GLuint fullscreenVao;
+        glGenVertexArrays(1, &fullscreenVao);
+        auto bindBackbuffer = [&]
         {
-            glEnable(GL_DEPTH_TEST);
-            glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+            GLState::bindFramebuffer(GL_FRAMEBUFFER, 0);
+            const glm::ivec2 framebufferSize = m_window.getFrameBufferSize();
+            GLState::viewport(0, 0, framebufferSize.x, framebufferSize.y);
+        };
+        // The shaders write gl_FragDepth, which always has to pass.
+        auto drawFullscreenTriangle = [&]
+        {
+            GLState::depthFunc(GL_ALWAYS);
+            GLState::bindVertexArray(fullscreenVao);
+            glDrawArrays(GL_TRIANGLES, 0, 3);
+            GLState::depthFunc(GL_LESS);
+        };
+        // Shades the G-buffer into the default framebuffer and copies its depth there.
+        auto lightGBuffer = [&](const RenderTarget &gbuffer, const LightClusters &lightClusters, const glm::mat4 &projectionMatrix, const glm::mat4 &viewMatrix, GLintptr viewConstantsOffset)
+        {
+            bindBackbuffer();
+            const Shader &shader = m_deferredLightingShader.select();
+            shader.bind();
+            bindLighting(shader, lightClusters);
+            shader.bindUniformBlock("ViewConstants"_uniform, UniformBinding::ViewConstants, uniformRing.buffer(), viewConstantsOffset, sizeof(GPUViewConstants));
+            GLState::bindTexture(0, GL_TEXTURE_2D, gbuffer.colorTexture(0));
+            GLState::bindTexture(1, GL_TEXTURE_2D, gbuffer.colorTexture(1));
+            GLState::bindTexture(2, GL_TEXTURE_2D, gbuffer.depthTexture());
+            glUniform1i(shader.getUniformLocation("gbufferAlbedo"_uniform), 0);
+            glUniform1i(shader.getUniformLocation("gbufferNormal"_uniform), 1);
+            glUniform1i(shader.getUniformLocation("gbufferDepth"_uniform), 2);
+            const glm::mat4 inverseViewProjection = glm::inverse(projectionMatrix * viewMatrix);
+            glUniformMatrix4fv(shader.getUniformLocation("inverseViewProjection"_uniform), 1, GL_FALSE, glm::value_ptr(inverseViewProjection));
+            drawFullscreenTriangle();
+        };
+        // Fills the visibility buffer with the triangles of the multi-draw batch, then shades every covered pixel once
+        // into the default framebuffer and copies the depth there.
+        auto drawVisibilityBuffer = [&](const RenderTarget &visibilityBuffer, const LightClusters &lightClusters, GLintptr viewConstantsOffset)
+        {
+            visibilityBuffer.bind();
+            const GLuint noTriangle = 0;
+            const GLfloat farDepth = 1.0f;
+            glClearBufferuiv(GL_COLOR, 0, &noTriangle);
+            glClearBufferfv(GL_DEPTH, 0, &farDepth);
+            const Shader &visibilityShader = m_visibilityShader.select();
+            visibilityShader.bind();
+            visibilityShader.bindUniformBlock("ViewConstants"_uniform, UniformBinding::ViewConstants, uniformRing.buffer(), viewConstantsOffset, sizeof(GPUViewConstants));
+            glUniform1ui(visibilityShader.getUniformLocation("triangleBits"_uniform), visibilityTriangleBits);
+            sceneBatch->draw(*sceneArena);
+
+            bindBackbuffer();
+            const Shader &shader = m_visibilityShadeShaders.select(m_useMaterial ? 1u : 0u);
+            shader.bind();
+            bindLighting(shader, lightClusters);
+            shader.bindUniformBlock("ViewConstants"_uniform, UniformBinding::ViewConstants, uniformRing.buffer(), viewConstantsOffset, sizeof(GPUViewConstants));
+            shader.bindUniformBlock("MaterialTable"_uniform, UniformBinding::MaterialTable, sceneMaterials->buffer());
+            sceneArena->bindStorage();
+            sceneBatch->bindDrawData();
+            GLState::bindTexture(0, GL_TEXTURE_2D, visibilityBuffer.colorTexture());
+            GLState::bindTexture(1, GL_TEXTURE_2D, visibilityBuffer.depthTexture());
+            glUniform1i(shader.getUniformLocation("visibilityBuffer"_uniform), 0);
+            glUniform1i(shader.getUniformLocation("visibilityDepth"_uniform), 1);
+            glUniform1ui(shader.getUniformLocation("triangleBits"_uniform), visibilityTriangleBits);
+            drawFullscreenTriangle();
+        };
+        // Sort and draw a queue; per-view state is only set when the shader changes.
+        // pSceneVisibility culls the multi-draw batch (whose draws are all scene meshes). afterOpaque runs once the opaque
+        // geometry is in the depth buffer, before anything transparent is drawn.
+        // With pGBuffer the opaque geometry fills the G-buffer instead (the queue must have been submitted with
+        // fillGBuffer) and is lit into the default framebuffer before afterOpaque; transparent geometry is shaded forward.
+        // With pVisibilityBuffer the multi-draw batch goes through the visibility buffer; the queue is drawn forward.
+        // With depthPrepass (forward only) the opaque geometry is first drawn depth-only from its position streams, so
+        // that the lit shaders run once per pixel: the opaque draws that were in it then test with GL_EQUAL.
+        auto drawQueue = [&](RenderQueue &queue, const LightClusters &lightClusters, const glm::mat4 &projectionMatrix, const glm::mat4 &viewMatrix, const Visibility *pSceneVisibility = nullptr, const std::function<void()> &afterOpaque = {}, const RenderTarget *pGBuffer = nullptr, const RenderTarget *pVisibilityBuffer = nullptr, bool depthPrepass = false)
+        {
+            queue.sort();
 
-            // Bind off-screen framebuffer
-            glBindFramebuffer(GL_FRAMEBUFFER, minimapFBO);
+            // Write the constants of the view and of all its draws up front, so they reach the GPU in one flush.
+            const GPUViewConstants viewConstants { viewMatrix, projectionMatrix, projectionMatrix * viewMatrix, glm::vec4(pFlyCamera->cameraPos(), 1.0f) };
+            const GLintptr viewConstantsOffset = uniformRing.push(viewConstants);
+            objectConstantOffsets.clear();
+            for (const DrawItem &item : queue.items())
+                objectConstantOffsets.push_back(item.pInstances ? 0 : uniformRing.push(GPUObjectConstants(item.pMesh->modelMatrix)));
+            uniformRing.flush();
 
-            // m_viewMatrix = pMinimapCamera->viewMatrix();
-            // TODO: This should be changed to an actual function in camera.cpp
-            float orthoWidth = minimap_ortho_height * utils::ASPECT_RATIO;
+            if (pGBuffer)
+            {
+                pGBuffer->bind();
+                glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+                glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+            }
 
-            const glm::mat4 m_projection2 = glm::ortho(-orthoWidth, orthoWidth, -minimap_ortho_height, minimap_ortho_height, 0.1f, 100.0f);
+            if (useMultiDraw())
+            {
+                for (size_t drawIndex = 0; drawIndex < multiDrawMeshIndices.size(); drawIndex++)
+                    sceneBatch->setDrawEnabled(drawIndex, !pSceneVisibility || (*pSceneVisibility)[multiDrawMeshIndices[drawIndex]]);
+            }
 
-             for (GPUMesh &mesh : m_meshes)
+            if (depthPrepass)
             {
-                const glm::mat4 mvpMatrix = m_projection2 * pMinimapCamera->viewMatrix() * mesh.modelMatrix;
-                // Normals should be transformed differently than positions (ignoring translations + dealing with scaling):
-                // https://paroj.github.io/gltut/Illumination/Tut09%20Normal%20Transformation.html
-                const glm::mat3 normalModelMatrix = glm::inverseTranspose(glm::mat3(mesh.modelMatrix));
+                glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+                if (useMultiDraw())
+                {
+                    const Shader &shader = m_multiDrawDepthShader.select();
+                    shader.bind();
+                    shader.bindUniformBlock("ViewConstants"_uniform, UniformBinding::ViewConstants, uniformRing.buffer(), viewConstantsOffset, sizeof(GPUViewConstants));
+                    sceneBatch->draw(*sceneArena);
+                }
+                const Shader &shader = m_shadowShader.select();
                 shader.bind();
-                //!! IMPORTANT -> mesh.draw binds material to block 0, we bind lightBuffer to 1 instead.
-                shader.bindUniformBlock("lightBuffer", 1, lightUBO);
-                glUniform3fv(shader.getUniformLocation("cameraPosition"), 1, glm::value_ptr(pFlyCamera->cameraPos()));
-                glUniformMatrix4fv(shader.getUniformLocation("mvpMatrix"), 1, GL_FALSE, glm::value_ptr(mvpMatrix));
-                // Uncomment this line when you use the modelMatrix (or fragmentPosition)
-                // glUniformMatrix4fv(m_defaultShader.getUniformLocation("modelMatrix"), 1, GL_FALSE, glm::value_ptr(m_modelMatrix));
-                glUniformMatrix3fv(shader.getUniformLocation("normalModelMatrix"), 1, GL_FALSE, glm::value_ptr(normalModelMatrix));
-                if (mesh.hasTextureCoords())
+                shader.bindUniformBlock("ViewConstants"_uniform, UniformBinding::ViewConstants, uniformRing.buffer(), viewConstantsOffset, sizeof(GPUViewConstants));
+                queue.executeDepthOnly(shader, [&](const Shader &depthShader, GPUMesh &, uint32_t itemIndex)
+                {
+                    depthShader.bindUniformBlock("ObjectConstants"_uniform, UniformBinding::ObjectConstants, uniformRing.buffer(), objectConstantOffsets[itemIndex], sizeof(GPUObjectConstants));
+                });
+                glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+                GLState::depthFunc(GL_EQUAL);
+            }
+
+            // Opaque geometry in the arena goes first, with one call for the whole batch.
+            if (useMultiDraw())
+            {
+                if (pVisibilityBuffer)
                 {
-                    m_texture.bind(GL_TEXTURE0);
-                    glUniform1i(shader.getUniformLocation("colorMap"), 0);
-                    glUniform1i(shader.getUniformLocation("hasTexCoords"), GL_TRUE);
-                    glUniform1i(shader.getUniformLocation("useMaterial"), GL_FALSE);
+                    drawVisibilityBuffer(*pVisibilityBuffer, lightClusters, viewConstantsOffset);
                 }
                 else
                 {
-                    glUniform1i(shader.getUniformLocation("hasTexCoords"), GL_FALSE);
-                    glUniform1i(shader.getUniformLocation("useMaterial"), m_useMaterial);
+                    // Feature order: USE_MATERIAL, GBUFFER.
+                    const Shader &shader = m_multiDrawShaders.select((m_useMaterial ? 1u : 0u) | (pGBuffer ? 2u : 0u));
+                    shader.bind();
+                    bindLighting(shader, lightClusters);
+                    shader.bindUniformBlock("ViewConstants"_uniform, UniformBinding::ViewConstants, uniformRing.buffer(), viewConstantsOffset, sizeof(GPUViewConstants));
+                    shader.bindUniformBlock("MaterialTable"_uniform, UniformBinding::MaterialTable, sceneMaterials->buffer());
+                    sceneBatch->draw(*sceneArena);
                 }
-                mesh.draw(shader);
             }
 
-            glBindFramebuffer(GL_FRAMEBUFFER, 0);
+            bool opaqueDone = false;
+            auto finishOpaque = [&]
+            {
+                GLState::depthFunc(GL_LESS);
+                if (pGBuffer)
+                    lightGBuffer(*pGBuffer, lightClusters, projectionMatrix, viewMatrix, viewConstantsOffset);
+                if (afterOpaque)
+                    afterOpaque();
+                opaqueDone = true;
+            };
+            queue.execute(
+                [&](const Shader &shader)
+                {
+                    bindLighting(shader, lightClusters);
+                    shader.bindUniformBlock("ViewConstants"_uniform, UniformBinding::ViewConstants, uniformRing.buffer(), viewConstantsOffset, sizeof(GPUViewConstants));
+                    shader.bindUniformBlock("MaterialTable"_uniform, UniformBinding::MaterialTable, propMaterials.buffer());
+                    glUniform1i(shader.getUniformLocation("colorMap"_uniform), 0);
+                },
+                [&](const Shader &shader, GPUMesh &, uint32_t itemIndex)
+                {
+                    // Only what the depth pre-pass drew has its exact depth in the buffer already.
+                    if (depthPrepass)
+                        GLState::depthFunc(!opaqueDone && RenderQueue::hasDepthOnlyDraw(queue.items()[itemIndex], RenderPass::Opaque) ? GL_EQUAL : GL_LESS);
+                    // Instanced draws take their transforms from vertex attributes.
+                    if (!queue.items()[itemIndex].pInstances)
+                        shader.bindUniformBlock("ObjectConstants"_uniform, UniformBinding::ObjectConstants, uniformRing.buffer(), objectConstantOffsets[itemIndex], sizeof(GPUObjectConstants));
+                },
+                [&](RenderPass pass)
+                {
+                    if (pass == RenderPass::Transparent)
+                        finishOpaque();
+                });
+            if (!opaqueDone)
+                finishOpaque();
+        };
+
+        std::vector<GPUMesh> fireMesh = GPUMesh::loadMeshGPU(RESOURCE_ROOT "resources/fireframes/firecube.obj");
+        // OFFSCREEN PASSES *********************************************************************************************
+        // Every offscreen pass declares its size, update rate and priority; the scheduler runs the ones that are due
+        // within a GPU time budget per frame and takes their render targets from a shared pool.
+        RenderTargetPool renderTargets;
+        OffscreenPasses offscreenPasses(renderTargets, 2.0f);
+        // The frame itself is declared as a render graph every frame (see the main loop), which culls what is not
+        // shown and gives the transient targets of its passes back to the same pool.
+        RenderGraph renderGraph(renderTargets);
+
+        // The static scene (scene meshes and props) is baked into a top-down map once; after a change the tiles are
+        // rendered again one step at a time, as many per frame as the budget allows. The minimap just samples the map.
+        AABB mapBounds;
+        for (const AABB &bounds : sceneBounds)
+            mapBounds.extend(bounds);
+        MinimapCache minimapCache(mapBounds, 2048, 512);
+        RenderQueue minimapQueue;
+        OffscreenPassDesc minimapPassDesc;
+        minimapPassDesc.name = "Minimap";
+        minimapPassDesc.fixedSize = glm::ivec2(minimapCache.resolution());
+        minimapPassDesc.colorFormat = GL_RGB8;
+        minimapPassDesc.mipmapped = true;
+        minimapPassDesc.rate = UpdateRate::OnChange;
+        minimapPassDesc.render = [&](RenderTarget &)
+        {
+            // Nothing invalidated means the pass runs because its target is new: all of it has to be drawn.
+            if (minimapCache.isComplete())
+                minimapCache.invalidateAll();
+            minimapCache.update([&](const glm::mat4 &projection, const glm::mat4 &view)
+            {
+                const Visibility *pVisibility = cullScene(projection, view);
+                minimapQueue.clear();
+                submitMeshes(minimapQueue, m_meshes, m_texture, view, useMultiDraw() ? drawnByMultiDraw : drawnByQueue, pVisibility);
+                submitProps(minimapQueue, characterMesh, characterTexture);
+                mapLightClusters.build(lights, view, projection);
+                drawQueue(minimapQueue, mapLightClusters, projection, view, pVisibility);
+            }, 1);
+            return !minimapCache.isComplete();
+        };
+        const OffscreenPasses::PassId minimapPass = offscreenPasses.add(std::move(minimapPassDesc));
+        auto invalidateMinimap = [&]
+        {
+            minimapCache.invalidateAll();
+            offscreenPasses.markChanged(minimapPass);
+        };
+        // END OFFSCREEN PASSES *****************************************************************************************
+        // ANIMATED LIGHTS **********************************************************************************************
+        // Small lights circling above the scene, to see how the clustered lighting scales; they are not baked into the map.
+        struct AnimatedLight
+        {
+            glm::vec3 center;
+            float orbitRadius, speed, phase;
+            PointLight light;
+        };
+        std::vector<AnimatedLight> animatedLights;
+        int animatedLightCount = 0;
+        auto resizeAnimatedLights = [&]
+        {
+            // Same seed every time, so growing the set keeps the lights that were already there.
+            std::mt19937 rng { 1 };
+            std::uniform_real_distribution<float> unit { 0.0f, 1.0f };
+            animatedLights.clear();
+            for (int i = 0; i < animatedLightCount; i++)
+            {
+                AnimatedLight animated;
+                animated.center = glm::mix(mapBounds.lower, mapBounds.upper, glm::vec3(unit(rng), 0.0f, unit(rng)));
+                animated.center.y = mapBounds.lower.y + 0.5f + 2.5f * unit(rng);
+                animated.orbitRadius = 0.5f + 1.5f * unit(rng);
+                animated.speed = 0.5f + unit(rng);
+                animated.phase = 6.2831853f * unit(rng);
+                animated.light.radius = 1.5f + 2.5f * unit(rng);
+                animated.light.color = glm::normalize(glm::vec3(unit(rng), unit(rng), unit(rng)) + 0.1f);
+                animatedLights.push_back(animated);
+            }
+        };
+        auto updateAnimatedLights = [&](std::vector<PointLight> &out, float time)
+        {
+            for (AnimatedLight &animated : animatedLights)
+            {
+                const float angle = animated.phase + animated.speed * time;
+                animated.light.position = animated.center + animated.orbitRadius * glm::vec3(std::cos(angle), 0.0f, std::sin(angle));
+                out.push_back(animated.light);
+            }
         };
+        // END ANIMATED LIGHTS ******************************************************************************************
         auto renderMinimap = [&]
         {
-            glDisable(GL_DEPTH_TEST);
-            m_quadShader.bind();
-            glActiveTexture(GL_TEXTURE2);
-            glBindTexture(GL_TEXTURE_2D, minimapTex);
-            glUniform1i(m_quadShader.getUniformLocation("texture1"), 2);
-            minimapOverlay.bind(GL_TEXTURE1);
-            glUniform1i(m_quadShader.getUniformLocation("overlay"), 1);
+            GLState::setEnabled(GL_DEPTH_TEST, false);
+            const Shader &quadShader = m_quadShader.select();
+            quadShader.bind();
+            GLState::bindTexture(2, GL_TEXTURE_2D, offscreenPasses.target(minimapPass)->colorTexture());
+            glUniform1i(quadShader.getUniformLocation("texture1"_uniform), 2);
+
+            // Same window as the minimap camera used to render: centered on the player with the view direction up.
+            const glm::vec2 mapHalfSize { minimap_ortho_height * utils::ASPECT_RATIO, minimap_ortho_height };
+            const glm::mat3 mapTransform = minimapCache.viewTransform(pFlyCamera->m_position, pFlyCamera->m_forward, mapHalfSize);
+            glUniformMatrix3fv(quadShader.getUniformLocation("mapTransform"_uniform), 1, GL_FALSE, glm::value_ptr(mapTransform));
+
+            // The player and the fire move (or animate), so they are drawn as icons instead of being baked.
+            const float iconRadius = 0.03f * minimap_ortho_height * minimapCache.mapUnitsPerWorldUnit();
+            std::vector<glm::vec3> icons { glm::vec3(minimapCache.mapCoords(pFlyCamera->m_position), iconRadius) };
+            std::vector<glm::vec3> iconColors { glm::vec3(1.0f) };
+            for (const GPUMesh &mesh : fireMesh)
+            {
+                if (icons.size() == maxMinimapIcons)
+                    break;
+                const glm::vec3 center = glm::vec3(mesh.modelMatrix * glm::vec4(0.5f * (mesh.localBoundsMin() + mesh.localBoundsMax()), 1.0f));
+                icons.push_back(glm::vec3(minimapCache.mapCoords(center), iconRadius));
+                iconColors.push_back(glm::vec3(1.0f, 0.5f, 0.0f));
+            }
+            glUniform1i(quadShader.getUniformLocation("iconCount"_uniform), static_cast<GLint>(icons.size()));
+            glUniform3fv(quadShader.getUniformLocation("icons"_uniform), static_cast<GLsizei>(icons.size()), glm::value_ptr(icons[0]));
+            glUniform3fv(quadShader.getUniformLocation("iconColors"_uniform), static_cast<GLsizei>(iconColors.size()), glm::value_ptr(iconColors[0]));
 
             const glm::mat4 mvpMatrix = m_projectionMatrix * m_viewMatrix * m_modelMatrix;
             // Normals should be transformed differently than positions (ignoring translations + dealing with scaling):
             // https://paroj.github.io/gltut/Illumination/Tut09%20Normal%20Transformation.html
             const glm::mat3 normalModelMatrix = glm::inverseTranspose(glm::mat3(m_modelMatrix));
 
-            glUniformMatrix4fv(m_quadShader.getUniformLocation("mvpMatrix"), 1, GL_FALSE, glm::value_ptr(mvpMatrix));
+            glUniformMatrix4fv(quadShader.getUniformLocation("mvpMatrix"_uniform), 1, GL_FALSE, glm::value_ptr(mvpMatrix));
 
             // Create Quad covering half screen
             //  Define quad vertices and indices
@@ -317,110 +960,48 @@ public:
 
             // Create and bind the vertex buffer object (VBO) for positions
             
-            glBindBuffer(GL_ARRAY_BUFFER, quad_vbo);
+            GLState::bindBuffer(GL_ARRAY_BUFFER, quad_vbo);
             glBufferData(GL_ARRAY_BUFFER, 4 * sizeof(glm::vec3), quad_vertices, GL_STATIC_DRAW);
 
             // Create and bind the VBO for texture coordinates
-            glBindBuffer(GL_ARRAY_BUFFER, tex_vbo);
+            GLState::bindBuffer(GL_ARRAY_BUFFER, tex_vbo);
             glBufferData(GL_ARRAY_BUFFER, 4 * sizeof(glm::vec2), quad_tex_coords, GL_STATIC_DRAW);
 
             // Set up the vertex array object (VAO)
-            glBindVertexArray(quad_vao);
+            GLState::bindVertexArray(quad_vao);
 
             // Bind the vertex position VBO
-            glBindBuffer(GL_ARRAY_BUFFER, quad_vbo);
+            GLState::bindBuffer(GL_ARRAY_BUFFER, quad_vbo);
             glEnableVertexAttribArray(0); // Layout location 0 (position)
             glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(glm::vec3), (void *)0);
 
             // Bind the texture coordinate VBO
-            glBindBuffer(GL_ARRAY_BUFFER, tex_vbo);
+            GLState::bindBuffer(GL_ARRAY_BUFFER, tex_vbo);
             glEnableVertexAttribArray(1); // Layout location 1 (texture coordinates)
             glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(glm::vec2), (void *)0);
 
-            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, quad_ibo);
+            GLState::bindBuffer(GL_ELEMENT_ARRAY_BUFFER, quad_ibo);
             glBufferData(GL_ELEMENT_ARRAY_BUFFER, 6 * sizeof(int), quad_indices, GL_STATIC_DRAW);
-            // glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0); // Do not unbind the element array buffer
+            // GLState::bindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0); // Do not unbind the element array buffer
 
             // Bind the index buffer object (IBO)
-            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, quad_ibo);
+            GLState::bindBuffer(GL_ELEMENT_ARRAY_BUFFER, quad_ibo);
 
             // Drawing
             glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, nullptr);
 
-            glBindFramebuffer(GL_FRAMEBUFFER, 0);
+            GLState::bindFramebuffer(GL_FRAMEBUFFER, 0);
 
-            glBindVertexArray(0);
+            GLState::bindVertexArray(0);
 
-            glBindBuffer(GL_ARRAY_BUFFER, 0);
-            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+            GLState::bindBuffer(GL_ARRAY_BUFFER, 0);
+            GLState::bindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
         };
 
-        auto renderScene = [&](const Shader &shader)
-        {
-            for (GPUMesh &mesh : m_meshes)
-            {
-                const glm::mat4 mvpMatrix = m_projectionMatrix * m_viewMatrix * mesh.modelMatrix;
-                // Normals should be transformed differently than positions (ignoring translations + dealing with scaling):
-                // https://paroj.github.io/gltut/Illumination/Tut09%20Normal%20Transformation.html
-                const glm::mat3 normalModelMatrix = glm::inverseTranspose(glm::mat3(mesh.modelMatrix));
-                shader.bind();
-                //!! IMPORTANT -> mesh.draw binds material to block 0, we bind lightBuffer to 1 instead.
-                shader.bindUniformBlock("lightBuffer", 1, lightUBO);
-                glUniform3fv(shader.getUniformLocation("cameraPosition"), 1, glm::value_ptr(pFlyCamera->cameraPos()));
-                glUniformMatrix4fv(shader.getUniformLocation("mvpMatrix"), 1, GL_FALSE, glm::value_ptr(mvpMatrix));
-                // Uncomment this line when you use the modelMatrix (or fragmentPosition)
-                // glUniformMatrix4fv(m_defaultShader.getUniformLocation("modelMatrix"), 1, GL_FALSE, glm::value_ptr(m_modelMatrix));
-                glUniformMatrix3fv(shader.getUniformLocation("normalModelMatrix"), 1, GL_FALSE, glm::value_ptr(normalModelMatrix));
-                if (mesh.hasTextureCoords())
-                {
-                    m_texture.bind(GL_TEXTURE0);
-                    glUniform1i(shader.getUniformLocation("colorMap"), 0);
-                    glUniform1i(shader.getUniformLocation("hasTexCoords"), GL_TRUE);
-                    glUniform1i(shader.getUniformLocation("useMaterial"), GL_FALSE);
-                }
-                else
-                {
-                    glUniform1i(shader.getUniformLocation("hasTexCoords"), GL_FALSE);
-                    glUniform1i(shader.getUniformLocation("useMaterial"), m_useMaterial);
-                }
-                mesh.draw(shader);
-            }
-        };
-
-        auto renderMeshes = [&](const Shader &shader, std::vector<GPUMesh> &meshes, Texture &texture)
-        {
-            for (GPUMesh &mesh : meshes)
-            {
-                const glm::mat4 mvpMatrix = m_projectionMatrix * m_viewMatrix * mesh.modelMatrix;
-                // Normals should be transformed differently than positions (ignoring translations + dealing with scaling):
-                // https://paroj.github.io/gltut/Illumination/Tut09%20Normal%20Transformation.html
-                const glm::mat3 normalModelMatrix = glm::inverseTranspose(glm::mat3(mesh.modelMatrix));
-                shader.bind();
-                //!! IMPORTANT -> mesh.draw binds material to block 0, we bind lightBuffer to 1 instead.
-                shader.bindUniformBlock("lightBuffer", 1, lightUBO);
-                glUniform3fv(shader.getUniformLocation("cameraPosition"), 1, glm::value_ptr(pFlyCamera->cameraPos()));
-                glUniformMatrix4fv(shader.getUniformLocation("mvpMatrix"), 1, GL_FALSE, glm::value_ptr(mvpMatrix));
-                // Uncomment this line when you use the modelMatrix (or fragmentPosition)
-                // glUniformMatrix4fv(m_defaultShader.getUniformLocation("modelMatrix"), 1, GL_FALSE, glm::value_ptr(m_modelMatrix));
-                glUniformMatrix3fv(shader.getUniformLocation("normalModelMatrix"), 1, GL_FALSE, glm::value_ptr(normalModelMatrix));
-                if (mesh.hasTextureCoords())
-                {
-                    texture.bind(GL_TEXTURE0);
-                    glUniform1i(shader.getUniformLocation("colorMap"), 0);
-                    glUniform1i(shader.getUniformLocation("hasTexCoords"), GL_TRUE);
-                    glUniform1i(shader.getUniformLocation("useMaterial"), GL_FALSE);
-                }
-                else
-                {
-                    glUniform1i(shader.getUniformLocation("hasTexCoords"), GL_FALSE);
-                    glUniform1i(shader.getUniformLocation("useMaterial"), m_useMaterial);
-                }
-                mesh.draw(shader);
-            }
-        };
+        // All draws of the main view are collected here every frame and submitted in one go.
+        RenderQueue sceneQueue;
         // GAME LOOP ****************************************************************************************************
 
-        std::vector<GPUMesh> fireMesh = GPUMesh::loadMeshGPU(RESOURCE_ROOT "resources/fireframes/firecube.obj");
         std::vector<Texture> fireTextures;
         fireTextures.push_back(Texture(RESOURCE_ROOT "resources/fireframes/frame1.png"));
         fireTextures.push_back(Texture(RESOURCE_ROOT "resources/fireframes/frame2.png"));
@@ -429,6 +1010,10 @@ public:
         Texture* activeFireTexture = &fireTextures[0];
         int frameCounter = 0;
 
+        // Recompile shaders when their source files change (checked a couple of times per second).
+        ShaderFileWatcher shaderWatcher(RESOURCE_ROOT "shaders/");
+        float previousShaderPollTime = static_cast<float>(glfwGetTime());
+
         float previousTime = static_cast<float>(glfwGetTime());
         while (!m_window.shouldClose())
         {
@@ -447,6 +1032,24 @@ public:
                 frameTimeAccumulator -= fixedTimeStep;
             }
 
+            if (currentTime - previousShaderPollTime > 0.5f) {
+                previousShaderPollTime = currentTime;
+                for (const std::filesystem::path& changedFile : shaderWatcher.poll()) {
+                    std::cout << "Reloading shaders using " << changedFile.filename() << std::endl;
+                    for (ShaderVariants* pShaders : allShaders()) {
+                        if (pShaders->usesFile(changedFile))
+                            pShaders->reload();
+                    }
+                }
+            }
+            // Swap in reloaded programs once the driver finished linking them.
+            for (ShaderVariants* pShaders : allShaders())
+                pShaders->poll();
+
+            uniformRing.beginFrame();
+            sceneCuller.beginFrame();
+            bvhVisibilities.clear();
+
             ImGuiIO& io = ImGui::GetIO();
 
             m_window.updateInput();
@@ -464,7 +1067,24 @@ public:
 
             { // Use ImGui for easy input/output of ints, floats, strings, etc...
                 ImGui::Begin("Window");
-                ImGui::Checkbox("Use material if no texture", &m_useMaterial);
+                if (ImGui::Checkbox("Use material if no texture", &m_useMaterial))
+                    invalidateMinimap();
+                if (sceneBatch)
+                    ImGui::Checkbox("Multi-draw indirect", &m_useMultiDraw);
+                int shadingPath = static_cast<int>(m_shadingPath);
+                // The visibility buffer is made of the multi-draw batch.
+                const int shadingPathCount = visibilityTriangleBits > 0 ? 3 : 2;
+                if (ImGui::Combo("Shading", &shadingPath, shadingPathNames.data(), shadingPathCount))
+                    m_shadingPath = static_cast<ShadingPath>(shadingPath);
+                if (m_shadingPath == ShadingPath::Forward)
+                {
+                    ImGui::Checkbox("Depth pre-pass", &m_useDepthPrepass);
+                    if (m_useDepthPrepass)
+                        ImGui::Text("Depth-only draws: %u", sceneQueue.stats().depthOnlyDraws);
+                }
+                const GLState::Counters glCounters = GLState::lastFrameCounters();
+                ImGui::Text("GL state calls: %u issued, %u elided", glCounters.issued, glCounters.elided);
+                ImGui::Text("Uniform ring: %s, %u stalls", uniformRing.isPersistentlyMapped() ? "persistent" : "staged", uniformRing.stallCount());
                 ImGui::Text("Camera Mode");
                 if (ImGui::BeginCombo("##combo", cameraModes[static_cast<int>(currentCameraMode)].c_str()))
                 {
@@ -507,6 +1127,9 @@ public:
                 if (ImGui::CollapsingHeader("Minimap"))
                 {
                     ImGui::DragFloat("Ortho Height", &minimap_ortho_height, 0.1f, 1.0f, 80.0f, "%.1f");
+                    ImGui::Text("Map tiles up to date: %zu / %zu", minimapCache.tileCount() - minimapCache.dirtyTileCount(), minimapCache.tileCount());
+                    if (ImGui::Button("Rebake map"))
+                        invalidateMinimap();
                     if (ImGui::CollapsingHeader("Minimap Position"))
                     {
                         ImGui::DragFloat3("Quad First", glm::value_ptr(quad_first), 0.01f, -1.0f, 1.8f, "%.2f");
@@ -516,6 +1139,77 @@ public:
                     }
                 }
 
+                if (ImGui::CollapsingHeader("Culling"))
+                {
+                    ImGui::Checkbox("Frustum culling", &m_useFrustumCulling);
+                    ImGui::Checkbox("Hierarchical (BVH)", &m_useSceneBVH);
+                    if (scenePVS)
+                    {
+                        ImGui::Checkbox("Potentially visible sets", &m_usePVS);
+                        if (pvsCell)
+                            ImGui::Text("PVS cell %u: %zu / %u meshes", *pvsCell, scenePVS->visibleObjects(*pvsCell).size(), scenePVS->objectCount());
+                        else
+                            ImGui::Text("PVS: camera outside of the baked region");
+                    }
+                    else
+                    {
+                        ImGui::Text("No PVS loaded (run with --bake-pvs)");
+                    }
+                    ImGui::SliderFloat("Min screen size", &m_minScreenSize, 0.0f, 0.05f, "%.4f");
+                    int occlusionMode = static_cast<int>(m_occlusionMode);
+                    if (ImGui::Combo("Occlusion culling", &occlusionMode, occlusionCullingModeNames.data(), static_cast<int>(occlusionCullingModeNames.size())))
+                    {
+                        m_occlusionMode = static_cast<OcclusionCullingMode>(occlusionMode);
+                        // Whatever the queries knew is outdated by now.
+                        sceneQueries.reset();
+                    }
+                    ImGui::Text("Scene meshes visible: %u / %zu (%u occluded)", sceneVisibleCount, m_meshes.size(), sceneOccludedCount);
+                    if (useOcclusionQueries())
+                        ImGui::Text("Occlusion queries issued: %u", sceneQueries.issuedQueryCount());
+                    ImGui::Text("BVH: %zu nodes, SAH cost %.2f", sceneBVH.nodeCount(), sceneBVH.sahCost());
+
+                    // Gameplay style query: which scene mesh is the fly camera looking at (by bounding box).
+                    Ray viewRay { pFlyCamera->m_position, glm::normalize(pFlyCamera->m_forward) };
+                    if (const std::optional<BoundingVolumeHierarchy::ObjectId> hit = sceneBVH.raycast(viewRay))
+                        ImGui::Text("Looking at mesh %u, %.2f away", *hit, viewRay.t);
+                    else
+                        ImGui::Text("Looking at nothing");
+                }
+
+                if (ImGui::CollapsingHeader("Offscreen passes"))
+                {
+                    float budgetMs = offscreenPasses.budgetMs();
+                    if (ImGui::SliderFloat("GPU budget (ms)", &budgetMs, 0.1f, 8.0f, "%.1f"))
+                        offscreenPasses.setBudgetMs(budgetMs);
+                    ImGui::Text("Estimated last frame: %.2f ms", offscreenPasses.estimatedMsLastFrame());
+                    ImGui::Text("Render targets: %zu, %.1f MB", renderTargets.targetCount(), static_cast<double>(renderTargets.sizeInBytes()) / (1024.0 * 1024.0));
+                    for (OffscreenPasses::PassId pass = 0; pass < offscreenPasses.passCount(); pass++)
+                    {
+                        const OffscreenPasses::PassStats stats = offscreenPasses.stats(pass);
+                        ImGui::Text("%s %dx%d: %.2f ms/update, %u updates, last %u frames ago", stats.name.c_str(), stats.size.x, stats.size.y, stats.estimatedMs, stats.updatesLastFrame, stats.framesSinceUpdate);
+                    }
+                }
+
+                if (ImGui::CollapsingHeader("Render graph"))
+                {
+                    // Timings lag a few frames behind the frame that is declared, so they are listed as measured.
+                    ImGui::Text("Passes: %zu, culled %zu", renderGraph.passCount(), renderGraph.culledPassCount());
+                    for (const RenderGraph::PassTiming &timing : renderGraph.timings())
+                        ImGui::Text("%s: %.3f ms GPU, %.3f ms CPU", timing.name.c_str(), timing.gpuMs, timing.cpuMs);
+                    if (ImGui::Button("Dump to console"))
+                        renderGraph.dump(std::cout);
+                }
+
+                if (ImGui::CollapsingHeader("Props"))
+                {
+                    if (ImGui::SliderInt("Instanced props", &propCount, 0, 4096))
+                    {
+                        resizeProps();
+                        updateShadowCasterBounds();
+                        invalidateMinimap();
+                    }
+                }
+
                 if (ImGui::CollapsingHeader("Lights"))
                 {
                     // Display lights in scene
@@ -538,10 +1232,13 @@ public:
                         selectedLightIndex = static_cast<size_t>(tempSelectedItem);
                     }
 
+                    // Only rebake the map when something was actually edited.
+                    bool lightsChanged = false;
                     if (ImGui::Button("Add Light"))
                     {
-                        lights.push_back(Light{glm::vec4(0, 0, 3, 0.f), glm::vec4(1)});
+                        lights.push_back(PointLight{glm::vec3(0, 0, 3), 10.0f, glm::vec3(1)});
                         selectedLightIndex = lights.size() - 1;
+                        lightsChanged = true;
                     }
 
                     ImGui::SameLine();
@@ -551,31 +1248,65 @@ public:
                         {
                             lights.erase(lights.begin() + selectedLightIndex);
                             selectedLightIndex = 0;
+                            lightsChanged = true;
                         }
                     }
 
                     ImGui::SameLine();
                     if (ImGui::Button("Move Light to Camera")) {
-                        lights[selectedLightIndex].position = glm::vec4(pFlyCamera->m_position, 1.0f);
+                        lights[selectedLightIndex].position = pFlyCamera->m_position;
+                        lightsChanged = true;
                     }
 
                     // Slider for selected camera pos
-                    ImGui::DragFloat4("Position", glm::value_ptr(lights[selectedLightIndex].position), 0.1f, -10.0f, 10.0f);
+                    lightsChanged |= ImGui::DragFloat3("Position", glm::value_ptr(lights[selectedLightIndex].position), 0.1f, -10.0f, 10.0f);
+                    lightsChanged |= ImGui::DragFloat("Radius", &lights[selectedLightIndex].radius, 0.1f, 0.1f, 100.0f);
 
                     // Color picker for selected light
-                    ImGui::ColorEdit4("Color", &lights[selectedLightIndex].color[0]);
-                    refreshLightsUBO();
+                    lightsChanged |= ImGui::ColorEdit3("Color", &lights[selectedLightIndex].color[0]);
+                    if (lightsChanged)
+                    {
+                        // The map is lit with the same lights.
+                        invalidateMinimap();
+                    }
+
+                    if (ImGui::SliderInt("Animated lights", &animatedLightCount, 0, 4096))
+                        resizeAnimatedLights();
+                    ImGui::Text("Clusters: %d x %d x %d, %zu light indices, at most %u lights in one", LightClusters::tilesX, LightClusters::tilesY, LightClusters::depthSlices,
+                        sceneLightClusters.lightIndexCount(), sceneLightClusters.maxLightsPerCluster());
+                    ImGui::Text("Binning %zu lights: %.3f ms", sceneLightClusters.lightCount(), sceneLightClusters.buildMs());
+                }
+
+                if (ImGui::CollapsingHeader("Sun"))
+                {
+                    // The map is lit by the sun too (without shadows).
+                    if (ImGui::DragFloat3("Direction", glm::value_ptr(sun.direction), 0.01f, -1.0f, 1.0f))
+                    {
+                        if (glm::length(sun.direction) < 1e-3f)
+                            sun.direction = glm::vec3(0.0f, -1.0f, 0.0f);
+                        sun.direction = glm::normalize(sun.direction);
+                        invalidateMinimap();
+                    }
+                    if (ImGui::ColorEdit3("Sun color", glm::value_ptr(sun.color)))
+                        invalidateMinimap();
+                    ImGui::Checkbox("Shadows", &m_useShadows);
+                    if (m_useShadows)
+                    {
+                        CascadedShadowMaps::Settings shadowSettings = shadowMaps.settings();
+                        ImGui::SliderFloat("Shadow distance", &shadowSettings.shadowDistance, 5.0f, 100.0f, "%.1f");
+                        ImGui::SliderFloat("Split lambda", &shadowSettings.splitLambda, 0.0f, 1.0f, "%.2f");
+                        ImGui::SliderFloat("Cache margin", &shadowSettings.cacheMargin, 0.0f, 1.0f, "%.2f");
+                        shadowMaps.setSettings(shadowSettings);
+                        ImGui::Text("Cascades ending at %.1f, %.1f, %.1f, %.1f", shadowMaps.splitDepth(0), shadowMaps.splitDepth(1), shadowMaps.splitDepth(2), shadowMaps.splitDepth(3));
+                        ImGui::Text("Cascades rendered last frame: %d static, %d dynamic", shadowMaps.staticRenderCount(), shadowMaps.dynamicRenderCount());
+                    }
                 }
                 ImGui::End();
             }
 
-            // Clear the screen
-            glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
-            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-
             // ...
-            glEnable(GL_DEPTH_TEST);
-            glEnable(GL_BLEND);
+            GLState::setEnabled(GL_DEPTH_TEST, true);
+            GLState::setEnabled(GL_BLEND, true);
 
             // TODO: We should change this to be actual character controls, but I hate the idea of it.
             switch (currentCameraMode)
@@ -631,28 +1362,116 @@ public:
 
                 // Recalculate up vector as perpendicular to forward and right, ensuring it’s stable even when looking up/down
                 pTppCamera->m_up = glm::cross(rightVector, pTppCamera->m_forward);
-
-                
-                renderMeshes(m_defaultShader, characterMesh, characterTexture);
-
             }
 
             for(GPUMesh &mesh : characterMesh) {
                 mesh.attachToCamera(pFlyCamera->m_position, pFlyCamera->m_forward, pFlyCamera->m_up, characterOffset);
             }
 
-            if(show_map) renderMinimapTexture(m_defaultShader);
-
-            renderScene(m_defaultShader);
-
-            renderMeshes(m_defaultShader, fireMesh, *activeFireTexture);
+            // FRAME ******************************************************************************************************
+            // Passes declare what they read and write; the graph culls the ones nothing visible depends on (the minimap
+            // when it is hidden) and runs the rest in dependency order.
+            renderGraph.reset();
+            const RenderGraph::ResourceId backbuffer = renderGraph.importBackbuffer("Backbuffer");
+            const RenderGraph::ResourceId minimapMap = renderGraph.importExternal("Minimap map");
+            // Decided here rather than inside the pass: the pass only runs when something reads the map, so it could
+            // never see the minimap as unused.
+            offscreenPasses.setEnabled(minimapPass, show_map);
+            renderGraph.addPass("Offscreen passes", {}, { minimapMap }, [&](const RenderGraph &)
+            {
+                offscreenPasses.execute(m_window.getFrameBufferSize());
+            });
+            // The deferred path renders the opaque geometry of the main view into a G-buffer first: albedo and octahedral
+            // normal in two RGBA8 targets plus depth. The lighting pass reads it back within the same graph pass.
+            // The visibility buffer path does the same with a single 32-bit target of draw and triangle indices.
+            std::vector<RenderGraph::ResourceId> sceneWrites { backbuffer };
+            std::optional<RenderGraph::ResourceId> gbuffer, visibilityBuffer;
+            if (m_shadingPath == ShadingPath::Deferred)
+            {
+                RenderTargetDesc gbufferDesc;
+                gbufferDesc.size = m_window.getFrameBufferSize();
+                gbufferDesc.extraColorFormats[0] = GL_RGBA8;
+                gbuffer = renderGraph.createTransient("G-buffer", gbufferDesc);
+                sceneWrites.push_back(*gbuffer);
+            }
+            else if (useVisibilityBuffer())
+            {
+                RenderTargetDesc visibilityDesc;
+                visibilityDesc.size = m_window.getFrameBufferSize();
+                visibilityDesc.colorFormat = GL_R32UI;
+                visibilityBuffer = renderGraph.createTransient("Visibility buffer", visibilityDesc);
+                sceneWrites.push_back(*visibilityBuffer);
+            }
+            // The cascades are brought up to date for the main view before it is drawn.
+            const RenderGraph::ResourceId sunShadowMaps = renderGraph.importExternal("Shadow maps");
+            std::vector<RenderGraph::ResourceId> sceneReads;
+            if (m_useShadows)
+            {
+                renderGraph.addPass("Shadow maps", {}, { sunShadowMaps }, [&](const RenderGraph &)
+                {
+                    dynamicShadowCasters.clear();
+                    if (currentCameraMode == CameraMode::ThirdPersonCamera)
+                    {
+                        for (const GPUMesh &mesh : characterMesh)
+                            dynamicShadowCasters.push_back(AABB::transformed(mesh.localBoundsMin(), mesh.localBoundsMax(), mesh.modelMatrix));
+                    }
+                    shadowMaps.update(m_viewMatrix, m_projectionMatrix, sun.direction, shadowCasterBounds, dynamicShadowCasters, renderShadowCasters);
+                });
+                sceneReads.push_back(sunShadowMaps);
+            }
+            renderGraph.addPass("Scene", std::move(sceneReads), std::move(sceneWrites), [&](const RenderGraph &graph)
+            {
+                glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+                glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-            // render quad
+                const Visibility *pSceneVisibility = cullScene(m_projectionMatrix, m_viewMatrix, true);
+                sceneOccludedCount = 0;
+                if (m_occlusionMode == OcclusionCullingMode::Software)
+                {
+                    pSceneVisibility = cullOccluded(pSceneVisibility, m_projectionMatrix, m_viewMatrix);
+                }
+                else if (useOcclusionQueries())
+                {
+                    sceneQueries.collectResults();
+                    pSceneVisibility = &sceneQueries.filter(pSceneVisibility);
+                    sceneOccludedCount = sceneQueries.occludedCount();
+                }
+                sceneVisibleCount = pSceneVisibility ? pSceneVisibility->visibleCount : static_cast<uint32_t>(m_meshes.size());
+                sceneQueue.clear();
+                fillGBuffer = gbuffer.has_value();
+                if (currentCameraMode == CameraMode::ThirdPersonCamera)
+                    submitMeshes(sceneQueue, characterMesh, characterTexture, m_viewMatrix);
+                submitMeshes(sceneQueue, m_meshes, m_texture, m_viewMatrix, useMultiDraw() ? drawnByMultiDraw : drawnByQueue, pSceneVisibility, useOcclusionQueries() ? &sceneQueries : nullptr);
+                submitMeshes(sceneQueue, fireMesh, *activeFireTexture, m_viewMatrix);
+                submitProps(sceneQueue, characterMesh, characterTexture);
+                fillGBuffer = false;
+                frameLights = lights;
+                updateAnimatedLights(frameLights, currentTime);
+                sceneLightClusters.build(frameLights, m_viewMatrix, m_projectionMatrix);
+                shadowedView = m_useShadows;
+                drawQueue(sceneQueue, sceneLightClusters, m_projectionMatrix, m_viewMatrix, pSceneVisibility, [&]
+                {
+                    if (useOcclusionQueries())
+                        sceneQueries.issueQueries(sceneBounds, m_boundingBoxShader.select(), m_projectionMatrix * m_viewMatrix);
+                }, gbuffer ? &graph.target(*gbuffer) : nullptr, visibilityBuffer ? &graph.target(*visibilityBuffer) : nullptr, m_useDepthPrepass && m_shadingPath == ShadingPath::Forward);
+                shadowedView = false;
+            });
+            if (show_map)
+            {
+                renderGraph.addPass("Minimap", { minimapMap, backbuffer }, { backbuffer }, [&](const RenderGraph &)
+                {
+                    renderMinimap();
+                });
+            }
+            renderGraph.execute();
+            // END FRAME **************************************************************************************************
 
-            if(show_map) renderMinimap();
+            uniformRing.endFrame();
             // Processes input and swaps the window buffer
             m_window.swapBuffers();
         }
+
+        GLState::deleteVertexArray(fullscreenVao);
     }
 
     // In here you can handle key presses
@@ -707,16 +1526,30 @@ private:
     Window m_window;
 
     // Shader for default rendering and for depth rendering
-    Shader m_defaultShader;
-    Shader m_shadowShader;
-    Shader m_quadShader;
-    Shader m_minimapShader;
+    ShaderVariants m_defaultShaders;
+    ShaderVariants m_shadowShader;
+    ShaderVariants m_quadShader;
+    ShaderVariants m_multiDrawShaders; // Only built when multiDrawSupported()
+    ShaderVariants m_multiDrawDepthShader; // Only built when multiDrawSupported()
+    ShaderVariants m_visibilityShader; // Only built when multiDrawSupported()
+    ShaderVariants m_visibilityShadeShaders; // Only built when multiDrawSupported()
+    ShaderVariants m_boundingBoxShader;
+    ShaderVariants m_deferredLightingShader;
 
     std::vector<GPUMesh> m_meshes;
     std::vector<GPUMesh> characterMesh;
     Texture m_texture;
     Texture characterTexture;
     bool m_useMaterial{true};
+    bool m_useMultiDraw{true};
+    ShadingPath m_shadingPath{ShadingPath::Forward};
+    bool m_useDepthPrepass{false}; // Forward shading of the main view only
+    bool m_useShadows{true}; // Cascaded shadow maps of the sun in the main view
+    bool m_useFrustumCulling{true};
+    bool m_useSceneBVH{false};
+    bool m_usePVS{true};
+    OcclusionCullingMode m_occlusionMode{OcclusionCullingMode::Software};
+    float m_minScreenSize{0.002f}; // Fraction of the viewport height below which scene meshes are culled
 
     // Projection and view matrices for you to fill in and use
     glm::mat4 m_projectionMatrix = glm::perspective(glm::radians(80.0f), 1.0f, 0.1f, 30.0f);
@@ -724,8 +1557,49 @@ private:
     glm::mat4 m_modelMatrix{1.0f};
 };
 
-int main()
+// Bakes the potentially visible sets of the scene meshes and writes them to scenePVSPath, without opening a window.
+// The bounds must be computed exactly like those of the GPU meshes in Application, or the file will not match.
+static void bakeScenePVS()
 {
+    const std::vector<Mesh> cpuMeshes = loadMesh(RESOURCE_ROOT "resources/scene1.obj");
+    std::vector<PotentiallyVisibleSet::BakeObject> objects;
+    AABB region;
+    for (const Mesh &mesh : cpuMeshes)
+    {
+        // Empty meshes still get an object so that the indices match the meshes. Their bounds are computed like
+        // GPUMesh does (a point at the origin), as PotentiallyVisibleSet::matches() compares them bit for bit, but
+        // they do not extend the region.
+        PotentiallyVisibleSet::BakeObject &object = objects.emplace_back();
+        glm::vec3 lower { 0.0f }, upper { 0.0f };
+        if (!mesh.vertices.empty())
+            lower = upper = mesh.vertices.front().position;
+        for (const Vertex &vertex : mesh.vertices)
+        {
+            object.positions.push_back(vertex.position);
+            lower = glm::min(lower, vertex.position);
+            upper = glm::max(upper, vertex.position);
+        }
+        object.triangles = mesh.triangles;
+        object.bounds = AABB::transformed(lower, upper, glm::mat4(1.0f)); // The scene meshes are not transformed
+        if (!mesh.vertices.empty())
+            region.extend(object.bounds);
+    }
+
+    // The camera can fly anywhere inside the scene bounds; outside of them the application falls back to frustum culling.
+    const PotentiallyVisibleSet pvs = PotentiallyVisibleSet::bake(region, objects, PotentiallyVisibleSet::BakeSettings {});
+    pvs.save(scenePVSPath);
+    const glm::uvec3 cells = pvs.cellCounts();
+    std::cout << "Baked " << pvs.cellCount() << " cells (" << cells.x << "x" << cells.y << "x" << cells.z << ") for " << pvs.objectCount() << " meshes to " << scenePVSPath << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1 && std::string_view(argv[1]) == "--bake-pvs")
+    {
+        bakeScenePVS();
+        return 0;
+    }
+
     Application app;
     app.update();
 
@@ -0,0 +1,453 @@
+#include "bvh.h"
+#include <framework/disable_all_warnings.h>
+DISABLE_WARNINGS_PUSH()
+#include <glm/geometric.hpp>
+#include <glm/vector_relational.hpp>
+DISABLE_WARNINGS_POP()
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cmath>
+#include <numeric>
+#include <utility>
+
+// Number of buckets per axis that object centroids are sorted into when evaluating SAH splits.
+static constexpr size_t sahBinCount = 16;
+
+AABB AABB::transformed(const glm::vec3& localLower, const glm::vec3& localUpper, const glm::mat4& modelMatrix)
+{
+    const glm::vec3 localCenter = 0.5f * (localLower + localUpper);
+    const glm::vec3 localExtent = 0.5f * (localUpper - localLower);
+    const glm::vec3 center = glm::vec3(modelMatrix * glm::vec4(localCenter, 1.0f));
+    const glm::mat3 linear { modelMatrix };
+    const glm::vec3 extent = glm::abs(linear[0]) * localExtent.x + glm::abs(linear[1]) * localExtent.y + glm::abs(linear[2]) * localExtent.z;
+    return { center - extent, center + extent };
+}
+
+// Distance along the ray to where it enters the box, or nullopt if it misses it or only hits it beyond ray.t.
+static std::optional<float> intersectRayBox(const Ray& ray, const glm::vec3& inverseDirection, const AABB& box)
+{
+    const glm::vec3 t0 = (box.lower - ray.origin) * inverseDirection;
+    const glm::vec3 t1 = (box.upper - ray.origin) * inverseDirection;
+    const glm::vec3 tMin = glm::min(t0, t1), tMax = glm::max(t0, t1);
+    const float tEnter = std::max({ tMin.x, tMin.y, tMin.z, 0.0f });
+    const float tExit = std::min({ tMax.x, tMax.y, tMax.z, ray.t });
+    if (tEnter > tExit)
+        return {};
+    return tEnter;
+}
+
+void BoundingVolumeHierarchy::build(std::span<const AABB> objectBounds)
+{
+    clear();
+    m_objectNodes.resize(objectBounds.size(), invalidIndex);
+    m_objectCount = objectBounds.size();
+
+    std::vector<ObjectId> objects(objectBounds.size());
+    std::iota(std::begin(objects), std::end(objects), ObjectId(0));
+    m_nodes.reserve(2 * objects.size());
+    if (!objects.empty())
+        m_root = buildRecursive(objects, objectBounds, invalidIndex);
+}
+
+void BoundingVolumeHierarchy::rebuild()
+{
+    std::vector<AABB> objectBounds(m_objectNodes.size());
+    std::vector<ObjectId> objects;
+    objects.reserve(m_objectCount);
+    for (ObjectId id = 0; id < m_objectNodes.size(); id++) {
+        if (m_objectNodes[id] == invalidIndex)
+            continue;
+        objectBounds[id] = m_nodes[m_objectNodes[id]].bounds;
+        objects.push_back(id);
+    }
+
+    m_nodes.clear();
+    m_freeNodes.clear();
+    m_root = invalidIndex;
+    m_nodes.reserve(2 * objects.size());
+    if (!objects.empty())
+        m_root = buildRecursive(objects, objectBounds, invalidIndex);
+}
+
+void BoundingVolumeHierarchy::clear()
+{
+    m_nodes.clear();
+    m_freeNodes.clear();
+    m_root = invalidIndex;
+    m_objectNodes.clear();
+    m_freeObjects.clear();
+    m_objectCount = 0;
+}
+
+uint32_t BoundingVolumeHierarchy::buildRecursive(std::span<ObjectId> objects, std::span<const AABB> objectBounds, uint32_t parent)
+{
+    const uint32_t node = allocateNode();
+    m_nodes[node].parent = parent;
+    if (objects.size() == 1) {
+        m_nodes[node].bounds = objectBounds[objects[0]];
+        m_nodes[node].object = objects[0];
+        m_objectNodes[objects[0]] = node;
+        return node;
+    }
+
+    AABB bounds, centroidBounds;
+    for (ObjectId id : objects) {
+        bounds.extend(objectBounds[id]);
+        const glm::vec3 centroid = objectBounds[id].center();
+        centroidBounds.extend({ centroid, centroid });
+    }
+    m_nodes[node].bounds = bounds;
+
+    // Binned SAH: sort the centroids into buckets along each axis and evaluate the cost of splitting between every two
+    // neighbouring buckets, cost = area(left) * count(left) + area(right) * count(right).
+    const glm::vec3 centroidSize = centroidBounds.upper - centroidBounds.lower;
+    auto binOf = [&](ObjectId id, int axis) {
+        const float relative = (objectBounds[id].center()[axis] - centroidBounds.lower[axis]) / centroidSize[axis];
+        return std::min(static_cast<size_t>(relative * static_cast<float>(sahBinCount)), sahBinCount - 1);
+    };
+    float bestCost = std::numeric_limits<float>::max();
+    int bestAxis = -1;
+    size_t bestSplit = 0;
+    for (int axis = 0; axis < 3; axis++) {
+        if (centroidSize[axis] <= 0.0f)
+            continue;
+        std::array<AABB, sahBinCount> binBounds;
+        std::array<size_t, sahBinCount> binCounts {};
+        for (ObjectId id : objects) {
+            const size_t bin = binOf(id, axis);
+            binBounds[bin].extend(objectBounds[id]);
+            binCounts[bin]++;
+        }
+
+        // Sweep from the right to get the cost of every right side, then from the left to combine them.
+        std::array<float, sahBinCount> rightCosts {};
+        AABB rightBounds;
+        size_t rightCount = 0;
+        for (size_t bin = sahBinCount - 1; bin > 0; bin--) {
+            rightBounds.extend(binBounds[bin]);
+            rightCount += binCounts[bin];
+            rightCosts[bin] = rightCount ? rightBounds.surfaceArea() * static_cast<float>(rightCount) : 0.0f;
+        }
+        AABB leftBounds;
+        size_t leftCount = 0;
+        for (size_t split = 1; split < sahBinCount; split++) {
+            leftBounds.extend(binBounds[split - 1]);
+            leftCount += binCounts[split - 1];
+            if (leftCount == 0 || leftCount == objects.size())
+                continue;
+            const float cost = leftBounds.surfaceArea() * static_cast<float>(leftCount) + rightCosts[split];
+            if (cost < bestCost) {
+                bestCost = cost;
+                bestAxis = axis;
+                bestSplit = split;
+            }
+        }
+    }
+
+    // All centroids in one spot (or in one bucket): any split is as good as another.
+    size_t leftCount = objects.size() / 2;
+    if (bestAxis != -1) {
+        const auto middle = std::partition(std::begin(objects), std::end(objects), [&](ObjectId id) { return binOf(id, bestAxis) < bestSplit; });
+        leftCount = static_cast<size_t>(middle - std::begin(objects));
+    }
+
+    const uint32_t left = buildRecursive(objects.first(leftCount), objectBounds, node);
+    const uint32_t right = buildRecursive(objects.subspan(leftCount), objectBounds, node);
+    m_nodes[node].children[0] = left;
+    m_nodes[node].children[1] = right;
+    return node;
+}
+
+BoundingVolumeHierarchy::ObjectId BoundingVolumeHierarchy::insert(const AABB& bounds)
+{
+    ObjectId id;
+    if (m_freeObjects.empty()) {
+        id = static_cast<ObjectId>(m_objectNodes.size());
+        m_objectNodes.push_back(invalidIndex);
+    } else {
+        id = m_freeObjects.back();
+        m_freeObjects.pop_back();
+    }
+
+    const uint32_t leaf = allocateNode();
+    m_nodes[leaf].bounds = bounds;
+    m_nodes[leaf].object = id;
+    m_objectNodes[id] = leaf;
+    insertLeaf(leaf);
+    m_objectCount++;
+    return id;
+}
+
+void BoundingVolumeHierarchy::remove(ObjectId id)
+{
+    const uint32_t leaf = m_objectNodes[id];
+    assert(leaf != invalidIndex);
+    removeLeaf(leaf);
+    freeNode(leaf);
+    m_objectNodes[id] = invalidIndex;
+    m_freeObjects.push_back(id);
+    m_objectCount--;
+}
+
+void BoundingVolumeHierarchy::refit(ObjectId id, const AABB& bounds)
+{
+    const uint32_t leaf = m_objectNodes[id];
+    m_nodes[leaf].bounds = bounds;
+    refitAncestors(m_nodes[leaf].parent);
+}
+
+void BoundingVolumeHierarchy::update(ObjectId id, const AABB& bounds)
+{
+    // While the object stays inside its parent's box, refitting only shrinks boxes and the tree does not get worse.
+    const uint32_t leaf = m_objectNodes[id];
+    const uint32_t parent = m_nodes[leaf].parent;
+    if (parent == invalidIndex || m_nodes[parent].bounds.contains(bounds)) {
+        refit(id, bounds);
+        return;
+    }
+    removeLeaf(leaf);
+    m_nodes[leaf].bounds = bounds;
+    insertLeaf(leaf);
+}
+
+uint32_t BoundingVolumeHierarchy::allocateNode()
+{
+    if (m_freeNodes.empty()) {
+        m_nodes.emplace_back();
+        return static_cast<uint32_t>(m_nodes.size() - 1);
+    }
+    const uint32_t node = m_freeNodes.back();
+    m_freeNodes.pop_back();
+    m_nodes[node] = Node {};
+    return node;
+}
+
+void BoundingVolumeHierarchy::freeNode(uint32_t node)
+{
+    m_nodes[node] = Node {};
+    m_freeNodes.push_back(node);
+}
+
+void BoundingVolumeHierarchy::insertLeaf(uint32_t leaf)
+{
+    if (m_root == invalidIndex) {
+        m_root = leaf;
+        m_nodes[leaf].parent = invalidIndex;
+        return;
+    }
+
+    // Walk down to the sibling with the lowest SAH cost: making `node` the sibling costs the area of the new parent,
+    // and every ancestor on the way grows by the area it gains from the leaf (the inherited cost). Stop as soon as
+    // descending into either child would cost more than pairing up with the current node.
+    const AABB leafBounds = m_nodes[leaf].bounds;
+    uint32_t sibling = m_root;
+    while (!m_nodes[sibling].isLeaf()) {
+        const Node& node = m_nodes[sibling];
+        const float area = node.bounds.surfaceArea();
+        const float combinedArea = merge(node.bounds, leafBounds).surfaceArea();
+        const float cost = 2.0f * combinedArea;
+        const float inheritedCost = 2.0f * (combinedArea - area);
+
+        std::array<float, 2> childCosts;
+        for (size_t i = 0; i < 2; i++) {
+            const Node& child = m_nodes[node.children[i]];
+            const float childCombinedArea = merge(child.bounds, leafBounds).surfaceArea();
+            childCosts[i] = (child.isLeaf() ? childCombinedArea : childCombinedArea - child.bounds.surfaceArea()) + inheritedCost;
+        }
+        if (cost < childCosts[0] && cost < childCosts[1])
+            break;
+        sibling = node.children[childCosts[0] < childCosts[1] ? 0 : 1];
+    }
+
+    const uint32_t oldParent = m_nodes[sibling].parent;
+    const uint32_t newParent = allocateNode();
+    m_nodes[newParent].parent = oldParent;
+    m_nodes[newParent].bounds = merge(m_nodes[sibling].bounds, leafBounds);
+    m_nodes[newParent].children[0] = sibling;
+    m_nodes[newParent].children[1] = leaf;
+    m_nodes[sibling].parent = newParent;
+    m_nodes[leaf].parent = newParent;
+    if (oldParent == invalidIndex) {
+        m_root = newParent;
+    } else {
+        uint32_t* pChildren = m_nodes[oldParent].children;
+        pChildren[pChildren[0] == sibling ? 0 : 1] = newParent;
+        refitAncestors(oldParent);
+    }
+}
+
+void BoundingVolumeHierarchy::removeLeaf(uint32_t leaf)
+{
+    if (leaf == m_root) {
+        m_root = invalidIndex;
+        return;
+    }
+
+    // The sibling takes the place of the parent, which is no longer needed.
+    const uint32_t parent = m_nodes[leaf].parent;
+    const uint32_t grandParent = m_nodes[parent].parent;
+    const uint32_t sibling = m_nodes[parent].children[m_nodes[parent].children[0] == leaf ? 1 : 0];
+    m_nodes[sibling].parent = grandParent;
+    if (grandParent == invalidIndex) {
+        m_root = sibling;
+    } else {
+        uint32_t* pChildren = m_nodes[grandParent].children;
+        pChildren[pChildren[0] == parent ? 0 : 1] = sibling;
+        refitAncestors(grandParent);
+    }
+    freeNode(parent);
+    m_nodes[leaf].parent = invalidIndex;
+}
+
+void BoundingVolumeHierarchy::refitAncestors(uint32_t node)
+{
+    for (; node != invalidIndex; node = m_nodes[node].parent)
+        m_nodes[node].bounds = merge(m_nodes[m_nodes[node].children[0]].bounds, m_nodes[m_nodes[node].children[1]].bounds);
+}
+
+void BoundingVolumeHierarchy::cullFrustum(const glm::mat4& viewProjection, float minScreenSize, Visibility& out) const
+{
+    out.visible.assign(m_objectNodes.size(), 0);
+    out.visibleCount = 0;
+    if (m_root == invalidIndex)
+        return;
+
+    const Frustum frustum = Frustum::fromViewProjection(viewProjection);
+    const ScreenSizeTest sizeTest = ScreenSizeTest::fromViewProjection(viewProjection, minScreenSize);
+
+    // Bit i of the mask is set while the node may still cross plane i. A node that is completely on the inside of a
+    // plane passes that on to its children, which are contained in it; with an empty mask no planes are tested.
+    constexpr uint8_t allPlanes = 0b111111;
+    std::vector<std::pair<uint32_t, uint8_t>> stack { { m_root, allPlanes } };
+    while (!stack.empty()) {
+        auto [nodeIndex, planeMask] = stack.back();
+        stack.pop_back();
+        const Node& node = m_nodes[nodeIndex];
+        const glm::vec3 center = node.bounds.center(), extent = node.bounds.extent();
+
+        bool outside = false;
+        for (size_t i = 0; i < 6 && !outside; i++) {
+            if (!(planeMask & (1 << i)))
+                continue;
+            const glm::vec4& plane = frustum.planes[i];
+            const float distance = glm::dot(glm::vec3(plane), center) + plane.w;
+            const float radius = glm::dot(glm::abs(glm::vec3(plane)), extent);
+            if (distance + radius < 0.0f)
+                outside = true;
+            else if (distance - radius >= 0.0f)
+                planeMask &= static_cast<uint8_t>(~(1 << i));
+        }
+        if (outside)
+            continue;
+
+        if (node.isLeaf()) {
+            // Not applied to inner nodes: a child can be closer to the camera than the center of its parent.
+            if (sizeTest.passes(center, glm::length(extent))) {
+                out.visible[node.object] = 1;
+                out.visibleCount++;
+            }
+        } else {
+            stack.push_back({ node.children[0], planeMask });
+            stack.push_back({ node.children[1], planeMask });
+        }
+    }
+}
+
+void BoundingVolumeHierarchy::queryOverlap(const AABB& bounds, std::vector<ObjectId>& out) const
+{
+    if (m_root == invalidIndex)
+        return;
+    std::vector<uint32_t> stack { m_root };
+    while (!stack.empty()) {
+        const Node& node = m_nodes[stack.back()];
+        stack.pop_back();
+        if (!node.bounds.overlaps(bounds))
+            continue;
+        if (node.isLeaf()) {
+            out.push_back(node.object);
+        } else {
+            stack.push_back(node.children[0]);
+            stack.push_back(node.children[1]);
+        }
+    }
+}
+
+void BoundingVolumeHierarchy::querySphere(const glm::vec3& center, float radius, std::vector<ObjectId>& out) const
+{
+    if (m_root == invalidIndex)
+        return;
+    std::vector<uint32_t> stack { m_root };
+    while (!stack.empty()) {
+        const Node& node = m_nodes[stack.back()];
+        stack.pop_back();
+        // Distance from the center to the closest point of the box.
+        const glm::vec3 offset = glm::clamp(center, node.bounds.lower, node.bounds.upper) - center;
+        if (glm::dot(offset, offset) > radius * radius)
+            continue;
+        if (node.isLeaf()) {
+            out.push_back(node.object);
+        } else {
+            stack.push_back(node.children[0]);
+            stack.push_back(node.children[1]);
+        }
+    }
+}
+
+std::optional<BoundingVolumeHierarchy::ObjectId> BoundingVolumeHierarchy::raycast(Ray& ray, const IntersectObject& intersect) const
+{
+    if (m_root == invalidIndex || !intersectRayBox(ray, 1.0f / ray.direction, m_nodes[m_root].bounds))
+        return {};
+
+    const glm::vec3 inverseDirection = 1.0f / ray.direction;
+    std::optional<ObjectId> nearest;
+    // Nodes with the distance at which the ray enters them; a node is skipped if a nearer hit was found since.
+    std::vector<std::pair<uint32_t, float>> stack { { m_root, 0.0f } };
+    while (!stack.empty()) {
+        const auto [nodeIndex, tEnter] = stack.back();
+        stack.pop_back();
+        if (tEnter > ray.t)
+            continue;
+
+        const Node& node = m_nodes[nodeIndex];
+        if (node.isLeaf()) {
+            const std::optional<float> t = intersect ? intersect(node.object, ray) : tEnter;
+            if (t && *t <= ray.t) {
+                ray.t = *t;
+                nearest = node.object;
+            }
+            continue;
+        }
+
+        const std::optional<float> t0 = intersectRayBox(ray, inverseDirection, m_nodes[node.children[0]].bounds);
+        const std::optional<float> t1 = intersectRayBox(ray, inverseDirection, m_nodes[node.children[1]].bounds);
+        // Push the far child first so that the near one is visited first.
+        const bool firstIsNear = !t1 || (t0 && *t0 <= *t1);
+        const int nearChild = firstIsNear ? 0 : 1;
+        const std::optional<float>& tNear = firstIsNear ? t0 : t1;
+        const std::optional<float>& tFar = firstIsNear ? t1 : t0;
+        if (tFar)
+            stack.push_back({ node.children[1 - nearChild], *tFar });
+        if (tNear)
+            stack.push_back({ node.children[nearChild], *tNear });
+    }
+    return nearest;
+}
+
+float BoundingVolumeHierarchy::sahCost() const
+{
+    if (m_root == invalidIndex || m_nodes[m_root].isLeaf())
+        return 0.0f;
+    float innerArea = 0.0f;
+    std::vector<uint32_t> stack { m_root };
+    while (!stack.empty()) {
+        const Node& node = m_nodes[stack.back()];
+        stack.pop_back();
+        if (node.isLeaf())
+            continue;
+        innerArea += node.bounds.surfaceArea();
+        stack.push_back(node.children[0]);
+        stack.push_back(node.children[1]);
+    }
+    return innerArea / m_nodes[m_root].bounds.surfaceArea();
+}
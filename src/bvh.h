@@ -0,0 +1,115 @@
+#pragma once
+
+#include "frustum_culling.h"
+#include <framework/disable_all_warnings.h>
+#include <framework/ray.h>
+DISABLE_WARNINGS_PUSH()
+#include <glm/common.hpp>
+#include <glm/mat4x4.hpp>
+#include <glm/vec3.hpp>
+DISABLE_WARNINGS_POP()
+
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <optional>
+#include <span>
+#include <vector>
+
+struct AABB {
+    glm::vec3 lower { std::numeric_limits<float>::max() };
+    glm::vec3 upper { std::numeric_limits<float>::lowest() };
+
+    // Box around the given box after transforming it (Arvo).
+    static AABB transformed(const glm::vec3& localLower, const glm::vec3& localUpper, const glm::mat4& modelMatrix);
+
+    glm::vec3 center() const { return 0.5f * (lower + upper); }
+    glm::vec3 extent() const { return 0.5f * (upper - lower); }
+    float surfaceArea() const
+    {
+        const glm::vec3 size = upper - lower;
+        return 2.0f * (size.x * size.y + size.y * size.z + size.z * size.x);
+    }
+    void extend(const AABB& other)
+    {
+        lower = glm::min(lower, other.lower);
+        upper = glm::max(upper, other.upper);
+    }
+    bool contains(const AABB& other) const { return glm::all(glm::lessThanEqual(lower, other.lower)) && glm::all(glm::greaterThanEqual(upper, other.upper)); }
+    bool overlaps(const AABB& other) const { return glm::all(glm::lessThanEqual(lower, other.upper)) && glm::all(glm::greaterThanEqual(upper, other.lower)); }
+};
+
+inline AABB merge(AABB lhs, const AABB& rhs)
+{
+    lhs.extend(rhs);
+    return lhs;
+}
+
+// Dynamic bounding volume hierarchy over the bounding boxes of scene objects, with one object per leaf.
+//
+// build() creates a tree top-down with the surface area heuristic (binned SAH). Afterwards objects can be inserted
+// and removed; insert() picks the sibling that increases the total surface area the least (branch and bound over the
+// SAH cost). When an object moves, refit() only grows/shrinks the boxes of its ancestors, which is cheap but makes the
+// tree worse when objects travel far; update() refits as long as the object stays inside its parent's box and
+// otherwise removes and reinserts the leaf. rebuild() starts over from the current boxes while keeping the object ids.
+//
+// Queries: frustum culling that stops testing planes a node is completely inside of (plane masking) and skips the
+// whole subtree once no plane is left, box and sphere overlap, and nearest hit ray casts.
+class BoundingVolumeHierarchy {
+public:
+    using ObjectId = uint32_t;
+
+    // Replaces the tree; object i gets id i.
+    void build(std::span<const AABB> objectBounds);
+    void rebuild();
+    void clear();
+
+    ObjectId insert(const AABB& bounds);
+    void remove(ObjectId id);
+    void refit(ObjectId id, const AABB& bounds);
+    void update(ObjectId id, const AABB& bounds);
+
+    // out.visible is indexed by object id (removed ids are never visible). See ScreenSizeTest for minScreenSize.
+    void cullFrustum(const glm::mat4& viewProjection, float minScreenSize, Visibility& out) const;
+    void queryOverlap(const AABB& bounds, std::vector<ObjectId>& out) const;
+    void querySphere(const glm::vec3& center, float radius, std::vector<ObjectId>& out) const;
+    // Returns the nearest object hit before ray.t and sets ray.t to the hit distance. By default the distance to the
+    // bounding box is used; intersect can replace that by an exact test against the object (return nullopt on a miss).
+    // Children are visited front to back, so subtrees behind the nearest hit so far are skipped.
+    using IntersectObject = std::function<std::optional<float>(ObjectId id, const Ray& ray)>;
+    std::optional<ObjectId> raycast(Ray& ray, const IntersectObject& intersect = {}) const;
+
+    const AABB& bounds(ObjectId id) const { return m_nodes[m_objectNodes[id]].bounds; }
+    size_t objectCount() const { return m_objectCount; }
+    size_t nodeCount() const { return m_nodes.size() - m_freeNodes.size(); }
+    // Sum of the surface areas of the internal nodes relative to the root; lower means faster queries.
+    float sahCost() const;
+
+private:
+    static constexpr uint32_t invalidIndex = 0xFFFFFFFF;
+
+    struct Node {
+        AABB bounds;
+        uint32_t parent { invalidIndex };
+        uint32_t children[2] { invalidIndex, invalidIndex };
+        ObjectId object { invalidIndex }; // Only for leaves
+
+        bool isLeaf() const { return children[0] == invalidIndex; }
+    };
+
+    uint32_t allocateNode();
+    void freeNode(uint32_t node);
+    uint32_t buildRecursive(std::span<ObjectId> objects, std::span<const AABB> objectBounds, uint32_t parent);
+    void insertLeaf(uint32_t leaf);
+    void removeLeaf(uint32_t leaf);
+    void refitAncestors(uint32_t node);
+
+private:
+    std::vector<Node> m_nodes;
+    std::vector<uint32_t> m_freeNodes;
+    uint32_t m_root { invalidIndex };
+
+    std::vector<uint32_t> m_objectNodes; // Leaf of every object id, invalidIndex for removed ids
+    std::vector<ObjectId> m_freeObjects;
+    size_t m_objectCount { 0 };
+};
@@ -0,0 +1,261 @@
+#include "cascaded_shadows.h"
+#include <framework/disable_all_warnings.h>
+#include <framework/gl_state.h>
+DISABLE_WARNINGS_PUSH()
+#include <glm/common.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtc/type_ptr.hpp>
+#include <glm/matrix.hpp>
+#include <glm/vec4.hpp>
+DISABLE_WARNINGS_POP()
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <limits>
+
+using namespace shader_literals;
+
+static std::array<glm::vec3, 8> corners(const AABB& bounds)
+{
+    std::array<glm::vec3, 8> out;
+    for (size_t i = 0; i < out.size(); i++)
+        out[i] = glm::vec3((i & 1) ? bounds.upper.x : bounds.lower.x, (i & 2) ? bounds.upper.y : bounds.lower.y, (i & 4) ? bounds.upper.z : bounds.lower.z);
+    return out;
+}
+
+// Sampled with a comparison (hardware filtered PCF); the cache of static casters is only ever copied.
+static GLuint createDepthArray(GLsizei resolution, bool compare)
+{
+    const GLint filter = compare ? GL_LINEAR : GL_NEAREST;
+    GLuint texture = 0;
+    if (GLState::directStateAccess()) {
+        glCreateTextures(GL_TEXTURE_2D_ARRAY, 1, &texture);
+        glTextureStorage3D(texture, 1, GL_DEPTH_COMPONENT32F, resolution, resolution, CascadedShadowMaps::cascadeCount);
+        glTextureParameteri(texture, GL_TEXTURE_MIN_FILTER, filter);
+        glTextureParameteri(texture, GL_TEXTURE_MAG_FILTER, filter);
+        glTextureParameteri(texture, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTextureParameteri(texture, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        if (compare) {
+            glTextureParameteri(texture, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+            glTextureParameteri(texture, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+        }
+        return texture;
+    }
+
+    glGenTextures(1, &texture);
+    GLState::bindTexture(0, GL_TEXTURE_2D_ARRAY, texture);
+    glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_DEPTH_COMPONENT32F, resolution, resolution, CascadedShadowMaps::cascadeCount, 0, GL_DEPTH_COMPONENT, GL_FLOAT, nullptr);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, 0);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, filter);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, filter);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    if (compare) {
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+    }
+    GLState::bindTexture(0, GL_TEXTURE_2D_ARRAY, 0);
+    return texture;
+}
+
+// Depth-only framebuffer that renders into one layer of a texture array.
+static GLuint createLayerFramebuffer(GLuint texture, GLint layer)
+{
+    GLuint framebuffer = 0;
+    if (GLState::directStateAccess()) {
+        glCreateFramebuffers(1, &framebuffer);
+        glNamedFramebufferTextureLayer(framebuffer, GL_DEPTH_ATTACHMENT, texture, 0, layer);
+        glNamedFramebufferDrawBuffer(framebuffer, GL_NONE);
+        glNamedFramebufferReadBuffer(framebuffer, GL_NONE);
+        if (glCheckNamedFramebufferStatus(framebuffer, GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+            std::cerr << "Shadow map framebuffer is not complete" << std::endl;
+        return framebuffer;
+    }
+
+    glGenFramebuffers(1, &framebuffer);
+    GLState::bindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, texture, 0, layer);
+    glDrawBuffer(GL_NONE);
+    glReadBuffer(GL_NONE);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        std::cerr << "Shadow map framebuffer is not complete" << std::endl;
+    GLState::bindFramebuffer(GL_FRAMEBUFFER, 0);
+    return framebuffer;
+}
+
+CascadedShadowMaps::CascadedShadowMaps(GLsizei resolution)
+    : m_resolution(resolution)
+{
+    m_staticMaps = createDepthArray(resolution, false);
+    m_maps = createDepthArray(resolution, true);
+    for (GLint layer = 0; layer < cascadeCount; layer++) {
+        m_staticFramebuffers[static_cast<size_t>(layer)] = createLayerFramebuffer(m_staticMaps, layer);
+        m_framebuffers[static_cast<size_t>(layer)] = createLayerFramebuffer(m_maps, layer);
+    }
+}
+
+CascadedShadowMaps::~CascadedShadowMaps()
+{
+    for (size_t layer = 0; layer < cascadeCount; layer++) {
+        GLState::deleteFramebuffer(m_staticFramebuffers[layer]);
+        GLState::deleteFramebuffer(m_framebuffers[layer]);
+    }
+    GLState::deleteTexture(m_staticMaps);
+    GLState::deleteTexture(m_maps);
+}
+
+void CascadedShadowMaps::invalidate()
+{
+    for (Cascade& cascade : m_cascades)
+        cascade.cached = false;
+}
+
+void CascadedShadowMaps::setSettings(const Settings& settings)
+{
+    if (settings == m_settings)
+        return;
+    m_settings = settings;
+    invalidate();
+}
+
+void CascadedShadowMaps::update(const glm::mat4& view, const glm::mat4& projection, const glm::vec3& lightDirection, const AABB& casterBounds,
+    std::span<const AABB> dynamicCasters, const RenderCasters& renderCasters)
+{
+    std::array<GLint, 4> previousViewport;
+    glGetIntegerv(GL_VIEWPORT, previousViewport.data());
+
+    const glm::vec3 direction = glm::normalize(lightDirection);
+    if (direction != m_lightDirection) {
+        m_lightDirection = direction;
+        const glm::vec3 up = std::abs(direction.y) > 0.99f ? glm::vec3(0.0f, 0.0f, 1.0f) : glm::vec3(0.0f, 1.0f, 0.0f);
+        m_lightRotation = glm::lookAt(glm::vec3(0.0f), direction, up);
+        invalidate();
+    }
+
+    // Corners of the view frustum on the near and the far plane; the slices are interpolated between them.
+    const glm::mat4 inverseViewProjection = glm::inverse(projection * view);
+    std::array<glm::vec3, 4> nearCorners, farCorners;
+    for (size_t i = 0; i < 4; i++) {
+        const glm::vec2 ndc { (i & 1) ? 1.0f : -1.0f, (i & 2) ? 1.0f : -1.0f };
+        const glm::vec4 nearCorner = inverseViewProjection * glm::vec4(ndc, -1.0f, 1.0f);
+        const glm::vec4 farCorner = inverseViewProjection * glm::vec4(ndc, 1.0f, 1.0f);
+        nearCorners[i] = glm::vec3(nearCorner) / nearCorner.w;
+        farCorners[i] = glm::vec3(farCorner) / farCorner.w;
+    }
+    const float nearDepth = -(view * glm::vec4(nearCorners[0], 1.0f)).z;
+    const float farDepth = -(view * glm::vec4(farCorners[0], 1.0f)).z;
+    const float shadowDepth = std::min(farDepth, m_settings.shadowDistance);
+    const auto splitDepth = [&](int split) {
+        const float fraction = static_cast<float>(split) / static_cast<float>(cascadeCount);
+        const float uniformSplit = nearDepth + (shadowDepth - nearDepth) * fraction;
+        const float logSplit = nearDepth * std::pow(shadowDepth / nearDepth, fraction);
+        return glm::mix(uniformSplit, logSplit, m_settings.splitLambda);
+    };
+
+    // Depth range along the light that contains all static casters; dynamic casters outside of it are clamped to it.
+    glm::vec2 depthRange { std::numeric_limits<float>::max(), std::numeric_limits<float>::lowest() };
+    for (const glm::vec3& corner : corners(casterBounds)) {
+        const float depth = -(m_lightRotation * glm::vec4(corner, 1.0f)).z;
+        depthRange = glm::vec2(std::min(depthRange.x, depth), std::max(depthRange.y, depth));
+    }
+    depthRange += glm::vec2(-1.0f, 1.0f);
+
+    GLState::setEnabled(GL_DEPTH_TEST, true);
+    GLState::setEnabled(GL_DEPTH_CLAMP, true);
+    GLState::setEnabled(GL_POLYGON_OFFSET_FILL, true);
+    glPolygonOffset(2.0f, 2.0f);
+
+    m_staticRenderCount = m_dynamicRenderCount = 0;
+    for (size_t cascadeIndex = 0; cascadeIndex < cascadeCount; cascadeIndex++) {
+        Cascade& cascade = m_cascades[cascadeIndex];
+        cascade.splitNear = splitDepth(static_cast<int>(cascadeIndex));
+        cascade.splitFar = splitDepth(static_cast<int>(cascadeIndex) + 1);
+
+        // Bounding sphere of the slice. Its radius only depends on the projection, not on where the camera looks;
+        // rounding it keeps float noise from changing the size of a texel.
+        std::array<glm::vec3, 8> sliceCorners;
+        glm::vec3 center { 0.0f };
+        for (size_t i = 0; i < 4; i++) {
+            sliceCorners[i] = glm::mix(nearCorners[i], farCorners[i], (cascade.splitNear - nearDepth) / (farDepth - nearDepth));
+            sliceCorners[i + 4] = glm::mix(nearCorners[i], farCorners[i], (cascade.splitFar - nearDepth) / (farDepth - nearDepth));
+            center += sliceCorners[i] + sliceCorners[i + 4];
+        }
+        center /= 8.0f;
+        float radius = 0.0f;
+        for (const glm::vec3& corner : sliceCorners)
+            radius = std::max(radius, glm::distance(corner, center));
+        radius = std::ceil(radius * 16.0f) / 16.0f;
+        const float halfSize = radius * (1.0f + m_settings.cacheMargin);
+        const glm::vec2 lightCenter { m_lightRotation * glm::vec4(center, 1.0f) };
+
+        // The cached static casters stay good as long as the whole slice is inside the region they were rendered for.
+        const glm::vec2 offset = glm::abs(lightCenter - cascade.center);
+        const bool renderStatic = !cascade.cached || cascade.halfSize != halfSize || cascade.depthRange != depthRange || std::max(offset.x, offset.y) + radius > cascade.halfSize;
+        if (renderStatic) {
+            // Snapped to whole texels, so that the static casters land on the same texels every time they are rendered.
+            const float texelSize = 2.0f * halfSize / static_cast<float>(m_resolution);
+            cascade.cached = true;
+            cascade.center = glm::round(lightCenter / texelSize) * texelSize;
+            cascade.halfSize = halfSize;
+            cascade.depthRange = depthRange;
+            cascade.viewProjection = cascadeViewProjection(cascade);
+
+            GLState::bindFramebuffer(GL_FRAMEBUFFER, m_staticFramebuffers[cascadeIndex]);
+            GLState::viewport(0, 0, m_resolution, m_resolution);
+            glClear(GL_DEPTH_BUFFER_BIT);
+            renderCasters(cascade.viewProjection, true);
+            m_staticRenderCount++;
+        }
+
+        const bool hasDynamicCasters = std::any_of(std::begin(dynamicCasters), std::end(dynamicCasters), [&](const AABB& bounds) {
+            glm::vec2 lower { std::numeric_limits<float>::max() }, upper { std::numeric_limits<float>::lowest() };
+            for (const glm::vec3& corner : corners(bounds)) {
+                const glm::vec2 lightCorner { m_lightRotation * glm::vec4(corner, 1.0f) };
+                lower = glm::min(lower, lightCorner);
+                upper = glm::max(upper, lightCorner);
+            }
+            return glm::all(glm::lessThanEqual(lower, cascade.center + cascade.halfSize)) && glm::all(glm::greaterThanEqual(upper, cascade.center - cascade.halfSize));
+        });
+        // The sampled layer is the cached one plus the dynamic casters; it only has to be rebuilt if either changed.
+        if (renderStatic || hasDynamicCasters || cascade.hadDynamicCasters) {
+            GLState::bindFramebuffer(GL_READ_FRAMEBUFFER, m_staticFramebuffers[cascadeIndex]);
+            GLState::bindFramebuffer(GL_DRAW_FRAMEBUFFER, m_framebuffers[cascadeIndex]);
+            glBlitFramebuffer(0, 0, m_resolution, m_resolution, 0, 0, m_resolution, m_resolution, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+            if (hasDynamicCasters) {
+                GLState::bindFramebuffer(GL_FRAMEBUFFER, m_framebuffers[cascadeIndex]);
+                GLState::viewport(0, 0, m_resolution, m_resolution);
+                renderCasters(cascade.viewProjection, false);
+                m_dynamicRenderCount++;
+            }
+        }
+        cascade.hadDynamicCasters = hasDynamicCasters;
+    }
+
+    GLState::setEnabled(GL_POLYGON_OFFSET_FILL, false);
+    GLState::setEnabled(GL_DEPTH_CLAMP, false);
+    GLState::bindFramebuffer(GL_FRAMEBUFFER, 0);
+    GLState::viewport(previousViewport[0], previousViewport[1], previousViewport[2], previousViewport[3]);
+}
+
+void CascadedShadowMaps::bind(const Shader& shader, bool enabled) const
+{
+    std::array<glm::mat4, cascadeCount> matrices;
+    glm::vec4 texelSizes;
+    for (size_t i = 0; i < cascadeCount; i++) {
+        matrices[i] = m_cascades[i].viewProjection;
+        texelSizes[static_cast<glm::length_t>(i)] = 2.0f * m_cascades[i].halfSize / static_cast<float>(m_resolution);
+    }
+    const bool cached = std::all_of(std::begin(m_cascades), std::end(m_cascades), [](const Cascade& cascade) { return cascade.cached; });
+
+    GLState::bindTexture(textureUnit, GL_TEXTURE_2D_ARRAY, m_maps);
+    glUniform1i(shader.getUniformLocation("shadowMaps"_uniform), static_cast<GLint>(textureUnit));
+    glUniformMatrix4fv(shader.getUniformLocation("shadowMatrices"_uniform), cascadeCount, GL_FALSE, glm::value_ptr(matrices[0]));
+    glUniform4fv(shader.getUniformLocation("shadowTexelSizes"_uniform), 1, glm::value_ptr(texelSizes));
+    glUniform1i(shader.getUniformLocation("shadowCascades"_uniform), enabled && cached ? cascadeCount : 0);
+}
+
+glm::mat4 CascadedShadowMaps::cascadeViewProjection(const Cascade& cascade) const
+{
+    const glm::mat4 projection = glm::ortho(-cascade.halfSize, cascade.halfSize, -cascade.halfSize, cascade.halfSize, cascade.depthRange.x, cascade.depthRange.y);
+    return projection * glm::translate(glm::mat4(1.0f), glm::vec3(-cascade.center, 0.0f)) * m_lightRotation;
+}
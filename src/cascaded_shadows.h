@@ -0,0 +1,105 @@
+#pragma once
+
+#include "bvh.h"
+#include <framework/disable_all_warnings.h>
+#include <framework/shader.h>
+DISABLE_WARNINGS_PUSH()
+#include <glm/mat4x4.hpp>
+#include <glm/vec2.hpp>
+#include <glm/vec3.hpp>
+DISABLE_WARNINGS_POP()
+
+#include <array>
+#include <functional>
+#include <span>
+#include <framework/opengl_includes.h>
+
+// Cascaded shadow maps of one directional light. The view frustum up to the shadow distance is split into
+// cascadeCount slices (between uniform and logarithmic spacing); every slice gets its own layer of a depth texture
+// array, rendered with an orthographic projection along the light that covers the bounding sphere of the slice.
+//  - Stable fitting: the sphere (and thus the size of a texel) does not change when the camera rotates, and the
+//    region is snapped to whole texels in light space, so shadow edges do not shimmer when the camera moves.
+//  - Caching: the static casters of a cascade are rendered for a region somewhat larger than the slice needs and kept
+//    in a separate texture array. They are only rendered again once the slice no longer fits in that region (or the
+//    light, the projection or the static casters changed). Every frame the cached layer is copied to the sampled
+//    layer, and only the dynamic casters are drawn on top, and only in cascades that they (or last frame) overlap.
+// On a frame where nothing moved but the camera within its cached regions, no caster is drawn at all.
+//
+// The fragment shaders sample the maps through shaders/shadows.glsl, which picks the first cascade that contains the
+// point; that works for any view, but bind() can also turn the shadows off (the minimap, which is baked once).
+class CascadedShadowMaps {
+public:
+    static constexpr int cascadeCount = 4; // SHADOW_CASCADES in shaders/shadows.glsl
+    // Texture unit used by bind().
+    static constexpr GLuint textureUnit = 8;
+
+    // Draws the static or the dynamic casters depth-only into the bound framebuffer (a layer of the maps);
+    // lightViewProjection is also what they should be culled against.
+    using RenderCasters = std::function<void(const glm::mat4& lightViewProjection, bool staticCasters)>;
+
+    struct Settings {
+        float shadowDistance { 40.0f }; // View depth up to which there are shadows
+        float splitLambda { 0.75f }; // 0 splits the cascades uniformly, 1 logarithmically
+        // Extra size of the region the static casters are rendered for, relative to the bounding sphere of the
+        // slice; the larger, the longer a cascade stays valid and the lower its resolution.
+        float cacheMargin { 0.25f };
+
+        [[nodiscard]] constexpr bool operator==(const Settings&) const noexcept = default;
+    };
+
+    explicit CascadedShadowMaps(GLsizei resolution);
+    CascadedShadowMaps(const CascadedShadowMaps&) = delete;
+    ~CascadedShadowMaps();
+
+    CascadedShadowMaps& operator=(const CascadedShadowMaps&) = delete;
+
+    // The static casters changed: all cascades render them again on the next update().
+    void invalidate();
+    const Settings& settings() const { return m_settings; }
+    void setSettings(const Settings& settings);
+
+    // Fits the cascades to the view and brings the maps up to date. lightDirection is the direction the light travels
+    // in; casterBounds contains all static casters (it determines the depth range). dynamicCasters are the bounds of
+    // the dynamic casters, to skip the cascades they do not reach. Leaves framebuffer 0 bound with the viewport it had.
+    void update(const glm::mat4& view, const glm::mat4& projection, const glm::vec3& lightDirection, const AABB& casterBounds,
+        std::span<const AABB> dynamicCasters, const RenderCasters& renderCasters);
+    // Binds the maps and sets the uniforms declared in shaders/shadows.glsl; with enabled false nothing is in shadow.
+    void bind(const Shader& shader, bool enabled = true) const;
+
+    GLsizei resolution() const { return m_resolution; }
+    // View depth at which a cascade ends.
+    float splitDepth(int cascade) const { return m_cascades[static_cast<size_t>(cascade)].splitFar; }
+    // Number of cascades whose static or dynamic casters were rendered in the last update().
+    int staticRenderCount() const { return m_staticRenderCount; }
+    int dynamicRenderCount() const { return m_dynamicRenderCount; }
+
+private:
+    struct Cascade {
+        float splitNear { 0.0f }, splitFar { 0.0f }; // View depth range of the slice
+        // Region the layers were rendered for; only valid while cached is set.
+        bool cached { false };
+        glm::vec2 center { 0.0f }; // Light space, snapped to texels
+        float halfSize { 0.0f };
+        glm::vec2 depthRange { 0.0f };
+        glm::mat4 viewProjection { 1.0f };
+        bool hadDynamicCasters { false }; // The sampled layer differs from the cached one
+    };
+
+    // Orthographic projection along the light of the region of a cascade.
+    glm::mat4 cascadeViewProjection(const Cascade& cascade) const;
+
+private:
+    GLsizei m_resolution;
+    Settings m_settings;
+    glm::vec3 m_lightDirection { 0.0f };
+    glm::mat4 m_lightRotation { 1.0f };
+    std::array<Cascade, cascadeCount> m_cascades;
+    int m_staticRenderCount { 0 }, m_dynamicRenderCount { 0 };
+
+    // Depth texture arrays with one layer per cascade: the static casters only, and the sampled maps.
+    GLuint m_staticMaps { 0 };
+    GLuint m_maps { 0 };
+    // One framebuffer per layer of each.
+    std::array<GLuint, cascadeCount> m_staticFramebuffers {};
+    std::array<GLuint, cascadeCount> m_framebuffers {};
+};
@@ -0,0 +1,161 @@
+#include "frustum_culling.h"
+#include <framework/disable_all_warnings.h>
+DISABLE_WARNINGS_PUSH()
+#include <glm/geometric.hpp>
+#include <glm/matrix.hpp>
+DISABLE_WARNINGS_POP()
+#include <algorithm>
+#include <cmath>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#define FRUSTUM_CULLING_AVX 1
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define FRUSTUM_CULLING_SSE 1
+#endif
+
+// All arrays are padded to a multiple of this, so the SIMD loops never need a scalar tail.
+static constexpr size_t simdWidth = 8;
+
+Frustum Frustum::fromViewProjection(const glm::mat4& viewProjection)
+{
+    // A point is inside the clip volume when -w <= x, y, z <= w; each inequality is a plane in world space.
+    const glm::mat4 rows = glm::transpose(viewProjection);
+    Frustum out;
+    out.planes[0] = rows[3] + rows[0];
+    out.planes[1] = rows[3] - rows[0];
+    out.planes[2] = rows[3] + rows[1];
+    out.planes[3] = rows[3] - rows[1];
+    out.planes[4] = rows[3] + rows[2];
+    out.planes[5] = rows[3] - rows[2];
+    for (glm::vec4& plane : out.planes)
+        plane /= glm::length(glm::vec3(plane));
+    return out;
+}
+
+ScreenSizeTest ScreenSizeTest::fromViewProjection(const glm::mat4& viewProjection, float minScreenSize)
+{
+    // How many units of NDC height one world unit covers at w = 1 is the length of the y row, because the view matrix
+    // is a rigid transform. The sphere (2 * radius) covers radius * sizeScale / w of the viewport (NDC is 2 units high).
+    const glm::mat4 rows = glm::transpose(viewProjection);
+    const float sizeScale = glm::length(glm::vec3(rows[1]));
+    return { rows[3], minScreenSize / sizeScale };
+}
+
+size_t FrustumCuller::add(const glm::vec3& localBoundsMin, const glm::vec3& localBoundsMax, const glm::mat4& modelMatrix)
+{
+    const size_t index = m_count++;
+    const size_t paddedSize = (m_count + simdWidth - 1) / simdWidth * simdWidth;
+    for (std::vector<float>* pArray : { &m_centerX, &m_centerY, &m_centerZ, &m_extentX, &m_extentY, &m_extentZ, &m_radius })
+        pArray->resize(paddedSize, 0.0f);
+    setTransform(index, localBoundsMin, localBoundsMax, modelMatrix);
+    return index;
+}
+
+void FrustumCuller::setTransform(size_t index, const glm::vec3& localBoundsMin, const glm::vec3& localBoundsMax, const glm::mat4& modelMatrix)
+{
+    // World-space box around the transformed local box: the extent along each world axis is the sum of the absolute
+    // projections of the local extents (Arvo).
+    const glm::vec3 localCenter = 0.5f * (localBoundsMin + localBoundsMax);
+    const glm::vec3 localExtent = 0.5f * (localBoundsMax - localBoundsMin);
+    const glm::vec3 center = glm::vec3(modelMatrix * glm::vec4(localCenter, 1.0f));
+    const glm::mat3 linear { modelMatrix };
+    const glm::vec3 extent = glm::abs(linear[0]) * localExtent.x + glm::abs(linear[1]) * localExtent.y + glm::abs(linear[2]) * localExtent.z;
+
+    m_centerX[index] = center.x;
+    m_centerY[index] = center.y;
+    m_centerZ[index] = center.z;
+    m_extentX[index] = extent.x;
+    m_extentY[index] = extent.y;
+    m_extentZ[index] = extent.z;
+    m_radius[index] = glm::length(extent);
+    m_cache.clear();
+}
+
+void FrustumCuller::clear()
+{
+    m_count = 0;
+    for (std::vector<float>* pArray : { &m_centerX, &m_centerY, &m_centerZ, &m_extentX, &m_extentY, &m_extentZ, &m_radius })
+        pArray->clear();
+    m_cache.clear();
+}
+
+void FrustumCuller::beginFrame()
+{
+    m_cache.clear();
+}
+
+const Visibility& FrustumCuller::cull(const glm::mat4& viewProjection, float minScreenSize)
+{
+    for (const CachedView& view : m_cache) {
+        if (view.viewProjection == viewProjection && view.minScreenSize == minScreenSize)
+            return view.visibility;
+    }
+
+    const Frustum frustum = Frustum::fromViewProjection(viewProjection);
+    const ScreenSizeTest sizeTest = ScreenSizeTest::fromViewProjection(viewProjection, minScreenSize);
+
+    Visibility visibility;
+    visibility.visible.resize(m_centerX.size());
+    uint8_t* pOut = visibility.visible.data();
+    const size_t paddedCount = m_centerX.size();
+
+#if defined(FRUSTUM_CULLING_AVX)
+    for (size_t i = 0; i < paddedCount; i += 8) {
+        const __m256 cx = _mm256_loadu_ps(&m_centerX[i]), cy = _mm256_loadu_ps(&m_centerY[i]), cz = _mm256_loadu_ps(&m_centerZ[i]);
+        const __m256 ex = _mm256_loadu_ps(&m_extentX[i]), ey = _mm256_loadu_ps(&m_extentY[i]), ez = _mm256_loadu_ps(&m_extentZ[i]);
+        __m256 inside = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+        for (const glm::vec4& plane : frustum.planes) {
+            // Distance of the center plus the projected half size of the box onto the plane normal.
+            const __m256 distance = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(plane.x), cx), _mm256_mul_ps(_mm256_set1_ps(plane.y), cy)),
+                _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(plane.z), cz), _mm256_set1_ps(plane.w)));
+            const __m256 radius = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(std::abs(plane.x)), ex), _mm256_mul_ps(_mm256_set1_ps(std::abs(plane.y)), ey)),
+                _mm256_mul_ps(_mm256_set1_ps(std::abs(plane.z)), ez));
+            inside = _mm256_and_ps(inside, _mm256_cmp_ps(_mm256_add_ps(distance, radius), _mm256_setzero_ps(), _CMP_GE_OQ));
+        }
+        const __m256 w = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(sizeTest.wRow.x), cx), _mm256_mul_ps(_mm256_set1_ps(sizeTest.wRow.y), cy)),
+            _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(sizeTest.wRow.z), cz), _mm256_set1_ps(sizeTest.wRow.w)));
+        inside = _mm256_and_ps(inside, _mm256_cmp_ps(_mm256_loadu_ps(&m_radius[i]), _mm256_mul_ps(w, _mm256_set1_ps(sizeTest.threshold)), _CMP_GE_OQ));
+        const int mask = _mm256_movemask_ps(inside);
+        for (int lane = 0; lane < 8; lane++)
+            pOut[i + lane] = static_cast<uint8_t>((mask >> lane) & 1);
+    }
+#elif defined(FRUSTUM_CULLING_SSE)
+    for (size_t i = 0; i < paddedCount; i += 4) {
+        const __m128 cx = _mm_loadu_ps(&m_centerX[i]), cy = _mm_loadu_ps(&m_centerY[i]), cz = _mm_loadu_ps(&m_centerZ[i]);
+        const __m128 ex = _mm_loadu_ps(&m_extentX[i]), ey = _mm_loadu_ps(&m_extentY[i]), ez = _mm_loadu_ps(&m_extentZ[i]);
+        __m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+        for (const glm::vec4& plane : frustum.planes) {
+            // Distance of the center plus the projected half size of the box onto the plane normal.
+            const __m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(plane.x), cx), _mm_mul_ps(_mm_set1_ps(plane.y), cy)),
+                _mm_add_ps(_mm_mul_ps(_mm_set1_ps(plane.z), cz), _mm_set1_ps(plane.w)));
+            const __m128 radius = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(std::abs(plane.x)), ex), _mm_mul_ps(_mm_set1_ps(std::abs(plane.y)), ey)),
+                _mm_mul_ps(_mm_set1_ps(std::abs(plane.z)), ez));
+            inside = _mm_and_ps(inside, _mm_cmpge_ps(_mm_add_ps(distance, radius), _mm_setzero_ps()));
+        }
+        const __m128 w = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(sizeTest.wRow.x), cx), _mm_mul_ps(_mm_set1_ps(sizeTest.wRow.y), cy)),
+            _mm_add_ps(_mm_mul_ps(_mm_set1_ps(sizeTest.wRow.z), cz), _mm_set1_ps(sizeTest.wRow.w)));
+        inside = _mm_and_ps(inside, _mm_cmpge_ps(_mm_loadu_ps(&m_radius[i]), _mm_mul_ps(w, _mm_set1_ps(sizeTest.threshold))));
+        const int mask = _mm_movemask_ps(inside);
+        for (size_t lane = 0; lane < 4; lane++)
+            pOut[i + lane] = static_cast<uint8_t>((mask >> static_cast<int>(lane)) & 1);
+    }
+#else
+    for (size_t i = 0; i < paddedCount; i++) {
+        const glm::vec3 center { m_centerX[i], m_centerY[i], m_centerZ[i] };
+        const glm::vec3 extent { m_extentX[i], m_extentY[i], m_extentZ[i] };
+        bool inside = true;
+        for (const glm::vec4& plane : frustum.planes)
+            inside &= glm::dot(glm::vec3(plane), center) + plane.w + glm::dot(glm::abs(glm::vec3(plane)), extent) >= 0.0f;
+        inside &= sizeTest.passes(center, m_radius[i]);
+        pOut[i] = inside ? 1 : 0;
+    }
+#endif
+
+    // Drop the padding.
+    visibility.visible.resize(m_count);
+    visibility.visibleCount = static_cast<uint32_t>(std::count(std::begin(visibility.visible), std::end(visibility.visible), uint8_t(1)));
+    m_cache.push_back({ viewProjection, minScreenSize, std::move(visibility) });
+    return m_cache.back().visibility;
+}
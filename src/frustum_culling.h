@@ -0,0 +1,80 @@
+#pragma once
+
+#include <framework/disable_all_warnings.h>
+DISABLE_WARNINGS_PUSH()
+#include <glm/geometric.hpp>
+#include <glm/mat4x4.hpp>
+#include <glm/vec3.hpp>
+#include <glm/vec4.hpp>
+DISABLE_WARNINGS_POP()
+
+#include <array>
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+// The six planes of a view frustum in world space, extracted from a view-projection matrix (Gribb & Hartmann). Each
+// plane is stored as (normal, distance) with the normal pointing into the frustum and normalized, so
+// dot(plane, vec4(p, 1)) is the signed distance of p to the plane.
+struct Frustum {
+    std::array<glm::vec4, 6> planes; // left, right, bottom, top, near, far
+
+    static Frustum fromViewProjection(const glm::mat4& viewProjection);
+};
+
+// Small object culling: an object passes when its bounding sphere covers at least minScreenSize (a fraction of the
+// viewport height). Uses the w row of the view-projection matrix, so it works for perspective and orthographic
+// projections alike.
+struct ScreenSizeTest {
+    glm::vec4 wRow; // Clip-space w of a world-space point
+    float threshold; // Minimum radius per unit of w
+
+    static ScreenSizeTest fromViewProjection(const glm::mat4& viewProjection, float minScreenSize);
+    bool passes(const glm::vec3& center, float radius) const { return radius >= (glm::dot(glm::vec3(wRow), center) + wRow.w) * threshold; }
+};
+
+// Which objects of a FrustumCuller passed the test for one view; indexed like the objects of the culler.
+struct Visibility {
+    std::vector<uint8_t> visible; // 1 = draw, 0 = culled
+    uint32_t visibleCount { 0 };
+
+    bool operator[](size_t index) const { return visible[index] != 0; }
+};
+
+// World-space bounding boxes of a set of objects, tested against a view frustum in batches of 4 (SSE) or 8 (AVX)
+// objects at a time. The boxes are kept as structure of arrays (one array per component of the centers and extents),
+// so one SIMD register holds the same component of consecutive objects and no shuffling is needed.
+//
+// Objects that fail the ScreenSizeTest are culled too.
+//
+// Results are cached per view: every pass that asks for the same view-projection matrix (and threshold) in the same
+// frame gets the stored Visibility instead of testing all objects again. The cache is cleared by beginFrame() and by
+// any change to the bounds; references returned by cull() stay valid until then.
+class FrustumCuller {
+public:
+    // Returns the index of the object.
+    size_t add(const glm::vec3& localBoundsMin, const glm::vec3& localBoundsMax, const glm::mat4& modelMatrix);
+    void setTransform(size_t index, const glm::vec3& localBoundsMin, const glm::vec3& localBoundsMax, const glm::mat4& modelMatrix);
+    void clear();
+
+    void beginFrame();
+    // minScreenSize is a fraction of the viewport height; 0 disables small object culling.
+    const Visibility& cull(const glm::mat4& viewProjection, float minScreenSize = 0.0f);
+
+    size_t size() const { return m_count; }
+
+private:
+    struct CachedView {
+        glm::mat4 viewProjection;
+        float minScreenSize;
+        Visibility visibility;
+    };
+
+    // Padded to a multiple of the SIMD width with empty boxes; only the first m_count entries are real objects.
+    std::vector<float> m_centerX, m_centerY, m_centerZ;
+    std::vector<float> m_extentX, m_extentY, m_extentZ;
+    std::vector<float> m_radius;
+    size_t m_count { 0 };
+
+    std::deque<CachedView> m_cache; // A deque so that returned references survive later calls to cull().
+};
@@ -0,0 +1,220 @@
+#include "instance_set.h"
+#include <framework/disable_all_warnings.h>
+#include <framework/gl_state.h>
+DISABLE_WARNINGS_PUSH()
+#include <glm/gtc/matrix_inverse.hpp>
+DISABLE_WARNINGS_POP()
+#include <algorithm>
+#include <stdexcept>
+
+static GPUInstance makeInstance(const glm::mat4& modelMatrix, uint32_t materialIndex)
+{
+    // Normals should be transformed differently than positions (ignoring translations + dealing with scaling):
+    // https://paroj.github.io/gltut/Illumination/Tut09%20Normal%20Transformation.html
+    return { modelMatrix, glm::inverseTranspose(glm::mat3(modelMatrix)), materialIndex };
+}
+
+InstanceSet::InstanceSet(const GPUMesh& mesh)
+{
+    if (GLState::directStateAccess()) {
+        // The instance buffer is attached to binding 1 by upload() once it has storage.
+        glCreateVertexArrays(1, &m_vao);
+        mesh.setupVertexAttributes(m_vao);
+        glVertexArrayBindingDivisor(m_vao, instanceBufferBinding, 1);
+        for (GLuint column = 0; column < 4; column++) {
+            const GLuint location = InstanceAttribute::ModelMatrix + column;
+            glEnableVertexArrayAttrib(m_vao, location);
+            glVertexArrayAttribFormat(m_vao, location, 4, GL_FLOAT, GL_FALSE, static_cast<GLuint>(offsetof(GPUInstance, modelMatrix) + column * sizeof(glm::vec4)));
+            glVertexArrayAttribBinding(m_vao, location, instanceBufferBinding);
+        }
+        for (GLuint column = 0; column < 3; column++) {
+            const GLuint location = InstanceAttribute::NormalModelMatrix + column;
+            glEnableVertexArrayAttrib(m_vao, location);
+            glVertexArrayAttribFormat(m_vao, location, 3, GL_FLOAT, GL_FALSE, static_cast<GLuint>(offsetof(GPUInstance, normalModelMatrix) + column * sizeof(glm::vec3)));
+            glVertexArrayAttribBinding(m_vao, location, instanceBufferBinding);
+        }
+        glEnableVertexArrayAttrib(m_vao, InstanceAttribute::MaterialIndex);
+        glVertexArrayAttribIFormat(m_vao, InstanceAttribute::MaterialIndex, 1, GL_UNSIGNED_INT, offsetof(GPUInstance, materialIndex));
+        glVertexArrayAttribBinding(m_vao, InstanceAttribute::MaterialIndex, instanceBufferBinding);
+        return;
+    }
+
+    glGenBuffers(1, &m_instanceBuffer);
+    glGenVertexArrays(1, &m_vao);
+    mesh.setupVertexAttributes(m_vao);
+
+    // Per-instance attributes advance once per instance instead of once per vertex. Matrices take one location per column.
+    GLState::bindBuffer(GL_ARRAY_BUFFER, m_instanceBuffer);
+    for (GLuint column = 0; column < 4; column++) {
+        const GLuint location = InstanceAttribute::ModelMatrix + column;
+        glEnableVertexAttribArray(location);
+        glVertexAttribPointer(location, 4, GL_FLOAT, GL_FALSE, sizeof(GPUInstance), (void*)(offsetof(GPUInstance, modelMatrix) + column * sizeof(glm::vec4)));
+        glVertexAttribDivisor(location, 1);
+    }
+    for (GLuint column = 0; column < 3; column++) {
+        const GLuint location = InstanceAttribute::NormalModelMatrix + column;
+        glEnableVertexAttribArray(location);
+        glVertexAttribPointer(location, 3, GL_FLOAT, GL_FALSE, sizeof(GPUInstance), (void*)(offsetof(GPUInstance, normalModelMatrix) + column * sizeof(glm::vec3)));
+        glVertexAttribDivisor(location, 1);
+    }
+    glEnableVertexAttribArray(InstanceAttribute::MaterialIndex);
+    glVertexAttribIPointer(InstanceAttribute::MaterialIndex, 1, GL_UNSIGNED_INT, sizeof(GPUInstance), (void*)offsetof(GPUInstance, materialIndex));
+    glVertexAttribDivisor(InstanceAttribute::MaterialIndex, 1);
+
+    GLState::bindVertexArray(0);
+}
+
+InstanceSet::InstanceSet(InstanceSet&& other)
+{
+    moveInto(std::move(other));
+}
+
+InstanceSet::~InstanceSet()
+{
+    freeGpuMemory();
+}
+
+InstanceSet& InstanceSet::operator=(InstanceSet&& other)
+{
+    moveInto(std::move(other));
+    return *this;
+}
+
+size_t InstanceSet::add(const glm::mat4& modelMatrix, uint32_t materialIndex)
+{
+    m_instances.push_back(makeInstance(modelMatrix, materialIndex));
+    markDirty(m_instances.size() - 1, m_instances.size());
+    return m_instances.size() - 1;
+}
+
+void InstanceSet::set(size_t index, const glm::mat4& modelMatrix, uint32_t materialIndex)
+{
+    m_instances[index] = makeInstance(modelMatrix, materialIndex);
+    markDirty(index, index + 1);
+}
+
+void InstanceSet::setModelMatrix(size_t index, const glm::mat4& modelMatrix)
+{
+    set(index, modelMatrix, m_instances[index].materialIndex);
+}
+
+void InstanceSet::resize(size_t count)
+{
+    const size_t oldCount = m_instances.size();
+    m_instances.resize(count, makeInstance(glm::mat4(1.0f), 0));
+    if (count > oldCount)
+        markDirty(oldCount, count);
+    m_dirtyEnd = std::min(m_dirtyEnd, count);
+    m_dirtyBegin = std::min(m_dirtyBegin, m_dirtyEnd);
+}
+
+void InstanceSet::clear()
+{
+    resize(0);
+}
+
+void InstanceSet::markDirty(size_t begin, size_t end)
+{
+    if (m_dirtyBegin == m_dirtyEnd) {
+        m_dirtyBegin = begin;
+        m_dirtyEnd = end;
+    } else {
+        m_dirtyBegin = std::min(m_dirtyBegin, begin);
+        m_dirtyEnd = std::max(m_dirtyEnd, end);
+    }
+}
+
+void InstanceSet::upload()
+{
+    if (GLState::directStateAccess()) {
+        if (m_instances.size() > m_capacity) {
+            // Immutable storage cannot grow: replace the buffer and point the VAO at the new one.
+            m_capacity = std::max({ m_instances.size(), 2 * m_capacity, size_t(64) });
+            if (m_instanceBuffer != INVALID)
+                GLState::deleteBuffer(m_instanceBuffer);
+            glCreateBuffers(1, &m_instanceBuffer);
+            glNamedBufferStorage(m_instanceBuffer, static_cast<GLsizeiptr>(m_capacity * sizeof(GPUInstance)), nullptr, GL_DYNAMIC_STORAGE_BIT);
+            glVertexArrayVertexBuffer(m_vao, instanceBufferBinding, m_instanceBuffer, 0, sizeof(GPUInstance));
+            m_dirtyBegin = 0;
+            m_dirtyEnd = m_instances.size();
+        }
+        if (m_dirtyBegin < m_dirtyEnd) {
+            glNamedBufferSubData(m_instanceBuffer, static_cast<GLintptr>(m_dirtyBegin * sizeof(GPUInstance)),
+                static_cast<GLsizeiptr>((m_dirtyEnd - m_dirtyBegin) * sizeof(GPUInstance)), &m_instances[m_dirtyBegin]);
+        }
+        m_dirtyBegin = m_dirtyEnd = 0;
+        return;
+    }
+
+    GLState::bindBuffer(GL_ARRAY_BUFFER, m_instanceBuffer);
+    if (m_instances.size() > m_capacity) {
+        // Reallocating keeps the buffer name, so the attribute pointers in the VAO stay valid.
+        m_capacity = std::max({ m_instances.size(), 2 * m_capacity, size_t(64) });
+        glBufferData(GL_ARRAY_BUFFER, static_cast<GLsizeiptr>(m_capacity * sizeof(GPUInstance)), nullptr, GL_DYNAMIC_DRAW);
+        m_dirtyBegin = 0;
+        m_dirtyEnd = m_instances.size();
+    }
+    if (m_dirtyBegin < m_dirtyEnd) {
+        glBufferSubData(GL_ARRAY_BUFFER, static_cast<GLintptr>(m_dirtyBegin * sizeof(GPUInstance)),
+            static_cast<GLsizeiptr>((m_dirtyEnd - m_dirtyBegin) * sizeof(GPUInstance)), &m_instances[m_dirtyBegin]);
+    }
+    m_dirtyBegin = m_dirtyEnd = 0;
+}
+
+void InstanceSet::moveInto(InstanceSet&& other)
+{
+    freeGpuMemory();
+    m_instances = std::move(other.m_instances);
+    m_dirtyBegin = other.m_dirtyBegin;
+    m_dirtyEnd = other.m_dirtyEnd;
+    m_capacity = other.m_capacity;
+    m_vao = other.m_vao;
+    m_instanceBuffer = other.m_instanceBuffer;
+
+    other.m_instances.clear();
+    other.m_dirtyBegin = other.m_dirtyEnd = other.m_capacity = 0;
+    other.m_vao = INVALID;
+    other.m_instanceBuffer = INVALID;
+}
+
+void InstanceSet::freeGpuMemory()
+{
+    if (m_vao != INVALID)
+        GLState::deleteVertexArray(m_vao);
+    if (m_instanceBuffer != INVALID)
+        GLState::deleteBuffer(m_instanceBuffer);
+}
+
+MaterialTable::MaterialTable()
+{
+    if (GLState::directStateAccess()) {
+        glCreateBuffers(1, &m_ubo);
+        glNamedBufferStorage(m_ubo, GPUMaterialTableLayout::size, nullptr, GL_DYNAMIC_STORAGE_BIT);
+        return;
+    }
+    glGenBuffers(1, &m_ubo);
+    GLState::bindBuffer(GL_UNIFORM_BUFFER, m_ubo);
+    glBufferData(GL_UNIFORM_BUFFER, GPUMaterialTableLayout::size, nullptr, GL_STATIC_DRAW);
+    GLState::bindBuffer(GL_UNIFORM_BUFFER, 0);
+}
+
+MaterialTable::~MaterialTable()
+{
+    GLState::deleteBuffer(m_ubo);
+}
+
+uint32_t MaterialTable::add(const Material& material)
+{
+    if (m_count == maxMaterials)
+        throw std::length_error("MaterialTable is full");
+
+    const GPUMaterial gpuMaterial(material);
+    if (GLState::directStateAccess()) {
+        glNamedBufferSubData(m_ubo, static_cast<GLintptr>(m_count * sizeof(GPUMaterial)), sizeof(GPUMaterial), &gpuMaterial);
+        return m_count++;
+    }
+    GLState::bindBuffer(GL_UNIFORM_BUFFER, m_ubo);
+    glBufferSubData(GL_UNIFORM_BUFFER, static_cast<GLintptr>(m_count * sizeof(GPUMaterial)), sizeof(GPUMaterial), &gpuMaterial);
+    GLState::bindBuffer(GL_UNIFORM_BUFFER, 0);
+    return m_count++;
+}
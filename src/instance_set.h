@@ -0,0 +1,106 @@
+#pragma once
+
+#include "mesh.h"
+#include <framework/disable_all_warnings.h>
+DISABLE_WARNINGS_PUSH()
+#include <glm/mat3x3.hpp>
+#include <glm/mat4x4.hpp>
+DISABLE_WARNINGS_POP()
+
+#include <cstdint>
+#include <vector>
+#include <framework/opengl_includes.h>
+
+// Vertex attribute locations of the per-instance data (see shaders/shader_vert.glsl with INSTANCED).
+namespace InstanceAttribute {
+    constexpr GLuint ModelMatrix = 3; // mat4: locations 3-6
+    constexpr GLuint NormalModelMatrix = 7; // mat3: locations 7-9
+    constexpr GLuint MaterialIndex = 10;
+}
+
+// Per-instance vertex data, tightly packed (vertex attributes have no std140 padding).
+struct GPUInstance {
+    glm::mat4 modelMatrix;
+    glm::mat3 normalModelMatrix;
+    uint32_t materialIndex;
+};
+
+// Copies of one GPUMesh drawn with a single glDrawElementsInstanced. The set owns a buffer with one GPUInstance per
+// instance and its own VAO, which reuses the vertex and index buffers of the mesh; any number of sets can therefore
+// share the geometry of one mesh. The mesh must outlive the set.
+//
+// Changes are collected in a CPU copy and upload() only sends the range between the first and the last modified
+// instance, so moving a handful of instances does not re-upload thousands of others.
+class InstanceSet {
+public:
+    InstanceSet(const GPUMesh& mesh);
+    InstanceSet(const InstanceSet&) = delete;
+    InstanceSet(InstanceSet&&);
+    ~InstanceSet();
+
+    InstanceSet& operator=(const InstanceSet&) = delete;
+    InstanceSet& operator=(InstanceSet&&);
+
+    // Returns the index of the new instance.
+    size_t add(const glm::mat4& modelMatrix, uint32_t materialIndex = 0);
+    void set(size_t index, const glm::mat4& modelMatrix, uint32_t materialIndex);
+    void setModelMatrix(size_t index, const glm::mat4& modelMatrix);
+    // Grows with identity transforms or drops instances from the end.
+    void resize(size_t count);
+    void clear();
+
+    // Upload the modified instances; call after changing the set and before drawing it.
+    void upload();
+
+    size_t size() const { return m_instances.size(); }
+    bool empty() const { return m_instances.empty(); }
+    const glm::mat4& modelMatrix(size_t index) const { return m_instances[index].modelMatrix; }
+    GLuint vao() const { return m_vao; }
+
+private:
+    // DSA only: vertex buffer binding of the instance buffer (binding 0 holds the mesh vertices).
+    static constexpr GLuint instanceBufferBinding = 1;
+
+    void markDirty(size_t begin, size_t end);
+    void moveInto(InstanceSet&&);
+    void freeGpuMemory();
+
+private:
+    static constexpr GLuint INVALID = 0xFFFFFFFF;
+
+    std::vector<GPUInstance> m_instances;
+    // Instances [m_dirtyBegin, m_dirtyEnd) differ from what is on the GPU.
+    size_t m_dirtyBegin { 0 };
+    size_t m_dirtyEnd { 0 };
+    size_t m_capacity { 0 }; // In instances, of m_instanceBuffer.
+
+    GLuint m_vao { INVALID };
+    GLuint m_instanceBuffer { INVALID };
+};
+
+// Array of materials in one uniform buffer, indexed by GPUInstance::materialIndex (MaterialTable block in
+// shaders/material.glsl with INSTANCED).
+class MaterialTable {
+public:
+    // Must match MAX_MATERIALS as injected into the shaders.
+    static constexpr size_t maxMaterials = 64;
+
+    MaterialTable();
+    MaterialTable(const MaterialTable&) = delete;
+    ~MaterialTable();
+
+    MaterialTable& operator=(const MaterialTable&) = delete;
+
+    // Returns the index of the material; throws std::length_error when the table is full.
+    uint32_t add(const Material& material);
+
+    GLuint buffer() const { return m_ubo; }
+
+private:
+    GLuint m_ubo { 0 };
+    uint32_t m_count { 0 };
+};
+
+// The MaterialTable block: an array of the Material struct (whose stride is its std140 size).
+using GPUMaterialTableLayout = gpu_layout::Struct<gpu_layout::Packing::Std140, gpu_layout::Array<GPUMaterialLayout, MaterialTable::maxMaterials>>;
+static_assert(sizeof(GPUMaterial) == gpu_layout::TypeLayout<gpu_layout::Packing::Std140, gpu_layout::Array<GPUMaterialLayout, MaterialTable::maxMaterials>>::stride);
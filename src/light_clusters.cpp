@@ -0,0 +1,310 @@
+#include "light_clusters.h"
+#include <framework/disable_all_warnings.h>
+#include <framework/gl_state.h>
+DISABLE_WARNINGS_PUSH()
+#include <glm/common.hpp>
+#include <glm/matrix.hpp>
+#include <glm/vec4.hpp>
+DISABLE_WARNINGS_POP()
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <limits>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#define LIGHT_CLUSTERS_AVX 1
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define LIGHT_CLUSTERS_SSE 1
+#endif
+
+using namespace shader_literals;
+
+// The candidate arrays are padded to a multiple of this, so the SIMD loops never need a scalar tail.
+static constexpr size_t simdWidth = 8;
+// Center of the padding lights: far enough away to never overlap a froxel (and its square still fits in a float).
+static constexpr float paddingDistance = 1e18f;
+
+static constexpr std::array<GLenum, 3> textureFormats { GL_RGBA32F, GL_RG32UI, GL_R32UI };
+
+LightClusters::LightClusters(unsigned workerThreads)
+    : m_slices(depthSlices)
+    , m_workers(workerThreads)
+{
+    if (GLState::directStateAccess()) {
+        glCreateBuffers(static_cast<GLsizei>(m_buffers.size()), m_buffers.data());
+        glCreateTextures(GL_TEXTURE_BUFFER, static_cast<GLsizei>(m_textures.size()), m_textures.data());
+        for (size_t i = 0; i < m_textures.size(); i++) {
+            // A buffer texture cannot be attached to a buffer without a data store.
+            glNamedBufferData(m_buffers[i], 16, nullptr, GL_STREAM_DRAW);
+            glTextureBuffer(m_textures[i], textureFormats[i], m_buffers[i]);
+        }
+    } else {
+        glGenBuffers(static_cast<GLsizei>(m_buffers.size()), m_buffers.data());
+        glGenTextures(static_cast<GLsizei>(m_textures.size()), m_textures.data());
+        for (size_t i = 0; i < m_textures.size(); i++) {
+            GLState::bindBuffer(GL_TEXTURE_BUFFER, m_buffers[i]);
+            glBufferData(GL_TEXTURE_BUFFER, 16, nullptr, GL_STREAM_DRAW);
+            GLState::bindTexture(0, GL_TEXTURE_BUFFER, m_textures[i]);
+            glTexBuffer(GL_TEXTURE_BUFFER, textureFormats[i], m_buffers[i]);
+        }
+        GLState::bindBuffer(GL_TEXTURE_BUFFER, 0);
+        GLState::bindTexture(0, GL_TEXTURE_BUFFER, 0);
+    }
+}
+
+LightClusters::~LightClusters()
+{
+    for (GLuint texture : m_textures)
+        GLState::deleteTexture(texture);
+    for (GLuint buffer : m_buffers)
+        GLState::deleteBuffer(buffer);
+}
+
+void LightClusters::build(std::span<const PointLight> lights, const glm::mat4& view, const glm::mat4& projection)
+{
+    const auto start = std::chrono::high_resolution_clock::now();
+    updateFroxels(projection);
+
+    m_lightCount = lights.size();
+    for (std::vector<float>* pArray : { &m_lightX, &m_lightY, &m_lightZ, &m_lightRadius })
+        pArray->resize(m_lightCount);
+    m_gpuLights.resize(2 * m_lightCount);
+    for (size_t i = 0; i < m_lightCount; i++) {
+        const glm::vec4 viewPosition = view * glm::vec4(lights[i].position, 1.0f);
+        m_lightX[i] = viewPosition.x;
+        m_lightY[i] = viewPosition.y;
+        m_lightZ[i] = viewPosition.z;
+        m_lightRadius[i] = lights[i].radius;
+        m_gpuLights[2 * i] = glm::vec4(lights[i].position, lights[i].radius);
+        m_gpuLights[2 * i + 1] = glm::vec4(lights[i].color, 0.0f);
+    }
+
+    // Bin the slices on the workers and on this thread.
+    m_nextSlice = 0;
+    m_workers.run([this] { binSlices(); });
+
+    // One list for all slices; the offsets of a slice are relative to the start of its own list.
+    m_lightIndices.clear();
+    m_clusters.resize(clusterCount);
+    m_maxLightsPerCluster = 0;
+    for (int slice = 0; slice < depthSlices; slice++) {
+        const SliceResult& result = m_slices[static_cast<size_t>(slice)];
+        const uint32_t base = static_cast<uint32_t>(m_lightIndices.size());
+        for (size_t tile = 0; tile < result.clusters.size(); tile++) {
+            m_clusters[static_cast<size_t>(slice) * result.clusters.size() + tile] = result.clusters[tile] + glm::uvec2(base, 0);
+            m_maxLightsPerCluster = std::max(m_maxLightsPerCluster, result.clusters[tile].y);
+        }
+        m_lightIndices.insert(std::end(m_lightIndices), std::begin(result.lightIndices), std::end(result.lightIndices));
+    }
+    upload();
+
+    const std::chrono::duration<float, std::milli> buildTime = std::chrono::high_resolution_clock::now() - start;
+    m_buildMs = buildTime.count();
+}
+
+void LightClusters::bind(const Shader& shader) const
+{
+    GLState::bindTexture(lightsTextureUnit, GL_TEXTURE_BUFFER, m_textures[0]);
+    GLState::bindTexture(gridTextureUnit, GL_TEXTURE_BUFFER, m_textures[1]);
+    GLState::bindTexture(indicesTextureUnit, GL_TEXTURE_BUFFER, m_textures[2]);
+    glUniform1i(shader.getUniformLocation("clusterLights"_uniform), static_cast<GLint>(lightsTextureUnit));
+    glUniform1i(shader.getUniformLocation("clusterGrid"_uniform), static_cast<GLint>(gridTextureUnit));
+    glUniform1i(shader.getUniformLocation("clusterLightIndices"_uniform), static_cast<GLint>(indicesTextureUnit));
+    glUniform3i(shader.getUniformLocation("clusterCount"_uniform), tilesX, tilesY, depthSlices);
+    glUniform2f(shader.getUniformLocation("clusterDepth"_uniform), m_near, m_slicesPerLogDepth);
+}
+
+void LightClusters::updateFroxels(const glm::mat4& projection)
+{
+    if (projection == m_projection)
+        return;
+    m_projection = projection;
+
+    const glm::mat4 inverseProjection = glm::inverse(projection);
+    const auto unproject = [&](float x, float y, float z) {
+        const glm::vec4 point = inverseProjection * glm::vec4(x, y, z, 1.0f);
+        return glm::vec3(point) / point.w;
+    };
+    m_near = -unproject(0.0f, 0.0f, -1.0f).z;
+    const float far = -unproject(0.0f, 0.0f, 1.0f).z;
+    m_slicesPerLogDepth = static_cast<float>(depthSlices) / std::log(far / m_near);
+
+    // Where the edges between the tiles cross the near and the far plane. Points between them are found by depth,
+    // which works for both perspective (edges through the eye) and orthographic projections (parallel edges).
+    std::vector<glm::vec3> nearCorners, farCorners;
+    for (int y = 0; y <= tilesY; y++) {
+        for (int x = 0; x <= tilesX; x++) {
+            const float ndcX = -1.0f + 2.0f * static_cast<float>(x) / tilesX, ndcY = -1.0f + 2.0f * static_cast<float>(y) / tilesY;
+            nearCorners.push_back(unproject(ndcX, ndcY, -1.0f));
+            farCorners.push_back(unproject(ndcX, ndcY, 1.0f));
+        }
+    }
+    const auto cornerAtDepth = [&](size_t corner, float depth) {
+        const float nearDepth = -nearCorners[corner].z, farDepth = -farCorners[corner].z;
+        return glm::mix(nearCorners[corner], farCorners[corner], (depth - nearDepth) / (farDepth - nearDepth));
+    };
+
+    m_froxels.resize(clusterCount);
+    for (int slice = 0; slice < depthSlices; slice++) {
+        const float sliceNear = sliceDepth(slice), sliceFar = sliceDepth(slice + 1);
+        for (int y = 0; y < tilesY; y++) {
+            for (int x = 0; x < tilesX; x++) {
+                Froxel& froxel = m_froxels[static_cast<size_t>((slice * tilesY + y) * tilesX + x)];
+                froxel.lower = glm::vec3(std::numeric_limits<float>::max());
+                froxel.upper = glm::vec3(std::numeric_limits<float>::lowest());
+                for (int cornerY : { y, y + 1 }) {
+                    for (int cornerX : { x, x + 1 }) {
+                        const size_t corner = static_cast<size_t>(cornerY * (tilesX + 1) + cornerX);
+                        for (float depth : { sliceNear, sliceFar }) {
+                            const glm::vec3 point = cornerAtDepth(corner, depth);
+                            froxel.lower = glm::min(froxel.lower, point);
+                            froxel.upper = glm::max(froxel.upper, point);
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+float LightClusters::sliceDepth(int slice) const
+{
+    return m_near * std::exp(static_cast<float>(slice) / m_slicesPerLogDepth);
+}
+
+void LightClusters::binSlices()
+{
+    SliceLights sliceLights, rowLights;
+    for (int slice = m_nextSlice++; slice < depthSlices; slice = m_nextSlice++)
+        binSlice(slice, sliceLights, rowLights);
+}
+
+// Calls hit(i) for every sphere of the (padded) structure of arrays that overlaps the box: the squared distance from
+// its center to the box (0 inside it) against its squared radius.
+template <typename Spheres, typename Hit>
+static void forEachOverlap(const Spheres& spheres, const glm::vec3& lower, const glm::vec3& upper, Hit&& hit)
+{
+    const size_t paddedCount = spheres.x.size();
+#if defined(LIGHT_CLUSTERS_AVX)
+    const __m256 lowerX = _mm256_set1_ps(lower.x), lowerY = _mm256_set1_ps(lower.y), lowerZ = _mm256_set1_ps(lower.z);
+    const __m256 upperX = _mm256_set1_ps(upper.x), upperY = _mm256_set1_ps(upper.y), upperZ = _mm256_set1_ps(upper.z);
+    for (size_t i = 0; i < paddedCount; i += 8) {
+        const __m256 x = _mm256_loadu_ps(&spheres.x[i]), y = _mm256_loadu_ps(&spheres.y[i]), z = _mm256_loadu_ps(&spheres.z[i]);
+        const __m256 r = _mm256_loadu_ps(&spheres.radius[i]);
+        const __m256 dx = _mm256_max_ps(_mm256_max_ps(_mm256_sub_ps(lowerX, x), _mm256_sub_ps(x, upperX)), _mm256_setzero_ps());
+        const __m256 dy = _mm256_max_ps(_mm256_max_ps(_mm256_sub_ps(lowerY, y), _mm256_sub_ps(y, upperY)), _mm256_setzero_ps());
+        const __m256 dz = _mm256_max_ps(_mm256_max_ps(_mm256_sub_ps(lowerZ, z), _mm256_sub_ps(z, upperZ)), _mm256_setzero_ps());
+        const __m256 distanceSquared = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)), _mm256_mul_ps(dz, dz));
+        const int mask = _mm256_movemask_ps(_mm256_cmp_ps(distanceSquared, _mm256_mul_ps(r, r), _CMP_LE_OQ));
+        for (int lane = 0; mask >> lane; lane++) {
+            if ((mask >> lane) & 1)
+                hit(i + static_cast<size_t>(lane));
+        }
+    }
+#elif defined(LIGHT_CLUSTERS_SSE)
+    const __m128 lowerX = _mm_set1_ps(lower.x), lowerY = _mm_set1_ps(lower.y), lowerZ = _mm_set1_ps(lower.z);
+    const __m128 upperX = _mm_set1_ps(upper.x), upperY = _mm_set1_ps(upper.y), upperZ = _mm_set1_ps(upper.z);
+    for (size_t i = 0; i < paddedCount; i += 4) {
+        const __m128 x = _mm_loadu_ps(&spheres.x[i]), y = _mm_loadu_ps(&spheres.y[i]), z = _mm_loadu_ps(&spheres.z[i]);
+        const __m128 r = _mm_loadu_ps(&spheres.radius[i]);
+        const __m128 dx = _mm_max_ps(_mm_max_ps(_mm_sub_ps(lowerX, x), _mm_sub_ps(x, upperX)), _mm_setzero_ps());
+        const __m128 dy = _mm_max_ps(_mm_max_ps(_mm_sub_ps(lowerY, y), _mm_sub_ps(y, upperY)), _mm_setzero_ps());
+        const __m128 dz = _mm_max_ps(_mm_max_ps(_mm_sub_ps(lowerZ, z), _mm_sub_ps(z, upperZ)), _mm_setzero_ps());
+        const __m128 distanceSquared = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+        const int mask = _mm_movemask_ps(_mm_cmple_ps(distanceSquared, _mm_mul_ps(r, r)));
+        for (int lane = 0; mask >> lane; lane++) {
+            if ((mask >> lane) & 1)
+                hit(i + static_cast<size_t>(lane));
+        }
+    }
+#else
+    for (size_t i = 0; i < paddedCount; i++) {
+        const glm::vec3 center { spheres.x[i], spheres.y[i], spheres.z[i] };
+        const glm::vec3 outside = glm::max(glm::max(lower - center, center - upper), glm::vec3(0.0f));
+        if (glm::dot(outside, outside) <= spheres.radius[i] * spheres.radius[i])
+            hit(i);
+    }
+#endif
+}
+
+void LightClusters::SliceLights::clear()
+{
+    for (std::vector<float>* pArray : { &x, &y, &z, &radius })
+        pArray->clear();
+    index.clear();
+}
+
+void LightClusters::SliceLights::push(float lightX, float lightY, float lightZ, float lightRadius, uint32_t lightIndex)
+{
+    x.push_back(lightX);
+    y.push_back(lightY);
+    z.push_back(lightZ);
+    radius.push_back(lightRadius);
+    index.push_back(lightIndex);
+}
+
+void LightClusters::SliceLights::pad()
+{
+    const size_t paddedCount = (index.size() + simdWidth - 1) / simdWidth * simdWidth;
+    for (std::vector<float>* pArray : { &x, &y, &z })
+        pArray->resize(paddedCount, paddingDistance);
+    radius.resize(paddedCount, 0.0f);
+}
+
+void LightClusters::binSlice(int slice, SliceLights& sliceLights, SliceLights& rowLights)
+{
+    // Lights that reach the depth range of the slice, then per row of tiles the ones that reach the row, and only
+    // those are tested against the froxels of the row.
+    const float sliceNear = sliceDepth(slice), sliceFar = sliceDepth(slice + 1);
+    sliceLights.clear();
+    for (size_t i = 0; i < m_lightCount; i++) {
+        const float depth = -m_lightZ[i];
+        if (depth + m_lightRadius[i] >= sliceNear && depth - m_lightRadius[i] <= sliceFar)
+            sliceLights.push(m_lightX[i], m_lightY[i], m_lightZ[i], m_lightRadius[i], static_cast<uint32_t>(i));
+    }
+    sliceLights.pad();
+
+    SliceResult& result = m_slices[static_cast<size_t>(slice)];
+    result.lightIndices.clear();
+    for (int y = 0; y < tilesY; y++) {
+        const Froxel* pRow = &m_froxels[static_cast<size_t>((slice * tilesY + y) * tilesX)];
+        glm::vec3 rowLower = pRow[0].lower, rowUpper = pRow[0].upper;
+        for (int x = 1; x < tilesX; x++) {
+            rowLower = glm::min(rowLower, pRow[x].lower);
+            rowUpper = glm::max(rowUpper, pRow[x].upper);
+        }
+        rowLights.clear();
+        forEachOverlap(sliceLights, rowLower, rowUpper, [&](size_t i) {
+            rowLights.push(sliceLights.x[i], sliceLights.y[i], sliceLights.z[i], sliceLights.radius[i], sliceLights.index[i]);
+        });
+        rowLights.pad();
+
+        for (int x = 0; x < tilesX; x++) {
+            const uint32_t offset = static_cast<uint32_t>(result.lightIndices.size());
+            forEachOverlap(rowLights, pRow[x].lower, pRow[x].upper, [&](size_t i) { result.lightIndices.push_back(rowLights.index[i]); });
+            result.clusters[static_cast<size_t>(y * tilesX + x)] = { offset, static_cast<uint32_t>(result.lightIndices.size()) - offset };
+        }
+    }
+}
+
+void LightClusters::upload()
+{
+    // Orphaned every time, because the previous contents may still be in use by the draws of another view. Buffer
+    // textures cannot be empty, so there is always at least one (unused) element.
+    const auto uploadBuffer = [](GLuint buffer, const void* pData, size_t size, size_t elementSize) {
+        const GLsizeiptr byteSize = static_cast<GLsizeiptr>(std::max<size_t>(size, 1) * elementSize);
+        if (GLState::directStateAccess()) {
+            glNamedBufferData(buffer, byteSize, size ? pData : nullptr, GL_STREAM_DRAW);
+        } else {
+            GLState::bindBuffer(GL_TEXTURE_BUFFER, buffer);
+            glBufferData(GL_TEXTURE_BUFFER, byteSize, size ? pData : nullptr, GL_STREAM_DRAW);
+        }
+    };
+    uploadBuffer(m_buffers[0], m_gpuLights.data(), m_gpuLights.size(), sizeof(glm::vec4));
+    uploadBuffer(m_buffers[1], m_clusters.data(), m_clusters.size(), sizeof(glm::uvec2));
+    uploadBuffer(m_buffers[2], m_lightIndices.data(), m_lightIndices.size(), sizeof(uint32_t));
+    if (!GLState::directStateAccess())
+        GLState::bindBuffer(GL_TEXTURE_BUFFER, 0);
+}
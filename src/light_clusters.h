@@ -0,0 +1,111 @@
+#pragma once
+
+#include <framework/disable_all_warnings.h>
+#include <framework/shader.h>
+DISABLE_WARNINGS_PUSH()
+#include <glm/mat4x4.hpp>
+#include <glm/vec2.hpp>
+#include <glm/vec3.hpp>
+#include <glm/vec4.hpp>
+DISABLE_WARNINGS_POP()
+
+#include "worker_pool.h"
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <span>
+#include <vector>
+#include <framework/opengl_includes.h>
+
+// A point light with a finite range; it does not reach anything farther than radius from its position.
+struct PointLight {
+    glm::vec3 position;
+    float radius;
+    glm::vec3 color;
+};
+
+// Clustered forward shading. The view frustum is split into a grid of froxels: tilesX x tilesY tiles in screen space
+// times depthSlices slices along the view direction, spaced exponentially between the near and far plane so that all
+// clusters are roughly cube shaped. build() bins the lights into the clusters their sphere overlaps; the fragment
+// shader (shaders/lights.glsl) then finds its cluster and only loops over the lights in it, so the cost per fragment
+// depends on how many lights reach it and not on how many lights there are.
+//
+// Binning runs on the CPU, one depth slice at a time, on a small pool of worker threads and the calling thread. Per
+// slice, the lights whose depth range overlaps it are gathered as structure of arrays, narrowed down per row of tiles,
+// and every froxel of the row is then tested against 4 (SSE) or 8 (AVX) of them at a time, as the distance between
+// the sphere center and the view-space bounding box of the froxel. The result is uploaded to three buffer textures:
+// the lights, a compact list of light indices, and per cluster the offset and length of its part of that list.
+//
+// Works for orthographic projections too (the minimap bake); the grid is rebuilt for every view.
+class LightClusters {
+public:
+    static constexpr int tilesX = 16, tilesY = 9, depthSlices = 24;
+    static constexpr int clusterCount = tilesX * tilesY * depthSlices;
+    // Texture units used by bind().
+    static constexpr GLuint lightsTextureUnit = 5, gridTextureUnit = 6, indicesTextureUnit = 7;
+
+    explicit LightClusters(unsigned workerThreads);
+    LightClusters(const LightClusters&) = delete;
+    ~LightClusters();
+
+    LightClusters& operator=(const LightClusters&) = delete;
+
+    // Bins the lights for the view and uploads the result.
+    void build(std::span<const PointLight> lights, const glm::mat4& view, const glm::mat4& projection);
+    // Binds the buffer textures and sets the uniforms declared in shaders/lights.glsl.
+    void bind(const Shader& shader) const;
+
+    size_t lightCount() const { return m_lightCount; }
+    size_t lightIndexCount() const { return m_lightIndices.size(); }
+    uint32_t maxLightsPerCluster() const { return m_maxLightsPerCluster; }
+    float buildMs() const { return m_buildMs; }
+
+private:
+    struct Froxel {
+        glm::vec3 lower, upper; // View-space bounds
+    };
+    struct SliceResult {
+        std::vector<uint32_t> lightIndices;
+        std::array<glm::uvec2, tilesX * tilesY> clusters; // Offset into lightIndices and count, per tile
+    };
+    // Lights overlapping the depth range of one slice, as structure of arrays padded to the SIMD width.
+    struct SliceLights {
+        std::vector<float> x, y, z, radius;
+        std::vector<uint32_t> index;
+
+        void clear();
+        void push(float lightX, float lightY, float lightZ, float lightRadius, uint32_t lightIndex);
+        // Pads to the SIMD width with lights that do not overlap anything.
+        void pad();
+    };
+
+    void updateFroxels(const glm::mat4& projection);
+    // View depth of the near side of a slice (depthSlices is the far plane).
+    float sliceDepth(int slice) const;
+    void binSlices();
+    void binSlice(int slice, SliceLights& sliceLights, SliceLights& rowLights);
+    void upload();
+
+private:
+    // Froxel bounds only depend on the projection, so they are kept until it changes.
+    glm::mat4 m_projection { 0.0f };
+    float m_near { 0.0f }, m_slicesPerLogDepth { 0.0f };
+    std::vector<Froxel> m_froxels;
+
+    // View-space lights of the current build.
+    std::vector<float> m_lightX, m_lightY, m_lightZ, m_lightRadius;
+    size_t m_lightCount { 0 };
+    std::vector<SliceResult> m_slices;
+    std::vector<uint32_t> m_lightIndices;
+    std::vector<glm::uvec2> m_clusters;
+    std::vector<glm::vec4> m_gpuLights; // Position and radius, then color, per light
+    uint32_t m_maxLightsPerCluster { 0 };
+    float m_buildMs { 0.0f };
+
+    // Buffer textures of the lights (RGBA32F), the per cluster ranges (RG32UI) and the light indices (R32UI).
+    std::array<GLuint, 3> m_buffers {};
+    std::array<GLuint, 3> m_textures {};
+
+    WorkerPool m_workers;
+    std::atomic<int> m_nextSlice { 0 };
+};
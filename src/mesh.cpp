@@ -1,14 +1,19 @@
 #include "mesh.h"
+#include "instance_set.h"
 #include <framework/disable_all_warnings.h>
+#include <framework/gl_state.h>
 DISABLE_WARNINGS_PUSH()
 #include <fmt/format.h>
 DISABLE_WARNINGS_POP()
+#include <algorithm>
 #include <iostream>
 #include <vector>
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp> // for glm::translate, glm::rotate, etc.
 #include <glm/gtc/type_ptr.hpp>
 
+using namespace shader_literals;
+
 GPUMaterial::GPUMaterial(const Material& material) :
     kd(material.kd),
     ks(material.ks),
@@ -23,26 +28,103 @@ GPUMesh::GPUMesh(const Mesh& cpuMesh)
 
     // Create uniform buffer to store mesh material (https://learnopengl.com/Advanced-OpenGL/Advanced-GLSL)
     GPUMaterial gpuMaterial(cpuMesh.material);
-    glGenBuffers(1, &m_uboMaterial);
-    glBindBuffer(GL_UNIFORM_BUFFER, m_uboMaterial);
-    glBufferData(GL_UNIFORM_BUFFER, sizeof(GPUMaterial), &gpuMaterial, GL_STATIC_READ);
+    if (GLState::directStateAccess()) {
+        glCreateBuffers(1, &m_uboMaterial);
+        glNamedBufferStorage(m_uboMaterial, sizeof(GPUMaterial), &gpuMaterial, 0);
+    } else {
+        glGenBuffers(1, &m_uboMaterial);
+        GLState::bindBuffer(GL_UNIFORM_BUFFER, m_uboMaterial);
+        glBufferData(GL_UNIFORM_BUFFER, sizeof(GPUMaterial), &gpuMaterial, GL_STATIC_READ);
+    }
 
     // Figure out if this mesh has texture coordinates
     m_hasTextureCoords = static_cast<bool>(cpuMesh.material.kdTexture);
+    m_isTransparent = cpuMesh.material.transparency < 1.0f;
+
+    if (!cpuMesh.vertices.empty()) {
+        m_localBoundsMin = m_localBoundsMax = cpuMesh.vertices.front().position;
+        for (const Vertex& vertex : cpuMesh.vertices) {
+            m_localBoundsMin = glm::min(m_localBoundsMin, vertex.position);
+            m_localBoundsMax = glm::max(m_localBoundsMax, vertex.position);
+        }
+    }
+
+    std::vector<glm::vec3> positions;
+    positions.reserve(cpuMesh.vertices.size());
+    for (const Vertex& vertex : cpuMesh.vertices)
+        positions.push_back(vertex.position);
+
+    const GLsizeiptr vertexBytes = static_cast<GLsizeiptr>(cpuMesh.vertices.size() * sizeof(decltype(cpuMesh.vertices)::value_type));
+    const GLsizeiptr positionBytes = static_cast<GLsizeiptr>(positions.size() * sizeof(glm::vec3));
+    const GLsizeiptr indexBytes = static_cast<GLsizeiptr>(cpuMesh.triangles.size() * sizeof(decltype(cpuMesh.triangles)::value_type));
+    if (GLState::directStateAccess()) {
+        // Immutable storage; nothing is bound to create or fill the buffers. The storage of an empty mesh is a single
+        // (uninitialized) byte, as glNamedBufferStorage does not accept a size of 0.
+        const auto createStorage = [](GLuint& buffer, GLsizeiptr size, const void* pData) {
+            glCreateBuffers(1, &buffer);
+            glNamedBufferStorage(buffer, std::max<GLsizeiptr>(size, 1), size ? pData : nullptr, 0);
+        };
+        createStorage(m_vbo, vertexBytes, cpuMesh.vertices.data());
+        createStorage(m_ibo, indexBytes, cpuMesh.triangles.data());
+        createStorage(m_positionVbo, positionBytes, positions.data());
+        glCreateVertexArrays(1, &m_vao);
+        glCreateVertexArrays(1, &m_positionVao);
+        glVertexArrayVertexBuffer(m_positionVao, 0, m_positionVbo, 0, sizeof(glm::vec3));
+        glVertexArrayElementBuffer(m_positionVao, m_ibo);
+        glEnableVertexArrayAttrib(m_positionVao, 0);
+        glVertexArrayAttribBinding(m_positionVao, 0, 0);
+        glVertexArrayAttribFormat(m_positionVao, 0, 3, GL_FLOAT, GL_FALSE, 0);
+    } else {
+        // Create VAO and bind it so subsequent creations of VBO and IBO are bound to this VAO
+        glGenVertexArrays(1, &m_vao);
+        GLState::bindVertexArray(m_vao);
+
+        // Create vertex buffer object (VBO)
+        glGenBuffers(1, &m_vbo);
+        GLState::bindBuffer(GL_ARRAY_BUFFER, m_vbo);
+        glBufferData(GL_ARRAY_BUFFER, vertexBytes, cpuMesh.vertices.data(), GL_STATIC_DRAW);
 
-    // Create VAO and bind it so subsequent creations of VBO and IBO are bound to this VAO
-    glGenVertexArrays(1, &m_vao);
-    glBindVertexArray(m_vao);
+        // Create index buffer object (IBO)
+        glGenBuffers(1, &m_ibo);
+        GLState::bindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_ibo);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, indexBytes, cpuMesh.triangles.data(), GL_STATIC_DRAW);
 
-    // Create vertex buffer object (VBO)
-    glGenBuffers(1, &m_vbo);
-    glBindBuffer(GL_ARRAY_BUFFER, m_vbo);
-    glBufferData(GL_ARRAY_BUFFER, static_cast<GLsizeiptr>(cpuMesh.vertices.size() * sizeof(decltype(cpuMesh.vertices)::value_type)), cpuMesh.vertices.data(), GL_STATIC_DRAW);
+        // Position-only stream with its own VAO, reusing the index buffer.
+        glGenVertexArrays(1, &m_positionVao);
+        GLState::bindVertexArray(m_positionVao);
+        glGenBuffers(1, &m_positionVbo);
+        GLState::bindBuffer(GL_ARRAY_BUFFER, m_positionVbo);
+        glBufferData(GL_ARRAY_BUFFER, positionBytes, positions.data(), GL_STATIC_DRAW);
+        GLState::bindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_ibo);
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(glm::vec3), nullptr);
+    }
 
-    // Create index buffer object (IBO)
-    glGenBuffers(1, &m_ibo);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_ibo);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, static_cast<GLsizeiptr>(cpuMesh.triangles.size() * sizeof(decltype(cpuMesh.triangles)::value_type)), cpuMesh.triangles.data(), GL_STATIC_DRAW);
+    setupVertexAttributes(m_vao);
+
+    // Each triangle has 3 vertices.
+    m_numIndices = static_cast<GLsizei>(3 * cpuMesh.triangles.size());
+}
+
+void GPUMesh::setupVertexAttributes(GLuint vao) const
+{
+    if (GLState::directStateAccess()) {
+        // Vertices are read through buffer binding 0 of the VAO.
+        glVertexArrayVertexBuffer(vao, 0, m_vbo, 0, sizeof(Vertex));
+        glVertexArrayElementBuffer(vao, m_ibo);
+        for (GLuint attribute = 0; attribute < 3; attribute++) {
+            glEnableVertexArrayAttrib(vao, attribute);
+            glVertexArrayAttribBinding(vao, attribute, 0);
+        }
+        glVertexArrayAttribFormat(vao, 0, 3, GL_FLOAT, GL_FALSE, offsetof(Vertex, position));
+        glVertexArrayAttribFormat(vao, 1, 3, GL_FLOAT, GL_FALSE, offsetof(Vertex, normal));
+        glVertexArrayAttribFormat(vao, 2, 2, GL_FLOAT, GL_FALSE, offsetof(Vertex, texCoord));
+        return;
+    }
+
+    GLState::bindVertexArray(vao);
+    GLState::bindBuffer(GL_ARRAY_BUFFER, m_vbo);
+    GLState::bindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_ibo);
 
     // Tell OpenGL that we will be using vertex attributes 0, 1 and 2.
     glEnableVertexAttribArray(0);
@@ -56,9 +138,6 @@ GPUMesh::GPUMesh(const Mesh& cpuMesh)
     glVertexAttribDivisor(0, 0);
     glVertexAttribDivisor(1, 0);
     glVertexAttribDivisor(2, 0);
-
-    // Each triangle has 3 vertices.
-    m_numIndices = static_cast<GLsizei>(3 * cpuMesh.triangles.size());
 }
 
 GPUMesh::GPUMesh(GPUMesh&& other)
@@ -94,15 +173,47 @@ bool GPUMesh::hasTextureCoords() const
     return m_hasTextureCoords;
 }
 
+bool GPUMesh::isTransparent() const
+{
+    return m_isTransparent;
+}
+
+glm::vec3 GPUMesh::localBoundsMin() const
+{
+    return m_localBoundsMin;
+}
+
+glm::vec3 GPUMesh::localBoundsMax() const
+{
+    return m_localBoundsMax;
+}
+
 void GPUMesh::draw(const Shader& drawingShader)
 {
     // Bind material data uniform (we assume that the uniform buffer objects is always called 'Material')
     // Yes, we could define the binding inside the shader itself, but that would break on OpenGL versions below 4.2
-    drawingShader.bindUniformBlock("Material", 0, m_uboMaterial);
-    glUniformMatrix4fv(drawingShader.getUniformLocation("modelMatrix"),1,GL_FALSE, glm::value_ptr(modelMatrix));
-    
+    drawingShader.bindUniformBlock("Material"_uniform, 0, m_uboMaterial);
+    // The model matrix is not set here; it is part of the per-object constants that the caller binds (see object.glsl).
+
     // Draw the mesh's triangles
-    glBindVertexArray(m_vao);
+    GLState::bindVertexArray(m_vao);
+    glDrawElements(GL_TRIANGLES, m_numIndices, GL_UNSIGNED_INT, nullptr);
+}
+
+void GPUMesh::drawInstanced(const Shader& drawingShader, const InstanceSet& instances)
+{
+    if (instances.empty())
+        return;
+    // Instanced shaders normally read the MaterialTable with the per-instance index; bind the mesh's own material
+    // anyway for shaders that do not.
+    drawingShader.bindUniformBlock("Material"_uniform, 0, m_uboMaterial);
+    GLState::bindVertexArray(instances.vao());
+    glDrawElementsInstanced(GL_TRIANGLES, m_numIndices, GL_UNSIGNED_INT, nullptr, static_cast<GLsizei>(instances.size()));
+}
+
+void GPUMesh::drawPositions() const
+{
+    GLState::bindVertexArray(m_positionVao);
     glDrawElements(GL_TRIANGLES, m_numIndices, GL_UNSIGNED_INT, nullptr);
 }
 
@@ -111,9 +222,15 @@ void GPUMesh::moveInto(GPUMesh&& other)
     freeGpuMemory();
     m_numIndices = other.m_numIndices;
     m_hasTextureCoords = other.m_hasTextureCoords;
+    m_isTransparent = other.m_isTransparent;
+    m_localBoundsMin = other.m_localBoundsMin;
+    m_localBoundsMax = other.m_localBoundsMax;
+    modelMatrix = other.modelMatrix;
     m_ibo = other.m_ibo;
     m_vbo = other.m_vbo;
     m_vao = other.m_vao;
+    m_positionVbo = other.m_positionVbo;
+    m_positionVao = other.m_positionVao;
     m_uboMaterial = other.m_uboMaterial;
 
     other.m_numIndices = 0;
@@ -121,19 +238,25 @@ void GPUMesh::moveInto(GPUMesh&& other)
     other.m_ibo = INVALID;
     other.m_vbo = INVALID;
     other.m_vao = INVALID;
+    other.m_positionVbo = INVALID;
+    other.m_positionVao = INVALID;
     other.m_uboMaterial = INVALID;
 }
 
 void GPUMesh::freeGpuMemory()
 {
     if (m_vao != INVALID)
-        glDeleteVertexArrays(1, &m_vao);
+        GLState::deleteVertexArray(m_vao);
     if (m_vbo != INVALID)
-        glDeleteBuffers(1, &m_vbo);
+        GLState::deleteBuffer(m_vbo);
     if (m_ibo != INVALID)
-        glDeleteBuffers(1, &m_ibo);
+        GLState::deleteBuffer(m_ibo);
+    if (m_positionVao != INVALID)
+        GLState::deleteVertexArray(m_positionVao);
+    if (m_positionVbo != INVALID)
+        GLState::deleteBuffer(m_positionVbo);
     if (m_uboMaterial != INVALID)
-        glDeleteBuffers(1, &m_uboMaterial);
+        GLState::deleteBuffer(m_uboMaterial);
 }
 
 void GPUMesh::translate(const glm::vec3& offset) {
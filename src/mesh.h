@@ -1,6 +1,7 @@
 #pragma once
 
 #include <framework/disable_all_warnings.h>
+#include <framework/gpu_layout.h>
 #include <framework/mesh.h>
 #include <framework/shader.h>
 DISABLE_WARNINGS_PUSH()
@@ -25,6 +26,17 @@ struct GPUMaterial {
 	float transparency{ 1.0f };
 };
 
+// The Material block in shaders/material.glsl.
+using GPUMaterialLayout = gpu_layout::Struct<gpu_layout::Packing::Std140, glm::vec3, glm::vec3, float, float>;
+GPU_LAYOUT_CHECK_MEMBER(GPUMaterial, GPUMaterialLayout, 0, kd);
+GPU_LAYOUT_CHECK_MEMBER(GPUMaterial, GPUMaterialLayout, 1, ks);
+GPU_LAYOUT_CHECK_MEMBER(GPUMaterial, GPUMaterialLayout, 2, shininess);
+GPU_LAYOUT_CHECK_MEMBER(GPUMaterial, GPUMaterialLayout, 3, transparency);
+GPU_LAYOUT_CHECK_SIZE(GPUMaterial, GPUMaterialLayout);
+constexpr std::array<std::string_view, GPUMaterialLayout::count> GPUMaterialMemberNames { "kd", "ks", "shininess", "transparency" };
+
+class InstanceSet;
+
 class GPUMesh {
 public:
     GPUMesh(const Mesh& cpuMesh);
@@ -42,9 +54,19 @@ public:
     GPUMesh& operator=(GPUMesh&&);
 
     bool hasTextureCoords() const;
+    bool isTransparent() const;
+    // Axis-aligned bounds of the vertices in model space.
+    glm::vec3 localBoundsMin() const;
+    glm::vec3 localBoundsMax() const;
 
     // Bind VAO and call glDrawElements.
     void draw(const Shader& drawingShader);
+    // Draw one copy of the mesh per instance with glDrawElementsInstanced. The per-instance transform and material
+    // index come from vertex attributes (see InstanceSet), so drawingShader must be built with INSTANCED.
+    void drawInstanced(const Shader& drawingShader, const InstanceSet& instances);
+    // Draw from the position-only vertex stream (attribute 0, tightly packed), for depth-only passes such as the depth
+    // pre-pass and shadow maps: it reads a third of the vertex data. No material is bound.
+    void drawPositions() const;
 
     void translate(const glm::vec3& offset);
     void rotate(float angle, const glm::vec3& axis);
@@ -58,6 +80,10 @@ public:
         glm::mat4 modelMatrix { 1.0f };
 
 private:
+    friend class InstanceSet;
+
+    // Point attributes 0-2 of vao at m_vbo (buffer binding 0 with DSA) and use m_ibo as its index buffer.
+    void setupVertexAttributes(GLuint vao) const;
     void moveInto(GPUMesh&&);
     void freeGpuMemory();
 
@@ -66,9 +92,15 @@ private:
 
     GLsizei m_numIndices { 0 };
     bool m_hasTextureCoords { false };
+    bool m_isTransparent { false };
+    glm::vec3 m_localBoundsMin { 0.0f };
+    glm::vec3 m_localBoundsMax { 0.0f };
     GLuint m_ibo { INVALID };
     GLuint m_vbo { INVALID };
     GLuint m_vao { INVALID };
+    // Copy of just the vertex positions, with a VAO that shares m_ibo.
+    GLuint m_positionVbo { INVALID };
+    GLuint m_positionVao { INVALID };
     GLuint m_uboMaterial { INVALID };
     
 };
@@ -0,0 +1,110 @@
+#include "minimap.h"
+#include <framework/disable_all_warnings.h>
+#include <framework/gl_state.h>
+DISABLE_WARNINGS_PUSH()
+#include <glm/gtc/matrix_transform.hpp>
+#include <glm/geometric.hpp>
+#include <glm/matrix.hpp>
+DISABLE_WARNINGS_POP()
+#include <algorithm>
+
+MinimapCache::MinimapCache(const AABB& worldBounds, GLsizei resolution, GLsizei tileSize)
+    : m_resolution(resolution)
+    , m_tileSize(tileSize)
+    , m_tilesPerSide(static_cast<size_t>(resolution / tileSize))
+    , m_center(worldBounds.center())
+    , m_side(2.0f * std::max(worldBounds.extent().x, worldBounds.extent().z))
+    , m_dirty(m_tilesPerSide * m_tilesPerSide, true)
+{
+    // Looking straight down from just above the scene with -z up, so the map has +x to the right.
+    const float height = worldBounds.upper.y - worldBounds.lower.y;
+    const glm::vec3 eye { m_center.x, worldBounds.upper.y + 1.0f, m_center.z };
+    m_view = glm::lookAt(eye, eye - glm::vec3(0.0f, 1.0f, 0.0f), glm::vec3(0.0f, 0.0f, -1.0f));
+    m_projection = glm::ortho(-0.5f * m_side, 0.5f * m_side, -0.5f * m_side, 0.5f * m_side, 0.5f, height + 2.0f);
+}
+
+void MinimapCache::invalidate(const AABB& worldRegion)
+{
+    for (size_t tile = 0; tile < m_dirty.size(); tile++) {
+        if (tileBounds(tile).overlaps(worldRegion))
+            m_dirty[tile] = true;
+    }
+}
+
+void MinimapCache::invalidateAll()
+{
+    std::fill(std::begin(m_dirty), std::end(m_dirty), true);
+}
+
+size_t MinimapCache::update(const RenderTile& renderTile, size_t maxTiles)
+{
+    size_t renderedTiles = 0;
+    for (size_t tile = 0; tile < m_dirty.size() && renderedTiles < maxTiles; tile++) {
+        if (!m_dirty[tile])
+            continue;
+        if (renderedTiles++ == 0) {
+            GLState::setEnabled(GL_SCISSOR_TEST, true);
+            GLState::setEnabled(GL_DEPTH_TEST, true);
+        }
+
+        const GLint tileX = static_cast<GLint>(tile % m_tilesPerSide), tileY = static_cast<GLint>(tile / m_tilesPerSide);
+        GLState::viewport(tileX * m_tileSize, tileY * m_tileSize, m_tileSize, m_tileSize);
+        glScissor(tileX * m_tileSize, tileY * m_tileSize, m_tileSize, m_tileSize);
+        // glClearBuffer* rather than glClearColor() + glClear() so the global clear color is left alone.
+        constexpr GLfloat black[] { 0.0f, 0.0f, 0.0f, 1.0f };
+        constexpr GLfloat farDepth = 1.0f;
+        glClearBufferfv(GL_COLOR, 0, black);
+        glClearBufferfv(GL_DEPTH, 0, &farDepth);
+
+        // Crop the projection of the whole map to the tile: its part of NDC is stretched to [-1, 1].
+        const float tilesPerSide = static_cast<float>(m_tilesPerSide);
+        const glm::vec2 tileLower = -1.0f + 2.0f * glm::vec2(tileX, tileY) / tilesPerSide;
+        const glm::mat4 crop = glm::scale(glm::translate(glm::mat4(1.0f), glm::vec3(-1.0f - tilesPerSide * tileLower, 0.0f)), glm::vec3(tilesPerSide, tilesPerSide, 1.0f));
+        renderTile(crop * m_projection, m_view);
+        m_dirty[tile] = false;
+    }
+    GLState::setEnabled(GL_SCISSOR_TEST, false);
+    return renderedTiles;
+}
+
+glm::vec2 MinimapCache::mapCoords(const glm::vec3& worldPosition) const
+{
+    const glm::vec4 clip = m_projection * m_view * glm::vec4(worldPosition, 1.0f);
+    return 0.5f * glm::vec2(clip) + 0.5f;
+}
+
+glm::mat3 MinimapCache::viewTransform(const glm::vec3& center, const glm::vec3& forward, const glm::vec2& halfSize) const
+{
+    // Right and forward on the ground plane.
+    const glm::vec3 up = glm::normalize(glm::vec3(forward.x, 0.0f, forward.z));
+    const glm::vec3 right { -up.z, 0.0f, up.x };
+    const glm::vec2 origin = mapCoords(center - halfSize.x * right - halfSize.y * up);
+    const glm::vec2 alongU = mapCoords(center + halfSize.x * right - halfSize.y * up) - origin;
+    const glm::vec2 alongV = mapCoords(center - halfSize.x * right + halfSize.y * up) - origin;
+    return glm::mat3(glm::vec3(alongU, 0.0f), glm::vec3(alongV, 0.0f), glm::vec3(origin, 1.0f));
+}
+
+size_t MinimapCache::dirtyTileCount() const
+{
+    return static_cast<size_t>(std::count(std::begin(m_dirty), std::end(m_dirty), true));
+}
+
+AABB MinimapCache::tileBounds(size_t tile) const
+{
+    // Corners of the tile in NDC (at the near and far plane) back in world space.
+    const glm::mat4 inverseViewProjection = glm::inverse(m_projection * m_view);
+    const float tilesPerSide = static_cast<float>(m_tilesPerSide);
+    const glm::vec2 lower = -1.0f + 2.0f * glm::vec2(static_cast<float>(tile % m_tilesPerSide), static_cast<float>(tile / m_tilesPerSide)) / tilesPerSide;
+    const glm::vec2 upper = lower + 2.0f / tilesPerSide;
+    AABB out;
+    for (float x : { lower.x, upper.x }) {
+        for (float y : { lower.y, upper.y }) {
+            for (float z : { -1.0f, 1.0f }) {
+                const glm::vec4 world = inverseViewProjection * glm::vec4(x, y, z, 1.0f);
+                const glm::vec3 point = glm::vec3(world) / world.w;
+                out.extend(AABB { point, point });
+            }
+        }
+    }
+    return out;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include "bvh.h"
+#include <framework/disable_all_warnings.h>
+DISABLE_WARNINGS_PUSH()
+#include <glm/mat3x3.hpp>
+#include <glm/mat4x4.hpp>
+#include <glm/vec2.hpp>
+#include <glm/vec3.hpp>
+DISABLE_WARNINGS_POP()
+
+#include <functional>
+#include <vector>
+#include <framework/opengl_includes.h>
+
+// Top-down map of the static scene. The scene is rendered once from above into a square texture covering its bounds,
+// one tile (a viewport of the texture) at a time. The texture is the render target of an offscreen pass (see
+// OffscreenPasses), which also rebuilds its mip chain, so the map can be shown at any zoom level without aliasing.
+// Afterwards the minimap only samples the texture through viewTransform(), which scrolls and rotates a window of the
+// map around the player; nothing is rendered per frame.
+//
+// When static content changes, invalidate() marks the tiles it overlaps; update() re-renders a limited number of
+// them per call so that a large change can be spread over a few frames. Moving objects are not baked into the map but
+// drawn on top of it as icons.
+class MinimapCache {
+public:
+    // Draws the static scene with the given (orthographic, top-down) projection and view into the bound framebuffer.
+    using RenderTile = std::function<void(const glm::mat4& projection, const glm::mat4& view)>;
+
+    // resolution is the width and height of the whole map (and its render target) in pixels and a multiple of tileSize.
+    MinimapCache(const AABB& worldBounds, GLsizei resolution, GLsizei tileSize);
+
+    void invalidate(const AABB& worldRegion);
+    void invalidateAll();
+    // Renders up to maxTiles of the invalidated tiles into the bound render target and returns how many were
+    // rendered. Changes the viewport; the scissor test is disabled afterwards.
+    size_t update(const RenderTile& renderTile, size_t maxTiles);
+
+    // Texture coordinates in the map of a world-space position (x and z).
+    glm::vec2 mapCoords(const glm::vec3& worldPosition) const;
+    // Transform from the texture coordinates of a minimap quad (0 to 1) to map coordinates, for a window of
+    // 2 * halfSize world units centered on center with forward pointing up. Affine, so it fits in a mat3.
+    glm::mat3 viewTransform(const glm::vec3& center, const glm::vec3& forward, const glm::vec2& halfSize) const;
+    // Size of one world unit in map coordinates (the map is square).
+    float mapUnitsPerWorldUnit() const { return 1.0f / m_side; }
+
+    GLsizei resolution() const { return m_resolution; }
+    size_t tileCount() const { return m_dirty.size(); }
+    size_t dirtyTileCount() const;
+    bool isComplete() const { return dirtyTileCount() == 0; }
+
+private:
+    AABB tileBounds(size_t tile) const;
+
+private:
+    GLsizei m_resolution, m_tileSize;
+    size_t m_tilesPerSide;
+    glm::vec3 m_center;
+    float m_side; // World units covered by the width (and height) of the map
+    glm::mat4 m_projection, m_view;
+    std::vector<bool> m_dirty; // Per tile, row by row starting at the bottom left of the map
+};
@@ -0,0 +1,164 @@
+#include "multi_draw.h"
+#include <framework/disable_all_warnings.h>
+#include <framework/gl_state.h>
+DISABLE_WARNINGS_PUSH()
+#include <fmt/format.h>
+#include <glm/gtc/matrix_inverse.hpp>
+DISABLE_WARNINGS_POP()
+#include <algorithm>
+#include <numeric>
+#include <stdexcept>
+
+GeometryArena::GeometryArena(size_t maxVertices, size_t maxIndices, size_t maxDraws)
+    : m_maxVertices(maxVertices)
+    , m_maxIndices(maxIndices)
+    , m_maxDraws(maxDraws)
+{
+    // Only used on GL 4.5 contexts, so everything is created with direct state access and immutable storage.
+    glCreateBuffers(1, &m_vbo);
+    glNamedBufferStorage(m_vbo, static_cast<GLsizeiptr>(std::max(maxVertices, size_t(1)) * sizeof(Vertex)), nullptr, GL_DYNAMIC_STORAGE_BIT);
+    glCreateBuffers(1, &m_ibo);
+    glNamedBufferStorage(m_ibo, static_cast<GLsizeiptr>(std::max(maxIndices, size_t(1)) * sizeof(GLuint)), nullptr, GL_DYNAMIC_STORAGE_BIT);
+
+    std::vector<GLuint> drawIds(std::max(maxDraws, size_t(1)));
+    std::iota(std::begin(drawIds), std::end(drawIds), 0u);
+    glCreateBuffers(1, &m_drawIdBuffer);
+    glNamedBufferStorage(m_drawIdBuffer, static_cast<GLsizeiptr>(drawIds.size() * sizeof(GLuint)), drawIds.data(), 0);
+
+    // Binding 0: vertices, binding 1: draw ids (advanced once per instance).
+    glCreateVertexArrays(1, &m_vao);
+    glVertexArrayVertexBuffer(m_vao, 0, m_vbo, 0, sizeof(Vertex));
+    glVertexArrayVertexBuffer(m_vao, 1, m_drawIdBuffer, 0, sizeof(GLuint));
+    glVertexArrayBindingDivisor(m_vao, 1, 1);
+    glVertexArrayElementBuffer(m_vao, m_ibo);
+    for (GLuint attribute = 0; attribute < 3; attribute++) {
+        glEnableVertexArrayAttrib(m_vao, attribute);
+        glVertexArrayAttribBinding(m_vao, attribute, 0);
+    }
+    glVertexArrayAttribFormat(m_vao, 0, 3, GL_FLOAT, GL_FALSE, offsetof(Vertex, position));
+    glVertexArrayAttribFormat(m_vao, 1, 3, GL_FLOAT, GL_FALSE, offsetof(Vertex, normal));
+    glVertexArrayAttribFormat(m_vao, 2, 2, GL_FLOAT, GL_FALSE, offsetof(Vertex, texCoord));
+    glEnableVertexArrayAttrib(m_vao, DRAW_ID_ATTRIBUTE);
+    glVertexArrayAttribIFormat(m_vao, DRAW_ID_ATTRIBUTE, 1, GL_UNSIGNED_INT, 0);
+    glVertexArrayAttribBinding(m_vao, DRAW_ID_ATTRIBUTE, 1);
+}
+
+GeometryArena::~GeometryArena()
+{
+    GLState::deleteVertexArray(m_vao);
+    GLState::deleteBuffer(m_vbo);
+    GLState::deleteBuffer(m_ibo);
+    GLState::deleteBuffer(m_drawIdBuffer);
+}
+
+void GeometryArena::bindStorage() const
+{
+    GLState::bindBufferBase(GL_SHADER_STORAGE_BUFFER, vertexStorageBinding, m_vbo);
+    GLState::bindBufferBase(GL_SHADER_STORAGE_BUFFER, indexStorageBinding, m_ibo);
+}
+
+ArenaMesh GeometryArena::add(const Mesh& mesh)
+{
+    const size_t indexCount = 3 * mesh.triangles.size();
+    if (m_vertexCount + mesh.vertices.size() > m_maxVertices || m_indexCount + indexCount > m_maxIndices)
+        throw std::length_error(fmt::format("GeometryArena is full ({} vertices, {} indices)", m_maxVertices, m_maxIndices));
+
+    ArenaMesh out;
+    out.baseVertex = static_cast<GLint>(m_vertexCount);
+    out.firstIndex = static_cast<GLuint>(m_indexCount);
+    out.indexCount = static_cast<GLuint>(indexCount);
+    out.hasTextureCoords = static_cast<bool>(mesh.material.kdTexture);
+    out.isTransparent = mesh.material.transparency < 1.0f;
+    if (!mesh.vertices.empty()) {
+        out.localBoundsMin = out.localBoundsMax = mesh.vertices.front().position;
+        for (const Vertex& vertex : mesh.vertices) {
+            out.localBoundsMin = glm::min(out.localBoundsMin, vertex.position);
+            out.localBoundsMax = glm::max(out.localBoundsMax, vertex.position);
+        }
+    }
+
+    // Indices stay relative to the mesh; baseVertex offsets them at draw time.
+    glNamedBufferSubData(m_vbo, static_cast<GLintptr>(m_vertexCount * sizeof(Vertex)), static_cast<GLsizeiptr>(mesh.vertices.size() * sizeof(Vertex)), mesh.vertices.data());
+    glNamedBufferSubData(m_ibo, static_cast<GLintptr>(m_indexCount * sizeof(GLuint)), static_cast<GLsizeiptr>(indexCount * sizeof(GLuint)), mesh.triangles.data());
+
+    m_vertexCount += mesh.vertices.size();
+    m_indexCount += indexCount;
+    return out;
+}
+
+MultiDrawBatch::MultiDrawBatch()
+{
+    // Buffers get their (immutable) storage on the first draw, see draw().
+    glCreateBuffers(1, &m_commandBuffer);
+    glCreateBuffers(1, &m_drawDataBuffer);
+}
+
+MultiDrawBatch::~MultiDrawBatch()
+{
+    GLState::deleteBuffer(m_commandBuffer);
+    GLState::deleteBuffer(m_drawDataBuffer);
+}
+
+void MultiDrawBatch::clear()
+{
+    m_commands.clear();
+    m_drawData.clear();
+    m_dirty = true;
+}
+
+void MultiDrawBatch::add(const ArenaMesh& mesh, const glm::mat4& modelMatrix, uint32_t materialIndex)
+{
+    const GLuint drawIndex = static_cast<GLuint>(m_commands.size());
+    m_commands.push_back({ mesh.indexCount, 1, mesh.firstIndex, mesh.baseVertex, drawIndex });
+    // Normals should be transformed differently than positions (ignoring translations + dealing with scaling):
+    // https://paroj.github.io/gltut/Illumination/Tut09%20Normal%20Transformation.html
+    m_drawData.push_back({ modelMatrix, glm::mat3x4(glm::inverseTranspose(glm::mat3(modelMatrix))), materialIndex, mesh.firstIndex, mesh.baseVertex, 0 });
+    m_dirty = true;
+}
+
+void MultiDrawBatch::setDrawEnabled(size_t drawIndex, bool enabled)
+{
+    DrawElementsIndirectCommand& command = m_commands[drawIndex];
+    const GLuint instanceCount = enabled ? 1 : 0;
+    if (command.instanceCount != instanceCount) {
+        command.instanceCount = instanceCount;
+        m_commandsDirty = true;
+    }
+}
+
+void MultiDrawBatch::draw(const GeometryArena& arena)
+{
+    if (m_commands.empty())
+        return;
+    if (m_commands.size() > arena.maxDraws())
+        throw std::length_error(fmt::format("MultiDrawBatch has {} draws but the arena only has {} draw ids", m_commands.size(), arena.maxDraws()));
+
+    if (m_dirty) {
+        if (m_commands.size() > m_capacity) {
+            // Immutable storage cannot grow: replace both buffers.
+            m_capacity = std::max(m_commands.size(), 2 * m_capacity);
+            GLState::deleteBuffer(m_commandBuffer);
+            GLState::deleteBuffer(m_drawDataBuffer);
+            glCreateBuffers(1, &m_commandBuffer);
+            glCreateBuffers(1, &m_drawDataBuffer);
+            glNamedBufferStorage(m_commandBuffer, static_cast<GLsizeiptr>(m_capacity * sizeof(DrawElementsIndirectCommand)), nullptr, GL_DYNAMIC_STORAGE_BIT);
+            glNamedBufferStorage(m_drawDataBuffer, static_cast<GLsizeiptr>(m_capacity * sizeof(GPUDrawData)), nullptr, GL_DYNAMIC_STORAGE_BIT);
+        }
+        glNamedBufferSubData(m_commandBuffer, 0, static_cast<GLsizeiptr>(m_commands.size() * sizeof(DrawElementsIndirectCommand)), m_commands.data());
+        glNamedBufferSubData(m_drawDataBuffer, 0, static_cast<GLsizeiptr>(m_drawData.size() * sizeof(GPUDrawData)), m_drawData.data());
+        m_dirty = m_commandsDirty = false;
+    } else if (m_commandsDirty) {
+        glNamedBufferSubData(m_commandBuffer, 0, static_cast<GLsizeiptr>(m_commands.size() * sizeof(DrawElementsIndirectCommand)), m_commands.data());
+        m_commandsDirty = false;
+    }
+
+    GLState::bindVertexArray(arena.vao());
+    GLState::bindBuffer(GL_DRAW_INDIRECT_BUFFER, m_commandBuffer);
+    GLState::bindBufferBase(GL_SHADER_STORAGE_BUFFER, drawDataBinding, m_drawDataBuffer);
+    glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, nullptr, static_cast<GLsizei>(m_commands.size()), 0);
+}
+
+void MultiDrawBatch::bindDrawData() const
+{
+    GLState::bindBufferBase(GL_SHADER_STORAGE_BUFFER, drawDataBinding, m_drawDataBuffer);
+}
@@ -0,0 +1,138 @@
+#pragma once
+
+#include <framework/disable_all_warnings.h>
+#include <framework/gpu_layout.h>
+#include <framework/mesh.h>
+DISABLE_WARNINGS_PUSH()
+#include <glm/mat3x4.hpp>
+#include <glm/mat4x4.hpp>
+#include <glm/vec3.hpp>
+DISABLE_WARNINGS_POP()
+
+#include <array>
+#include <cstdint>
+#include <string_view>
+#include <vector>
+#include <framework/opengl_includes.h>
+
+// GL 4.5 only: besides glMultiDrawElementsIndirect and shader storage buffers (4.3) everything here is created and
+// filled with direct state access (see GLState::directStateAccess()).
+
+// Vertex attribute that holds the draw index when gl_DrawIDARB is not available (see shaders/mdi_vert.glsl).
+constexpr GLuint DRAW_ID_ATTRIBUTE = 11;
+
+// Location of one mesh inside a GeometryArena.
+struct ArenaMesh {
+    GLint baseVertex { 0 };
+    GLuint firstIndex { 0 };
+    GLuint indexCount { 0 };
+    bool hasTextureCoords { false };
+    bool isTransparent { false };
+    // Axis-aligned bounds of the vertices in model space.
+    glm::vec3 localBoundsMin { 0.0f };
+    glm::vec3 localBoundsMax { 0.0f };
+};
+
+// One vertex buffer and one index buffer that static meshes are appended to, with a single VAO describing both, so
+// that any number of meshes can be drawn without rebinding anything. Meshes cannot be removed.
+//
+// The same buffers can be bound as shader storage, for shaders that fetch vertices themselves instead of through the
+// VAO (the material pass of the visibility buffer, shaders/visibility_shade_frag.glsl).
+//
+// The VAO also contains the draw-id attribute: a buffer with 0, 1, 2, ... read once per instance. Every
+// MultiDrawBatch command sets baseInstance to its own index, so the attribute tells the vertex shader which draw it
+// belongs to even without ARB_shader_draw_parameters (gl_DrawID is core in 4.6 only).
+class GeometryArena {
+public:
+    // Shader storage binding points of bindStorage() (fixed in the shader with layout(binding = ...)).
+    static constexpr GLuint vertexStorageBinding = 1, indexStorageBinding = 2;
+
+    GeometryArena(size_t maxVertices, size_t maxIndices, size_t maxDraws);
+    GeometryArena(const GeometryArena&) = delete;
+    ~GeometryArena();
+
+    GeometryArena& operator=(const GeometryArena&) = delete;
+
+    // Copies the mesh into the arena; throws std::length_error if it does not fit.
+    ArenaMesh add(const Mesh& mesh);
+
+    // Binds the vertices (as tightly packed Vertex structs) and the indices (relative to the baseVertex of their mesh).
+    void bindStorage() const;
+
+    GLuint vao() const { return m_vao; }
+    size_t maxDraws() const { return m_maxDraws; }
+
+private:
+    GLuint m_vao { 0 };
+    GLuint m_vbo { 0 };
+    GLuint m_ibo { 0 };
+    GLuint m_drawIdBuffer { 0 };
+
+    size_t m_maxVertices, m_maxIndices, m_maxDraws;
+    size_t m_vertexCount { 0 };
+    size_t m_indexCount { 0 };
+};
+
+// Per-draw data in the DrawDataBuffer shader storage block of shaders/draw_data.glsl.
+struct GPUDrawData {
+    glm::mat4 modelMatrix;
+    glm::mat3x4 normalModelMatrix; // std430 still stores each column of a mat3 as a vec4.
+    uint32_t materialIndex;
+    // Where the mesh is in the arena, for shaders that fetch its triangles themselves.
+    uint32_t firstIndex;
+    int32_t baseVertex;
+    uint32_t padding;
+};
+using GPUDrawDataLayout = gpu_layout::Struct<gpu_layout::Packing::Std430, glm::mat4, glm::mat3, uint32_t, uint32_t, int32_t>;
+GPU_LAYOUT_CHECK_MEMBER(GPUDrawData, GPUDrawDataLayout, 0, modelMatrix);
+GPU_LAYOUT_CHECK_MEMBER(GPUDrawData, GPUDrawDataLayout, 1, normalModelMatrix);
+GPU_LAYOUT_CHECK_MEMBER(GPUDrawData, GPUDrawDataLayout, 2, materialIndex);
+GPU_LAYOUT_CHECK_MEMBER(GPUDrawData, GPUDrawDataLayout, 3, firstIndex);
+GPU_LAYOUT_CHECK_MEMBER(GPUDrawData, GPUDrawDataLayout, 4, baseVertex);
+static_assert(sizeof(GPUDrawData) == GPUDrawDataLayout::size, "GPUDrawData is the array stride of the draws[] array");
+
+// A list of draws from one GeometryArena that is submitted with a single glMultiDrawElementsIndirect. The indirect
+// commands and the per-draw data (transform, material index) live in GPU buffers that are only re-uploaded when the
+// list changed, so drawing an unchanged batch costs the same regardless of how many meshes it contains.
+class MultiDrawBatch {
+public:
+    // Shader storage binding point of the DrawDataBuffer block (fixed in the shader with layout(binding = ...)).
+    static constexpr GLuint drawDataBinding = 0;
+
+    MultiDrawBatch();
+    MultiDrawBatch(const MultiDrawBatch&) = delete;
+    ~MultiDrawBatch();
+
+    MultiDrawBatch& operator=(const MultiDrawBatch&) = delete;
+
+    void clear();
+    void add(const ArenaMesh& mesh, const glm::mat4& modelMatrix, uint32_t materialIndex);
+    // Disabled draws stay in the batch with an instance count of 0; toggling them only re-uploads the commands.
+    void setDrawEnabled(size_t drawIndex, bool enabled);
+
+    // Binds the arena and the draw data and issues all draws. The shader must already be bound.
+    void draw(const GeometryArena& arena);
+    // Binds the per-draw data of the last draw() on its own, for passes that look draws up by index afterwards.
+    void bindDrawData() const;
+
+    size_t size() const { return m_commands.size(); }
+
+private:
+    // Layout defined by the GL spec for GL_DRAW_INDIRECT_BUFFER.
+    struct DrawElementsIndirectCommand {
+        GLuint count;
+        GLuint instanceCount;
+        GLuint firstIndex;
+        GLint baseVertex;
+        GLuint baseInstance;
+    };
+
+    std::vector<DrawElementsIndirectCommand> m_commands;
+    std::vector<GPUDrawData> m_drawData;
+    bool m_dirty { false };
+    bool m_commandsDirty { false };
+
+    GLuint m_commandBuffer { 0 };
+    GLuint m_drawDataBuffer { 0 };
+    size_t m_capacity { 0 }; // In draws, of both buffers.
+};
@@ -0,0 +1,265 @@
+#include "occlusion_culling.h"
+#include <framework/disable_all_warnings.h>
+DISABLE_WARNINGS_PUSH()
+#include <glm/common.hpp>
+#include <glm/vec4.hpp>
+DISABLE_WARNINGS_POP()
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <limits>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define OCCLUSION_CULLING_SSE 1
+#endif
+
+// Objects are only hidden if they are behind the occluders by at least this much (in [0, 1] depth), so that an
+// occluder does not hide itself when its front face lies exactly on its bounding box.
+static constexpr float depthBias = 1e-5f;
+
+OcclusionCuller::OcclusionCuller(int width, int height, unsigned workerThreads)
+    : m_width(width)
+    , m_height(height)
+    , m_bufferWidth((width + tileWidth - 1) / tileWidth * tileWidth)
+    , m_bufferHeight((height + tileHeight - 1) / tileHeight * tileHeight)
+    , m_tilesX(m_bufferWidth / tileWidth)
+    , m_tilesY(m_bufferHeight / tileHeight)
+    , m_depth(static_cast<size_t>(m_bufferWidth * m_bufferHeight), 1.0f)
+    , m_blockMaxDepth(static_cast<size_t>((m_bufferWidth / blockSize) * (m_bufferHeight / blockSize)), 1.0f)
+    , m_tileBins(static_cast<size_t>(m_tilesX * m_tilesY))
+    , m_workers(workerThreads)
+{
+}
+
+OcclusionCuller::~OcclusionCuller() = default;
+
+void OcclusionCuller::addOccluder(std::span<const glm::vec3> positions, std::span<const glm::uvec3> triangles)
+{
+    const uint32_t firstVertex = static_cast<uint32_t>(m_occluderPositions.size());
+    m_occluderPositions.insert(std::end(m_occluderPositions), std::begin(positions), std::end(positions));
+    for (const glm::uvec3& triangle : triangles)
+        m_occluderTriangles.push_back(triangle + firstVertex);
+}
+
+void OcclusionCuller::clearOccluders()
+{
+    m_occluderPositions.clear();
+    m_occluderTriangles.clear();
+}
+
+void OcclusionCuller::render(const glm::mat4& viewProjection)
+{
+    m_viewProjection = viewProjection;
+
+    // Transform, clip and bin on this thread; it is cheap compared to filling pixels.
+    m_screenTriangles.clear();
+    for (std::vector<uint32_t>& bin : m_tileBins)
+        bin.clear();
+    std::vector<glm::vec4> clipPositions(m_occluderPositions.size());
+    std::transform(std::begin(m_occluderPositions), std::end(m_occluderPositions), std::begin(clipPositions),
+        [&](const glm::vec3& position) { return viewProjection * glm::vec4(position, 1.0f); });
+    for (const glm::uvec3& triangle : m_occluderTriangles) {
+        const std::array<glm::vec4, 3> clip { clipPositions[triangle.x], clipPositions[triangle.y], clipPositions[triangle.z] };
+        // Signed distance to the near plane (z >= -w); the other planes are handled by clamping to the screen.
+        std::array<float, 3> distance;
+        for (size_t i = 0; i < 3; i++)
+            distance[i] = clip[i].z + clip[i].w;
+        if (distance[0] >= 0.0f && distance[1] >= 0.0f && distance[2] >= 0.0f) {
+            addScreenTriangle(clip[0], clip[1], clip[2]);
+            continue;
+        }
+        if (distance[0] < 0.0f && distance[1] < 0.0f && distance[2] < 0.0f)
+            continue;
+
+        // Sutherland-Hodgman against the near plane: a triangle becomes a triangle or a quad.
+        std::array<glm::vec4, 4> polygon;
+        size_t vertexCount = 0;
+        for (size_t i = 0; i < 3; i++) {
+            const size_t next = (i + 1) % 3;
+            if (distance[i] >= 0.0f)
+                polygon[vertexCount++] = clip[i];
+            if ((distance[i] >= 0.0f) != (distance[next] >= 0.0f))
+                polygon[vertexCount++] = glm::mix(clip[i], clip[next], distance[i] / (distance[i] - distance[next]));
+        }
+        for (size_t i = 2; i < vertexCount; i++)
+            addScreenTriangle(polygon[0], polygon[i - 1], polygon[i]);
+    }
+
+    // Rasterize the tiles on the workers and on this thread.
+    m_nextTile = 0;
+    m_workers.run([this] { rasterizeTiles(); });
+}
+
+void OcclusionCuller::addScreenTriangle(const glm::vec4& clip0, const glm::vec4& clip1, const glm::vec4& clip2)
+{
+    ScreenTriangle triangle;
+    const std::array<const glm::vec4*, 3> clip { &clip0, &clip1, &clip2 };
+    for (size_t i = 0; i < 3; i++) {
+        const glm::vec3 ndc = glm::vec3(*clip[i]) / clip[i]->w;
+        triangle.vertices[i] = { (0.5f * ndc.x + 0.5f) * static_cast<float>(m_width), (0.5f * ndc.y + 0.5f) * static_cast<float>(m_height), 0.5f * ndc.z + 0.5f };
+    }
+
+    const glm::vec2 boundsMin = glm::min(glm::min(glm::vec2(triangle.vertices[0]), glm::vec2(triangle.vertices[1])), glm::vec2(triangle.vertices[2]));
+    const glm::vec2 boundsMax = glm::max(glm::max(glm::vec2(triangle.vertices[0]), glm::vec2(triangle.vertices[1])), glm::vec2(triangle.vertices[2]));
+    if (boundsMax.x < 0.0f || boundsMax.y < 0.0f || boundsMin.x >= static_cast<float>(m_width) || boundsMin.y >= static_cast<float>(m_height))
+        return;
+
+    const uint32_t index = static_cast<uint32_t>(m_screenTriangles.size());
+    m_screenTriangles.push_back(triangle);
+    const int tileX0 = std::max(static_cast<int>(boundsMin.x) / tileWidth, 0), tileX1 = std::min(static_cast<int>(boundsMax.x) / tileWidth, m_tilesX - 1);
+    const int tileY0 = std::max(static_cast<int>(boundsMin.y) / tileHeight, 0), tileY1 = std::min(static_cast<int>(boundsMax.y) / tileHeight, m_tilesY - 1);
+    for (int tileY = tileY0; tileY <= tileY1; tileY++) {
+        for (int tileX = tileX0; tileX <= tileX1; tileX++)
+            m_tileBins[static_cast<size_t>(tileY * m_tilesX + tileX)].push_back(index);
+    }
+}
+
+void OcclusionCuller::rasterizeTiles()
+{
+    const int tileCount = m_tilesX * m_tilesY;
+    for (int tile = m_nextTile++; tile < tileCount; tile = m_nextTile++)
+        rasterizeTile(tile);
+}
+
+void OcclusionCuller::rasterizeTile(int tile)
+{
+    const int tileX0 = (tile % m_tilesX) * tileWidth, tileY0 = (tile / m_tilesX) * tileHeight;
+    for (int y = tileY0; y < tileY0 + tileHeight; y++)
+        std::fill_n(&m_depth[static_cast<size_t>(y * m_bufferWidth + tileX0)], tileWidth, 1.0f);
+
+    for (uint32_t triangleIndex : m_tileBins[static_cast<size_t>(tile)]) {
+        glm::vec3 v0 = m_screenTriangles[triangleIndex].vertices[0];
+        glm::vec3 v1 = m_screenTriangles[triangleIndex].vertices[1];
+        glm::vec3 v2 = m_screenTriangles[triangleIndex].vertices[2];
+        // Edge functions E(x, y) = A x + B y + C, positive on the inside when the triangle is counter-clockwise.
+        // Pixels exactly on an edge count as inside, so that there are no holes along edges shared by two triangles.
+        float area = (v1.x - v0.x) * (v2.y - v0.y) - (v1.y - v0.y) * (v2.x - v0.x);
+        if (area == 0.0f)
+            continue;
+        if (area < 0.0f) {
+            std::swap(v1, v2);
+            area = -area;
+        }
+        const std::array<glm::vec3, 3> vertices { v0, v1, v2 };
+        std::array<float, 3> edgeA, edgeB, edgeC;
+        for (size_t i = 0; i < 3; i++) {
+            // Edge opposite to vertex i.
+            const glm::vec3& a = vertices[(i + 1) % 3];
+            const glm::vec3& b = vertices[(i + 2) % 3];
+            edgeA[i] = a.y - b.y;
+            edgeB[i] = b.x - a.x;
+            edgeC[i] = a.x * b.y - a.y * b.x;
+        }
+        // Depth is linear in screen space: z = dzdx x + dzdy y + z0, the edge functions being the barycentrics * area.
+        const float dzdx = (edgeA[0] * v0.z + edgeA[1] * v1.z + edgeA[2] * v2.z) / area;
+        const float dzdy = (edgeB[0] * v0.z + edgeB[1] * v1.z + edgeB[2] * v2.z) / area;
+        const float z0 = (edgeC[0] * v0.z + edgeC[1] * v1.z + edgeC[2] * v2.z) / area;
+
+        // Bounding box within the tile, with x aligned to 4 pixels for SIMD.
+        const int x0 = std::max(static_cast<int>(std::floor(std::min({ v0.x, v1.x, v2.x }))), tileX0) & ~3;
+        const int x1 = std::min(static_cast<int>(std::ceil(std::max({ v0.x, v1.x, v2.x }))), tileX0 + tileWidth);
+        const int y0 = std::max(static_cast<int>(std::floor(std::min({ v0.y, v1.y, v2.y }))), tileY0);
+        const int y1 = std::min(static_cast<int>(std::ceil(std::max({ v0.y, v1.y, v2.y }))), tileY0 + tileHeight);
+
+        for (int y = y0; y < y1; y++) {
+            const float pixelY = static_cast<float>(y) + 0.5f;
+            float* pRow = &m_depth[static_cast<size_t>(y * m_bufferWidth)];
+#if defined(OCCLUSION_CULLING_SSE)
+            const __m128 laneOffsets = _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f);
+            const __m128 zero = _mm_setzero_ps();
+            for (int x = x0; x < x1; x += 4) {
+                const __m128 pixelX = _mm_add_ps(_mm_set1_ps(static_cast<float>(x)), laneOffsets);
+                __m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+                for (size_t i = 0; i < 3; i++) {
+                    const __m128 edge = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(edgeA[i]), pixelX), _mm_set1_ps(edgeB[i] * pixelY + edgeC[i]));
+                    inside = _mm_and_ps(inside, _mm_cmpge_ps(edge, zero));
+                }
+                if (_mm_movemask_ps(inside) == 0)
+                    continue;
+                const __m128 depth = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(dzdx), pixelX), _mm_set1_ps(dzdy * pixelY + z0));
+                const __m128 current = _mm_loadu_ps(pRow + x);
+                const __m128 closest = _mm_min_ps(current, depth);
+                _mm_storeu_ps(pRow + x, _mm_or_ps(_mm_and_ps(inside, closest), _mm_andnot_ps(inside, current)));
+            }
+#else
+            for (int x = x0; x < x1; x++) {
+                const float pixelX = static_cast<float>(x) + 0.5f;
+                bool inside = true;
+                for (size_t i = 0; i < 3; i++)
+                    inside &= edgeA[i] * pixelX + edgeB[i] * pixelY + edgeC[i] >= 0.0f;
+                if (inside)
+                    pRow[x] = std::min(pRow[x], dzdx * pixelX + dzdy * pixelY + z0);
+            }
+#endif
+        }
+    }
+
+    // Coarse level: the farthest depth of every block in this tile.
+    const int blocksPerRow = m_bufferWidth / blockSize;
+    for (int blockY = tileY0 / blockSize; blockY < (tileY0 + tileHeight) / blockSize; blockY++) {
+        for (int blockX = tileX0 / blockSize; blockX < (tileX0 + tileWidth) / blockSize; blockX++) {
+            float maxDepth = 0.0f;
+            for (int y = blockY * blockSize; y < (blockY + 1) * blockSize; y++) {
+                const float* pRow = &m_depth[static_cast<size_t>(y * m_bufferWidth + blockX * blockSize)];
+                maxDepth = std::max(maxDepth, *std::max_element(pRow, pRow + blockSize));
+            }
+            m_blockMaxDepth[static_cast<size_t>(blockY * blocksPerRow + blockX)] = maxDepth;
+        }
+    }
+}
+
+bool OcclusionCuller::isVisible(const AABB& bounds) const
+{
+    // Screen rectangle and nearest depth of the box.
+    glm::vec2 screenMin { std::numeric_limits<float>::max() }, screenMax { std::numeric_limits<float>::lowest() };
+    float nearestDepth = 1.0f;
+    for (int corner = 0; corner < 8; corner++) {
+        const glm::vec3 position { (corner & 1) ? bounds.upper.x : bounds.lower.x, (corner & 2) ? bounds.upper.y : bounds.lower.y, (corner & 4) ? bounds.upper.z : bounds.lower.z };
+        const glm::vec4 clip = m_viewProjection * glm::vec4(position, 1.0f);
+        // Crossing the near plane: the box surrounds the camera or is too close to say.
+        if (clip.z < -clip.w || clip.w <= 0.0f)
+            return true;
+        const glm::vec3 ndc = glm::vec3(clip) / clip.w;
+        const glm::vec2 screen { (0.5f * ndc.x + 0.5f) * static_cast<float>(m_width), (0.5f * ndc.y + 0.5f) * static_cast<float>(m_height) };
+        screenMin = glm::min(screenMin, screen);
+        screenMax = glm::max(screenMax, screen);
+        nearestDepth = std::min(nearestDepth, 0.5f * ndc.z + 0.5f);
+    }
+
+    const int x0 = std::max(static_cast<int>(std::floor(screenMin.x)), 0), x1 = std::min(static_cast<int>(std::ceil(screenMax.x)), m_width);
+    const int y0 = std::max(static_cast<int>(std::floor(screenMin.y)), 0), y1 = std::min(static_cast<int>(std::ceil(screenMax.y)), m_height);
+    if (x0 >= x1 || y0 >= y1)
+        return false;
+
+    // Hidden if everything in the rectangle is nearer than the box. Blocks whose farthest depth is nearer are done
+    // without looking at their pixels.
+    const float threshold = nearestDepth - depthBias;
+    const int blocksPerRow = m_bufferWidth / blockSize;
+    for (int blockY = y0 / blockSize; blockY <= (y1 - 1) / blockSize; blockY++) {
+        for (int blockX = x0 / blockSize; blockX <= (x1 - 1) / blockSize; blockX++) {
+            if (m_blockMaxDepth[static_cast<size_t>(blockY * blocksPerRow + blockX)] < threshold)
+                continue;
+            for (int y = std::max(y0, blockY * blockSize); y < std::min(y1, (blockY + 1) * blockSize); y++) {
+                for (int x = std::max(x0, blockX * blockSize); x < std::min(x1, (blockX + 1) * blockSize); x++) {
+                    if (m_depth[static_cast<size_t>(y * m_bufferWidth + x)] >= threshold)
+                        return true;
+                }
+            }
+        }
+    }
+    return false;
+}
+
+uint32_t OcclusionCuller::cullOccluded(std::span<const AABB> bounds, Visibility& visibility) const
+{
+    uint32_t culledCount = 0;
+    for (size_t i = 0; i < bounds.size(); i++) {
+        if (visibility.visible[i] && !isVisible(bounds[i])) {
+            visibility.visible[i] = 0;
+            culledCount++;
+        }
+    }
+    visibility.visibleCount -= culledCount;
+    return culledCount;
+}
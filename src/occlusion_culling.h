@@ -0,0 +1,83 @@
+#pragma once
+
+#include "bvh.h"
+#include "frustum_culling.h"
+#include "worker_pool.h"
+#include <framework/disable_all_warnings.h>
+DISABLE_WARNINGS_PUSH()
+#include <glm/mat4x4.hpp>
+#include <glm/vec3.hpp>
+DISABLE_WARNINGS_POP()
+
+#include <atomic>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+// CPU occlusion culling. A small set of occluders (large, opaque, simple meshes) is rasterized into a low resolution
+// depth buffer, against which the screen-space bounding rectangles of objects are tested before they are submitted.
+// Nothing is read back from the GPU, so the result is available in the same frame.
+//
+// The depth buffer is split into tiles. Triangles are transformed, clipped against the near plane and binned to the
+// tiles they overlap on the calling thread; the tiles are then rasterized in parallel by a small pool of worker
+// threads (and the calling thread), 4 pixels at a time with SSE when available. Each tile also writes the farthest
+// depth of every 8x8 block, a coarse level of a hierarchical depth buffer, so most tests never look at single pixels.
+//
+// Depth is NDC depth mapped to [0, 1] (0 = near plane). Coverage uses pixel centers, so gaps between occluders that
+// are narrower than a pixel of this buffer can hide objects that are visible in the full resolution image.
+class OcclusionCuller {
+public:
+    OcclusionCuller(int width, int height, unsigned workerThreads);
+    OcclusionCuller(const OcclusionCuller&) = delete;
+    ~OcclusionCuller();
+
+    OcclusionCuller& operator=(const OcclusionCuller&) = delete;
+
+    // Occluder triangles in world space.
+    void addOccluder(std::span<const glm::vec3> positions, std::span<const glm::uvec3> triangles);
+    void clearOccluders();
+
+    // Clear the depth buffer and rasterize all occluders as seen through viewProjection.
+    void render(const glm::mat4& viewProjection);
+
+    // Whether any part of the box may be visible in the view passed to render().
+    bool isVisible(const AABB& bounds) const;
+    // Tests the objects that are still visible and clears the ones that are hidden; visibility is indexed like bounds.
+    // Returns the number of objects that were culled.
+    uint32_t cullOccluded(std::span<const AABB> bounds, Visibility& visibility) const;
+
+    int width() const { return m_width; }
+    int height() const { return m_height; }
+    // Row-major, bufferWidth() floats per row; row 0 is the bottom of the screen.
+    std::span<const float> depthBuffer() const { return m_depth; }
+    int bufferWidth() const { return m_bufferWidth; }
+    size_t rasterizedTriangleCount() const { return m_screenTriangles.size(); }
+
+private:
+    struct ScreenTriangle {
+        glm::vec3 vertices[3]; // Pixels in x and y, depth in z
+    };
+
+    void addScreenTriangle(const glm::vec4& clip0, const glm::vec4& clip1, const glm::vec4& clip2);
+    void rasterizeTiles();
+    void rasterizeTile(int tile);
+
+private:
+    static constexpr int tileWidth = 32, tileHeight = 16;
+    static constexpr int blockSize = 8; // Of the coarse depth level
+
+    int m_width, m_height;
+    int m_bufferWidth, m_bufferHeight; // Rounded up to whole tiles
+    int m_tilesX, m_tilesY;
+    glm::mat4 m_viewProjection { 1.0f };
+    std::vector<float> m_depth;
+    std::vector<float> m_blockMaxDepth; // Farthest depth of every blockSize x blockSize block
+
+    std::vector<glm::vec3> m_occluderPositions;
+    std::vector<glm::uvec3> m_occluderTriangles;
+    std::vector<ScreenTriangle> m_screenTriangles;
+    std::vector<std::vector<uint32_t>> m_tileBins; // Triangles overlapping each tile
+
+    WorkerPool m_workers;
+    std::atomic<int> m_nextTile { 0 };
+};
@@ -0,0 +1,151 @@
+#include "occlusion_queries.h"
+#include <framework/disable_all_warnings.h>
+#include <framework/gl_state.h>
+DISABLE_WARNINGS_PUSH()
+#include <glm/gtc/type_ptr.hpp>
+DISABLE_WARNINGS_POP()
+
+using namespace shader_literals;
+
+// Boxes that reach in front of the near plane (or contain the camera) get their front faces clipped away and their back
+// faces fail the depth test against whatever is behind them, so their query would report them occluded.
+static bool crossesNearPlane(const AABB& bounds, const glm::mat4& viewProjection)
+{
+    for (int corner = 0; corner < 8; corner++) {
+        const glm::vec3 position { (corner & 1) ? bounds.upper.x : bounds.lower.x, (corner & 2) ? bounds.upper.y : bounds.lower.y, (corner & 4) ? bounds.upper.z : bounds.lower.z };
+        const glm::vec4 clip = viewProjection * glm::vec4(position, 1.0f);
+        if (clip.z < -clip.w || clip.w <= 0.0f)
+            return true;
+    }
+    return false;
+}
+
+OcclusionQueries::OcclusionQueries(size_t objectCount)
+    : m_objects(objectCount)
+{
+    for (Object& object : m_objects)
+        glGenQueries(static_cast<GLsizei>(queriesPerObject), object.queries.data());
+    // The box shader generates its vertices, but the core profile still needs a VAO to draw.
+    if (GLState::directStateAccess())
+        glCreateVertexArrays(1, &m_emptyVao);
+    else
+        glGenVertexArrays(1, &m_emptyVao);
+}
+
+OcclusionQueries::~OcclusionQueries()
+{
+    for (Object& object : m_objects)
+        glDeleteQueries(static_cast<GLsizei>(queriesPerObject), object.queries.data());
+    GLState::deleteVertexArray(m_emptyVao);
+}
+
+void OcclusionQueries::collectResults()
+{
+    for (Object& object : m_objects) {
+        // Oldest first; queries finish in order, so stop at the first one that is not done.
+        for (size_t i = 0; i < queriesPerObject; i++) {
+            const size_t slot = (object.nextQuery + i) % queriesPerObject;
+            if (!object.inFlight[slot])
+                continue;
+            GLuint available = GL_FALSE;
+            glGetQueryObjectuiv(object.queries[slot], GL_QUERY_RESULT_AVAILABLE, &available);
+            if (!available)
+                break;
+            GLuint anySamplesPassed = GL_FALSE;
+            glGetQueryObjectuiv(object.queries[slot], GL_QUERY_RESULT, &anySamplesPassed);
+            object.state = anySamplesPassed ? State::Visible : State::Occluded;
+            object.inFlight[slot] = false;
+        }
+    }
+}
+
+void OcclusionQueries::reset()
+{
+    for (Object& object : m_objects) {
+        object.inFlight.fill(false);
+        object.state = State::Pending;
+        object.inFrustum = false;
+    }
+}
+
+const Visibility& OcclusionQueries::filter(const Visibility* pFrustumVisibility)
+{
+    m_visibility.visible.assign(m_objects.size(), 0);
+    m_visibility.visibleCount = 0;
+    m_occludedCount = 0;
+    for (size_t i = 0; i < m_objects.size(); i++) {
+        Object& object = m_objects[i];
+        const bool inFrustum = !pFrustumVisibility || (*pFrustumVisibility)[i];
+        if (inFrustum && !object.inFrustum) {
+            // Just came into view: whatever we knew (or still have in flight) is about another camera position.
+            object.state = State::Pending;
+            object.inFlight.fill(false);
+        }
+        object.inFrustum = inFrustum;
+        if (!inFrustum)
+            continue;
+        if (object.state == State::Occluded) {
+            m_occludedCount++;
+            continue;
+        }
+        m_visibility.visible[i] = 1;
+        m_visibility.visibleCount++;
+    }
+    return m_visibility;
+}
+
+void OcclusionQueries::issueQueries(std::span<const AABB> bounds, const Shader& boxShader, const glm::mat4& viewProjection)
+{
+    boxShader.bind();
+    glUniformMatrix4fv(boxShader.getUniformLocation("viewProjectionMatrix"_uniform), 1, GL_FALSE, glm::value_ptr(viewProjection));
+    const GLint boundsMinLocation = boxShader.getUniformLocation("boundsMin"_uniform);
+    const GLint boundsMaxLocation = boxShader.getUniformLocation("boundsMax"_uniform);
+    GLState::bindVertexArray(m_emptyVao);
+
+    // Test against the scene depth without changing it. LEQUAL because box faces often lie exactly on the surface of
+    // the object itself.
+    glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+    GLState::setEnabled(GL_DEPTH_TEST, true);
+    GLState::depthMask(false);
+    GLState::depthFunc(GL_LEQUAL);
+
+    m_issuedQueryCount = 0;
+    for (size_t i = 0; i < m_objects.size(); i++) {
+        Object& object = m_objects[i];
+        if (!object.inFrustum)
+            continue;
+        if (crossesNearPlane(bounds[i], viewProjection)) {
+            // Treated as visible without a query, like OcclusionCuller does; results still in flight are outdated.
+            object.state = State::Visible;
+            object.inFlight.fill(false);
+            continue;
+        }
+        if (object.state == State::Visible && (i + m_frame) % visibleQueryInterval != 0)
+            continue;
+
+        // Reusing a slot that is still in flight drops its result, which only happens if the GPU is several frames behind.
+        const size_t slot = object.nextQuery;
+        glUniform3fv(boundsMinLocation, 1, glm::value_ptr(bounds[i].lower));
+        glUniform3fv(boundsMaxLocation, 1, glm::value_ptr(bounds[i].upper));
+        glBeginQuery(GL_ANY_SAMPLES_PASSED, object.queries[slot]);
+        glDrawArrays(GL_TRIANGLES, 0, 36);
+        glEndQuery(GL_ANY_SAMPLES_PASSED);
+        object.inFlight[slot] = true;
+        object.nextQuery = static_cast<uint32_t>((slot + 1) % queriesPerObject);
+        m_issuedQueryCount++;
+    }
+
+    glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+    GLState::depthMask(true);
+    GLState::depthFunc(GL_LESS);
+    m_frame++;
+}
+
+GLuint OcclusionQueries::conditionQuery(size_t object) const
+{
+    const Object& data = m_objects[object];
+    if (data.state != State::Pending)
+        return 0;
+    const size_t newest = (data.nextQuery + queriesPerObject - 1) % queriesPerObject;
+    return data.inFlight[newest] ? data.queries[newest] : 0;
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include "bvh.h"
+#include "frustum_culling.h"
+#include <framework/disable_all_warnings.h>
+#include <framework/shader.h>
+DISABLE_WARNINGS_PUSH()
+#include <glm/mat4x4.hpp>
+DISABLE_WARNINGS_POP()
+
+#include <array>
+#include <cstdint>
+#include <span>
+#include <vector>
+#include <framework/opengl_includes.h>
+
+// GPU occlusion culling with hardware occlusion queries (GL_ANY_SAMPLES_PASSED) on the bounding boxes of objects.
+//
+// Results are never waited for: every object has a few queries in flight and collectResults() only reads the ones
+// the GPU has finished, typically from one or two frames ago. Between results the last known state is reused
+// (temporal coherence):
+//   Visible  - drawn normally; the box is queried again every visibleQueryInterval frames.
+//   Occluded - not drawn; the box is queried every frame until it turns visible again.
+//   Pending  - no usable result (new, or just entered the view frustum); drawn inside glBeginConditionalRender on
+//              the newest query, so the GPU still skips it if that query has finished and found nothing.
+// Boxes that cross the near plane (the camera is in or right next to them) are never queried and count as visible.
+//
+// Per frame: collectResults(), filter() the frustum visibility, draw the scene (using conditionQuery() for pending
+// objects) and then issueQueries() while the depth buffer of the scene is still bound.
+class OcclusionQueries {
+public:
+    enum class State : uint8_t {
+        Pending,
+        Visible,
+        Occluded
+    };
+
+    // Queries in flight per object, and how often the boxes of visible objects are checked (staggered per object).
+    static constexpr size_t queriesPerObject = 3;
+    static constexpr uint32_t visibleQueryInterval = 4;
+
+    OcclusionQueries(size_t objectCount);
+    OcclusionQueries(const OcclusionQueries&) = delete;
+    ~OcclusionQueries();
+
+    OcclusionQueries& operator=(const OcclusionQueries&) = delete;
+
+    void collectResults();
+    // Forget all results and queries in flight (e.g. after not being used for a while).
+    void reset();
+    // Removes the objects that are known to be occluded from the frustum visibility (nullptr = all in the frustum).
+    // The returned reference stays valid until the next call.
+    const Visibility& filter(const Visibility* pFrustumVisibility);
+    // Draws the bounding boxes of the objects that need a new query (among those passed to filter()). Requires
+    // shaders/bounding_box_vert.glsl; color and depth writes are disabled while drawing.
+    void issueQueries(std::span<const AABB> bounds, const Shader& boxShader, const glm::mat4& viewProjection);
+
+    State state(size_t object) const { return m_objects[object].state; }
+    // Query to make the draw of a pending object conditional on; 0 if the object is not pending or has no query yet.
+    GLuint conditionQuery(size_t object) const;
+
+    uint32_t occludedCount() const { return m_occludedCount; }
+    uint32_t issuedQueryCount() const { return m_issuedQueryCount; }
+
+private:
+    struct Object {
+        std::array<GLuint, queriesPerObject> queries;
+        std::array<bool, queriesPerObject> inFlight {};
+        uint32_t nextQuery { 0 }; // Slot that is used for the next query; slots are used round robin
+        State state { State::Pending };
+        bool inFrustum { false }; // During the previous filter()
+    };
+
+    std::vector<Object> m_objects;
+    Visibility m_visibility;
+    GLuint m_emptyVao { 0 };
+    uint32_t m_frame { 0 };
+    uint32_t m_occludedCount { 0 };
+    uint32_t m_issuedQueryCount { 0 };
+};
@@ -0,0 +1,186 @@
+#include "offscreen_passes.h"
+#include <framework/disable_all_warnings.h>
+#include <framework/gl_state.h>
+DISABLE_WARNINGS_PUSH()
+#include <glm/common.hpp>
+DISABLE_WARNINGS_POP()
+#include <algorithm>
+#include <array>
+#include <cmath>
+
+// Upper limit on the steps of one incremental pass per frame, for passes that have no measurement yet.
+static constexpr uint32_t maxStepsPerFrame = 32;
+
+OffscreenPasses::OffscreenPasses(RenderTargetPool& pool, float budgetMs)
+    : m_pool(pool)
+    , m_budgetMs(budgetMs)
+{
+}
+
+OffscreenPasses::~OffscreenPasses()
+{
+    for (const PendingQuery& pending : m_pendingQueries)
+        m_freeQueries.push_back(pending.query);
+    glDeleteQueries(static_cast<GLsizei>(m_freeQueries.size()), m_freeQueries.data());
+    for (const Pass& pass : m_passes) {
+        if (pass.pTarget)
+            m_pool.release(*pass.pTarget);
+    }
+}
+
+OffscreenPasses::PassId OffscreenPasses::add(OffscreenPassDesc desc)
+{
+    m_passes.push_back({ std::move(desc) });
+    return static_cast<PassId>(m_passes.size() - 1);
+}
+
+void OffscreenPasses::markChanged(PassId pass)
+{
+    m_passes[pass].changed = true;
+}
+
+void OffscreenPasses::setEnabled(PassId pass, bool enabled)
+{
+    m_passes[pass].enabled = enabled;
+}
+
+void OffscreenPasses::execute(const glm::ivec2& windowSize)
+{
+    collectTimings();
+    std::array<GLint, 4> previousViewport;
+    glGetIntegerv(GL_VIEWPORT, previousViewport.data());
+
+    std::vector<PassId> due;
+    for (PassId passId = 0; passId < m_passes.size(); passId++) {
+        Pass& pass = m_passes[passId];
+        pass.updatesLastFrame = 0;
+        if (!pass.enabled)
+            continue;
+        if (pass.desc.persistent) {
+            const RenderTargetDesc targetDesc { targetSize(pass, windowSize), pass.desc.colorFormat, pass.desc.depthFormat, pass.desc.mipmapped };
+            if (!pass.pTarget || pass.pTarget->desc() != targetDesc) {
+                // New or resized; whatever was in the old target has to be rendered again.
+                if (pass.pTarget)
+                    m_pool.release(*pass.pTarget);
+                pass.pTarget = &m_pool.acquire(targetDesc);
+                pass.changed = true;
+            }
+        }
+        if (isDue(pass))
+            due.push_back(passId);
+    }
+    // Passes that must run every frame first, then by priority, then the ones that waited longest.
+    std::stable_sort(std::begin(due), std::end(due), [&](PassId lhsId, PassId rhsId) {
+        const Pass &lhs = m_passes[lhsId], &rhs = m_passes[rhsId];
+        const bool lhsEveryFrame = lhs.desc.rate == UpdateRate::EveryFrame, rhsEveryFrame = rhs.desc.rate == UpdateRate::EveryFrame;
+        if (lhsEveryFrame != rhsEveryFrame)
+            return lhsEveryFrame;
+        if (lhs.desc.priority != rhs.desc.priority)
+            return lhs.desc.priority > rhs.desc.priority;
+        return m_frame - lhs.lastUpdateFrame > m_frame - rhs.lastUpdateFrame;
+    });
+
+    float spentMs = 0.0f;
+    bool optionalPassRan = false;
+    for (PassId passId : due) {
+        Pass& pass = m_passes[passId];
+        const bool everyFrame = pass.desc.rate == UpdateRate::EveryFrame;
+        for (uint32_t step = 0; step < maxStepsPerFrame; step++) {
+            const bool forced = step == 0 && (everyFrame || !optionalPassRan);
+            if (!forced && spentMs + pass.estimatedMs > m_budgetMs)
+                break;
+            if (pass.desc.persistent) {
+                run(passId, *pass.pTarget);
+            } else {
+                RenderTarget& target = m_pool.acquire({ targetSize(pass, windowSize), pass.desc.colorFormat, pass.desc.depthFormat, pass.desc.mipmapped });
+                run(passId, target);
+                m_pool.release(target);
+            }
+            spentMs += pass.estimatedMs;
+            optionalPassRan |= !everyFrame;
+            if (!pass.hasMoreWork)
+                break;
+        }
+    }
+
+    GLState::bindFramebuffer(GL_FRAMEBUFFER, 0);
+    GLState::viewport(previousViewport[0], previousViewport[1], previousViewport[2], previousViewport[3]);
+    m_estimatedMsLastFrame = spentMs;
+    m_frame++;
+}
+
+OffscreenPasses::PassStats OffscreenPasses::stats(PassId passId) const
+{
+    const Pass& pass = m_passes[passId];
+    const glm::ivec2 size = pass.pTarget ? pass.pTarget->desc().size : pass.desc.fixedSize;
+    return { pass.desc.name, size, pass.estimatedMs, pass.updatedOnce ? m_frame - pass.lastUpdateFrame : m_frame, pass.updatesLastFrame };
+}
+
+glm::ivec2 OffscreenPasses::targetSize(const Pass& pass, const glm::ivec2& windowSize) const
+{
+    if (pass.desc.fixedSize != glm::ivec2(0))
+        return pass.desc.fixedSize;
+    return glm::max(glm::ivec2(glm::round(glm::vec2(windowSize) * pass.desc.resolutionScale)), glm::ivec2(1));
+}
+
+bool OffscreenPasses::isDue(const Pass& pass) const
+{
+    if (pass.changed || pass.hasMoreWork || !pass.updatedOnce)
+        return true;
+    switch (pass.desc.rate) {
+        case UpdateRate::EveryFrame:
+            return true;
+        case UpdateRate::EveryNFrames:
+            return m_frame - pass.lastUpdateFrame >= pass.desc.interval;
+        case UpdateRate::OnChange:
+            return false;
+    }
+    return false;
+}
+
+void OffscreenPasses::run(PassId passId, RenderTarget& target)
+{
+    Pass& pass = m_passes[passId];
+    GLuint query;
+    if (m_freeQueries.empty()) {
+        glGenQueries(1, &query);
+    } else {
+        query = m_freeQueries.back();
+        m_freeQueries.pop_back();
+    }
+
+    glBeginQuery(GL_TIME_ELAPSED, query);
+    target.bind();
+    // Cleared before rendering, so that a change made while the pass runs triggers another update.
+    pass.changed = false;
+    pass.hasMoreWork = pass.desc.render(target);
+    target.generateMipmaps();
+    glEndQuery(GL_TIME_ELAPSED);
+    m_pendingQueries.push_back({ query, passId });
+
+    pass.lastUpdateFrame = m_frame;
+    pass.updatedOnce = true;
+    pass.updatesLastFrame++;
+}
+
+void OffscreenPasses::collectTimings()
+{
+    // Queries finish in order, so stop at the first one that is not done.
+    size_t collected = 0;
+    for (; collected < m_pendingQueries.size(); collected++) {
+        const PendingQuery& pending = m_pendingQueries[collected];
+        GLuint available = GL_FALSE;
+        glGetQueryObjectuiv(pending.query, GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available)
+            break;
+        GLuint64 nanoseconds = 0;
+        glGetQueryObjectui64v(pending.query, GL_QUERY_RESULT, &nanoseconds);
+        const float ms = static_cast<float>(nanoseconds) * 1e-6f;
+        Pass& pass = m_passes[pending.pass];
+        // Smoothed, because a single update can be delayed by unrelated work on the GPU.
+        pass.estimatedMs = pass.measured ? 0.8f * pass.estimatedMs + 0.2f * ms : ms;
+        pass.measured = true;
+        m_freeQueries.push_back(pending.query);
+    }
+    m_pendingQueries.erase(std::begin(m_pendingQueries), std::begin(m_pendingQueries) + static_cast<std::ptrdiff_t>(collected));
+}
@@ -0,0 +1,116 @@
+#pragma once
+
+#include "render_target_pool.h"
+#include <framework/disable_all_warnings.h>
+DISABLE_WARNINGS_PUSH()
+#include <glm/vec2.hpp>
+DISABLE_WARNINGS_POP()
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+#include <framework/opengl_includes.h>
+
+enum class UpdateRate {
+    EveryFrame,
+    EveryNFrames, // OffscreenPassDesc::interval
+    OnChange // After OffscreenPasses::markChanged(), and while the pass reports that it has more work
+};
+
+struct OffscreenPassDesc {
+    std::string name;
+
+    // Size of the target: the window size times resolutionScale, or fixedSize when that is set. Targets that follow
+    // the window are reallocated (and the pass updated) when it is resized.
+    float resolutionScale { 1.0f };
+    glm::ivec2 fixedSize { 0 };
+    GLenum colorFormat { GL_RGBA8 };
+    GLenum depthFormat { GL_DEPTH_COMPONENT24 };
+    bool mipmapped { false }; // Mips are rebuilt after every update
+
+    UpdateRate rate { UpdateRate::EveryFrame };
+    uint32_t interval { 1 };
+    int priority { 0 }; // Higher goes first when the budget does not allow all passes
+    // Persistent passes keep their target, because the result is sampled later (minimap, shadow maps). Otherwise the
+    // target is only held while the pass runs and can be shared with other such passes of the same size and format.
+    bool persistent { true };
+
+    // Renders into the target, which is bound with a viewport covering all of it. Return true when there is more
+    // work left (an incremental pass); the pass is then run again while the budget lasts, and in later frames.
+    std::function<bool(RenderTarget&)> render;
+};
+
+// Schedules the offscreen passes of a frame. Passes that update every frame always run; the others run when they are
+// due, highest priority (and then longest waiting) first, until the estimated GPU time of the passes run this frame
+// reaches the budget. The GPU time of every update is measured with timer queries, which are read a few frames later
+// without waiting; passes without a measurement yet are assumed to be free. At least one pass that is due runs every
+// frame, so a pass that is more expensive than the whole budget still gets updated, and everything else catches up
+// in the following frames.
+class OffscreenPasses {
+public:
+    using PassId = uint32_t;
+
+    OffscreenPasses(RenderTargetPool& pool, float budgetMs);
+    OffscreenPasses(const OffscreenPasses&) = delete;
+    ~OffscreenPasses();
+
+    OffscreenPasses& operator=(const OffscreenPasses&) = delete;
+
+    PassId add(OffscreenPassDesc desc);
+    void markChanged(PassId pass);
+    // Disabled passes are not run (and do not count as waiting); they keep their target.
+    void setEnabled(PassId pass, bool enabled);
+    // Result of a persistent pass; nullptr before its first update.
+    const RenderTarget* target(PassId pass) const { return m_passes[pass].pTarget; }
+
+    // Runs the passes that are due this frame; framebuffer 0 and the viewport are restored afterwards.
+    void execute(const glm::ivec2& windowSize);
+
+    float budgetMs() const { return m_budgetMs; }
+    void setBudgetMs(float budgetMs) { m_budgetMs = budgetMs; }
+
+    struct PassStats {
+        const std::string& name;
+        glm::ivec2 size;
+        float estimatedMs; // GPU time of one update (one step of an incremental pass)
+        uint32_t framesSinceUpdate;
+        uint32_t updatesLastFrame;
+    };
+    size_t passCount() const { return m_passes.size(); }
+    PassStats stats(PassId pass) const;
+    float estimatedMsLastFrame() const { return m_estimatedMsLastFrame; }
+
+private:
+    struct Pass {
+        OffscreenPassDesc desc;
+        RenderTarget* pTarget { nullptr }; // Persistent passes only
+        bool enabled { true };
+        bool changed { true };
+        bool hasMoreWork { false };
+        uint32_t lastUpdateFrame { 0 };
+        bool updatedOnce { false };
+        uint32_t updatesLastFrame { 0 };
+        float estimatedMs { 0.0f };
+        bool measured { false };
+    };
+    struct PendingQuery {
+        GLuint query;
+        PassId pass;
+    };
+
+    glm::ivec2 targetSize(const Pass& pass, const glm::ivec2& windowSize) const;
+    bool isDue(const Pass& pass) const;
+    void run(PassId passId, RenderTarget& target);
+    void collectTimings();
+
+private:
+    RenderTargetPool& m_pool;
+    float m_budgetMs;
+    std::vector<Pass> m_passes;
+    uint32_t m_frame { 0 };
+    float m_estimatedMsLastFrame { 0.0f };
+
+    std::vector<GLuint> m_freeQueries;
+    std::vector<PendingQuery> m_pendingQueries; // Oldest first
+};
@@ -0,0 +1,252 @@
+#include "potentially_visible_set.h"
+#include <framework/disable_all_warnings.h>
+DISABLE_WARNINGS_PUSH()
+#include <fmt/format.h>
+#include <glm/common.hpp>
+#include <glm/geometric.hpp>
+#include <glm/gtc/constants.hpp>
+#include <glm/vector_relational.hpp>
+DISABLE_WARNINGS_POP()
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <thread>
+
+static constexpr std::array<char, 4> fileMagic { 'P', 'V', 'S', '1' };
+
+// Distance to the nearest front-facing triangle of the object before ray.t (Moller-Trumbore). Triangles are front
+// facing when they are counter-clockwise as seen from the ray origin.
+static std::optional<float> intersectFrontFaces(const PotentiallyVisibleSet::BakeObject& object, const Ray& ray)
+{
+    std::optional<float> nearest;
+    float tMax = ray.t;
+    for (const glm::uvec3& triangle : object.triangles) {
+        const glm::vec3 v0 = object.positions[triangle.x];
+        const glm::vec3 edge1 = object.positions[triangle.y] - v0;
+        const glm::vec3 edge2 = object.positions[triangle.z] - v0;
+        const glm::vec3 p = glm::cross(ray.direction, edge2);
+        const float determinant = glm::dot(edge1, p);
+        if (determinant <= 1e-8f)
+            continue; // Back facing or parallel
+        const glm::vec3 s = ray.origin - v0;
+        const float u = glm::dot(s, p) / determinant;
+        if (u < 0.0f || u > 1.0f)
+            continue;
+        const glm::vec3 q = glm::cross(s, edge1);
+        const float v = glm::dot(ray.direction, q) / determinant;
+        if (v < 0.0f || u + v > 1.0f)
+            continue;
+        const float t = glm::dot(edge2, q) / determinant;
+        if (t > 0.0f && t <= tMax) {
+            tMax = t;
+            nearest = t;
+        }
+    }
+    return nearest;
+}
+
+PotentiallyVisibleSet PotentiallyVisibleSet::bake(const AABB& region, std::span<const BakeObject> objects, const BakeSettings& settings)
+{
+    PotentiallyVisibleSet out;
+    out.m_region = region;
+    const glm::vec3 regionSize = region.upper - region.lower;
+    out.m_cellCounts = glm::max(glm::uvec3(glm::ceil(regionSize / settings.cellSize)), glm::uvec3(1));
+    out.m_cellSize = regionSize / glm::vec3(out.m_cellCounts);
+    out.m_objectCount = static_cast<uint32_t>(objects.size());
+    out.m_wordsPerCell = (objects.size() + 63) / 64;
+    out.m_bits.assign(out.cellCount() * out.m_wordsPerCell, 0);
+
+    std::vector<AABB> objectBounds;
+    for (const BakeObject& object : objects)
+        objectBounds.push_back(object.bounds);
+    out.m_boundsHash = hashBounds(objectBounds);
+    BoundingVolumeHierarchy bvh;
+    bvh.build(objectBounds);
+
+    // Cells are independent and only write their own words, so they are simply handed out to the threads. Every cell
+    // gets its own random sequence, which keeps the result the same for any number of threads.
+    std::atomic<uint32_t> nextCell { 0 };
+    auto bakeCells = [&]() {
+        std::vector<BoundingVolumeHierarchy::ObjectId> overlapping;
+        for (uint32_t cell = nextCell++; cell < out.cellCount(); cell = nextCell++) {
+            uint64_t* pCellBits = &out.m_bits[cell * out.m_wordsPerCell];
+            auto markVisible = [&](uint32_t object) { pCellBits[object / 64] |= uint64_t(1) << (object % 64); };
+
+            // The camera can be right next to (or inside the bounds of) these, where few rays would hit them.
+            const AABB bounds = out.cellBounds(cell);
+            overlapping.clear();
+            bvh.queryOverlap(bounds, overlapping);
+            for (BoundingVolumeHierarchy::ObjectId object : overlapping)
+                markVisible(object);
+
+            std::mt19937 random { settings.seed * 0x9E3779B9u + cell };
+            std::uniform_real_distribution<float> unit { 0.0f, 1.0f };
+            for (uint32_t sample = 0; sample < settings.samplesPerCell; sample++) {
+                const glm::vec3 origin = bounds.lower + glm::vec3(unit(random), unit(random), unit(random)) * (bounds.upper - bounds.lower);
+                // Spherical Fibonacci directions, shifted and rotated randomly per sample so that the samples of a
+                // cell do not all miss the same gaps.
+                const float offset = unit(random), rotation = unit(random) * glm::two_pi<float>();
+                for (uint32_t i = 0; i < settings.raysPerSample; i++) {
+                    const float z = 1.0f - 2.0f * (static_cast<float>(i) + offset) / static_cast<float>(settings.raysPerSample);
+                    const float r = std::sqrt(std::max(0.0f, 1.0f - z * z));
+                    const float phi = static_cast<float>(i) * glm::golden_ratio<float>() * glm::two_pi<float>() + rotation;
+                    Ray ray { origin, glm::vec3(r * std::cos(phi), r * std::sin(phi), z) };
+                    const std::optional<BoundingVolumeHierarchy::ObjectId> hit = bvh.raycast(ray, [&](BoundingVolumeHierarchy::ObjectId id, const Ray& objectRay) {
+                        return intersectFrontFaces(objects[id], objectRay);
+                    });
+                    if (hit)
+                        markVisible(*hit);
+                }
+            }
+        }
+    };
+    const unsigned threadCount = settings.workerThreads ? settings.workerThreads : std::max(std::thread::hardware_concurrency(), 1u);
+    std::vector<std::thread> workers;
+    for (unsigned i = 1; i < threadCount; i++)
+        workers.emplace_back(bakeCells);
+    bakeCells();
+    for (std::thread& worker : workers)
+        worker.join();
+
+    out.buildObjectLists();
+    return out;
+}
+
+// File layout (native byte order): magic, object count, bounds hash, region lower and upper, cell counts, and then
+// the bits of every cell as 64-bit words, cells in the order of cellAt().
+PotentiallyVisibleSet PotentiallyVisibleSet::load(const std::filesystem::path& filePath)
+{
+    std::ifstream file { filePath, std::ios::binary };
+    if (!file)
+        throw PVSLoadingException(fmt::format("File {} does not exist", filePath.string()));
+
+    PotentiallyVisibleSet out;
+    std::array<char, 4> magic;
+    file.read(magic.data(), magic.size());
+    file.read(reinterpret_cast<char*>(&out.m_objectCount), sizeof(out.m_objectCount));
+    file.read(reinterpret_cast<char*>(&out.m_boundsHash), sizeof(out.m_boundsHash));
+    file.read(reinterpret_cast<char*>(&out.m_region.lower), sizeof(out.m_region.lower));
+    file.read(reinterpret_cast<char*>(&out.m_region.upper), sizeof(out.m_region.upper));
+    file.read(reinterpret_cast<char*>(&out.m_cellCounts), sizeof(out.m_cellCounts));
+    if (!file || magic != fileMagic)
+        throw PVSLoadingException(fmt::format("{} is not a PVS file", filePath.string()));
+    if (glm::any(glm::equal(out.m_cellCounts, glm::uvec3(0))) || glm::any(glm::lessThanEqual(out.m_region.upper, out.m_region.lower)))
+        throw PVSLoadingException(fmt::format("{} has an empty cell grid", filePath.string()));
+
+    out.m_cellSize = (out.m_region.upper - out.m_region.lower) / glm::vec3(out.m_cellCounts);
+    out.m_wordsPerCell = (out.m_objectCount + 63) / 64;
+    out.m_bits.resize(out.cellCount() * out.m_wordsPerCell);
+    file.read(reinterpret_cast<char*>(out.m_bits.data()), static_cast<std::streamsize>(out.m_bits.size() * sizeof(uint64_t)));
+    if (!file)
+        throw PVSLoadingException(fmt::format("{} is truncated", filePath.string()));
+
+    out.buildObjectLists();
+    return out;
+}
+
+void PotentiallyVisibleSet::save(const std::filesystem::path& filePath) const
+{
+    std::ofstream file { filePath, std::ios::binary };
+    file.write(fileMagic.data(), fileMagic.size());
+    file.write(reinterpret_cast<const char*>(&m_objectCount), sizeof(m_objectCount));
+    file.write(reinterpret_cast<const char*>(&m_boundsHash), sizeof(m_boundsHash));
+    file.write(reinterpret_cast<const char*>(&m_region.lower), sizeof(m_region.lower));
+    file.write(reinterpret_cast<const char*>(&m_region.upper), sizeof(m_region.upper));
+    file.write(reinterpret_cast<const char*>(&m_cellCounts), sizeof(m_cellCounts));
+    file.write(reinterpret_cast<const char*>(m_bits.data()), static_cast<std::streamsize>(m_bits.size() * sizeof(uint64_t)));
+    if (!file)
+        throw std::runtime_error(fmt::format("Failed to write {}", filePath.string()));
+}
+
+bool PotentiallyVisibleSet::matches(std::span<const AABB> objectBounds) const
+{
+    return objectBounds.size() == m_objectCount && hashBounds(objectBounds) == m_boundsHash;
+}
+
+std::optional<uint32_t> PotentiallyVisibleSet::cellAt(const glm::vec3& position) const
+{
+    const glm::vec3 cell = glm::floor((position - m_region.lower) / m_cellSize);
+    if (glm::any(glm::lessThan(cell, glm::vec3(0.0f))) || glm::any(glm::greaterThanEqual(cell, glm::vec3(m_cellCounts))))
+        return {};
+    const glm::uvec3 index { cell };
+    return index.x + m_cellCounts.x * (index.y + m_cellCounts.y * index.z);
+}
+
+std::span<const uint32_t> PotentiallyVisibleSet::visibleObjects(uint32_t cell) const
+{
+    return std::span(m_cellObjects).subspan(m_cellOffsets[cell], m_cellOffsets[cell + 1] - m_cellOffsets[cell]);
+}
+
+void PotentiallyVisibleSet::cullFrustum(uint32_t cell, const glm::mat4& viewProjection, float minScreenSize, std::span<const AABB> objectBounds, Visibility& out) const
+{
+    out.visible.assign(m_objectCount, 0);
+    out.visibleCount = 0;
+    const Frustum frustum = Frustum::fromViewProjection(viewProjection);
+    const ScreenSizeTest sizeTest = ScreenSizeTest::fromViewProjection(viewProjection, minScreenSize);
+    for (uint32_t object : visibleObjects(cell)) {
+        const glm::vec3 center = objectBounds[object].center(), extent = objectBounds[object].extent();
+        const bool inside = std::all_of(std::begin(frustum.planes), std::end(frustum.planes), [&](const glm::vec4& plane) {
+            return glm::dot(glm::vec3(plane), center) + plane.w + glm::dot(glm::abs(glm::vec3(plane)), extent) >= 0.0f;
+        });
+        if (inside && sizeTest.passes(center, glm::length(extent))) {
+            out.visible[object] = 1;
+            out.visibleCount++;
+        }
+    }
+}
+
+void PotentiallyVisibleSet::getVisibility(uint32_t cell, Visibility& out) const
+{
+    out.visible.assign(m_objectCount, 0);
+    for (uint32_t object : visibleObjects(cell))
+        out.visible[object] = 1;
+    out.visibleCount = static_cast<uint32_t>(visibleObjects(cell).size());
+}
+
+uint64_t PotentiallyVisibleSet::hashBounds(std::span<const AABB> objectBounds)
+{
+    // FNV-1a over the bits of the floats; the bake and the application compute the bounds the same way, so they are
+    // bit for bit equal when the scene did not change.
+    uint64_t hash = 0xcbf29ce484222325;
+    for (const AABB& bounds : objectBounds) {
+        for (float value : { bounds.lower.x, bounds.lower.y, bounds.lower.z, bounds.upper.x, bounds.upper.y, bounds.upper.z }) {
+            uint32_t bits;
+            std::memcpy(&bits, &value, sizeof(bits));
+            for (int i = 0; i < 4; i++) {
+                hash ^= (bits >> (8 * i)) & 0xFF;
+                hash *= 0x100000001b3;
+            }
+        }
+    }
+    return hash;
+}
+
+AABB PotentiallyVisibleSet::cellBounds(uint32_t cell) const
+{
+    const glm::uvec3 index { cell % m_cellCounts.x, (cell / m_cellCounts.x) % m_cellCounts.y, cell / (m_cellCounts.x * m_cellCounts.y) };
+    const glm::vec3 lower = m_region.lower + glm::vec3(index) * m_cellSize;
+    return { lower, lower + m_cellSize };
+}
+
+void PotentiallyVisibleSet::buildObjectLists()
+{
+    m_cellOffsets.clear();
+    m_cellObjects.clear();
+    for (uint32_t cell = 0; cell < cellCount(); cell++) {
+        m_cellOffsets.push_back(static_cast<uint32_t>(m_cellObjects.size()));
+        for (size_t word = 0; word < m_wordsPerCell; word++) {
+            // Visit the set bits only; bits past the last object can only come from a damaged file.
+            for (uint64_t bits = m_bits[cell * m_wordsPerCell + word]; bits; bits &= bits - 1) {
+                const uint32_t object = static_cast<uint32_t>(word * 64 + static_cast<size_t>(std::countr_zero(bits)));
+                if (object < m_objectCount)
+                    m_cellObjects.push_back(object);
+            }
+        }
+    }
+    m_cellOffsets.push_back(static_cast<uint32_t>(m_cellObjects.size()));
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include "bvh.h"
+#include "frustum_culling.h"
+#include <framework/disable_all_warnings.h>
+DISABLE_WARNINGS_PUSH()
+#include <glm/mat4x4.hpp>
+#include <glm/vec3.hpp>
+DISABLE_WARNINGS_POP()
+
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <vector>
+
+struct PVSLoadingException : public std::runtime_error {
+    using std::runtime_error::runtime_error;
+};
+
+// Precomputed visibility for static scenes. The region the camera can be in is split into a grid of cells, and for
+// every cell an offline bake stores which objects can be seen from anywhere inside it (the potentially visible set).
+// At runtime the cell of the camera is found with a few multiplications, and only the objects in its set are frustum
+// culled; everything else is skipped without being looked at.
+//
+// The bake shoots rays from random points in each cell, in evenly spread directions, and records the nearest object
+// each ray hits; back faces are ignored, so rays leave closed objects they start in. Objects whose bounds overlap a
+// cell are always in its set. Like any sampled PVS the result is not exact: an object that is only visible through a
+// gap narrower than the spacing of the rays can be missing, so bake with more rays if objects pop in.
+//
+// Sets are stored as one bit per object per cell. The file also stores a hash of the object bounds it was baked for,
+// so a stale file (the scene changed since) can be detected with matches().
+class PotentiallyVisibleSet {
+public:
+    // World-space triangles of one object; object i of the bake is object i of the sets. bounds must be the box the
+    // object is culled with at runtime, because that is what matches() compares.
+    struct BakeObject {
+        std::vector<glm::vec3> positions;
+        std::vector<glm::uvec3> triangles;
+        AABB bounds;
+    };
+    struct BakeSettings {
+        float cellSize { 4.0f };
+        uint32_t samplesPerCell { 32 };
+        uint32_t raysPerSample { 512 };
+        uint32_t seed { 1 };
+        unsigned workerThreads { 0 }; // 0 = one per hardware thread
+    };
+
+    static PotentiallyVisibleSet bake(const AABB& region, std::span<const BakeObject> objects, const BakeSettings& settings);
+    static PotentiallyVisibleSet load(const std::filesystem::path& filePath);
+    void save(const std::filesystem::path& filePath) const;
+
+    // Whether the file was baked for objects with exactly these bounds.
+    bool matches(std::span<const AABB> objectBounds) const;
+
+    // Cell that contains the point, or nullopt outside of the baked region.
+    std::optional<uint32_t> cellAt(const glm::vec3& position) const;
+    // Objects visible from the cell, in increasing order.
+    std::span<const uint32_t> visibleObjects(uint32_t cell) const;
+    bool isVisible(uint32_t cell, uint32_t object) const { return (m_bits[cell * m_wordsPerCell + object / 64] >> (object % 64)) & 1; }
+
+    // out.visible is indexed by object; objects that are not in the set of the cell are never visible. The others are
+    // frustum culled against their bounds (see ScreenSizeTest for minScreenSize).
+    void cullFrustum(uint32_t cell, const glm::mat4& viewProjection, float minScreenSize, std::span<const AABB> objectBounds, Visibility& out) const;
+    // Same without frustum culling.
+    void getVisibility(uint32_t cell, Visibility& out) const;
+
+    const AABB& region() const { return m_region; }
+    glm::uvec3 cellCounts() const { return m_cellCounts; }
+    uint32_t cellCount() const { return m_cellCounts.x * m_cellCounts.y * m_cellCounts.z; }
+    uint32_t objectCount() const { return m_objectCount; }
+
+    static uint64_t hashBounds(std::span<const AABB> objectBounds);
+
+private:
+    AABB cellBounds(uint32_t cell) const;
+    // Fills the per-cell object lists from the bits.
+    void buildObjectLists();
+
+private:
+    AABB m_region;
+    glm::uvec3 m_cellCounts { 0 };
+    glm::vec3 m_cellSize { 0.0f };
+    uint32_t m_objectCount { 0 };
+    uint64_t m_boundsHash { 0 };
+
+    size_t m_wordsPerCell { 0 };
+    std::vector<uint64_t> m_bits; // m_wordsPerCell words per cell, bit i = object i
+
+    std::vector<uint32_t> m_cellOffsets; // Start of the list of each cell in m_cellObjects, plus one past the end
+    std::vector<uint32_t> m_cellObjects;
+};
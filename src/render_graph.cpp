@@ -0,0 +1,262 @@
+#include "render_graph.h"
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+
+RenderGraph::RenderGraph(RenderTargetPool& pool)
+    : m_pool(pool)
+{
+}
+
+RenderGraph::~RenderGraph()
+{
+    for (const PendingFrame& frame : m_pendingFrames)
+        m_freeQueries.insert(std::end(m_freeQueries), std::begin(frame.queries), std::end(frame.queries));
+    glDeleteQueries(static_cast<GLsizei>(m_freeQueries.size()), m_freeQueries.data());
+    for (const Resource& resource : m_resources) {
+        if (resource.pTarget)
+            m_pool.release(*resource.pTarget);
+    }
+}
+
+void RenderGraph::reset()
+{
+    m_resources.clear();
+    m_passes.clear();
+    m_order.clear();
+}
+
+RenderGraph::ResourceId RenderGraph::importBackbuffer(std::string name)
+{
+    return addResource(std::move(name), ResourceKind::Backbuffer, {});
+}
+
+RenderGraph::ResourceId RenderGraph::importExternal(std::string name)
+{
+    return addResource(std::move(name), ResourceKind::External, {});
+}
+
+RenderGraph::ResourceId RenderGraph::createTransient(std::string name, const RenderTargetDesc& desc)
+{
+    return addResource(std::move(name), ResourceKind::Transient, desc);
+}
+
+RenderGraph::PassId RenderGraph::addPass(std::string name, std::vector<ResourceId> reads, std::vector<ResourceId> writes, Execute execute)
+{
+    const PassId passId = static_cast<PassId>(m_passes.size());
+    for (ResourceId resource : writes)
+        m_resources[resource].writers.push_back(passId);
+    Pass& pass = m_passes.emplace_back();
+    pass.name = std::move(name);
+    pass.reads = std::move(reads);
+    pass.writes = std::move(writes);
+    pass.execute = std::move(execute);
+    return passId;
+}
+
+RenderGraph::ResourceId RenderGraph::addResource(std::string name, ResourceKind kind, const RenderTargetDesc& desc)
+{
+    Resource& resource = m_resources.emplace_back();
+    resource.name = std::move(name);
+    resource.kind = kind;
+    resource.desc = desc;
+    return static_cast<ResourceId>(m_resources.size() - 1);
+}
+
+void RenderGraph::compile()
+{
+    m_order.clear();
+    for (Pass& pass : m_passes) {
+        pass.dependencies.clear();
+        pass.culled = true;
+    }
+    for (Resource& resource : m_resources)
+        resource.used = false;
+
+    // Dependencies: readers wait for the writers of what they read, writers of the same resource keep their order.
+    for (PassId passId = 0; passId < m_passes.size(); passId++) {
+        Pass& pass = m_passes[passId];
+        for (ResourceId resource : pass.reads) {
+            const bool readModifyWrite = std::find(std::begin(pass.writes), std::end(pass.writes), resource) != std::end(pass.writes);
+            for (PassId writer : m_resources[resource].writers) {
+                if (writer != passId && (!readModifyWrite || writer < passId))
+                    pass.dependencies.push_back(writer);
+            }
+        }
+        for (ResourceId resource : pass.writes) {
+            for (PassId writer : m_resources[resource].writers) {
+                if (writer < passId)
+                    pass.dependencies.push_back(writer);
+            }
+        }
+        std::sort(std::begin(pass.dependencies), std::end(pass.dependencies));
+        pass.dependencies.erase(std::unique(std::begin(pass.dependencies), std::end(pass.dependencies)), std::end(pass.dependencies));
+    }
+
+    // Culling: keep what the backbuffer (transitively) depends on.
+    std::vector<PassId> stack;
+    for (const Resource& resource : m_resources) {
+        if (resource.kind == ResourceKind::Backbuffer)
+            stack.insert(std::end(stack), std::begin(resource.writers), std::end(resource.writers));
+    }
+    size_t keptPassCount = 0;
+    while (!stack.empty()) {
+        Pass& pass = m_passes[stack.back()];
+        stack.pop_back();
+        if (!pass.culled)
+            continue;
+        pass.culled = false;
+        keptPassCount++;
+        stack.insert(std::end(stack), std::begin(pass.dependencies), std::end(pass.dependencies));
+    }
+
+    // Topological order; among the passes that are ready, the one declared first goes first.
+    std::vector<bool> scheduled(m_passes.size(), false);
+    while (m_order.size() < keptPassCount) {
+        const auto isReady = [&](PassId passId) {
+            const Pass& pass = m_passes[passId];
+            return !pass.culled && !scheduled[passId] && std::all_of(std::begin(pass.dependencies), std::end(pass.dependencies), [&](PassId dependency) { return scheduled[dependency]; });
+        };
+        PassId next = 0;
+        while (next < m_passes.size() && !isReady(next))
+            next++;
+        if (next == m_passes.size())
+            throw RenderGraphException("Render graph has a cycle between its passes");
+        scheduled[next] = true;
+        m_order.push_back(next);
+    }
+
+    // Lifetimes of the resources in execution order.
+    for (size_t position = 0; position < m_order.size(); position++) {
+        const Pass& pass = m_passes[m_order[position]];
+        for (const std::vector<ResourceId>* pResources : { &pass.reads, &pass.writes }) {
+            for (ResourceId resourceId : *pResources) {
+                Resource& resource = m_resources[resourceId];
+                if (!resource.used)
+                    resource.firstUse = position;
+                resource.used = true;
+                resource.lastUse = position;
+            }
+        }
+    }
+}
+
+void RenderGraph::execute()
+{
+    collectTimings();
+    compile();
+
+    PendingFrame frame;
+    for (size_t i = 0; i <= m_order.size() && !m_order.empty(); i++) {
+        if (m_freeQueries.empty()) {
+            GLuint query;
+            glGenQueries(1, &query);
+            m_freeQueries.push_back(query);
+        }
+        frame.queries.push_back(m_freeQueries.back());
+        m_freeQueries.pop_back();
+    }
+
+    for (size_t position = 0; position < m_order.size(); position++) {
+        Pass& pass = m_passes[m_order[position]];
+        for (Resource& resource : m_resources) {
+            if (resource.kind == ResourceKind::Transient && resource.used && resource.firstUse == position) {
+                resource.pTarget = &m_pool.acquire(resource.desc);
+                resource.pLastTarget = resource.pTarget;
+            }
+        }
+
+        glQueryCounter(frame.queries[position], GL_TIMESTAMP);
+        const auto cpuStart = std::chrono::high_resolution_clock::now();
+        pass.execute(*this);
+        const std::chrono::duration<float, std::milli> cpuTime = std::chrono::high_resolution_clock::now() - cpuStart;
+        frame.timings.push_back({ pass.name, 0.0f, cpuTime.count() });
+
+        // Given back right away, so a later transient with the same description gets the same target.
+        for (Resource& resource : m_resources) {
+            if (resource.pTarget && resource.lastUse == position) {
+                m_pool.release(*resource.pTarget);
+                resource.pTarget = nullptr;
+            }
+        }
+    }
+
+    if (!m_order.empty()) {
+        glQueryCounter(frame.queries.back(), GL_TIMESTAMP);
+        m_pendingFrames.push_back(std::move(frame));
+    }
+    m_pool.endFrame();
+}
+
+RenderTarget& RenderGraph::target(ResourceId resource) const
+{
+    if (!m_resources[resource].pTarget)
+        throw RenderGraphException("Render graph resource \"" + m_resources[resource].name + "\" has no render target outside of its passes");
+    return *m_resources[resource].pTarget;
+}
+
+void RenderGraph::dump(std::ostream& stream) const
+{
+    stream << "Render graph: " << m_order.size() << " of " << m_passes.size() << " passes" << std::endl;
+    stream << std::fixed << std::setprecision(3);
+    for (PassId passId : m_order) {
+        const Pass& pass = m_passes[passId];
+        stream << "  " << std::left << std::setw(24) << pass.name << std::right;
+        // Timings lag a few frames behind, so they are matched by name.
+        const auto match = std::find_if(std::begin(m_timings), std::end(m_timings), [&](const PassTiming& timing) { return timing.name == pass.name; });
+        if (match != std::end(m_timings))
+            stream << " GPU " << std::setw(7) << match->gpuMs << " ms, CPU " << std::setw(7) << match->cpuMs << " ms";
+        const auto writeNames = [&](const char* label, const std::vector<ResourceId>& resources) {
+            if (resources.empty())
+                return;
+            stream << " " << label;
+            for (ResourceId resource : resources)
+                stream << " " << m_resources[resource].name;
+        };
+        writeNames("reads", pass.reads);
+        writeNames("writes", pass.writes);
+        stream << std::endl;
+    }
+
+    for (const Pass& pass : m_passes) {
+        if (pass.culled)
+            stream << "  culled: " << pass.name << std::endl;
+    }
+
+    std::vector<const RenderTarget*> targets;
+    for (const Resource& resource : m_resources) {
+        if (resource.kind != ResourceKind::Transient)
+            continue;
+        stream << "  transient " << resource.name << " " << resource.desc.size.x << "x" << resource.desc.size.y;
+        if (!resource.used) {
+            stream << ": unused" << std::endl;
+            continue;
+        }
+        auto target = std::find(std::begin(targets), std::end(targets), resource.pLastTarget);
+        if (target == std::end(targets))
+            target = targets.insert(target, resource.pLastTarget);
+        stream << ": passes " << resource.firstUse << " to " << resource.lastUse << ", target " << std::distance(std::begin(targets), target) << std::endl;
+    }
+    stream << std::defaultfloat;
+}
+
+void RenderGraph::collectTimings()
+{
+    // Frames finish in order, so stop at the first one that is not done.
+    size_t collected = 0;
+    for (; collected < m_pendingFrames.size(); collected++) {
+        PendingFrame& frame = m_pendingFrames[collected];
+        GLuint available = GL_FALSE;
+        glGetQueryObjectuiv(frame.queries.back(), GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available)
+            break;
+        std::vector<GLuint64> timestamps(frame.queries.size());
+        for (size_t i = 0; i < frame.queries.size(); i++)
+            glGetQueryObjectui64v(frame.queries[i], GL_QUERY_RESULT, &timestamps[i]);
+        for (size_t i = 0; i < frame.timings.size(); i++)
+            frame.timings[i].gpuMs = static_cast<float>(timestamps[i + 1] - timestamps[i]) * 1e-6f;
+        m_timings = std::move(frame.timings);
+        m_freeQueries.insert(std::end(m_freeQueries), std::begin(frame.queries), std::end(frame.queries));
+    }
+    m_pendingFrames.erase(std::begin(m_pendingFrames), std::begin(m_pendingFrames) + static_cast<std::ptrdiff_t>(collected));
+}
@@ -0,0 +1,111 @@
+#pragma once
+
+#include "render_target_pool.h"
+
+#include <cstdint>
+#include <functional>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <framework/opengl_includes.h>
+
+struct RenderGraphException : public std::runtime_error {
+    using std::runtime_error::runtime_error;
+};
+
+// A frame described as passes that declare which resources they read and write, instead of a fixed sequence of draw
+// calls. The graph is declared again every frame (reset(), then the resources and passes) and then executed:
+//  - Passes that do not contribute to the backbuffer, directly or through the resources they write, are culled.
+//  - The remaining passes are ordered by their dependencies, so they can be declared in any order. A pass that reads
+//    a resource runs after every pass that writes it; passes that write the same resource run in declaration order.
+//    A pass that reads and writes a resource (blending onto it) only waits for the writers declared before it.
+//  - Transient resources are render targets that only live within the frame. They are taken from the render target
+//    pool right before their first pass and given back after their last one, so transients with the same description
+//    whose lifetimes do not overlap share the same memory.
+// The GPU time of every pass is measured with timestamp queries, which are read a few frames later without waiting.
+class RenderGraph {
+public:
+    using ResourceId = uint32_t;
+    using PassId = uint32_t;
+    // Binding render targets is left to the pass; transients are available through target().
+    using Execute = std::function<void(const RenderGraph&)>;
+
+    explicit RenderGraph(RenderTargetPool& pool);
+    RenderGraph(const RenderGraph&) = delete;
+    ~RenderGraph();
+
+    RenderGraph& operator=(const RenderGraph&) = delete;
+
+    // Starts declaring a new frame; resource and pass ids of the previous frame are no longer valid.
+    void reset();
+    // The default framebuffer. Everything that is not needed to produce it is culled.
+    ResourceId importBackbuffer(std::string name);
+    // A resource that outlives the frame and is owned elsewhere, such as the target of a persistent offscreen pass.
+    ResourceId importExternal(std::string name);
+    ResourceId createTransient(std::string name, const RenderTargetDesc& desc);
+    PassId addPass(std::string name, std::vector<ResourceId> reads, std::vector<ResourceId> writes, Execute execute);
+
+    // Culls, orders and runs the passes. Throws RenderGraphException when the dependencies form a cycle.
+    void execute();
+
+    // Only valid while a pass that declared the (transient) resource is running.
+    RenderTarget& target(ResourceId resource) const;
+    // Whether a pass that survived culling reads or writes the resource; valid from the start of execute().
+    bool isUsed(ResourceId resource) const { return m_resources[resource].used; }
+
+    struct PassTiming {
+        std::string name;
+        float gpuMs;
+        float cpuMs;
+    };
+    // Timings of the most recent frame whose queries are done, in execution order.
+    const std::vector<PassTiming>& timings() const { return m_timings; }
+    size_t passCount() const { return m_passes.size(); }
+    size_t culledPassCount() const { return m_passes.size() - m_order.size(); }
+    // Writes the passes of the last executed frame in order (with their timings), the culled passes, and the lifetimes
+    // of the transient resources with the pooled render target each of them was placed in.
+    void dump(std::ostream& stream) const;
+
+private:
+    enum class ResourceKind {
+        Backbuffer,
+        External,
+        Transient
+    };
+    struct Resource {
+        std::string name;
+        ResourceKind kind { ResourceKind::Transient };
+        RenderTargetDesc desc;
+        std::vector<PassId> writers; // In declaration order
+        bool used { false };
+        size_t firstUse { 0 }, lastUse { 0 }; // Positions in the execution order
+        RenderTarget* pTarget { nullptr };
+        const RenderTarget* pLastTarget { nullptr }; // For dump(), after the target went back to the pool
+    };
+    struct Pass {
+        std::string name;
+        std::vector<ResourceId> reads, writes;
+        Execute execute;
+        std::vector<PassId> dependencies;
+        bool culled { true };
+    };
+    struct PendingFrame {
+        std::vector<GLuint> queries; // One timestamp before every pass and one after the last
+        std::vector<PassTiming> timings;
+    };
+
+    ResourceId addResource(std::string name, ResourceKind kind, const RenderTargetDesc& desc);
+    void compile();
+    void collectTimings();
+
+private:
+    RenderTargetPool& m_pool;
+    std::vector<Resource> m_resources;
+    std::vector<Pass> m_passes;
+    std::vector<PassId> m_order;
+
+    std::vector<GLuint> m_freeQueries;
+    std::vector<PendingFrame> m_pendingFrames; // Oldest first
+    std::vector<PassTiming> m_timings;
+};
@@ -0,0 +1,167 @@
+#include "render_queue.h"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cassert>
+#include <cmath>
+#include <numeric>
+#include <optional>
+#include <utility>
+
+static constexpr uint64_t maxShaderId = (1u << 12) - 1;
+static constexpr uint64_t maxTextureId = (1u << 16) - 1;
+
+// Positive IEEE floats sort the same as their bit patterns interpreted as unsigned integers.
+static uint32_t depthBits(float viewDepth)
+{
+    return std::bit_cast<uint32_t>(std::max(viewDepth, 0.0f));
+}
+
+void RenderQueue::clear()
+{
+    m_keys.clear();
+    m_order.clear();
+    m_items.clear();
+    m_inDepthOnlyPass.clear();
+    m_stats = {};
+}
+
+void RenderQueue::submit(RenderPass pass, const Shader& shader, GPUMesh& mesh, Texture* pTexture, float viewDepth, const InstanceSet* pInstances, GLuint conditionQuery)
+{
+    const uint64_t passBits = static_cast<uint64_t>(pass) << 60;
+    const uint64_t shaderBits = shaderId(&shader);
+    const uint64_t textureBits = textureId(pTexture);
+    const uint64_t depth = depthBits(viewDepth);
+
+    uint64_t key;
+    if (pass == RenderPass::Transparent)
+        key = passBits | (uint64_t(~static_cast<uint32_t>(depth)) << 28) | (shaderBits << 16) | textureBits;
+    else
+        key = passBits | (shaderBits << 48) | (textureBits << 32) | depth;
+
+    m_keys.push_back(key);
+    m_items.push_back({ &shader, &mesh, pTexture, pInstances, conditionQuery });
+}
+
+void RenderQueue::sort()
+{
+    const size_t count = m_keys.size();
+    m_order.resize(count);
+    std::iota(std::begin(m_order), std::end(m_order), 0u);
+    m_keysScratch.resize(count);
+    m_orderScratch.resize(count);
+
+    // LSD radix sort with 8-bit digits. Digits that are the same for all keys (common: unused shader/texture id
+    // bits) are skipped, so a typical frame only needs a few passes.
+    for (unsigned shift = 0; shift < 64; shift += 8) {
+        std::array<uint32_t, 256> histogram {};
+        for (uint64_t key : m_keys)
+            histogram[(key >> shift) & 0xFF]++;
+        if (count == 0 || histogram[(m_keys[0] >> shift) & 0xFF] == count)
+            continue;
+
+        uint32_t offset = 0;
+        for (uint32_t& bucket : histogram)
+            offset += std::exchange(bucket, offset);
+
+        for (size_t i = 0; i < count; i++) {
+            const uint32_t destination = histogram[(m_keys[i] >> shift) & 0xFF]++;
+            m_keysScratch[destination] = m_keys[i];
+            m_orderScratch[destination] = m_order[i];
+        }
+        std::swap(m_keys, m_keysScratch);
+        std::swap(m_order, m_orderScratch);
+    }
+}
+
+void RenderQueue::execute(const std::function<void(const Shader&)>& onShaderBound, const std::function<void(const Shader&, GPUMesh&, uint32_t itemIndex)>& onDraw,
+    const std::function<void(RenderPass)>& onPassBegin)
+{
+    assert(m_order.size() == m_items.size());
+    const Shader* pBoundShader = nullptr;
+    const Texture* pBoundTexture = nullptr;
+    std::optional<RenderPass> currentPass;
+    for (size_t i = 0; i < m_order.size(); i++) {
+        const uint32_t index = m_order[i];
+        const DrawItem& item = m_items[index];
+        // m_keys is sorted along with m_order; the pass is in the top bits.
+        const RenderPass pass = static_cast<RenderPass>(m_keys[i] >> 60);
+        if (pass != currentPass) {
+            currentPass = pass;
+            if (onPassBegin) {
+                onPassBegin(pass);
+                pBoundShader = nullptr;
+                pBoundTexture = nullptr;
+            }
+        }
+        if (item.pShader != pBoundShader) {
+            item.pShader->bind();
+            onShaderBound(*item.pShader);
+            pBoundShader = item.pShader;
+            m_stats.shaderBinds++;
+        }
+        if (item.pTexture && item.pTexture != pBoundTexture) {
+            item.pTexture->bind(GL_TEXTURE0);
+            pBoundTexture = item.pTexture;
+            m_stats.textureBinds++;
+        }
+        onDraw(*item.pShader, *item.pMesh, index);
+        // The depth pre-pass already decided whether the item is drawn: if its depth is in the buffer it has to be
+        // shaded too (GL_EQUAL keeps that to the pixels it won), even if the query result came in since.
+        const bool conditional = item.conditionQuery && !(index < m_inDepthOnlyPass.size() && m_inDepthOnlyPass[index]);
+        if (conditional)
+            glBeginConditionalRender(item.conditionQuery, GL_QUERY_NO_WAIT);
+        if (item.pInstances)
+            item.pMesh->drawInstanced(*item.pShader, *item.pInstances);
+        else
+            item.pMesh->draw(*item.pShader);
+        if (conditional)
+            glEndConditionalRender();
+        m_stats.draws++;
+    }
+}
+
+void RenderQueue::executeDepthOnly(const Shader& depthShader, const std::function<void(const Shader&, GPUMesh&, uint32_t itemIndex)>& onDraw)
+{
+    assert(m_order.size() == m_items.size());
+    // The opaque keys end with the view depth; without the state bits in front of it they sort front to back.
+    m_depthOnlyOrder.clear();
+    m_inDepthOnlyPass.assign(m_items.size(), false);
+    for (size_t i = 0; i < m_order.size(); i++) {
+        const RenderPass pass = static_cast<RenderPass>(m_keys[i] >> 60);
+        if (hasDepthOnlyDraw(m_items[m_order[i]], pass))
+            m_depthOnlyOrder.push_back((m_keys[i] << 32) | m_order[i]);
+    }
+    std::sort(std::begin(m_depthOnlyOrder), std::end(m_depthOnlyOrder));
+
+    for (uint64_t entry : m_depthOnlyOrder) {
+        const uint32_t index = static_cast<uint32_t>(entry);
+        const DrawItem& item = m_items[index];
+        onDraw(depthShader, *item.pMesh, index);
+        m_inDepthOnlyPass[index] = true;
+        if (item.conditionQuery)
+            glBeginConditionalRender(item.conditionQuery, GL_QUERY_NO_WAIT);
+        item.pMesh->drawPositions();
+        if (item.conditionQuery)
+            glEndConditionalRender();
+        m_stats.depthOnlyDraws++;
+    }
+}
+
+uint16_t RenderQueue::shaderId(const Shader* pShader)
+{
+    auto [iter, inserted] = m_shaderIds.try_emplace(pShader, static_cast<uint16_t>(m_shaderIds.size()));
+    assert(iter->second <= maxShaderId);
+    return iter->second;
+}
+
+uint16_t RenderQueue::textureId(const Texture* pTexture)
+{
+    // Id 0 is reserved for "no texture".
+    if (!pTexture)
+        return 0;
+    auto [iter, inserted] = m_textureIds.try_emplace(pTexture, static_cast<uint16_t>(m_textureIds.size() + 1));
+    assert(iter->second <= maxTextureId);
+    return iter->second;
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include "instance_set.h"
+#include "mesh.h"
+#include "texture.h"
+#include <framework/shader.h>
+
+#include <cstdint>
+#include <functional>
+#include <unordered_map>
+#include <vector>
+
+enum class RenderPass : uint8_t {
+    Opaque = 0,
+    Transparent = 1
+};
+
+struct DrawItem {
+    const Shader* pShader;
+    GPUMesh* pMesh;
+    Texture* pTexture; // nullptr if the mesh is not textured
+    const InstanceSet* pInstances; // nullptr for a single (non-instanced) draw
+    GLuint conditionQuery; // Non-zero: drawn inside glBeginConditionalRender on this occlusion query
+};
+
+// Collects the draws of one view for a frame, sorts them by a 64-bit key and submits them with redundant shader and
+// texture binds skipped. Key layout (most significant first):
+//   opaque:      pass (4) | shader (12) | texture (16) | view depth, front-to-back (32)
+//   transparent: pass (4) | view depth, back-to-front (32) | shader (12) | texture (16)
+// so opaque draws are grouped by state (and front-to-back within a state), while transparent draws are strictly
+// back-to-front.
+class RenderQueue {
+public:
+    struct Stats {
+        uint32_t draws { 0 };
+        uint32_t shaderBinds { 0 };
+        uint32_t textureBinds { 0 };
+        uint32_t depthOnlyDraws { 0 };
+    };
+
+    void clear();
+    // viewDepth is the distance from the camera (only used for ordering). With pInstances the item is drawn with
+    // GPUMesh::drawInstanced instead of GPUMesh::draw. With a conditionQuery the GPU skips the draw if that occlusion
+    // query has finished and no samples passed (GL_QUERY_NO_WAIT: it is drawn if the result is not in yet).
+    void submit(RenderPass pass, const Shader& shader, GPUMesh& mesh, Texture* pTexture, float viewDepth, const InstanceSet* pInstances = nullptr, GLuint conditionQuery = 0);
+    // Radix sort on the keys; must be called before execute().
+    void sort();
+
+    // onShaderBound is called after every shader change to set per-view state (uniform blocks, samplers); onDraw is
+    // called for every item to bind its per-object data, after which the mesh is drawn. itemIndex is the position of
+    // the item in items(), so per-object data can be prepared for all items before execute() runs. onPassBegin is
+    // called before the first item of every pass and may change any GL state (the queue rebinds what it needs).
+    void execute(const std::function<void(const Shader&)>& onShaderBound, const std::function<void(const Shader&, GPUMesh&, uint32_t itemIndex)>& onDraw,
+        const std::function<void(RenderPass)>& onPassBegin = {});
+    // Depth pre-pass: draws the opaque items that are not instanced (see hasDepthOnlyDraw()) strictly front to back
+    // with GPUMesh::drawPositions, all with the bound depthShader. onDraw binds the per-object data as in execute().
+    // Condition queries are only applied here: a following execute() draws these items unconditionally.
+    void executeDepthOnly(const Shader& depthShader, const std::function<void(const Shader&, GPUMesh&, uint32_t itemIndex)>& onDraw);
+    // Instanced items have no position-only stream, so they are left out of executeDepthOnly().
+    static bool hasDepthOnlyDraw(const DrawItem& item, RenderPass pass) { return pass == RenderPass::Opaque && !item.pInstances; }
+
+    // Items in submission order.
+    const std::vector<DrawItem>& items() const { return m_items; }
+    const Stats& stats() const { return m_stats; }
+
+private:
+    uint16_t shaderId(const Shader* pShader);
+    uint16_t textureId(const Texture* pTexture);
+
+private:
+    std::vector<uint64_t> m_keys;
+    std::vector<uint32_t> m_order;
+    std::vector<DrawItem> m_items;
+
+    // Scratch buffers for the radix sort (kept around to avoid allocations every frame).
+    std::vector<uint64_t> m_keysScratch;
+    std::vector<uint32_t> m_orderScratch;
+    std::vector<uint64_t> m_depthOnlyOrder; // View depth (high bits) and item index, for executeDepthOnly()
+    std::vector<bool> m_inDepthOnlyPass; // Per item: drawn by the last executeDepthOnly() since clear()
+
+    // Small persistent ids so shaders/textures fit in the key.
+    std::unordered_map<const void*, uint16_t> m_shaderIds;
+    std::unordered_map<const void*, uint16_t> m_textureIds;
+
+    Stats m_stats;
+};
@@ -0,0 +1,246 @@
+#include "render_target_pool.h"
+#include <framework/disable_all_warnings.h>
+#include <framework/gl_state.h>
+DISABLE_WARNINGS_PUSH()
+#include <glm/common.hpp>
+DISABLE_WARNINGS_POP()
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+static bool isDepthFormat(GLenum format)
+{
+    return format == GL_DEPTH_COMPONENT16 || format == GL_DEPTH_COMPONENT24 || format == GL_DEPTH_COMPONENT32F || format == GL_DEPTH24_STENCIL8 || format == GL_DEPTH32F_STENCIL8;
+}
+
+// Integer textures are only complete with nearest filtering; they are read with texelFetch anyway.
+static bool isIntegerFormat(GLenum format)
+{
+    return format == GL_R32UI || format == GL_RG32UI || format == GL_RGBA32UI;
+}
+
+// Pixel format that glTexImage2D accepts together with the internal format when no data is uploaded.
+static GLenum pixelFormat(GLenum internalFormat)
+{
+    switch (internalFormat) {
+        case GL_DEPTH24_STENCIL8:
+        case GL_DEPTH32F_STENCIL8:
+            return GL_DEPTH_STENCIL;
+        case GL_R8:
+        case GL_R16F:
+        case GL_R32F:
+            return GL_RED;
+        case GL_R32UI:
+            return GL_RED_INTEGER;
+        case GL_RG32UI:
+            return GL_RG_INTEGER;
+        case GL_RGBA32UI:
+            return GL_RGBA_INTEGER;
+        case GL_RG8:
+        case GL_RG16F:
+        case GL_RG32F:
+            return GL_RG;
+        case GL_RGB8:
+        case GL_RGB16F:
+        case GL_R11F_G11F_B10F:
+            return GL_RGB;
+        default:
+            return isDepthFormat(internalFormat) ? GL_DEPTH_COMPONENT : GL_RGBA;
+    }
+}
+
+static size_t bytesPerPixel(GLenum internalFormat)
+{
+    switch (internalFormat) {
+        case GL_R8:
+            return 1;
+        case GL_DEPTH_COMPONENT16:
+        case GL_R16F:
+        case GL_RG8:
+            return 2;
+        case GL_RGB8:
+            return 3;
+        case GL_RGBA16F:
+        case GL_RG32F:
+        case GL_RG32UI:
+        case GL_DEPTH32F_STENCIL8:
+            return 8;
+        case GL_RGB16F:
+            return 6;
+        case GL_RGBA32F:
+        case GL_RGBA32UI:
+            return 16;
+        default:
+            return 4;
+    }
+}
+
+static GLuint createTexture(GLenum internalFormat, const glm::ivec2& size, GLsizei levels)
+{
+    // Depth textures are typically shadow maps: outside of them nothing is in shadow.
+    const bool depth = isDepthFormat(internalFormat);
+    const float borderColor[] { depth ? 1.0f : 0.0f, depth ? 1.0f : 0.0f, depth ? 1.0f : 0.0f, 1.0f };
+    const bool nearest = depth || isIntegerFormat(internalFormat);
+    const GLint minFilter = levels > 1 ? GL_LINEAR_MIPMAP_LINEAR : (nearest ? GL_NEAREST : GL_LINEAR);
+    const GLint magFilter = nearest ? GL_NEAREST : GL_LINEAR;
+
+    GLuint texture = 0;
+    if (GLState::directStateAccess()) {
+        glCreateTextures(GL_TEXTURE_2D, 1, &texture);
+        glTextureStorage2D(texture, levels, internalFormat, size.x, size.y);
+        glTextureParameteri(texture, GL_TEXTURE_MIN_FILTER, minFilter);
+        glTextureParameteri(texture, GL_TEXTURE_MAG_FILTER, magFilter);
+        glTextureParameteri(texture, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
+        glTextureParameteri(texture, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
+        glTextureParameterfv(texture, GL_TEXTURE_BORDER_COLOR, borderColor);
+        return texture;
+    }
+
+    glGenTextures(1, &texture);
+    GLState::bindTexture(0, GL_TEXTURE_2D, texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, levels - 1);
+    for (GLsizei level = 0; level < levels; level++) {
+        const glm::ivec2 levelSize = glm::max(size >> level, glm::ivec2(1));
+        const GLenum format = pixelFormat(internalFormat);
+        const GLenum type = format == GL_DEPTH_STENCIL ? GL_UNSIGNED_INT_24_8 : (isIntegerFormat(internalFormat) ? GL_UNSIGNED_INT : GL_FLOAT);
+        glTexImage2D(GL_TEXTURE_2D, level, static_cast<GLint>(internalFormat), levelSize.x, levelSize.y, 0, format, type, nullptr);
+    }
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, minFilter);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, magFilter);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
+    glTexParameterfv(GL_TEXTURE_2D, GL_TEXTURE_BORDER_COLOR, borderColor);
+    GLState::bindTexture(0, GL_TEXTURE_2D, 0);
+    return texture;
+}
+
+RenderTarget::RenderTarget(const RenderTargetDesc& desc)
+    : m_desc(desc)
+{
+    const GLsizei colorLevels = desc.mipmapped ? 1 + static_cast<GLsizei>(std::floor(std::log2(std::max(desc.size.x, desc.size.y)))) : 1;
+    std::array<GLenum, RenderTargetDesc::maxColorAttachments> drawBuffers;
+    size_t colorCount = 0;
+    if (desc.colorFormat != GL_NONE) {
+        m_colorTextures[0] = createTexture(desc.colorFormat, desc.size, colorLevels);
+        drawBuffers[colorCount++] = GL_COLOR_ATTACHMENT0;
+        for (size_t i = 0; i < desc.extraColorFormats.size() && desc.extraColorFormats[i] != GL_NONE; i++) {
+            m_colorTextures[i + 1] = createTexture(desc.extraColorFormats[i], desc.size, 1);
+            drawBuffers[colorCount] = GL_COLOR_ATTACHMENT0 + static_cast<GLenum>(colorCount);
+            colorCount++;
+        }
+    }
+    if (desc.depthFormat != GL_NONE)
+        m_depthTexture = createTexture(desc.depthFormat, desc.size, 1);
+    const GLenum depthAttachment = pixelFormat(desc.depthFormat) == GL_DEPTH_STENCIL ? GL_DEPTH_STENCIL_ATTACHMENT : GL_DEPTH_ATTACHMENT;
+
+    if (GLState::directStateAccess()) {
+        glCreateFramebuffers(1, &m_framebuffer);
+        for (size_t i = 0; i < colorCount; i++)
+            glNamedFramebufferTexture(m_framebuffer, drawBuffers[i], m_colorTextures[i], 0);
+        if (colorCount > 1)
+            glNamedFramebufferDrawBuffers(m_framebuffer, static_cast<GLsizei>(colorCount), drawBuffers.data());
+        else if (colorCount == 0)
+            glNamedFramebufferDrawBuffer(m_framebuffer, GL_NONE);
+        if (m_depthTexture)
+            glNamedFramebufferTexture(m_framebuffer, depthAttachment, m_depthTexture, 0);
+        if (glCheckNamedFramebufferStatus(m_framebuffer, GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+            std::cerr << "Render target framebuffer is not complete" << std::endl;
+        return;
+    }
+
+    glGenFramebuffers(1, &m_framebuffer);
+    GLState::bindFramebuffer(GL_FRAMEBUFFER, m_framebuffer);
+    for (size_t i = 0; i < colorCount; i++)
+        glFramebufferTexture2D(GL_FRAMEBUFFER, drawBuffers[i], GL_TEXTURE_2D, m_colorTextures[i], 0);
+    if (colorCount > 1) {
+        glDrawBuffers(static_cast<GLsizei>(colorCount), drawBuffers.data());
+    } else if (colorCount == 0) {
+        glDrawBuffer(GL_NONE);
+        glReadBuffer(GL_NONE);
+    }
+    if (m_depthTexture)
+        glFramebufferTexture2D(GL_FRAMEBUFFER, depthAttachment, GL_TEXTURE_2D, m_depthTexture, 0);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        std::cerr << "Render target framebuffer is not complete" << std::endl;
+    GLState::bindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+RenderTarget::~RenderTarget()
+{
+    GLState::deleteFramebuffer(m_framebuffer);
+    for (GLuint texture : m_colorTextures) {
+        if (texture)
+            GLState::deleteTexture(texture);
+    }
+    if (m_depthTexture)
+        GLState::deleteTexture(m_depthTexture);
+}
+
+void RenderTarget::bind() const
+{
+    GLState::bindFramebuffer(GL_FRAMEBUFFER, m_framebuffer);
+    GLState::viewport(0, 0, m_desc.size.x, m_desc.size.y);
+}
+
+void RenderTarget::generateMipmaps() const
+{
+    if (!m_desc.mipmapped || !m_colorTextures[0])
+        return;
+    if (GLState::directStateAccess()) {
+        glGenerateTextureMipmap(m_colorTextures[0]);
+    } else {
+        GLState::bindTexture(0, GL_TEXTURE_2D, m_colorTextures[0]);
+        glGenerateMipmap(GL_TEXTURE_2D);
+    }
+}
+
+size_t RenderTarget::sizeInBytes() const
+{
+    const size_t pixels = static_cast<size_t>(m_desc.size.x) * static_cast<size_t>(m_desc.size.y);
+    size_t bytes = 0;
+    if (m_colorTextures[0])
+        bytes += pixels * bytesPerPixel(m_desc.colorFormat) * (m_desc.mipmapped ? 4 : 3) / 3; // A mip chain adds a third
+    for (size_t i = 0; i < m_desc.extraColorFormats.size(); i++) {
+        if (m_colorTextures[i + 1])
+            bytes += pixels * bytesPerPixel(m_desc.extraColorFormats[i]);
+    }
+    if (m_depthTexture)
+        bytes += pixels * bytesPerPixel(m_desc.depthFormat);
+    return bytes;
+}
+
+RenderTarget& RenderTargetPool::acquire(const RenderTargetDesc& desc)
+{
+    auto iter = std::find_if(std::begin(m_entries), std::end(m_entries), [&](const Entry& entry) { return !entry.inUse && entry.pTarget->desc() == desc; });
+    if (iter == std::end(m_entries)) {
+        m_entries.push_back({ std::make_unique<RenderTarget>(desc) });
+        iter = std::prev(std::end(m_entries));
+    }
+    iter->inUse = true;
+    iter->lastUsedFrame = m_frame;
+    return *iter->pTarget;
+}
+
+void RenderTargetPool::release(const RenderTarget& target)
+{
+    for (Entry& entry : m_entries) {
+        if (entry.pTarget.get() == &target) {
+            entry.inUse = false;
+            entry.lastUsedFrame = m_frame;
+        }
+    }
+}
+
+void RenderTargetPool::endFrame()
+{
+    std::erase_if(m_entries, [&](const Entry& entry) { return !entry.inUse && m_frame - entry.lastUsedFrame > framesBeforeFree; });
+    m_frame++;
+}
+
+size_t RenderTargetPool::sizeInBytes() const
+{
+    size_t bytes = 0;
+    for (const Entry& entry : m_entries)
+        bytes += entry.pTarget->sizeInBytes();
+    return bytes;
+}
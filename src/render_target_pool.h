@@ -0,0 +1,80 @@
+#pragma once
+
+#include <framework/disable_all_warnings.h>
+DISABLE_WARNINGS_PUSH()
+#include <glm/vec2.hpp>
+DISABLE_WARNINGS_POP()
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include <framework/opengl_includes.h>
+
+struct RenderTargetDesc {
+    static constexpr size_t maxColorAttachments = 4;
+
+    glm::ivec2 size { 0 };
+    GLenum colorFormat { GL_RGBA8 }; // GL_NONE for depth only targets (e.g. shadow maps)
+    GLenum depthFormat { GL_DEPTH_COMPONENT24 }; // GL_NONE for no depth buffer
+    bool mipmapped { false }; // Allocates the full mip chain of the first color texture
+    // Color attachments 1 and up, for multiple render targets (a G-buffer); the first GL_NONE ends the list.
+    std::array<GLenum, maxColorAttachments - 1> extraColorFormats { GL_NONE, GL_NONE, GL_NONE };
+
+    [[nodiscard]] constexpr bool operator==(const RenderTargetDesc&) const noexcept = default;
+};
+
+// A framebuffer with color and/or depth textures, all of which can be sampled once rendering is done.
+class RenderTarget {
+public:
+    RenderTarget(const RenderTargetDesc& desc);
+    RenderTarget(const RenderTarget&) = delete;
+    ~RenderTarget();
+
+    RenderTarget& operator=(const RenderTarget&) = delete;
+
+    // Binds the framebuffer and sets the viewport to all of it.
+    void bind() const;
+    // Rebuilds the mip chain of the first color texture from level 0 (only for mipmapped targets).
+    void generateMipmaps() const;
+
+    const RenderTargetDesc& desc() const { return m_desc; }
+    GLuint framebuffer() const { return m_framebuffer; }
+    GLuint colorTexture(size_t attachment = 0) const { return m_colorTextures[attachment]; }
+    GLuint depthTexture() const { return m_depthTexture; }
+    size_t sizeInBytes() const;
+
+private:
+    RenderTargetDesc m_desc;
+    GLuint m_framebuffer { 0 };
+    std::array<GLuint, RenderTargetDesc::maxColorAttachments> m_colorTextures {};
+    GLuint m_depthTexture { 0 };
+};
+
+// Owns all offscreen render targets. Targets that are released go back to the pool and are handed out again to the
+// next acquire() with the same description, so passes that only need a target while they run share (alias) the same
+// GPU memory instead of each keeping their own. Released targets that are not reused for a while are freed.
+class RenderTargetPool {
+public:
+    // Frames a released target is kept around for reuse before it is deleted.
+    static constexpr uint32_t framesBeforeFree = 60;
+
+    // The returned target stays valid (and is not handed out again) until it is released.
+    RenderTarget& acquire(const RenderTargetDesc& desc);
+    void release(const RenderTarget& target);
+    // Deletes the targets that have not been used for framesBeforeFree frames. Called once per frame, by the render graph.
+    void endFrame();
+
+    size_t targetCount() const { return m_entries.size(); }
+    size_t sizeInBytes() const;
+
+private:
+    struct Entry {
+        std::unique_ptr<RenderTarget> pTarget;
+        bool inUse { false };
+        uint32_t lastUsedFrame { 0 };
+    };
+
+    std::vector<Entry> m_entries;
+    uint32_t m_frame { 0 };
+};
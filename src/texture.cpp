@@ -3,8 +3,11 @@
 DISABLE_WARNINGS_PUSH()
 #include <fmt/format.h>
 DISABLE_WARNINGS_POP()
+#include <framework/gl_state.h>
 #include <framework/image.h>
 
+#include <algorithm>
+#include <cmath>
 #include <iostream>
 
 Texture::Texture(std::filesystem::path filePath)
@@ -13,34 +16,55 @@ Texture::Texture(std::filesystem::path filePath)
     // Image class is defined in <framework/image.h>
     Image cpuTexture { filePath };
 
-    // Create a texture on the GPU and bind it for parameter setting
-    glGenTextures(1, &m_texture);
-    glBindTexture(GL_TEXTURE_2D, m_texture);
-
-    // Set behavior for when texture coordinates are outside the [0, 1] range (wrap around).
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-
-    // Set interpolation for texture sampling (bilinear interpolation across mip-maps).
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-
-    // Define GPU texture parameters and upload corresponding data based on number of image channels
+    // Pick the GPU texture format based on number of image channels
+    GLenum format, internalFormat;
     switch (cpuTexture.channels) {
         case 1:
-            glTexImage2D(GL_TEXTURE_2D, 0, GL_RED, cpuTexture.width, cpuTexture.height, 0, GL_RED, GL_UNSIGNED_BYTE, cpuTexture.get_data());
+            format = GL_RED;
+            internalFormat = GL_R8;
             break;
         case 3:
-            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, cpuTexture.width, cpuTexture.height, 0, GL_RGB, GL_UNSIGNED_BYTE, cpuTexture.get_data());
+            format = GL_RGB;
+            internalFormat = GL_RGB8;
             break;
         case 4:
-            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, cpuTexture.width, cpuTexture.height, 0, GL_RGBA, GL_UNSIGNED_BYTE, cpuTexture.get_data());
+            format = GL_RGBA;
+            internalFormat = GL_RGBA8;
             break;
         default:
             std::cerr << "Number of channels read for texture is not supported" << std::endl;
             throw std::exception();
     }
 
+    if (GLState::directStateAccess()) {
+        // Immutable storage with the full mip chain; edited by name, so no texture unit is disturbed.
+        const GLsizei levels = 1 + static_cast<GLsizei>(std::floor(std::log2(std::max(cpuTexture.width, cpuTexture.height))));
+        glCreateTextures(GL_TEXTURE_2D, 1, &m_texture);
+        glTextureStorage2D(m_texture, levels, internalFormat, cpuTexture.width, cpuTexture.height);
+        glTextureSubImage2D(m_texture, 0, 0, 0, cpuTexture.width, cpuTexture.height, format, GL_UNSIGNED_BYTE, cpuTexture.get_data());
+        glTextureParameteri(m_texture, GL_TEXTURE_WRAP_S, GL_REPEAT);
+        glTextureParameteri(m_texture, GL_TEXTURE_WRAP_T, GL_REPEAT);
+        glTextureParameteri(m_texture, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+        glTextureParameteri(m_texture, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glGenerateTextureMipmap(m_texture);
+        return;
+    }
+
+    // Create a texture on the GPU and bind it for parameter setting
+    glGenTextures(1, &m_texture);
+    GLState::bindTexture(0, GL_TEXTURE_2D, m_texture);
+
+    // Set behavior for when texture coordinates are outside the [0, 1] range (wrap around).
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+
+    // Set interpolation for texture sampling (bilinear interpolation across mip-maps).
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+    // Upload the image (the driver picks the internal format)
+    glTexImage2D(GL_TEXTURE_2D, 0, static_cast<GLint>(format), cpuTexture.width, cpuTexture.height, 0, format, GL_UNSIGNED_BYTE, cpuTexture.get_data());
+
     // Generate mip-maps
     glGenerateMipmap(GL_TEXTURE_2D);
 }
@@ -54,11 +78,10 @@ Texture::Texture(Texture&& other)
 Texture::~Texture()
 {
     if (m_texture != INVALID)
-        glDeleteTextures(1, &m_texture);
+        GLState::deleteTexture(m_texture);
 }
 
 void Texture::bind(GLint textureSlot)
 {
-    glActiveTexture(textureSlot);
-    glBindTexture(GL_TEXTURE_2D, m_texture);
+    GLState::bindTexture(static_cast<GLuint>(textureSlot - GL_TEXTURE0), GL_TEXTURE_2D, m_texture);
 }
@@ -0,0 +1,55 @@
+#include "worker_pool.h"
+
+WorkerPool::WorkerPool(unsigned workerThreads)
+{
+    for (unsigned i = 0; i < workerThreads; i++)
+        m_workers.emplace_back([this] { workerLoop(); });
+}
+
+WorkerPool::~WorkerPool()
+{
+    {
+        std::lock_guard lock { m_mutex };
+        m_stopWorkers = true;
+    }
+    m_workAvailable.notify_all();
+    for (std::thread& worker : m_workers)
+        worker.join();
+}
+
+void WorkerPool::run(const std::function<void()>& job)
+{
+    {
+        std::lock_guard lock { m_mutex };
+        m_pJob = &job;
+        m_generation++;
+        m_busyWorkers = static_cast<unsigned>(m_workers.size());
+    }
+    m_workAvailable.notify_all();
+    job();
+    std::unique_lock lock { m_mutex };
+    m_workDone.wait(lock, [&] { return m_busyWorkers == 0; });
+    m_pJob = nullptr;
+}
+
+void WorkerPool::workerLoop()
+{
+    uint64_t finishedGeneration = 0;
+    while (true) {
+        const std::function<void()>* pJob;
+        {
+            std::unique_lock lock { m_mutex };
+            m_workAvailable.wait(lock, [&] { return m_stopWorkers || m_generation != finishedGeneration; });
+            if (m_stopWorkers)
+                return;
+            finishedGeneration = m_generation;
+            pJob = m_pJob;
+        }
+        (*pJob)();
+        {
+            std::lock_guard lock { m_mutex };
+            if (--m_busyWorkers == 0)
+                m_workDone.notify_one();
+        }
+    }
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed set of threads that help the calling thread with one job at a time. run() hands the job to every worker,
+// runs it on the calling thread as well and returns when all of them are done; the job divides the work itself,
+// typically by taking items from an atomic counter until none are left.
+class WorkerPool {
+public:
+    explicit WorkerPool(unsigned workerThreads);
+    WorkerPool(const WorkerPool&) = delete;
+    ~WorkerPool();
+
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    void run(const std::function<void()>& job);
+
+    size_t workerCount() const { return m_workers.size(); }
+
+private:
+    void workerLoop();
+
+private:
+    std::vector<std::thread> m_workers;
+    std::mutex m_mutex;
+    std::condition_variable m_workAvailable, m_workDone;
+    const std::function<void()>* m_pJob { nullptr };
+    uint64_t m_generation { 0 }; // Incremented for every run() so that the workers know there is new work
+    unsigned m_busyWorkers { 0 };
+    bool m_stopWorkers { false };
+};
@@ -0,0 +1,214 @@
+#include "bvh.h"
+#include <framework/disable_all_warnings.h>
+DISABLE_WARNINGS_PUSH()
+#include <catch2/catch_approx.hpp>
+#include <catch2/catch_test_macros.hpp>
+#include <glm/common.hpp>
+#include <glm/geometric.hpp>
+DISABLE_WARNINGS_POP()
+#include <algorithm>
+#include <optional>
+#include <random>
+#include <vector>
+
+using ObjectId = BoundingVolumeHierarchy::ObjectId;
+
+static AABB randomBox(std::mt19937& random, float regionSize = 100.0f, float maxSize = 5.0f)
+{
+    std::uniform_real_distribution<float> position(-regionSize, regionSize), size(0.1f, maxSize);
+    const glm::vec3 lower { position(random), position(random), position(random) };
+    return { lower, lower + glm::vec3(size(random), size(random), size(random)) };
+}
+
+// The objects that are still in the tree; removed ids have no value.
+using Objects = std::vector<std::optional<AABB>>;
+
+static std::vector<ObjectId> sorted(std::vector<ObjectId> ids)
+{
+    std::sort(std::begin(ids), std::end(ids));
+    return ids;
+}
+
+static std::vector<ObjectId> bruteForceOverlap(const Objects& objects, const AABB& query)
+{
+    std::vector<ObjectId> out;
+    for (size_t id = 0; id < objects.size(); id++) {
+        if (objects[id] && objects[id]->overlaps(query))
+            out.push_back(static_cast<ObjectId>(id));
+    }
+    return out;
+}
+
+static std::vector<ObjectId> bruteForceSphere(const Objects& objects, const glm::vec3& center, float radius)
+{
+    std::vector<ObjectId> out;
+    for (size_t id = 0; id < objects.size(); id++) {
+        if (!objects[id])
+            continue;
+        const glm::vec3 offset = glm::clamp(center, objects[id]->lower, objects[id]->upper) - center;
+        if (glm::dot(offset, offset) <= radius * radius)
+            out.push_back(static_cast<ObjectId>(id));
+    }
+    return out;
+}
+
+// Distance to the nearest box the ray enters (or starts in), if any.
+static std::optional<float> bruteForceRaycast(const Objects& objects, const Ray& ray)
+{
+    std::optional<float> nearest;
+    for (const std::optional<AABB>& box : objects) {
+        if (!box)
+            continue;
+        const glm::vec3 t0 = (box->lower - ray.origin) / ray.direction, t1 = (box->upper - ray.origin) / ray.direction;
+        const glm::vec3 tMin = glm::min(t0, t1), tMax = glm::max(t0, t1);
+        const float tEnter = std::max({ tMin.x, tMin.y, tMin.z, 0.0f });
+        const float tExit = std::min({ tMax.x, tMax.y, tMax.z, ray.t });
+        if (tEnter <= tExit && (!nearest || tEnter < *nearest))
+            nearest = tEnter;
+    }
+    return nearest;
+}
+
+// Compares all queries against brute force over the objects, with random query boxes, spheres and rays.
+static void checkQueries(const BoundingVolumeHierarchy& bvh, const Objects& objects, std::mt19937& random)
+{
+    size_t objectCount = 0;
+    for (size_t id = 0; id < objects.size(); id++) {
+        if (!objects[id])
+            continue;
+        objectCount++;
+        REQUIRE(bvh.bounds(static_cast<ObjectId>(id)).lower == objects[id]->lower);
+        REQUIRE(bvh.bounds(static_cast<ObjectId>(id)).upper == objects[id]->upper);
+    }
+    REQUIRE(bvh.objectCount() == objectCount);
+
+    std::uniform_real_distribution<float> position(-110.0f, 110.0f), radius(0.0f, 30.0f), direction(-1.0f, 1.0f);
+    for (int i = 0; i < 50; i++) {
+        const AABB query = randomBox(random, 100.0f, 40.0f);
+        std::vector<ObjectId> overlapping;
+        bvh.queryOverlap(query, overlapping);
+        REQUIRE(sorted(overlapping) == bruteForceOverlap(objects, query));
+
+        const glm::vec3 center { position(random), position(random), position(random) };
+        const float sphereRadius = radius(random);
+        std::vector<ObjectId> inSphere;
+        bvh.querySphere(center, sphereRadius, inSphere);
+        REQUIRE(sorted(inSphere) == bruteForceSphere(objects, center, sphereRadius));
+
+        Ray ray;
+        ray.origin = center;
+        ray.direction = glm::normalize(glm::vec3(direction(random), direction(random), direction(random)) + glm::vec3(1e-3f));
+        const std::optional<float> expected = bruteForceRaycast(objects, ray);
+        const std::optional<ObjectId> hit = bvh.raycast(ray);
+        REQUIRE(hit.has_value() == expected.has_value());
+        if (hit)
+            REQUIRE(ray.t == Catch::Approx(*expected));
+    }
+}
+
+TEST_CASE("Queries after build match brute force", "[bvh]")
+{
+    std::mt19937 random { 1 };
+    Objects objects;
+    std::vector<AABB> bounds;
+    for (int i = 0; i < 500; i++)
+        objects.push_back(bounds.emplace_back(randomBox(random)));
+
+    BoundingVolumeHierarchy bvh;
+    bvh.build(bounds);
+    checkQueries(bvh, objects, random);
+
+    bvh.rebuild();
+    checkQueries(bvh, objects, random);
+}
+
+TEST_CASE("Insert and remove keep queries correct", "[bvh]")
+{
+    std::mt19937 random { 2 };
+    Objects objects;
+    std::vector<AABB> bounds;
+    for (int i = 0; i < 200; i++)
+        objects.push_back(bounds.emplace_back(randomBox(random)));
+    BoundingVolumeHierarchy bvh;
+    bvh.build(bounds);
+
+    SECTION("Insert into a built tree")
+    {
+        for (int i = 0; i < 200; i++) {
+            const AABB box = randomBox(random);
+            const ObjectId id = bvh.insert(box);
+            REQUIRE(id == objects.size());
+            objects.push_back(box);
+        }
+        checkQueries(bvh, objects, random);
+    }
+
+    SECTION("Remove and reuse ids")
+    {
+        for (ObjectId id = 0; id < objects.size(); id += 3) {
+            bvh.remove(id);
+            objects[id].reset();
+        }
+        checkQueries(bvh, objects, random);
+
+        // Removed ids are handed out again.
+        for (int i = 0; i < 50; i++) {
+            const AABB box = randomBox(random);
+            const ObjectId id = bvh.insert(box);
+            REQUIRE(id < objects.size());
+            REQUIRE_FALSE(objects[id].has_value());
+            objects[id] = box;
+        }
+        checkQueries(bvh, objects, random);
+    }
+
+    SECTION("Remove everything")
+    {
+        for (ObjectId id = 0; id < objects.size(); id++)
+            bvh.remove(id);
+        REQUIRE(bvh.objectCount() == 0);
+        std::vector<ObjectId> overlapping;
+        bvh.queryOverlap(AABB { glm::vec3(-1000.0f), glm::vec3(1000.0f) }, overlapping);
+        REQUIRE(overlapping.empty());
+    }
+}
+
+TEST_CASE("Update and refit after moving objects keep queries correct", "[bvh]")
+{
+    std::mt19937 random { 3 };
+    Objects objects;
+    std::vector<AABB> bounds;
+    for (int i = 0; i < 300; i++)
+        objects.push_back(bounds.emplace_back(randomBox(random)));
+    BoundingVolumeHierarchy bvh;
+    bvh.build(bounds);
+
+    std::uniform_real_distribution<float> smallMove(-1.0f, 1.0f);
+    const auto moved = [&](const AABB& box, float distance) {
+        const glm::vec3 offset = distance * glm::vec3(smallMove(random), smallMove(random), smallMove(random));
+        return AABB { box.lower + offset, box.upper + offset };
+    };
+
+    SECTION("Refit")
+    {
+        for (int frame = 0; frame < 5; frame++) {
+            for (ObjectId id = 0; id < objects.size(); id += 2) {
+                objects[id] = moved(*objects[id], 20.0f);
+                bvh.refit(id, *objects[id]);
+            }
+            checkQueries(bvh, objects, random);
+        }
+    }
+
+    SECTION("Update with small and large moves")
+    {
+        for (int frame = 0; frame < 5; frame++) {
+            for (ObjectId id = 0; id < objects.size(); id++) {
+                // Most objects stay inside their parent's box; some travel across the scene and are reinserted.
+                objects[id] = id % 10 == 0 ? randomBox(random) : moved(*objects[id], 0.5f);
+                bvh.update(id, *objects[id]);
+            }
+            checkQueries(bvh, objects, random);
+        }
+    }
+}